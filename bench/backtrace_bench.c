@@ -0,0 +1,218 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure how long collecting and printing backtraces takes.
+ *
+ * Usage: backtrace_bench [-r repeats] [-m max_depth]
+ *
+ * Times shbt_get_stack_depth, shbt_collect_backtrace and
+ * shbt_print_collected_backtrace_fd (writing to /dev/null) at stack depths
+ * from 8 to max_depth (default 10000) extra frames, made up of either C or
+ * C++ functions, with caches either emptied before every call (cold) or
+ * left as the previous call left them (warm). Cold calls start with both
+ * libunwind's caches and SHBT's cache of symbol names and demangled names
+ * empty. Flushing libunwind's caches is only supported on Linux, so
+ * elsewhere cold results are not reported.
+ *
+ * Writes CSV to standard output with one row per combination:
+ *   operation,language,cache,frames,repeats,mean_ns,min_ns,max_ns,
+ *   ns_per_frame
+ * where frames is the number of frames the backtrace has.
+ */
+
+#define _POSIX_C_SOURCE 200809L  // For clock_gettime.
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define UNW_LOCAL_ONLY  // Only need the local API for libunwind.
+#include <libunwind.h>
+
+#include "shbt/shbt.h"
+// For resetting the symbol cache.
+#include "shbt/shbt_internal.h"
+
+#define MAX_REPEATS 1000
+// Frames below the ones added for the benchmark (main, libc start, etc.).
+#define BASE_FRAMES 64
+
+static const size_t depths[] = {8, 32, 128, 512, 2048, 10000};
+
+/** What to measure at the bottom of the stack. */
+struct bench_context {
+  const char* language;
+  bool cold;
+  int repeats;
+  shbt_frame_t* trace;
+  size_t max_frames;
+  int devnull;
+  uint64_t times[MAX_REPEATS];
+};
+
+// Add depth C frames, then call fn.
+void bench_c_frames(size_t depth, void (*fn)(void*), void* arg);
+// Add depth C++ frames, then call fn.
+void bench_cpp_frames(size_t depth, void (*fn)(void*), void* arg);
+
+volatile int c_calls = 0;
+
+__attribute__((noinline)) void bench_c_frames(size_t depth,
+                                              void (*fn)(void*), void* arg) {
+  if (depth > 1) {
+    bench_c_frames(depth - 1, fn, arg);
+  } else {
+    fn(arg);
+  }
+  ++c_calls;  // Prevent tail calls so each frame shows up.
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static bool can_flush_caches() {
+#ifdef __linux__
+  return true;
+#else
+  return false;
+#endif
+}
+
+static void flush_caches() {
+#ifdef __linux__
+  unw_flush_cache(unw_local_addr_space, 0, 0);
+#endif
+  shbt_symbol_cache_reset();
+}
+
+static void report(const char* operation, struct bench_context* ctx,
+                   size_t frames) {
+  uint64_t total = 0, min = UINT64_MAX, max = 0;
+  for (int i = 0; i < ctx->repeats; ++i) {
+    total += ctx->times[i];
+    min = ctx->times[i] < min ? ctx->times[i] : min;
+    max = ctx->times[i] > max ? ctx->times[i] : max;
+  }
+  double mean = (double) total / ctx->repeats;
+  printf("%s,%s,%s,%zu,%d,%.0f,%llu,%llu,%.1f\n", operation, ctx->language,
+         ctx->cold ? "cold" : "warm", frames, ctx->repeats, mean,
+         (unsigned long long) min, (unsigned long long) max,
+         frames > 0 ? mean / frames : 0.0);
+}
+
+// Time each operation at the current depth.
+static void measure(void* arg) {
+  struct bench_context* ctx = (struct bench_context*) arg;
+  size_t frames = 0, num_frames = 0;
+
+  // Warm caches start from a call that has already unwound this stack.
+  shbt_collect_backtrace(ctx->trace, ctx->max_frames, &num_frames);
+  for (int i = 0; i < ctx->repeats; ++i) {
+    if (ctx->cold) {
+      flush_caches();
+    }
+    uint64_t start = now_ns();
+    frames = shbt_get_stack_depth();
+    ctx->times[i] = now_ns() - start;
+  }
+  report("get_stack_depth", ctx, frames);
+
+  for (int i = 0; i < ctx->repeats; ++i) {
+    if (ctx->cold) {
+      flush_caches();
+    }
+    uint64_t start = now_ns();
+    shbt_collect_backtrace(ctx->trace, ctx->max_frames, &num_frames);
+    ctx->times[i] = now_ns() - start;
+  }
+  report("collect_backtrace", ctx, num_frames);
+
+  for (int i = 0; i < ctx->repeats; ++i) {
+    if (ctx->cold) {
+      flush_caches();
+    }
+    uint64_t start = now_ns();
+    shbt_print_collected_backtrace_fd(ctx->trace, num_frames, ctx->devnull);
+    ctx->times[i] = now_ns() - start;
+  }
+  report("print_collected_backtrace", ctx, num_frames);
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: backtrace_bench [-r repeats] [-m max_depth]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+  int repeats = 20;
+  size_t max_depth = 10000;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      repeats = atoi(argv[++i]);
+      if (repeats <= 0 || repeats > MAX_REPEATS) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc) {
+      max_depth = (size_t) atol(argv[++i]);
+      if (max_depth < depths[0]) {
+        usage();
+      }
+    } else {
+      usage();
+    }
+  }
+
+  struct bench_context ctx;
+  ctx.repeats = repeats;
+  ctx.max_frames = max_depth + BASE_FRAMES;
+  ctx.trace = malloc(ctx.max_frames * sizeof(shbt_frame_t));
+  ctx.devnull = open("/dev/null", O_WRONLY);
+  if (ctx.trace == NULL || ctx.devnull < 0) {
+    fprintf(stderr, "backtrace_bench: cannot set up\n");
+    return EXIT_FAILURE;
+  }
+  // Only used when SHBT is built with SHBT_UNWINDER=UNWIND_TABLE.
+  shbt_build_unwind_table();
+  printf("operation,language,cache,frames,repeats,mean_ns,min_ns,max_ns,"
+         "ns_per_frame\n");
+  for (int language = 0; language < 2; ++language) {
+    ctx.language = language == 0 ? "c" : "c++";
+    for (size_t i = 0; i < sizeof(depths) / sizeof(depths[0]); ++i) {
+      if (depths[i] > max_depth) {
+        break;
+      }
+      for (int cold = can_flush_caches() ? 1 : 0; cold >= 0; --cold) {
+        ctx.cold = cold;
+        if (language == 0) {
+          bench_c_frames(depths[i], &measure, &ctx);
+        } else {
+          bench_cpp_frames(depths[i], &measure, &ctx);
+        }
+        fflush(stdout);
+      }
+    }
+  }
+  close(ctx.devnull);
+  free(ctx.trace);
+  return EXIT_SUCCESS;
+}
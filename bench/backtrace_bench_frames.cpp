@@ -0,0 +1,55 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * C++ frames for backtrace_bench: templated member functions in a
+ * namespace, so the symbols are mangled like typical C++ code.
+ */
+
+#include <stddef.h>
+#include <map>
+#include <string>
+#include <vector>
+
+namespace shbt_bench {
+
+volatile int cpp_calls = 0;
+
+template <typename Key, typename Value>
+class Recurser {
+ public:
+  explicit Recurser(void (*fn)(void*), void* arg) : fn_(fn), arg_(arg) {}
+
+  __attribute__((noinline)) void recurse(size_t depth) {
+    if (depth > 1) {
+      recurse(depth - 1);
+    } else {
+      fn_(arg_);
+    }
+    ++cpp_calls;  // Prevent tail calls so each frame shows up.
+  }
+
+ private:
+  void (*fn_)(void*);
+  void* arg_;
+};
+
+}  // namespace shbt_bench
+
+extern "C" void bench_cpp_frames(size_t depth, void (*fn)(void*), void* arg) {
+  shbt_bench::Recurser<std::string, std::vector<std::map<int, std::string>>>
+    recurser(fn, arg);
+  recurser.recurse(depth);
+}
@@ -0,0 +1,319 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure how long crashing takes when many workers crash at once.
+ *
+ * Usage: crash_bench [-p processes | -t threads] [-d depth] [-o output]
+ *
+ * Starts the given number of processes (by default, one per CPU) or threads,
+ * waits until all are ready, and then has every one segfault at the same
+ * time, depth frames (default 32) deep. Processes exit from the signal
+ * handler; threads jump out of it (from the signal's callback) and finish.
+ * Reports go to output (default /dev/null), which all workers share.
+ *
+ * Writes CSV to standard output with one row per phase of handling the
+ * crash, with the mean, median, 99th percentile and maximum over the
+ * workers:
+ *   delivery: from the fault until the handler started.
+ *   print, unwind, demangle, write: the handler's phases (see
+ *     struct shbt_handler_timing).
+ *   handler: the whole handler.
+ *   exit: from the fault until the process was reaped by its parent, or
+ *     until the thread left the handler.
+ * followed by the time from the first fault to the last exit.
+ *
+ * This is Linux-only.
+ */
+
+#define _GNU_SOURCE  // For MAP_ANONYMOUS.
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <setjmp.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "shbt/shbt.h"
+// For handler timing.
+#include "shbt/shbt_internal.h"
+
+/** What happened to one worker. Lives in memory shared with the parent. */
+struct worker_result {
+  /** When the worker faulted. */
+  int64_t fault_ns;
+  /** When the worker was reaped or left the handler. */
+  int64_t exit_ns;
+  /** Whether the handler's timing was recorded. */
+  bool handled;
+  struct shbt_handler_timing timing;
+};
+
+/** State shared by all workers. */
+struct shared_state {
+  /** Number of workers waiting to fault. */
+  atomic_int ready;
+  /** Set once every worker is ready. */
+  atomic_int go;
+  struct worker_result results[];
+};
+
+static struct shared_state* shared;
+static size_t fault_depth = 32;
+static _Thread_local struct worker_result* worker_result;
+static _Thread_local sigjmp_buf worker_recover;
+static volatile int* volatile null_ptr = NULL;
+volatile int fault_calls = 0;
+
+static void record_timing(int sig_num,
+                          const struct shbt_handler_timing* timing) {
+  (void) sig_num;
+  worker_result->timing = *timing;
+  worker_result->handled = true;
+}
+
+// Signal callback for threads: leave the handler and finish the thread.
+static void recover_thread(int sig_num) {
+  (void) sig_num;
+  worker_result->exit_ns = shbt_now_ns();
+  siglongjmp(worker_recover, 1);
+}
+
+__attribute__((noinline)) static void fault(size_t depth) {
+  if (depth > 1) {
+    fault(depth - 1);
+  } else {
+    worker_result->fault_ns = shbt_now_ns();
+    *null_ptr = 0;
+  }
+  ++fault_calls;  // Prevent tail calls so each frame shows up.
+}
+
+static void wait_for_start() {
+  atomic_fetch_add(&shared->ready, 1);
+  while (!atomic_load(&shared->go)) {
+    sched_yield();
+  }
+}
+
+static void* thread_main(void* arg) {
+  worker_result = (struct worker_result*) arg;
+  if (sigsetjmp(worker_recover, 1) == 0) {
+    wait_for_start();
+    fault(fault_depth);
+  }
+  return NULL;
+}
+
+static void start_when_ready(int num_workers) {
+  while (atomic_load(&shared->ready) < num_workers) {
+    sched_yield();
+  }
+  atomic_store(&shared->go, 1);
+}
+
+static bool run_processes(int num_workers, int out_fd) {
+  pid_t* pids = malloc(num_workers * sizeof(pid_t));
+  if (pids == NULL) {
+    return false;
+  }
+  int started = 0;
+  for (; started < num_workers; ++started) {
+    pid_t pid = fork();
+    if (pid < 0) {
+      perror("crash_bench: fork");
+      break;
+    }
+    if (pid == 0) {
+      dup2(out_fd, STDERR_FILENO);
+      worker_result = &shared->results[started];
+      wait_for_start();
+      fault(fault_depth);
+      _exit(EXIT_SUCCESS);  // Not reached.
+    }
+    pids[started] = pid;
+  }
+  start_when_ready(started);
+  for (int reaped = 0; reaped < started; ++reaped) {
+    pid_t pid = wait(NULL);
+    int64_t now = shbt_now_ns();
+    for (int i = 0; i < started; ++i) {
+      if (pids[i] == pid) {
+        shared->results[i].exit_ns = now;
+      }
+    }
+  }
+  free(pids);
+  return started == num_workers;
+}
+
+static bool run_threads(int num_workers, int out_fd) {
+  pthread_t* threads = malloc(num_workers * sizeof(pthread_t));
+  if (threads == NULL) {
+    return false;
+  }
+  // Reports go to stderr, which the threads share with this one.
+  int saved_stderr = dup(STDERR_FILENO);
+  dup2(out_fd, STDERR_FILENO);
+  int started = 0;
+  for (; started < num_workers; ++started) {
+    if (pthread_create(&threads[started], NULL, &thread_main,
+                       &shared->results[started]) != 0) {
+      break;
+    }
+  }
+  start_when_ready(started);
+  for (int i = 0; i < started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+  dup2(saved_stderr, STDERR_FILENO);
+  close(saved_stderr);
+  free(threads);
+  return started == num_workers;
+}
+
+static int compare_int64s(const void* a, const void* b) {
+  int64_t x = *(const int64_t*) a;
+  int64_t y = *(const int64_t*) b;
+  return x < y ? -1 : x > y;
+}
+
+// Print one phase's statistics over the workers.
+static void report(const char* phase, int64_t* times, size_t count) {
+  if (count == 0) {
+    printf("%s,,,,\n", phase);
+    return;
+  }
+  qsort(times, count, sizeof(int64_t), &compare_int64s);
+  int64_t total = 0;
+  for (size_t i = 0; i < count; ++i) {
+    total += times[i];
+  }
+  printf("%s,%.1f,%.1f,%.1f,%.1f\n", phase, total / 1000.0 / count,
+         times[count / 2] / 1000.0, times[count - 1 - count / 100] / 1000.0,
+         times[count - 1] / 1000.0);
+}
+
+static void usage() {
+  fprintf(stderr,
+          "Usage: crash_bench [-p processes | -t threads] [-d depth] "
+          "[-o output]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_workers = num_cpus > 0 ? (int) num_cpus : 1;
+  bool use_threads = false;
+  const char* out_path = "/dev/null";
+  for (int i = 1; i < argc; ++i) {
+    if ((strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "-t") == 0) &&
+        i + 1 < argc) {
+      use_threads = argv[i][1] == 't';
+      num_workers = atoi(argv[++i]);
+      if (num_workers <= 0) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      fault_depth = (size_t) atol(argv[++i]);
+      if (fault_depth == 0) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      out_path = argv[++i];
+    } else {
+      usage();
+    }
+  }
+
+  int out_fd = open(out_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (out_fd < 0) {
+    perror("crash_bench: open");
+    return EXIT_FAILURE;
+  }
+  size_t shared_size = sizeof(struct shared_state) +
+                       num_workers * sizeof(struct worker_result);
+  shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (shared == MAP_FAILED) {
+    perror("crash_bench: mmap");
+    return EXIT_FAILURE;
+  }
+  memset(shared, 0, shared_size);
+
+  if (!shbt_register_signal_handler(
+        SIGSEGV, SHBT_EXIT_ACTION_EXIT,
+        use_threads ? &recover_thread : NULL)) {
+    fprintf(stderr, "crash_bench: failed to register signal handler\n");
+    return EXIT_FAILURE;
+  }
+  shbt_set_handler_timing_hook(&record_timing);
+  bool ok = use_threads ? run_threads(num_workers, out_fd) :
+                          run_processes(num_workers, out_fd);
+  shbt_set_handler_timing_hook(NULL);
+  close(out_fd);
+
+  printf("# %s: %d, depth: %zu\n", use_threads ? "threads" : "processes",
+         num_workers, fault_depth);
+  printf("phase,mean_us,median_us,p99_us,max_us\n");
+  int64_t* times = malloc(num_workers * sizeof(int64_t));
+  const char* phases[] = {"delivery", "print", "unwind", "demangle",
+                          "write", "handler", "exit"};
+  int64_t first_fault = INT64_MAX, last_exit = 0;
+  size_t num_handled = 0;
+  for (size_t phase = 0; phase < sizeof(phases) / sizeof(phases[0]);
+       ++phase) {
+    size_t count = 0;
+    for (int i = 0; i < num_workers; ++i) {
+      const struct worker_result* result = &shared->results[i];
+      if (!result->handled) {
+        continue;
+      }
+      const struct shbt_handler_timing* timing = &result->timing;
+      int64_t values[] = {
+        timing->start_ns - result->fault_ns, timing->print_ns,
+        timing->unwind_ns, timing->demangle_ns, timing->write_ns,
+        timing->total_ns, result->exit_ns - result->fault_ns};
+      times[count++] = values[phase];
+      if (result->fault_ns < first_fault) {
+        first_fault = result->fault_ns;
+      }
+      if (result->exit_ns > last_exit) {
+        last_exit = result->exit_ns;
+      }
+    }
+    report(phases[phase], times, count);
+    num_handled = count;
+  }
+  if (num_handled > 0) {
+    printf("# wall time from first fault to last exit: %.3f ms\n",
+           (last_exit - first_fault) / 1e6);
+  }
+  free(times);
+  if (!ok || num_handled != (size_t) num_workers) {
+    fprintf(stderr, "crash_bench: only %zu of %d workers were handled\n",
+            num_handled, num_workers);
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
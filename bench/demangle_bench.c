@@ -0,0 +1,282 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Measure how long shbt_demangle takes.
+ *
+ * Usage: demangle_bench [-r repeats] [-b buffer_size] [-l max_mean_ns]
+ *                       [-e expected] [corpus]
+ *
+ * Demangles every symbol in corpus (one mangled name per line; by default
+ * the corpus bundled with SHBT, which has symbols from libstdc++, Boost,
+ * Eigen, LLVM and lambda-heavy code) repeats times, and reports the time
+ * per symbol, the slowest symbol, and how many symbols did not fit in a
+ * buffer_size buffer (by default the size backtraces use).
+ *
+ * With -l, exits with a failure if the mean time per symbol is more than
+ * max_mean_ns, so this can be used to catch regressions.
+ *
+ * With -e, also compares the output for each symbol with the line at the
+ * same position in expected (e.g. the output of c++filt on corpus), and
+ * exits with a failure if any differ. A symbol that cannot be demangled is
+ * compared as itself, which is what c++filt and backtraces print for it.
+ */
+
+#define _POSIX_C_SOURCE 200809L  // For getline and clock_gettime.
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "shbt/shbt.h"
+// For shbt_demangle.
+#include "shbt/shbt_internal.h"
+
+#if defined(SHBT_USE_BUILTIN_IA64_DEMANGLER)
+#define DEMANGLER_NAME "BUILTIN_IA64"
+#elif defined(SHBT_USE_ABI_DEMANGLER)
+#define DEMANGLER_NAME "ABI"
+#else
+#define DEMANGLER_NAME "unknown"
+#endif
+
+// Buffer used to tell symbols that do not fit from ones that fail.
+#define LARGE_BUFFER_SIZE (64 * 1024)
+
+/** Result of demangling one symbol. */
+struct result {
+  /** Mean time per demangle, in nanoseconds. */
+  double ns;
+  /** Whether it was demangled into the normal buffer. */
+  bool demangled;
+  /** Whether it only demangled into the large buffer. */
+  bool too_long;
+};
+
+static void* xrealloc(void* ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    fprintf(stderr, "demangle_bench: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+  double x = *(const double*) a;
+  double y = *(const double*) b;
+  return x < y ? -1 : x > y;
+}
+
+// Read one symbol (or expected result) per line, skipping blank lines.
+static char** read_corpus(FILE* in, size_t* num_symbols) {
+  char** symbols = NULL;
+  size_t count = 0, capacity = 0;
+  char* line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  while ((len = getline(&line, &line_size, in)) >= 0) {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) {
+      line[--len] = '\0';
+    }
+    if (len == 0) {
+      continue;
+    }
+    if (count == capacity) {
+      capacity = capacity ? 2 * capacity : 1024;
+      symbols = xrealloc(symbols, capacity * sizeof(char*));
+    }
+    symbols[count] = xrealloc(NULL, (size_t) len + 1);
+    memcpy(symbols[count++], line, (size_t) len + 1);
+  }
+  free(line);
+  *num_symbols = count;
+  return symbols;
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: demangle_bench [-r repeats] [-b buffer_size] "
+          "[-l max_mean_ns] [-e expected] [corpus]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+  int repeats = 20;
+  size_t buf_size = 4096;
+  double max_mean_ns = 0;
+  const char* path = SHBT_DEMANGLE_CORPUS;
+  const char* expected_path = NULL;
+  bool have_path = false;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      repeats = atoi(argv[++i]);
+      if (repeats <= 0) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      buf_size = (size_t) atol(argv[++i]);
+      if (buf_size == 0 || buf_size > LARGE_BUFFER_SIZE) {
+        usage();
+      }
+    } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+      max_mean_ns = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-e") == 0 && i + 1 < argc) {
+      expected_path = argv[++i];
+    } else if (argv[i][0] == '-' || have_path) {
+      usage();
+    } else {
+      path = argv[i];
+      have_path = true;
+    }
+  }
+
+  FILE* in = fopen(path, "r");
+  if (in == NULL) {
+    fprintf(stderr, "demangle_bench: cannot open %s: %s\n", path,
+            strerror(errno));
+    return EXIT_FAILURE;
+  }
+  size_t num_symbols;
+  char** symbols = read_corpus(in, &num_symbols);
+  fclose(in);
+  if (num_symbols == 0) {
+    fprintf(stderr, "demangle_bench: no symbols in %s\n", path);
+    return EXIT_FAILURE;
+  }
+  char** expected = NULL;
+  if (expected_path != NULL) {
+    in = fopen(expected_path, "r");
+    if (in == NULL) {
+      fprintf(stderr, "demangle_bench: cannot open %s: %s\n", expected_path,
+              strerror(errno));
+      return EXIT_FAILURE;
+    }
+    size_t num_expected;
+    expected = read_corpus(in, &num_expected);
+    fclose(in);
+    if (num_expected != num_symbols) {
+      fprintf(stderr, "demangle_bench: %s has %zu lines, but %s has %zu\n",
+              expected_path, num_expected, path, num_symbols);
+      return EXIT_FAILURE;
+    }
+  }
+
+  char* buf = xrealloc(NULL, buf_size);
+  char* large_buf = xrealloc(NULL, LARGE_BUFFER_SIZE);
+  struct result* results = xrealloc(NULL, num_symbols * sizeof(struct result));
+  // Warm up caches and page in the library before timing anything.
+  for (size_t i = 0; i < num_symbols; ++i) {
+    shbt_demangle(symbols[i], buf, buf_size);
+  }
+  uint64_t total_ns = 0;
+  size_t total_bytes = 0;
+  for (size_t i = 0; i < num_symbols; ++i) {
+    bool demangled = false;
+    uint64_t start = now_ns();
+    for (int r = 0; r < repeats; ++r) {
+      demangled = shbt_demangle(symbols[i], buf, buf_size);
+    }
+    uint64_t elapsed = now_ns() - start;
+    total_ns += elapsed;
+    total_bytes += strlen(symbols[i]);
+    results[i].ns = (double) elapsed / repeats;
+    results[i].demangled = demangled;
+    results[i].too_long =
+      !demangled && shbt_demangle(symbols[i], large_buf, LARGE_BUFFER_SIZE);
+  }
+
+  size_t num_demangled = 0, num_too_long = 0, worst = 0;
+  double* sorted_ns = xrealloc(NULL, num_symbols * sizeof(double));
+  for (size_t i = 0; i < num_symbols; ++i) {
+    num_demangled += results[i].demangled;
+    num_too_long += results[i].too_long;
+    if (results[i].ns > results[worst].ns) {
+      worst = i;
+    }
+    sorted_ns[i] = results[i].ns;
+  }
+  qsort(sorted_ns, num_symbols, sizeof(double), &compare_doubles);
+  double mean_ns = (double) total_ns / ((double) num_symbols * repeats);
+
+  printf("Demangler: %s\n", DEMANGLER_NAME);
+  printf("Corpus: %s (%zu symbols, %zu bytes)\n", path, num_symbols,
+         total_bytes);
+  printf("Demangled: %zu, did not fit in %zu bytes: %zu, failed: %zu\n",
+         num_demangled, buf_size, num_too_long,
+         num_symbols - num_demangled - num_too_long);
+  printf("Time per symbol: mean %.0f ns, median %.0f ns, p99 %.0f ns\n",
+         mean_ns, sorted_ns[num_symbols / 2],
+         sorted_ns[num_symbols - 1 - num_symbols / 100]);
+  printf("Time per mangled byte: %.1f ns\n",
+         (double) total_ns / ((double) total_bytes * repeats));
+  printf("Slowest: %.0f ns, %zu bytes%s: %s\n", results[worst].ns,
+         strlen(symbols[worst]),
+         results[worst].demangled ? "" :
+         (results[worst].too_long ? " (did not fit)" : " (failed)"),
+         symbols[worst]);
+  for (size_t i = 0; i < num_symbols; ++i) {
+    if (!results[i].demangled) {
+      printf("%s: %s\n", results[i].too_long ? "Did not fit" : "Failed",
+             symbols[i]);
+    }
+  }
+
+  int status = EXIT_SUCCESS;
+  if (max_mean_ns > 0 && mean_ns > max_mean_ns) {
+    printf("Mean time per symbol %.0f ns exceeds limit of %.0f ns\n",
+           mean_ns, max_mean_ns);
+    status = EXIT_FAILURE;
+  }
+  if (expected != NULL) {
+    size_t num_wrong = 0;
+    for (size_t i = 0; i < num_symbols; ++i) {
+      const char* result = shbt_demangle(symbols[i], large_buf,
+                                         LARGE_BUFFER_SIZE) ?
+                           large_buf : symbols[i];
+      if (strcmp(result, expected[i]) != 0) {
+        printf("Wrong: %s\n  got:      %s\n  expected: %s\n", symbols[i],
+               result, expected[i]);
+        ++num_wrong;
+      }
+    }
+    printf("Matched %s: %zu of %zu\n", expected_path,
+           num_symbols - num_wrong, num_symbols);
+    if (num_wrong > 0) {
+      status = EXIT_FAILURE;
+    }
+    for (size_t i = 0; i < num_symbols; ++i) {
+      free(expected[i]);
+    }
+    free(expected);
+  }
+  for (size_t i = 0; i < num_symbols; ++i) {
+    free(symbols[i]);
+  }
+  free(symbols);
+  free(sorted_ns);
+  free(results);
+  free(large_buf);
+  free(buf);
+  return status;
+}
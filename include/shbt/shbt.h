@@ -18,6 +18,8 @@
 #include "shbt_config.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
 
 #ifdef __cplusplus
 extern "C" {
@@ -45,6 +47,84 @@ typedef struct shbt_frame {
  */
 bool shbt_collect_backtrace(shbt_frame_t trace[], size_t num_frames,
                             size_t* num_valid_frames);
+/**
+ * Collect a backtrace of the code a signal interrupted.
+ *
+ * This works like shbt_collect_backtrace, but must be called from a signal
+ * handler installed with SA_SIGINFO, and starts from the context the
+ * handler was given. The first frame is the instruction the signal
+ * interrupted (e.g. the one that faulted), and the frames of the handler
+ * and the signal trampoline are never unwound.
+ *
+ * Where the context cannot be unwound from directly (e.g. on macOS), the
+ * handler's frames are unwound and skipped instead.
+ *
+ * This function is safe to call from a signal handler and is thread-safe.
+ *
+ * @param ucontext The handler's third argument (a ucontext_t*).
+ * @param trace Pre-allocated array to store frame info in.
+ * @param num_frames Maximum number of frames to write to trace.
+ * @param num_valid_frames Will contain the number of valid frames written to
+ * trace.
+ */
+bool shbt_collect_backtrace_from_context(const void* ucontext,
+                                         shbt_frame_t trace[],
+                                         size_t num_frames,
+                                         size_t* num_valid_frames);
+/**
+ * Collect a backtrace consisting only of addresses.
+ *
+ * This writes at most max_pcs program counters to pcs. Unlike
+ * shbt_collect_backtrace, this does not look up symbol names, which is the
+ * most expensive part of collecting a backtrace. Use shbt_symbolize to look
+ * them up later, or save the addresses and symbolize them offline.
+ *
+ * Frames are in the same order as shbt_collect_backtrace.
+ *
+ * This function is safe to call from a signal handler and is thread-safe.
+ *
+ * @param pcs Pre-allocated array to store addresses in.
+ * @param max_pcs Maximum number of addresses to write to pcs.
+ * @param num_pcs Will contain the number of valid addresses written to pcs.
+ */
+bool shbt_collect_addresses(void* pcs[], size_t max_pcs, size_t* num_pcs);
+/**
+ * Look up symbol names for addresses collected by shbt_collect_addresses.
+ *
+ * This fills in one entry of trace for each address, so the result can be
+ * used anywhere a backtrace from shbt_collect_backtrace can. The addresses
+ * must come from this process and the modules they refer to must still be
+ * loaded.
+ *
+ * This function is safe to call from a signal handler and is thread-safe.
+ *
+ * @param pcs Addresses to symbolize.
+ * @param num_pcs Number of addresses in pcs.
+ * @param trace Pre-allocated array of at least num_pcs entries to store frame
+ * info in.
+ */
+bool shbt_symbolize(void* const pcs[], size_t num_pcs, shbt_frame_t trace[]);
+/**
+ * Look up symbol names for addresses whose first may be exact.
+ *
+ * This works like shbt_symbolize, which treats every address as a return
+ * address and looks up the call instruction before it. If
+ * first_frame_exact is true, the first address is instead the instruction
+ * a signal interrupted (as from shbt_collect_thread_addresses, profiler
+ * samples and crash records), and is looked up as it is. Otherwise, an
+ * interrupted instruction at the start of a function is named after the
+ * function before it.
+ *
+ * This function is safe to call from a signal handler and is thread-safe.
+ *
+ * @param pcs Addresses to symbolize.
+ * @param num_pcs Number of addresses in pcs.
+ * @param trace Pre-allocated array of at least num_pcs entries to store frame
+ * info in.
+ * @param first_frame_exact Whether pcs[0] is an interrupted instruction.
+ */
+bool shbt_symbolize_ex(void* const pcs[], size_t num_pcs,
+                       shbt_frame_t trace[], bool first_frame_exact);
 /**
  * Print a collected backtrace to a file descriptor.
  *
@@ -59,8 +139,10 @@ bool shbt_print_collected_backtrace_fd(shbt_frame_t trace[], size_t num_frames,
 /**
  * Write a backtrace from the current frame to a file descriptor.
  *
- * This is essentially shbt_collect_backtrace followed by
- * shbt_print_collected_backtrace_fd.
+ * This produces the same output as shbt_collect_backtrace followed by
+ * shbt_print_collected_backtrace_fd, but streams each frame as it is
+ * unwound. The stack is only unwound once and the stack space used does not
+ * depend on the depth of the backtrace.
  *
  * This function is safe to call from a signal handler and is thread-safe.
  *
@@ -68,6 +150,106 @@ bool shbt_print_collected_backtrace_fd(shbt_frame_t trace[], size_t num_frames,
  */
 bool shbt_print_backtrace_fd(int fd);
 
+/**
+ * Version of the frame API.
+ *
+ * Version 1 is shbt_frame_t, which stores symbol names inline. Version 2
+ * adds shbt_compact_frame_t, which stores them in a separate string arena.
+ * Both are supported.
+ */
+#define SHBT_FRAME_API_VERSION 2
+
+/** Marks a compact frame that has no symbol name. */
+#define SHBT_NO_SYMBOL UINT32_MAX
+
+/**
+ * Storage for symbol names referenced by compact frames.
+ *
+ * The buffer is provided by the caller, and may be shared by any number of
+ * backtraces. Set it up with shbt_string_arena_init; to reuse it, set used
+ * to 0.
+ */
+typedef struct shbt_string_arena {
+  /** Buffer that null-terminated names are stored in. */
+  char* buf;
+  /** Size of buf. */
+  size_t size;
+  /** Number of bytes of buf in use. */
+  size_t used;
+} shbt_string_arena_t;
+
+/** Saves collected stack frame information compactly. */
+typedef struct shbt_compact_frame {
+  /** Address for the function (PC). */
+  void* addr;
+  /** Offset of addr from the start of the function. */
+  uint32_t offset;
+  /**
+   * Saved symbol name (not demangled), as an offset into a string arena, or
+   * SHBT_NO_SYMBOL if it is not known.
+   */
+  uint32_t symbol;
+} shbt_compact_frame_t;
+
+/**
+ * Set up a string arena.
+ *
+ * @param arena The arena to set up.
+ * @param buf Buffer to store names in.
+ * @param size Size of buf.
+ */
+void shbt_string_arena_init(shbt_string_arena_t* arena, char* buf,
+                            size_t size);
+/**
+ * Return a name stored in a string arena.
+ *
+ * Returns NULL if ref is SHBT_NO_SYMBOL or is not in the arena.
+ *
+ * This function is safe to call from a signal handler and is thread-safe.
+ *
+ * @param arena The arena the name is stored in.
+ * @param ref Reference to the name (e.g. shbt_compact_frame_t::symbol).
+ */
+const char* shbt_string_arena_get(const shbt_string_arena_t* arena,
+                                  uint32_t ref);
+/**
+ * Collect a backtrace with compact frames.
+ *
+ * This works like shbt_collect_backtrace, but symbol names are stored in
+ * arena rather than in each frame, so they are not truncated and take only
+ * as much space as they need. Consecutive frames in the same function share
+ * the name. If the arena runs out of space, frames will still be collected
+ * but their symbol will be SHBT_NO_SYMBOL.
+ *
+ * This function is safe to call from a signal handler. It is thread-safe
+ * provided arena is not used concurrently.
+ *
+ * @param trace Pre-allocated array to store frame info in.
+ * @param num_frames Maximum number of frames to write to trace.
+ * @param num_valid_frames Will contain the number of valid frames written to
+ * trace.
+ * @param arena String arena to store symbol names in.
+ */
+bool shbt_collect_compact_backtrace(shbt_compact_frame_t trace[],
+                                    size_t num_frames,
+                                    size_t* num_valid_frames,
+                                    shbt_string_arena_t* arena);
+/**
+ * Print a backtrace collected with compact frames to a file descriptor.
+ *
+ * The output is the same as shbt_print_collected_backtrace_fd.
+ *
+ * This function is safe to call from a signal handler and is thread-safe.
+ *
+ * @param trace Collected stack trace.
+ * @param num_frames Number of frames in trace.
+ * @param arena String arena the symbol names are stored in.
+ * @param fd The file descriptor to write to.
+ */
+bool shbt_print_compact_backtrace_fd(const shbt_compact_frame_t trace[],
+                                     size_t num_frames,
+                                     const shbt_string_arena_t* arena, int fd);
+
 /**
  * Return the current depth of the stack frame.
  *
@@ -79,6 +261,112 @@ bool shbt_print_backtrace_fd(int fd);
  */
 size_t shbt_get_stack_depth();
 
+/**
+ * Build an index of the symbols in all currently loaded modules.
+ *
+ * Once this has been built, backtraces look up symbol names by a binary
+ * search in the index rather than through libunwind, which re-reads symbol
+ * tables for every lookup. The index takes memory proportional to the
+ * number of function symbols and keeps each module's file mapped.
+ *
+ * Once built, the index is rebuilt along with the module snapshot (see
+ * shbt_update_module_map), which adds newly loaded modules and drops
+ * unloaded ones. This may also be called again to do that immediately.
+ * Files that were already indexed are reused, even if they are loaded at a
+ * different address, and files that are no longer loaded are unmapped.
+ *
+ * The index is only supported on Linux; elsewhere, this returns false.
+ *
+ * This function is not safe to call from a signal handler, but is
+ * thread-safe.
+ */
+bool shbt_build_symbol_index();
+
+/**
+ * Build compact unwind tables for all currently loaded modules.
+ *
+ * When SHBT is built with SHBT_UNWINDER=UNWIND_TABLE, backtraces step
+ * through frames with these tables instead of libunwind where they can.
+ * Building them interprets the call frame information in each module's
+ * .eh_frame once, so stepping is a binary search instead. The tables take
+ * memory proportional to the size of the code. Signal handlers and the
+ * profiler build them when they are registered or started, and rebuild
+ * them along with the module snapshot (see shbt_update_module_map).
+ *
+ * This may be called again (e.g. after loading libraries) to add newly
+ * loaded modules. Files that already have tables are reused, even if they
+ * are loaded at a different address, and the tables of files that are no
+ * longer loaded are freed.
+ *
+ * The tables are only supported on x86-64 Linux, with
+ * SHBT_UNWINDER=UNWIND_TABLE; otherwise, this returns false.
+ *
+ * This function is not safe to call from a signal handler, but is
+ * thread-safe.
+ */
+bool shbt_build_unwind_table();
+
+/** Time shbt_dump_all_threads waits for threads to respond, in ms. */
+#define SHBT_THREAD_TIMEOUT_MS 100
+
+/**
+ * Collect the addresses of another thread's backtrace.
+ *
+ * The thread is interrupted with the signal SIGRTMAX - 5, which must not be
+ * used for anything else; a handler for it is installed on first use and
+ * left installed. The first address is the instruction the thread was
+ * interrupted at (so symbolize them with shbt_symbolize_ex, with
+ * first_frame_exact set). If the thread does not respond within the timeout (e.g.
+ * because it blocks the signal), this fails rather than waiting longer.
+ *
+ * Only one thread capture can run at a time; if another is running, this
+ * fails immediately.
+ *
+ * This is only supported on Linux; elsewhere, this returns false.
+ *
+ * This function is safe to call from a signal handler and is thread-safe.
+ *
+ * @param tid Thread ID (as returned by gettid) of a thread in this process.
+ * @param pcs Pre-allocated array to store addresses in.
+ * @param max_pcs Maximum number of addresses to write to pcs.
+ * @param num_pcs Will contain the number of valid addresses written to pcs.
+ * @param timeout_ms How long to wait for the thread, in milliseconds.
+ */
+bool shbt_collect_thread_addresses(int tid, void* pcs[], size_t max_pcs,
+                                   size_t* num_pcs, int timeout_ms);
+/**
+ * Collect another thread's backtrace.
+ *
+ * This works like shbt_collect_thread_addresses, then looks up symbols like
+ * shbt_symbolize.
+ *
+ * This function is safe to call from a signal handler and is thread-safe.
+ *
+ * @param tid Thread ID (as returned by gettid) of a thread in this process.
+ * @param trace Pre-allocated array to store frame info in.
+ * @param num_frames Maximum number of frames to write to trace.
+ * @param num_valid_frames Will contain the number of valid frames written to
+ * trace.
+ * @param timeout_ms How long to wait for the thread, in milliseconds.
+ */
+bool shbt_collect_thread_backtrace(int tid, shbt_frame_t trace[],
+                                   size_t num_frames,
+                                   size_t* num_valid_frames, int timeout_ms);
+/**
+ * Print the backtraces of all threads in the process to a file descriptor.
+ *
+ * Threads are interrupted in batches as with shbt_collect_thread_addresses,
+ * and each batch waits at most SHBT_THREAD_TIMEOUT_MS. Threads that do not
+ * respond in time are listed without a backtrace.
+ *
+ * This is only supported on Linux; elsewhere, this returns false.
+ *
+ * This function is safe to call from a signal handler and is thread-safe.
+ *
+ * @param fd The file descriptor to write to.
+ */
+bool shbt_dump_all_threads(int fd);
+
 /** Exit action for signal handlers. */
 typedef enum shbt_exit_action {
   /** Exit the program after the signal handler completes. */
@@ -92,8 +380,9 @@ typedef enum shbt_exit_action {
  * Register a signal handler for a signal.
  *
  * This signal handler will automatically print signal information and a
- * backtrace to stderr. It can also invoke an optional callback after this
- * (see shbt_register_signal_callback).
+ * backtrace to stderr (or write a binary crash record instead, see
+ * shbt_set_crash_record_fd). It can also invoke an optional callback after
+ * this (see shbt_register_signal_callback).
  *
  * It can then take one of three actions:
  *   1. Exit the program (default).
@@ -115,6 +404,25 @@ typedef enum shbt_exit_action {
  */
 bool shbt_register_signal_handler(int sig_num, shbt_exit_action_t exit_action,
                                   void (*callback)(int));
+/**
+ * Install an alternate signal stack for the calling thread.
+ *
+ * Signal handlers registered through SHBT run on the alternate stack, so
+ * they still work when a thread overflows its own stack. Stacks come from a
+ * pool of guard-paged mappings and are returned to it when the thread
+ * exits. Their size is 64 KiB (or SIGSTKSZ, if larger) unless overridden
+ * by the SHBT_SIGNAL_STACK_SIZE environment variable, in bytes, which is
+ * read when the first stack is installed.
+ *
+ * Registering a handler installs a stack for the registering thread. When
+ * SHBT is built with SHBT_HOOK_THREAD_CREATE (the default), every thread
+ * created after that gets one automatically; otherwise, threads must call
+ * this themselves. Threads that already have an alternate stack keep it.
+ *
+ * This function is not safe to call from a signal handler, but is
+ * thread-safe.
+ */
+bool shbt_install_signal_stack();
 /**
  * Register multiple signal handlers.
  *
@@ -142,6 +450,10 @@ bool shbt_register_signal_handlers(const int sig_nums[], size_t num_sigs,
  *   SIGTERM, SIGTRAP, SIGUSR1, SIGUSR2, SIGVTALRM, SIGXCPU, and SIGXFSZ.
  *
  * These are the signals that either terminate or dump core when received.
+ *
+ * If the SHBT_SYMBOL_INDEX environment variable is set to anything other
+ * than 0, this also builds the symbol index (see shbt_build_symbol_index),
+ * so the handlers do not need to look up symbols through libunwind.
  */
 bool shbt_register_fatal_handlers();
 /**
@@ -171,6 +483,452 @@ bool shbt_register_signal_callback(int sig_num, void (*callback)(int));
 bool shbt_register_signal_exit_action(int sig_num,
                                       shbt_exit_action_t exit_action);
 
+/**
+ * Update the snapshot of loaded modules used in reports.
+ *
+ * Backtraces printed by SHBT give each frame's module and offset in it,
+ * and crash records list the loaded modules with their build IDs. Signal
+ * handlers cannot safely ask the dynamic loader for these, so SHBT keeps a
+ * snapshot, taken when the first signal handler is registered. SHBT
+ * updates it when it notices that libraries have been loaded or unloaded
+ * (from the profiler and watchdog threads, when handlers are registered,
+ * and after every dlopen and dlclose when built with SHBT_HOOK_DLOPEN);
+ * otherwise, call this after loading libraries. This also rebuilds the
+ * symbol index and unwind tables if they are used, and flushes the cache of
+ * symbol names if libraries have been unloaded.
+ * Programs that print backtraces without registering a handler can call
+ * this to get module offsets too; until then, frames are printed with
+ * their absolute address.
+ *
+ * Returns false if some modules did not fit in the snapshot.
+ *
+ * This function is not safe to call from a signal handler, but is
+ * thread-safe.
+ */
+bool shbt_update_module_map();
+
+/** Magic number at the start of every crash record ("SHBT" big-endian). */
+#define SHBT_CRASH_RECORD_MAGIC 0x53484254u
+/** Version of the crash record layout. */
+#define SHBT_CRASH_RECORD_VERSION 1
+/** Maximum number of addresses in a crash record. */
+#define SHBT_CRASH_RECORD_MAX_PCS 256
+/** Maximum size of a module's build ID in a crash record. */
+#define SHBT_CRASH_RECORD_MAX_BUILD_ID 32
+/** Set in a crash record's flags if modules had to be left out. */
+#define SHBT_CRASH_RECORD_TRUNCATED 0x1u
+
+/**
+ * Header of a binary crash record.
+ *
+ * A crash record is this header, followed by num_pcs 64-bit addresses
+ * (innermost first, the first being the interrupted instruction, as
+ * shbt_symbolize_ex expects with first_frame_exact set), followed
+ * by num_modules module entries. All fields are in the byte order of the
+ * process that wrote the record; a reader can detect a mismatch from magic.
+ * Readers should use header_size and entry_size to find the following
+ * sections, so fields can be added at the end in later versions.
+ */
+typedef struct shbt_crash_record_header {
+  /** SHBT_CRASH_RECORD_MAGIC. */
+  uint32_t magic;
+  /** SHBT_CRASH_RECORD_VERSION. */
+  uint16_t version;
+  /** Size of this header, in bytes. */
+  uint16_t header_size;
+  /** Size of the whole record, in bytes. */
+  uint32_t record_size;
+  /** Signal number. */
+  int32_t sig_num;
+  /** Signal code (si_code). */
+  int32_t sig_code;
+  /** Error number (si_errno). */
+  int32_t sig_errno;
+  /** Process ID of the crashing process. */
+  int32_t pid;
+  /** Thread ID of the crashing thread, or 0 if unknown. */
+  int32_t tid;
+  /** Sending process ID (si_pid), if the signal was sent by a process. */
+  int32_t sender_pid;
+  /** Sending user ID (si_uid), if the signal was sent by a process. */
+  int32_t sender_uid;
+  /** MPI rank of the process, or -1 if unknown. */
+  int32_t mpi_rank;
+  /** Number of addresses following the header. */
+  uint32_t num_pcs;
+  /** Number of module entries following the addresses. */
+  uint32_t num_modules;
+  /** SHBT_CRASH_RECORD_* flags. */
+  uint32_t flags;
+  /** Faulting address (si_addr) for SIGSEGV, SIGBUS, etc., otherwise 0. */
+  uint64_t fault_addr;
+  /** Time of the crash, in nanoseconds since the epoch. */
+  int64_t time_ns;
+} shbt_crash_record_header_t;
+
+/**
+ * A module (executable or shared library) in a crash record.
+ *
+ * Each entry is followed by the module's null-terminated path, padded with
+ * zeros so the next entry starts on an 8-byte boundary.
+ */
+typedef struct shbt_crash_record_module {
+  /** Difference between the module's load and link-time addresses. */
+  uint64_t load_base;
+  /** Lowest address of the module's loaded segments. */
+  uint64_t start;
+  /** End of the module's loaded segments. */
+  uint64_t end;
+  /** Size of this entry including the path and padding, in bytes. */
+  uint32_t entry_size;
+  /** Length of the path including the null terminator. */
+  uint16_t path_size;
+  /** Length of build_id, or 0 if the module has none. */
+  uint16_t build_id_size;
+  /** GNU build ID of the module. */
+  uint8_t build_id[SHBT_CRASH_RECORD_MAX_BUILD_ID];
+} shbt_crash_record_module_t;
+
+/**
+ * Write binary crash records instead of text reports.
+ *
+ * When a file descriptor is set, signal handlers registered through SHBT
+ * write a crash record (see shbt_crash_record_header_t) to it with a single
+ * write instead of printing the signal and a symbolized backtrace to
+ * stderr. This is much cheaper than the text report, since nothing is
+ * symbolized or formatted, so it suits jobs where many processes may crash
+ * at once. Records can be symbolized later, using the modules they list.
+ *
+ * The descriptor should be opened beforehand (e.g. with O_APPEND, so
+ * records from several processes do not overwrite each other) and stay open.
+ *
+ * @param fd File descriptor to write records to, or -1 to go back to text
+ * reports.
+ */
+void shbt_set_crash_record_fd(int fd);
+
+/** Stack ID returned when a stack could not be interned. */
+#define SHBT_NO_STACK_ID UINT32_MAX
+
+/**
+ * A table that interns stacks of addresses.
+ *
+ * Each distinct stack added to the table is stored once and given a 32-bit
+ * ID, along with a count. All memory is allocated when the table is created,
+ * and adding stacks is lock-free and safe in signal handlers.
+ */
+typedef struct shbt_stack_table shbt_stack_table_t;
+
+/**
+ * Create a stack table.
+ *
+ * Memory for the table is reserved up front, but pages are only used as
+ * stacks are added.
+ *
+ * This function is not safe to call from a signal handler.
+ *
+ * @param max_stacks Maximum number of distinct stacks.
+ * @param max_pcs Maximum total number of addresses in all stacks.
+ * @return The table, or NULL on error.
+ */
+shbt_stack_table_t* shbt_stack_table_create(size_t max_stacks,
+                                            size_t max_pcs);
+
+/**
+ * Destroy a stack table created by shbt_stack_table_create.
+ *
+ * This function is not safe to call from a signal handler.
+ */
+void shbt_stack_table_destroy(shbt_stack_table_t* table);
+
+/**
+ * Add a stack to a table and add to its count.
+ *
+ * If the stack is already in the table, this returns its existing ID.
+ *
+ * This is lock-free and safe to call from a signal handler.
+ *
+ * @param table The table.
+ * @param pcs Addresses of the stack.
+ * @param num_pcs Number of addresses.
+ * @param count Amount to add to the stack's count.
+ * @return The ID of the stack, or SHBT_NO_STACK_ID if the table is full.
+ */
+uint32_t shbt_stack_table_intern(shbt_stack_table_t* table,
+                                 void* const pcs[], size_t num_pcs,
+                                 uint64_t count);
+
+/**
+ * Get a stack from a table by ID.
+ *
+ * The returned addresses remain valid until the table is reset or
+ * destroyed.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param table The table.
+ * @param id ID of the stack.
+ * @param pcs Will point to the stack's addresses.
+ * @param num_pcs Will contain the number of addresses.
+ * @param count If not NULL, will contain the stack's count.
+ * @return true if id is a stack in the table.
+ */
+bool shbt_stack_table_get(const shbt_stack_table_t* table, uint32_t id,
+                          void* const** pcs, size_t* num_pcs,
+                          uint64_t* count);
+
+/**
+ * Call a function for every stack in a table, in order of ID.
+ *
+ * Stacks may be added concurrently; these may or may not be visited.
+ *
+ * @param table The table.
+ * @param fn Function to call with each stack's ID, addresses and count.
+ * @param arg Argument passed to fn.
+ * @return The number of stacks visited.
+ */
+size_t shbt_stack_table_foreach(
+  const shbt_stack_table_t* table,
+  void (*fn)(uint32_t id, void* const pcs[], size_t num_pcs, uint64_t count,
+             void* arg),
+  void* arg);
+
+/**
+ * Remove all stacks from a table.
+ *
+ * This invalidates all IDs and addresses previously returned, and must not
+ * run concurrently with any other use of the table.
+ */
+void shbt_stack_table_reset(shbt_stack_table_t* table);
+
+/** Maximum number of frames recorded in a profiler sample. */
+#define SHBT_PROFILER_MAX_FRAMES 128
+
+/** A stack sample recorded by the profiler. */
+typedef struct shbt_profiler_sample {
+  /** Thread ID (as from gettid) of the sampled thread. */
+  int tid;
+  /**
+   * Addresses of the sampled frames, innermost first. The first address is
+   * the interrupted instruction; the rest are return addresses (see
+   * shbt_symbolize_ex).
+   */
+  void* const* pcs;
+  /** Number of entries in pcs. */
+  size_t num_pcs;
+  /**
+   * ID of the stack in the profiler's stack table (see shbt_profiler_stacks),
+   * or SHBT_NO_STACK_ID if the table was full.
+   */
+  uint32_t stack_id;
+  /**
+   * For wall-clock samples, the thread's scheduler state when the sample was
+   * requested, as in /proc (e.g. 'R' for running, 'S' for sleeping, 'D' for
+   * uninterruptible wait). 0 for CPU-time samples or if it is not known.
+   */
+  char state;
+} shbt_profiler_sample_t;
+
+/**
+ * Start the sampling profiler.
+ *
+ * This samples each thread after every 1/hz seconds of CPU time it uses.
+ * Each thread is driven by its own CPU-time timer delivering SIGPROF to it,
+ * and the SIGPROF handler interns the thread's stack in the profiler's stack
+ * table (counting the samples of each stack) and records the sample into a
+ * preallocated ring buffer for the thread. Samples are not symbolized; use
+ * shbt_profiler_read_samples to retrieve individual samples, or
+ * shbt_profiler_stacks for the counts of each stack.
+ *
+ * This replaces any SIGPROF handler until the profiler is stopped, and
+ * SIGPROF must not be used for anything else while it runs. Interrupted
+ * system calls are restarted.
+ *
+ * All threads that exist when this is called are sampled. Threads created
+ * later must call shbt_profiler_register_thread to be sampled. At most a
+ * fixed number of threads can be sampled at once; additional threads are
+ * ignored. The slots of threads that have exited are reused.
+ *
+ * The profiler is only supported on Linux; elsewhere, this returns false.
+ *
+ * @param hz Sampling frequency, in samples per CPU-second.
+ * @return true if the profiler was started, false on error or if it is
+ * already running.
+ */
+bool shbt_profiler_start(int hz);
+
+/**
+ * Start the sampling profiler in wall-clock mode.
+ *
+ * This samples every thread 1/hz seconds of real time, whether it is running
+ * or blocked, so it shows where threads wait as well as where they compute.
+ * A sampler thread lists the process's threads in /proc every period and
+ * queues the real-time signal SIGRTMAX - 4 to each of them with its current
+ * state; each thread's handler then records its stack as in CPU mode. New
+ * threads are found automatically.
+ *
+ * SIGRTMAX - 4 must not be used for anything else while the profiler runs.
+ * Interrupted system calls are restarted where possible, but as with any
+ * signal, calls that are never restarted (e.g. nanosleep or epoll_wait) may
+ * fail with EINTR in sampled threads.
+ *
+ * @param hz Sampling frequency, in samples per second.
+ * @return true if the profiler was started, false on error or if it is
+ * already running.
+ */
+bool shbt_profiler_start_wall(int hz);
+
+/**
+ * Sample the calling thread with the running profiler.
+ *
+ * This does nothing if the profiler is not running or the thread is already
+ * sampled. This is only needed in CPU mode.
+ *
+ * @return true if the thread is being sampled.
+ */
+bool shbt_profiler_register_thread();
+
+/**
+ * Stop the sampling profiler and restore the previous signal handler.
+ *
+ * Samples that have not been read are kept until they are read.
+ *
+ * @return true if the profiler was stopped, false if it was not running.
+ */
+bool shbt_profiler_stop();
+
+/**
+ * Pass recorded samples to a callback and remove them from the buffers.
+ *
+ * This may be called while the profiler is running. The sample passed to fn
+ * is only valid during the call, and fn must not call profiler functions.
+ *
+ * This function is not safe to call from a signal handler.
+ *
+ * @param fn Callback invoked for each sample.
+ * @param arg Argument passed to fn.
+ * @return The number of samples read.
+ */
+size_t shbt_profiler_read_samples(
+  void (*fn)(const shbt_profiler_sample_t* sample, void* arg), void* arg);
+
+/**
+ * Return the number of samples dropped because a buffer was full.
+ *
+ * The stacks of these samples are usually still counted in the profiler's
+ * stack table.
+ */
+uint64_t shbt_profiler_dropped_samples();
+
+/**
+ * Return the profiler's stack table.
+ *
+ * This contains every distinct stack sampled since the profiler was first
+ * started (or the table was last reset), with its number of samples. Unlike
+ * the per-sample buffers, it does not grow with the number of samples, so it
+ * does not need to be read periodically.
+ *
+ * The table may be reset with shbt_stack_table_reset, but only while the
+ * profiler is stopped; unread samples then lose their stacks.
+ *
+ * @return The table, or NULL if the profiler has never been started.
+ */
+shbt_stack_table_t* shbt_profiler_stacks();
+
+/**
+ * Write the profiler's stacks in folded format.
+ *
+ * Each line is one distinct stack: the demangled names of its frames,
+ * outermost first and separated by ';', then a space and the number of
+ * samples, e.g. "main;solve;dot 42". This is the input format of flame graph
+ * tools, including tools/shbt_flamegraph. Frames whose symbol is not found
+ * are written as their address.
+ *
+ * This may be called while the profiler is running. It is not safe to call
+ * from a signal handler.
+ *
+ * @param fd File descriptor to write to.
+ * @return true on success.
+ */
+bool shbt_profile_write_folded(int fd);
+
+/**
+ * Write the profiler's stacks as a pprof profile.
+ *
+ * The output is an uncompressed profile.proto message, which pprof reads
+ * directly (and which may be gzipped as usual). Each distinct stack is one
+ * sample, with values for the number of samples and the time they represent
+ * (CPU or wall-clock, depending on how the profiler was last started).
+ * Frames are symbolized where possible, and the process's executable
+ * mappings are included, with build IDs, so that pprof can symbolize the
+ * rest offline.
+ *
+ * This may be called while the profiler is running. It is not safe to call
+ * from a signal handler.
+ *
+ * @param fd File descriptor to write to.
+ * @return true on success.
+ */
+bool shbt_profile_write_pprof(int fd);
+
+/**
+ * Start the watchdog.
+ *
+ * The watchdog monitors every thread that has called shbt_heartbeat. If a
+ * thread then goes timeout_ms without another heartbeat, the watchdog
+ * prints its backtrace to stderr (using shbt_collect_thread_backtrace) and
+ * takes the exit action:
+ *   - SHBT_EXIT_ACTION_EXIT: Exit the program.
+ *   - SHBT_EXIT_ACTION_RETURN: Keep running. The thread is reported again
+ *     only if it resumes heartbeats and then stalls again.
+ *   - SHBT_EXIT_ACTION_RERAISE: Abort the program with SIGABRT, sent to the
+ *     hung thread, e.g. to get a core dump.
+ * If its backtrace cannot be collected (e.g. while another thread's is
+ * being collected), the watchdog tries again for up to about another
+ * timeout_ms before reporting the thread without it.
+ *
+ * At most 256 threads are monitored; heartbeats from further threads are
+ * ignored.
+ *
+ * The watchdog is only supported on Linux; elsewhere, this returns false.
+ *
+ * @param timeout_ms Heartbeat deadline, in milliseconds.
+ * @param exit_action One of SHBT_EXIT_ACTION_*.
+ * @return true if the watchdog was started, false on error or if it is
+ * already running.
+ */
+bool shbt_watchdog_start(int timeout_ms, shbt_exit_action_t exit_action);
+
+/**
+ * Stop the watchdog.
+ *
+ * @return true if the watchdog was stopped, false if it was not running.
+ */
+bool shbt_watchdog_stop();
+
+/**
+ * Record a heartbeat for the calling thread.
+ *
+ * The first heartbeat registers the thread with the watchdog. After that,
+ * this is a call into SHBT that loads a thread-local pointer and does a
+ * relaxed atomic store to the thread's own cache line (a few nanoseconds),
+ * so it can be called in inner loops. Heartbeats may be sent whether or not
+ * the watchdog is running.
+ *
+ * This function is safe to call from a signal handler and is thread-safe,
+ * except for a thread's first call.
+ */
+void shbt_heartbeat();
+
+/**
+ * Stop monitoring the calling thread.
+ *
+ * Call this before a thread stops sending heartbeats for a legitimate
+ * reason, e.g. before waiting for new work. The next heartbeat registers
+ * it again. Threads are unregistered automatically when they exit.
+ */
+void shbt_watchdog_unregister_thread();
+
 #ifdef __cplusplus
 }  // extern "C"
 #endif
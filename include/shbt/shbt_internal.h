@@ -24,7 +24,9 @@
 #endif
 #include <signal.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "shbt/shbt.h"
 
@@ -55,6 +57,131 @@ struct shbt_signal_code_info {
   const char* code_desc;
 };
 
+/** Name used for frames whose symbol could not be found. */
+#define SHBT_UNKNOWN_SYMBOL "(unknown symbol)"
+
+/** Size of the inline buffer in shbt_writer, used as a fallback. */
+#define SHBT_WRITER_LOCAL_BUFFER_SIZE 256
+
+/**
+ * Time spent handling a signal, for benchmarking.
+ *
+ * Times are in nanoseconds. When a crash record is written, only start_ns
+ * and total_ns are set.
+ */
+struct shbt_handler_timing {
+  /** CLOCK_MONOTONIC time when the handler started. */
+  int64_t start_ns;
+  /** Formatting the report (everything not in another phase). */
+  int64_t print_ns;
+  /** Unwinding the stack and looking up symbol names. */
+  int64_t unwind_ns;
+  /** Demangling symbol names. */
+  int64_t demangle_ns;
+  /** Writing the report out. */
+  int64_t write_ns;
+  /** The whole handler, up to the signal's callback and exit action. */
+  int64_t total_ns;
+};
+
+/**
+ * Buffered output that is safe to use in a signal handler.
+ *
+ * Output is accumulated in a buffer and written out a whole line at a time
+ * (or all at once, if it fits), so printing a report takes a handful of
+ * system calls rather than one per token, and lines from different
+ * processes writing to the same file are not interleaved.
+ *
+ * Writers should be set up with shbt_writer_init and must be finished with
+ * shbt_writer_finish.
+ */
+struct shbt_writer {
+  /** File descriptor to write to. */
+  int fd;
+  /** Output buffer. */
+  char* buf;
+  /** Size of buf. */
+  size_t size;
+  /** Number of bytes currently in buf. */
+  size_t len;
+  /** Whether buf is the shared static buffer. */
+  bool is_static;
+  /** Whether any write has failed. */
+  bool failed;
+  /** Where to add the time spent in each phase, or NULL. */
+  struct shbt_handler_timing* timing;
+  /** Fallback buffer if the static buffer is in use. */
+  char local_buf[SHBT_WRITER_LOCAL_BUFFER_SIZE];
+};
+
+/**
+ * Set up a writer for a file descriptor.
+ *
+ * This uses a large static buffer when it is available, and falls back to a
+ * small inline buffer when another writer is using it (e.g. when multiple
+ * threads are handling signals).
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param writer The writer to initialize.
+ * @param fd File descriptor to write to.
+ */
+void shbt_writer_init(struct shbt_writer* writer, int fd);
+/**
+ * Write out any remaining buffered output and release the writer's buffer.
+ *
+ * Returns false if any write failed.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param writer The writer to finish.
+ */
+bool shbt_writer_finish(struct shbt_writer* writer);
+/**
+ * Add data to a writer.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param writer The writer to add to.
+ * @param data Data to add.
+ * @param len Length of data.
+ */
+void shbt_writer_write(struct shbt_writer* writer, const char* data,
+                       size_t len);
+/**
+ * Add a string to a writer.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param writer The writer to add to.
+ * @param str String to add. Must be null-terminated.
+ */
+void shbt_writer_puts(struct shbt_writer* writer, const char* str);
+/**
+ * Add an integer to a writer.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param writer The writer to add to.
+ * @param i Integer to add.
+ * @param base Base for the representation (see shbt_itoa).
+ * @param pad Prepend up to this many 0s (see shbt_itoa).
+ */
+void shbt_writer_put_int(struct shbt_writer* writer, intptr_t i, int base,
+                         size_t pad);
+
+/**
+ * Write all of a set of buffers to a file descriptor.
+ *
+ * This retries on interruption and short writes. iov is modified.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param fd File descriptor to write to.
+ * @param iov Buffers to write.
+ * @param iovcnt Number of entries in iov.
+ */
+bool shbt_safe_writev(int fd, struct iovec* iov, int iovcnt);
 /**
  * Print to file descriptor.
  *
@@ -72,6 +199,12 @@ void shbt_safe_print(const char* output, int fd);
  * @param output String to print. Must be null-terminated.
  */
 void shbt_print_to_stderr(const char* output);
+/**
+ * Return the current CLOCK_MONOTONIC time in nanoseconds.
+ *
+ * This is safe to call from a signal handler.
+ */
+int64_t shbt_now_ns();
 
 /**
  * Return signal information struct.
@@ -98,18 +231,164 @@ const struct shbt_signal_code_info* shbt_get_signal_code_info(
   const struct shbt_signal_code_info info_list[], int code_num);
 
 /**
- * Print detailed signal information to stderr
+ * Print detailed signal information.
  *
  * This is safe to call from a signal handler.
  *
+ * @param writer Writer to print to.
  * @param sig_num The signal number.
  * @param info Additional signal information.
  */
-void shbt_print_signal(int sig_num, siginfo_t* info);
+void shbt_print_signal(struct shbt_writer* writer, int sig_num,
+                       siginfo_t* info);
 /**
  * Actual signal handler.
  */
 void shbt_sigaction_handler(int sig_num, siginfo_t* info, void* void_ucontext);
+/**
+ * Set a function to call with the time each signal handler took.
+ *
+ * The hook is called from the signal handler, before the signal's callback
+ * and exit action. While no hook is set, handlers are not timed.
+ *
+ * @param hook Function to call, or NULL to stop timing handlers.
+ */
+void shbt_set_handler_timing_hook(
+  void (*hook)(int sig_num, const struct shbt_handler_timing* timing));
+
+/** Maximum number of modules in a module map snapshot. */
+#define SHBT_MAX_MODULES 512
+
+/** A loaded module (executable or shared library). */
+struct shbt_module {
+  /** Lowest address of the module's loaded segments. */
+  uintptr_t start;
+  /** End of the module's loaded segments. */
+  uintptr_t end;
+  /** Difference between the module's load and link-time addresses. */
+  uintptr_t load_base;
+  /** Path of the module. */
+  const char* path;
+  /** File name part of path. */
+  const char* name;
+  /** GNU build ID of the module. */
+  uint8_t build_id[SHBT_CRASH_RECORD_MAX_BUILD_ID];
+  /** Length of build_id, or 0 if the module has none. */
+  size_t build_id_size;
+};
+
+/** A snapshot of the loaded modules, sorted by address. */
+struct shbt_module_map {
+  /** Number of entries in modules. */
+  size_t num_modules;
+  /** Whether some modules did not fit. */
+  bool truncated;
+  /** The modules. */
+  struct shbt_module modules[SHBT_MAX_MODULES];
+  /** Storage for the modules' paths. */
+  char paths[64 * 1024];
+  /** Number of bytes used in paths. */
+  size_t paths_used;
+};
+
+/**
+ * Take the first module map snapshot, if none has been taken yet.
+ *
+ * After this, the snapshot is updated by shbt_check_modules.
+ */
+void shbt_enable_module_map();
+/**
+ * Update the module map snapshot (if one has been taken) and everything
+ * else derived from the loaded modules, if any modules have been loaded or
+ * unloaded since the last update.
+ *
+ * This is cheap when nothing has changed, so it is called whenever SHBT
+ * gets the chance outside signal handlers: when handlers are registered,
+ * by the profiler and watchdog threads, and after dlopen and dlclose (with
+ * SHBT_HOOK_DLOPEN).
+ *
+ * This is not safe to call from a signal handler.
+ */
+void shbt_check_modules();
+/**
+ * Get the current module map snapshot.
+ *
+ * Returns NULL if no snapshot has been taken. Otherwise, the snapshot stays
+ * valid until it is passed to shbt_module_map_release.
+ *
+ * This is safe to call from a signal handler.
+ */
+const struct shbt_module_map* shbt_module_map_acquire();
+/**
+ * Release a snapshot from shbt_module_map_acquire.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param map The snapshot (may be NULL).
+ */
+void shbt_module_map_release(const struct shbt_module_map* map);
+/**
+ * Find the module containing an address.
+ *
+ * Returns NULL if map is NULL or no module contains addr.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param map Module map snapshot.
+ * @param addr Address to look up.
+ */
+const struct shbt_module* shbt_module_map_find(
+  const struct shbt_module_map* map, uintptr_t addr);
+
+/**
+ * Return the file descriptor set by shbt_set_crash_record_fd, or -1.
+ *
+ * This is safe to call from a signal handler.
+ */
+int shbt_get_crash_record_fd();
+/**
+ * Write a binary crash record for a signal.
+ *
+ * This must be called from a signal handler, since the backtrace starts at
+ * the interrupted frame.
+ *
+ * Modules are taken from the module map snapshot.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param fd File descriptor to write to.
+ * @param sig_num The signal number.
+ * @param info Additional signal information (may be NULL).
+ * @param ucontext The context the handler was given (may be NULL).
+ * @param mpi_rank MPI rank of the process, or -1.
+ */
+bool shbt_write_crash_record(int fd, int sig_num, siginfo_t* info,
+                             const void* ucontext, int mpi_rank);
+
+/**
+ * Write a backtrace from the current frame to a writer.
+ *
+ * This is what shbt_print_backtrace_fd uses internally.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param writer Writer to print to.
+ * @param skip_frames Number of frames above the caller to skip.
+ */
+bool shbt_write_backtrace(struct shbt_writer* writer, size_t skip_frames);
+/**
+ * Write a backtrace of the frames interrupted by a signal to a writer.
+ *
+ * This is what the signal handler uses.
+ *
+ * This must be called from the handler for the signal, and is safe to call
+ * there.
+ *
+ * @param writer Writer to print to.
+ * @param ucontext The context the handler was given (may be NULL).
+ */
+bool shbt_write_signal_backtrace(struct shbt_writer* writer,
+                                 const void* ucontext);
 
 /**
  * Convert an integer to a string.
@@ -133,10 +412,137 @@ void shbt_sigaction_handler(int sig_num, siginfo_t* info, void* void_ucontext);
  */
 char* shbt_itoa(intptr_t i, char* buf, size_t size, int base, size_t pad);
 
+/**
+ * Collect the addresses of the frames interrupted by a signal.
+ *
+ * This must be called from the handler for the signal. Unwinding starts
+ * from ucontext, so the first address is the interrupted instruction and
+ * the rest are return addresses. Without ucontext (or where it cannot be
+ * used), the handler's own frames are unwound and skipped instead.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param ucontext The context the handler was given (may be NULL).
+ * @param pcs Buffer to store the addresses in.
+ * @param max_pcs Number of entries in pcs.
+ * @return The number of addresses collected.
+ */
+size_t shbt_collect_signal_addresses(const void* ucontext, void* pcs[],
+                                     size_t max_pcs);
+
+/**
+ * Look up the function containing an address in the symbol index.
+ *
+ * Returns the length of the (mangled) name of the function, or 0 if there
+ * is no symbol index or the address is not in an indexed function. The
+ * name is copied into buf, and truncated if the length is size or more.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param addr Address to look up.
+ * @param buf Buffer for the name.
+ * @param size Size of buf.
+ * @param start Will contain the start address of the function.
+ */
+size_t shbt_symbol_index_lookup(uintptr_t addr, char* buf, size_t size,
+                                uintptr_t* start);
+/**
+ * Rebuild the symbol index if it has been built, so it covers exactly the
+ * modules that are loaded now.
+ *
+ * This is not safe to call from a signal handler.
+ */
+void shbt_update_symbol_index();
+
+/**
+ * Look up a return address in the symbol cache.
+ *
+ * Returns the cached (mangled) name of the function containing pc, or NULL if
+ * it is not cached. Returned names remain valid forever.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param pc Return address to look up.
+ * @param offset Will contain the offset of pc from the start of the function.
+ */
+const char* shbt_symbol_cache_lookup(uintptr_t pc, uintptr_t* offset);
+
+/**
+ * Return the current generation of the symbol cache.
+ *
+ * Read this before looking up a name to insert, and pass it to
+ * shbt_symbol_cache_insert, so a name looked up while the cache was being
+ * flushed is not added.
+ *
+ * This is safe to call from a signal handler.
+ */
+uint32_t shbt_symbol_cache_generation();
+/**
+ * Add the symbol name for a return address to the symbol cache.
+ *
+ * Nothing is added if pc is already cached, the cache is full, or the cache
+ * has been flushed since generation was read.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param pc Return address.
+ * @param symbol Name of the function containing pc.
+ * @param offset Offset of pc from the start of the function.
+ * @param generation Value of shbt_symbol_cache_generation from before symbol
+ * was looked up.
+ */
+void shbt_symbol_cache_insert(uintptr_t pc, const char* symbol,
+                              uintptr_t offset, uint32_t generation);
+/**
+ * Forget everything in the symbol cache.
+ *
+ * This is called when modules are unloaded, since their addresses may hold
+ * other functions later. Names returned before remain valid, and the slots
+ * of forgotten entries are reused.
+ *
+ * This is safe to call from a signal handler.
+ */
+void shbt_symbol_cache_flush();
+/**
+ * Empty the symbol cache and reclaim all of its space.
+ *
+ * This is for benchmarks that measure an empty cache. Names returned
+ * before become invalid.
+ *
+ * This is not thread-safe: nothing else may use the cache meanwhile.
+ */
+void shbt_symbol_cache_reset();
+
+/**
+ * Demangle a symbol, using the symbol cache when possible.
+ *
+ * If pc is cached with the same symbol name, this returns its cached
+ * demangled name, demangling it into the cache first if needed. Otherwise,
+ * the symbol is demangled into buf.
+ *
+ * Returns the demangled name (either cached or buf), or NULL if symbol could
+ * not be demangled.
+ *
+ * This is safe to call from a signal handler if shbt_demangle is.
+ *
+ * @param pc Return address symbol was looked up for.
+ * @param symbol Mangled symbol.
+ * @param buf Buffer to demangle into if needed.
+ * @param size Size of buf.
+ */
+const char* shbt_symbol_cache_demangle(uintptr_t pc, const char* symbol,
+                                       char* buf, size_t size);
+
 /**
  * Demangle a mangled symbol from the Itanium C++ ABI.
  *
- * Returns true if demangling is successful, false otherwise.
+ * Returns true if demangling is successful, false otherwise (including when
+ * the demangled name does not fit in out).
+ *
+ * With the builtin demangler, the time this takes is bounded by the length
+ * of mangled and the stack it takes by a fixed nesting depth (about 29 KiB
+ * at most), and symbols that need more than that (which are pathological
+ * or not valid) are not demangled.
  *
  * This is safe to call from a signal handler unless SHBT_USE_ABI_DEMANGLER
  * is defined.
@@ -148,9 +554,212 @@ char* shbt_itoa(intptr_t i, char* buf, size_t size, int base, size_t pad);
 bool shbt_demangle(const char* mangled, char* out, size_t out_size);
 
 /**
- * Handle internal cleanup on exit.
+ * Write "Thread <tid> (<name>)" for a thread in this process.
+ *
+ * The name is omitted if it cannot be read.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param writer Writer to write to.
+ * @param tid Thread ID.
+ */
+void shbt_write_thread_name(struct shbt_writer* writer, int tid);
+
+/** Information about the most recent profiler run, for exports. */
+struct shbt_profiler_run {
+  /** Whether the run was in wall-clock mode. */
+  bool wall;
+  /** Sampling interval, in nanoseconds. */
+  int64_t period_ns;
+  /** Time the run started, in nanoseconds since the epoch. */
+  int64_t start_ns;
+  /** Length of the run so far, in nanoseconds. */
+  int64_t duration_ns;
+};
+
+/**
+ * Get information about the most recent profiler run.
+ *
+ * Returns false if the profiler has never been started.
+ *
+ * @param run Will contain the information.
+ */
+bool shbt_profiler_get_run(struct shbt_profiler_run* run);
+
+/**
+ * Have threads created from now on install a signal stack when they start.
+ *
+ * This only has an effect when SHBT_HOOK_THREAD_CREATE is defined.
+ */
+void shbt_enable_thread_signal_stacks();
+
+/** A position in a stack being walked with frame pointers. */
+struct shbt_frame_pointer_cursor {
+  /** PC of the current frame. */
+  uintptr_t pc;
+  /** Whether pc is the instruction a signal interrupted. */
+  bool is_signal_frame;
+  /** Frame pointer (back chain on POWER) of the current frame, or 0. */
+  uintptr_t frame;
+  /** Bounds of the stack the current frame is on. */
+  uintptr_t stack_low;
+  uintptr_t stack_high;
+  /** Bounds of the thread's stack and of its alternate signal stack. */
+  uintptr_t thread_low;
+  uintptr_t thread_high;
+  uintptr_t alt_low;
+  uintptr_t alt_high;
+  /** If the current frame is a signal trampoline, the signal's context. */
+  const void* signal_context;
+};
+
+/**
+ * Start walking the calling thread's stack with frame pointers.
+ *
+ * Returns false if the stack cannot be walked with frame pointers (this is
+ * not x86-64 or POWER, or the thread's stack bounds are not known; see
+ * shbt_frame_pointer_register_thread). Otherwise, the cursor is at the
+ * frame given, whose PC is not known.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param cursor Cursor to initialize.
+ * @param frame Frame address (from __builtin_frame_address(0)) of the
+ * function to start from.
+ */
+bool shbt_frame_pointer_init(struct shbt_frame_pointer_cursor* cursor,
+                             void* frame);
+/**
+ * Start walking the stack interrupted by a signal with frame pointers.
+ *
+ * This is like shbt_frame_pointer_init, but the first step goes to the
+ * interrupted frame. This is only supported on x86-64; elsewhere this
+ * returns false.
+ *
+ * This must be called from the handler for the signal.
+ *
+ * @param cursor Cursor to initialize.
+ * @param context The ucontext_t the handler was given.
+ */
+bool shbt_frame_pointer_init_context(struct shbt_frame_pointer_cursor* cursor,
+                                     const void* context);
+/**
+ * Step a frame pointer cursor to the caller of its frame.
+ *
+ * Returns false if there is no caller, or the next frame is not within the
+ * known stack bounds. Memory outside those bounds is never read, so a
+ * corrupted stack ends the walk rather than faulting.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param cursor Cursor to step.
+ */
+bool shbt_frame_pointer_step(struct shbt_frame_pointer_cursor* cursor);
+/**
+ * Record the calling thread's stack bounds for the frame pointer and unwind
+ * table unwinders.
+ *
+ * This is called for the thread that loads SHBT, when signal handlers are
+ * registered, when a signal stack is installed, when threads start (with
+ * SHBT_HOOK_THREAD_CREATE), and when threads are profiled. It does nothing
+ * unless SHBT_USE_FRAME_POINTER_UNWINDER or SHBT_USE_UNWIND_TABLE_UNWINDER
+ * is defined.
+ *
+ * This is not safe to call from a signal handler.
+ */
+void shbt_frame_pointer_register_thread();
+/**
+ * Record how handlers for a signal return, so the frame pointer unwinder
+ * can step out of them.
+ *
+ * This must be called after installing a handler for sig_num. It does
+ * nothing unless SHBT_USE_FRAME_POINTER_UNWINDER is defined.
+ *
+ * @param sig_num Signal a handler was installed for.
+ */
+void shbt_frame_pointer_note_handler(int sig_num);
+
+/** A position in a stack being walked with the unwind table. */
+struct shbt_unwind_table_cursor {
+  /** PC of the current frame. */
+  uintptr_t pc;
+  /** Stack and frame pointers of the current frame. */
+  uintptr_t sp;
+  uintptr_t fp;
+  /**
+   * Whether pc is the instruction a signal interrupted, rather than a
+   * return address.
+   */
+  bool exact;
+  /**
+   * Whether the last step failed because the table has no simple rule for
+   * the current frame, so libunwind should step it instead.
+   */
+  bool fallback;
+  /** Bounds of the stack being walked. */
+  struct shbt_frame_pointer_cursor stack;
+};
+
+/**
+ * Build the unwind table (see shbt_build_unwind_table) if it has not been
+ * built, and rebuild it when modules are loaded or unloaded from now on
+ * (see shbt_check_modules).
+ *
+ * This is not safe to call from a signal handler.
+ */
+void shbt_enable_unwind_table();
+/**
+ * Rebuild the unwind table if shbt_enable_unwind_table has been called.
+ *
+ * This is not safe to call from a signal handler.
+ */
+void shbt_update_unwind_table();
+/**
+ * Start walking a stack with the unwind table.
+ *
+ * Returns false if the stack cannot be walked with the table (there is no
+ * table, or the thread's stack bounds are not known; see
+ * shbt_frame_pointer_register_thread). Otherwise, the cursor is at the
+ * frame whose registers are in context.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param cursor Cursor to initialize.
+ * @param context The ucontext_t (e.g. from unw_getcontext) to start from,
+ * which must be from the calling thread.
+ * @param exact Whether the context is from a signal, so its PC is the
+ * interrupted instruction rather than a return address (whose call is
+ * looked up instead).
+ */
+bool shbt_unwind_table_init(struct shbt_unwind_table_cursor* cursor,
+                            const void* context, bool exact);
+/**
+ * Step an unwind table cursor to the caller of its frame.
+ *
+ * Returns false if there is no caller, the next frame is not within the
+ * stack's bounds, or the table has no simple rule for the current frame
+ * (in which case the cursor's fallback is set). Memory outside the stack is
+ * never read.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param cursor Cursor to step.
+ */
+bool shbt_unwind_table_step(struct shbt_unwind_table_cursor* cursor);
+/**
+ * Set the PC, stack pointer and frame pointer in a context to those of an
+ * unwind table cursor's frame, so libunwind can continue from there.
+ *
+ * Other registers are left as they are, so they only match the frame if
+ * it saved them, but libunwind rarely needs them to step.
+ *
+ * This is safe to call from a signal handler.
+ *
+ * @param cursor Cursor whose frame to use.
+ * @param context ucontext_t to update.
  */
-void __attribute__((destructor)) shbt_cleanup();
+void shbt_unwind_table_get_context(
+  const struct shbt_unwind_table_cursor* cursor, void* context);
 
 #ifdef __cplusplus
 }  // extern "C"
@@ -44,12 +44,16 @@ static const AbbrevPair operator_list[] = {
   {"oR", "|="},     {"eO", "^="},    {"ls", "<<"},     {"rs", ">>"},
   {"lS", "<<="},    {"rS", ">>="},   {"eq", "=="},     {"ne", "!="},
   {"lt", "<"},      {"gt", ">"},     {"le", "<="},     {"ge", ">="},
-  {"nt", "!"},      {"aa", "&&"},    {"oo", "||"},     {"pp", "++"},
-  {"mm", "--"},     {"cm", ","},     {"pm", "->*"},    {"pt", "->"},
-  {"cl", "()"},     {"ix", "[]"},    {"qu", "?"},      {"st", "sizeof"},
-  {"sz", "sizeof"}, {NULL, NULL},
+  {"ss", "<=>"},    {"nt", "!"},     {"aa", "&&"},     {"oo", "||"},
+  {"pp", "++"},     {"mm", "--"},    {"cm", ","},      {"pm", "->*"},
+  {"pt", "->"},     {"cl", "()"},    {"ix", "[]"},     {"qu", "?"},
+  {"st", "sizeof"}, {"sz", "sizeof"}, {"aw", "co_await"}, {NULL, NULL},
 };
 
+// Operators from operator_list that take one operand in expressions.
+static const char* const unary_operator_list[] = {
+  "ps", "ng", "ad", "de", "co", "nt", "pp", "mm", "aw", NULL};
+
 // List of builtin types from Itanium C++ ABI.
 static const AbbrevPair builtin_type_list[] = {
   {"v", "void"},        {"w", "wchar_t"},
@@ -62,34 +66,176 @@ static const AbbrevPair builtin_type_list[] = {
   {"n", "__int128"},    {"o", "unsigned __int128"},
   {"f", "float"},       {"d", "double"},
   {"e", "long double"}, {"g", "__float128"},
-  {"z", "ellipsis"},    {NULL, NULL}};
+  {"z", "..."},         {NULL, NULL}};
+
+// List of builtin types that start with D.
+static const AbbrevPair builtin_d_type_list[] = {
+  {"Dd", "decimal64"},        {"De", "decimal128"},
+  {"Df", "decimal32"},        {"Dh", "half"},
+  {"Di", "char32_t"},         {"Ds", "char16_t"},
+  {"Du", "char8_t"},          {"Da", "auto"},
+  {"Dc", "decltype(auto)"},   {"Dn", "decltype(nullptr)"},
+  {NULL, NULL}};
+
+// Suffixes of integer literals (e.g. 1ul), for the types that have them.
+static const AbbrevPair literal_suffix_list[] = {
+  {"i", ""},   {"j", "u"},   {"l", "l"},
+  {"m", "ul"}, {"x", "ll"},  {"y", "ull"},
+  {NULL, NULL}};
 
 // List of substitutions Itanium C++ ABI.
 static const AbbrevPair substitution_list[] = {
   {"St", ""},
   {"Sa", "allocator"},
   {"Sb", "basic_string"},
-  // std::basic_string<char, std::char_traits<char>,std::allocator<char> >
-  {"Ss", "string"},
-  // std::basic_istream<char, std::char_traits<char> >
-  {"Si", "istream"},
-  // std::basic_ostream<char, std::char_traits<char> >
-  {"So", "ostream"},
-  // std::basic_iostream<char, std::char_traits<char> >
-  {"Sd", "iostream"},
+  {"Ss",
+   "basic_string<char, std::char_traits<char>, std::allocator<char> >"},
+  {"Si", "basic_istream<char, std::char_traits<char> >"},
+  {"So", "basic_ostream<char, std::char_traits<char> >"},
+  {"Sd", "basic_iostream<char, std::char_traits<char> >"},
   {NULL, NULL}};
 
-// State needed for demangling.
+// Limits on the work done to demangle one symbol. Demangling happens in
+// signal handlers, so pathological symbols (or garbage) must not take long
+// or use much stack; anything that exceeds these is not demangled.
+//
+// The step budget is proportional to the length of the symbol. Failed
+// parses are memoized (see ParseMemoized), so typical symbols use only a
+// few steps per character.
+//
+// Stack use is about 11 KiB for the state plus up to about 350 bytes per
+// level of depth, so at the depth limit demangling takes about 26 KiB of
+// stack in optimized builds and 29 KiB in debug builds. This has to fit on
+// a signal stack (see shbt_sigstack.c) along with the rest of the handler.
+// The deepest symbol in the bundled corpus reaches a depth of 62; most
+// need less than 30.
+#define DEMANGLE_STEPS_PER_CHAR 32
+#define DEMANGLE_MIN_STEPS 1024
+#define DEMANGLE_MAX_DEPTH 64
+// Number of positions in a symbol that failed parses are memoized for.
+#define DEMANGLE_MEMO_SIZE 2048
+// Capacity of the tables used to print substitutions, template arguments
+// and declarators. Symbols that need more are not demangled.
+#define DEMANGLE_MAX_SUBSTITUTIONS 256
+#define DEMANGLE_MAX_TEMPLATE_ARGS 64
+#define DEMANGLE_MAX_DECLARATORS 32
+#define DEMANGLE_MAX_REFERENCED_PARAMS 32
+
+// Parsing functions that are memoized. Every recursive cycle in the grammar
+// passes through at least one of these (or Replay), so counting steps in
+// them bounds the total work.
+typedef enum {
+  RULE_ENCODING,
+  RULE_NAME,
+  RULE_UNQUALIFIED_NAME,
+  RULE_TYPE,
+  RULE_TEMPLATE_ARGS,
+  RULE_TEMPLATE_ARG,
+  RULE_EXPRESSION,
+  RULE_EXPR_PRIMARY,
+} ParseRule;
+
+// What a substitution candidate was parsed as, which is how it is parsed
+// again to print it.
+typedef enum {
+  SUBSTITUTION_TYPE,
+  SUBSTITUTION_PREFIX,
+  SUBSTITUTION_UNSCOPED_NAME,
+  SUBSTITUTION_TEMPLATE_PARAM,
+} SubstitutionKind;
+
+// A substitution candidate: the part of the mangled name it came from.
+// Like c++filt, template params in it refer to the template args where it
+// is printed, not where it was recorded (but see ReferencedParam).
+typedef struct {
+  int begin;
+  int end;
+  SubstitutionKind kind;
+} Substitution;
+
+// A template param that a reference type referred to, and the template args
+// it was printed with.
+typedef struct {
+  int param;
+  int template_args;
+} ReferencedParam;
+
+// Type modifiers that are printed around the type they modify.
+typedef enum {
+  DECLARATOR_POINTER,
+  DECLARATOR_REFERENCE,
+  DECLARATOR_RVALUE_REFERENCE,
+  DECLARATOR_CONST,
+  DECLARATOR_VOLATILE,
+  DECLARATOR_RESTRICT,
+  DECLARATOR_COMPLEX,
+  DECLARATOR_IMAGINARY,
+  DECLARATOR_MEMBER_POINTER,
+} DeclaratorKind;
+
+typedef struct {
+  DeclaratorKind kind;
+  int class_type;  // Offset of the class, for member pointers.
+} Declarator;
+
+// Qualifiers of a member function, from its <nested-name>.
+#define QUALIFIER_CONST 0x1
+#define QUALIFIER_VOLATILE 0x2
+#define QUALIFIER_RESTRICT 0x4
+#define QUALIFIER_REFERENCE 0x8
+#define QUALIFIER_RVALUE_REFERENCE 0x10
+
+// Part of the state that is saved and restored when backtracking.
 typedef struct {
   const char* mangled_cur;  // Cursor of mangled name.
   char* out_cur;            // Cursor of output string.
-  const char* out_begin;    // Beginning of output string.
-  const char* out_end;      // End of output string.
   const char* prev_name;    // For constructors/destructors.
   int prev_name_length;     // For constructors/destructors.
-  short nest_level;         // For nested names.
+  // Offset of the <template-args> that template params refer to, or -1.
+  int template_args;
+  short num_substitutions;  // Substitution candidates seen so far.
+  short num_referenced_params;  // Template params printed as references.
+  short num_declarators;    // Declarators waiting to be printed.
+  short first_declarator;   // First declarator of the current type.
+  short pack_index;         // Element of packs being expanded, or -1.
+  bool continue_declarators;  // Next type is modified by the declarators.
+  bool bind_template_args;  // Template args parsed now are referred to.
+  bool in_lambda_signature;  // Template params are auto parameters.
+  bool hide_return_type;    // Next <encoding> omits its return type.
+  bool hide_type;           // Next <encoding> prints only its name.
+  bool replaying;           // Printing a part of the name again.
   bool append;              // Append flag.
   bool overflowed;          // True if output gets overflowed.
+  bool unresolved;          // True if a reference could not be resolved.
+  // Properties of the last <name> parsed, for ParseEncoding.
+  bool name_is_template;
+  bool name_is_ctor_dtor_conv;
+  unsigned char name_qualifiers;
+} ParseState;
+
+// State needed for demangling.
+typedef struct {
+  ParseState parse;
+  const char* mangled_begin;  // Beginning of mangled name.
+  const char* mangled_end;    // End of mangled name.
+  const char* out_begin;      // Beginning of output string.
+  const char* out_end;        // End of output string.
+  const char* prefix_end;     // Where to stop a replayed <prefix>.
+  const char* hidden_candidate;  // Type that is not a substitution.
+  long steps_left;            // Remaining step budget.
+  int depth;                  // Current depth of memoized parses.
+  bool too_complex;           // True once a limit has been exceeded.
+  int pack_size;              // Size of the last pack expanded.
+  char* array_dimensions;     // Output of the last array's dimensions.
+  Substitution substitutions[DEMANGLE_MAX_SUBSTITUTIONS];
+  Declarator declarators[DEMANGLE_MAX_DECLARATORS];
+  ReferencedParam referenced_params[DEMANGLE_MAX_REFERENCED_PARAMS];
+  // Offsets of the arguments in the <template-args> at args_list.
+  int args_list;
+  int num_args;
+  int args[DEMANGLE_MAX_TEMPLATE_ARGS];
+  // Bit r of failed[i] is set if rule r is known to fail at position i.
+  unsigned char failed[DEMANGLE_MEMO_SIZE];
 } State;
 
 // We don't use strlen() in libc since it's not guaranteed to be async
@@ -103,14 +249,9 @@ static size_t StrLen(const char* str) {
   return len;
 }
 
-// Returns true if "str" has at least "n" characters remaining.
-static bool AtLeastNumCharsRemaining(const char* str, int n) {
-  for (int i = 0; i < n; ++i) {
-    if (str[i] == '\0') {
-      return false;
-    }
-  }
-  return true;
+// Returns true if there are at least "n" characters remaining.
+static bool AtLeastNumCharsRemaining(const State* state, int n) {
+  return n >= 0 && state->mangled_end - state->parse.mangled_cur >= n;
 }
 
 // Returns true if "str" has "prefix" as a prefix.
@@ -122,23 +263,53 @@ static bool StrPrefix(const char* str, const char* prefix) {
 
 static void InitState(State* state, const char* mangled, char* out,
                       int out_size) {
-  state->mangled_cur = mangled;
-  state->out_cur = out;
+  size_t length = StrLen(mangled);
+  state->parse.mangled_cur = mangled;
+  state->parse.out_cur = out;
+  state->parse.prev_name = NULL;
+  state->parse.prev_name_length = -1;
+  state->parse.template_args = -1;
+  state->parse.num_substitutions = 0;
+  state->parse.num_referenced_params = 0;
+  state->parse.num_declarators = 0;
+  state->parse.first_declarator = 0;
+  state->parse.pack_index = -1;
+  state->parse.continue_declarators = false;
+  state->parse.bind_template_args = false;
+  state->parse.in_lambda_signature = false;
+  state->parse.hide_return_type = false;
+  state->parse.hide_type = false;
+  state->parse.replaying = false;
+  state->parse.append = true;
+  state->parse.overflowed = false;
+  state->parse.unresolved = false;
+  state->parse.name_is_template = false;
+  state->parse.name_is_ctor_dtor_conv = false;
+  state->parse.name_qualifiers = 0;
+  state->mangled_begin = mangled;
+  state->mangled_end = mangled + length;
   state->out_begin = out;
   state->out_end = out + out_size;
-  state->prev_name = NULL;
-  state->prev_name_length = -1;
-  state->nest_level = -1;
-  state->append = true;
-  state->overflowed = false;
+  state->prefix_end = NULL;
+  state->hidden_candidate = NULL;
+  state->steps_left = DEMANGLE_MIN_STEPS + DEMANGLE_STEPS_PER_CHAR * length;
+  state->depth = 0;
+  state->too_complex = false;
+  state->pack_size = -1;
+  state->array_dimensions = out;
+  state->args_list = -1;
+  state->num_args = 0;
+  for (size_t i = 0; i < DEMANGLE_MEMO_SIZE && i <= length; ++i) {
+    state->failed[i] = 0;
+  }
 }
 
 // Returns true and advances "mangled_cur" if we find "one_char_token"
 // at "mangled_cur" position.  It is assumed that "one_char_token" does
 // not contain '\0'.
 static bool ParseOneCharToken(State* state, const char one_char_token) {
-  if (state->mangled_cur[0] == one_char_token) {
-    ++state->mangled_cur;
+  if (state->parse.mangled_cur[0] == one_char_token) {
+    ++state->parse.mangled_cur;
     return true;
   }
   return false;
@@ -148,9 +319,9 @@ static bool ParseOneCharToken(State* state, const char one_char_token) {
 // at "mangled_cur" position.  It is assumed that "two_char_token" does
 // not contain '\0'.
 static bool ParseTwoCharToken(State* state, const char* two_char_token) {
-  if (state->mangled_cur[0] == two_char_token[0] &&
-      state->mangled_cur[1] == two_char_token[1]) {
-    state->mangled_cur += 2;
+  if (state->parse.mangled_cur[0] == two_char_token[0] &&
+      state->parse.mangled_cur[1] == two_char_token[1]) {
+    state->parse.mangled_cur += 2;
     return true;
   }
   return false;
@@ -161,8 +332,8 @@ static bool ParseTwoCharToken(State* state, const char* two_char_token) {
 static bool ParseCharClass(State* state, const char* char_class) {
   const char* p = char_class;
   for (; *p != '\0'; ++p) {
-    if (state->mangled_cur[0] == *p) {
-      ++state->mangled_cur;
+    if (state->parse.mangled_cur[0] == *p) {
+      ++state->parse.mangled_cur;
       return true;
     }
   }
@@ -175,23 +346,37 @@ static bool Optional(bool unused) {
   return true;
 }
 
-// This function is used for handling <non-terminal>+ syntax.
 typedef bool (*ParseFunc)(State*);
-static bool OneOrMore(ParseFunc parse_func, State* state) {
-  if (parse_func(state)) {
-    while (parse_func(state)) {}
-    return true;
-  }
-  return false;
-}
 
-// This function is used for handling <non-terminal>* syntax. The function
-// always returns true and must be followed by a termination token or a
-// terminating sequence not handled by parse_func (e.g.
-// ParseOneCharToken(state, 'E')).
-static bool ZeroOrMore(ParseFunc parse_func, State* state) {
-  while (parse_func(state)) {}
-  return true;
+// This function is used for memoizing a parsing function. It fails without
+// parsing if parse_func is already known to fail at this position, and
+// records failures so they are not retried. This relies on whether a parse
+// succeeds, and where it ends, depending only on where it starts; in
+// particular, references to substitutions and template arguments always
+// parse, even if they cannot be resolved.
+//
+// It also enforces the limits on steps and depth. Once one is exceeded,
+// every parse fails, so the results of a truncated search are never used.
+static bool ParseMemoized(State* state, ParseRule rule, ParseFunc parse_func) {
+  if (state->too_complex) {
+    return false;
+  }
+  size_t pos = state->parse.mangled_cur - state->mangled_begin;
+  unsigned char mask = (unsigned char) (1u << rule);
+  if (pos < DEMANGLE_MEMO_SIZE && (state->failed[pos] & mask)) {
+    return false;
+  }
+  if (--state->steps_left < 0 || state->depth >= DEMANGLE_MAX_DEPTH) {
+    state->too_complex = true;
+    return false;
+  }
+  ++state->depth;
+  bool result = parse_func(state);
+  --state->depth;
+  if (!result && !state->too_complex && pos < DEMANGLE_MEMO_SIZE) {
+    state->failed[pos] |= mask;
+  }
+  return result;
 }
 
 // Append "str" at "out_cur".  If there is an overflow, "overflowed"
@@ -200,16 +385,16 @@ static bool ZeroOrMore(ParseFunc parse_func, State* state) {
 static void Append(State* state, const char* const str, const int length) {
   int i;
   for (i = 0; i < length; ++i) {
-    if (state->out_cur + 1 < state->out_end) {  // +1 for '\0'
-      *state->out_cur = str[i];
-      ++state->out_cur;
+    if (state->parse.out_cur + 1 < state->out_end) {  // +1 for '\0'
+      *state->parse.out_cur = str[i];
+      ++state->parse.out_cur;
     } else {
-      state->overflowed = true;
+      state->parse.overflowed = true;
       break;
     }
   }
-  if (!state->overflowed) {
-    *state->out_cur = '\0';  // Terminate it with '\0'
+  if (!state->parse.overflowed) {
+    *state->parse.out_cur = '\0';  // Terminate it with '\0'
   }
 }
 
@@ -222,102 +407,116 @@ static bool IsAlpha(char c) {
 
 static bool IsDigit(char c) { return c >= '0' && c <= '9'; }
 
-// Returns true if "str" is a function clone suffix.  These suffixes are used
-// by GCC 4.5.x and later versions to indicate functions which have been
-// cloned during optimization.  We treat any sequence (.<alpha>+.<digit>+)+ as
-// a function clone suffix.
-static bool IsFunctionCloneSuffix(const char* str) {
+// Returns the length of the clone suffix at the start of "str", or 0 if
+// there is none.  These suffixes are used by GCC to indicate functions
+// which have been cloned or split during optimization, e.g. ".isra.0" or
+// ".cold".  A clone suffix is .<lower/_>+ or .<digit>+, followed by any
+// number of .<digit>+.
+static size_t CloneSuffixLength(const char* str) {
   size_t i = 0;
-  while (str[i] != '\0') {
-    // Consume a single .<alpha>+.<digit>+ sequence.
-    if (str[i] != '.' || !IsAlpha(str[i + 1])) {
-      return false;
-    }
-    i += 2;
-    while (IsAlpha(str[i])) { ++i; }
-    if (str[i] != '.' || !IsDigit(str[i + 1])) {
-      return false;
-    }
+  if (str[i] != '.' ||
+      !(IsLower(str[i + 1]) || str[i + 1] == '_' || IsDigit(str[i + 1]))) {
+    return 0;
+  }
+  ++i;
+  while (IsLower(str[i]) || str[i] == '_') { ++i; }
+  if (str[i - 1] == '.') {
+    while (IsDigit(str[i])) { ++i; }
+  }
+  while (str[i] == '.' && IsDigit(str[i + 1])) {
     i += 2;
     while (IsDigit(str[i])) { ++i; }
   }
-  return true;  // Consumed everything in "str".
+  return i;
 }
 
 // Append "str" with some tweaks, iff "append" state is true.
-// Returns true so that it can be placed in "if" conditions.
 static void MaybeAppendWithLength(State* state, const char* const str,
                                   const int length) {
-  if (state->append && length > 0) {
+  if (state->parse.append && length > 0) {
     // Append a space if the output buffer ends with '<' and "str"
     // starts with '<' to avoid <<<.
-    if (str[0] == '<' && state->out_begin < state->out_cur &&
-        state->out_cur[-1] == '<') {
+    if (str[0] == '<' && state->out_begin < state->parse.out_cur &&
+        state->parse.out_cur[-1] == '<') {
       Append(state, " ", 1);
     }
-    // Remember the last identifier name for ctors/dtors.
-    if (IsAlpha(str[0]) || str[0] == '_') {
-      state->prev_name = state->out_cur;
-      state->prev_name_length = length;
-    }
     Append(state, str, length);
   }
 }
 
 // A convenient wrapper arount MaybeAppendWithLength().
 static bool MaybeAppend(State* state, const char* const str) {
-  if (state->append) {
+  if (state->parse.append) {
     int length = StrLen(str);
     MaybeAppendWithLength(state, str, length);
   }
   return true;
 }
 
-// This function is used for handling nested names.
-static bool EnterNestedName(State* state) {
-  state->nest_level = 0;
-  return true;
-}
-
-// This function is used for handling nested names.
-static bool LeaveNestedName(State* state, short prev_value) {
-  state->nest_level = prev_value;
-  return true;
+// Append a non-negative decimal number.
+static void MaybeAppendNumber(State* state, int number) {
+  char buf[16];
+  int i = sizeof(buf);
+  do {
+    buf[--i] = '0' + number % 10;
+    number /= 10;
+  } while (number > 0 && i > 0);
+  MaybeAppendWithLength(state, buf + i, sizeof(buf) - i);
 }
 
-// Disable the append mode not to print function parameters, etc.
-static bool DisableAppend(State* state) {
-  state->append = false;
-  return true;
+// Append the qualifiers of a member function or function type.
+static void MaybeAppendQualifiers(State* state, unsigned char qualifiers) {
+  if (qualifiers & QUALIFIER_CONST) {
+    MaybeAppend(state, " const");
+  }
+  if (qualifiers & QUALIFIER_VOLATILE) {
+    MaybeAppend(state, " volatile");
+  }
+  if (qualifiers & QUALIFIER_RESTRICT) {
+    MaybeAppend(state, " restrict");
+  }
+  if (qualifiers & QUALIFIER_REFERENCE) {
+    MaybeAppend(state, " &");
+  }
+  if (qualifiers & QUALIFIER_RVALUE_REFERENCE) {
+    MaybeAppend(state, " &&");
+  }
 }
 
-// Restore the append mode to the previous state.
-static bool RestoreAppend(State* state, bool prev_value) {
-  state->append = prev_value;
-  return true;
+// Returns true if the output ends with "c".
+static bool OutputEndsWith(State* state, char c) {
+  return state->parse.append && state->out_begin < state->parse.out_cur &&
+         state->parse.out_cur[-1] == c;
 }
 
-// Increase the nest level for nested names.
-static void MaybeIncreaseNestLevel(State* state) {
-  if (state->nest_level > -1) {
-    ++state->nest_level;
+// Remove everything appended since "pos".
+static void TruncateOutput(State* state, char* pos) {
+  if (state->parse.append && pos < state->parse.out_cur) {
+    state->parse.out_cur = pos;
+    if (!state->parse.overflowed) {
+      *pos = '\0';
+    }
   }
 }
 
-// Appends :: for nested names if necessary.
-static void MaybeAppendSeparator(State* state) {
-  if (state->nest_level >= 1) {
-    MaybeAppend(state, "::");
+static void ReverseOutput(char* begin, char* end) {
+  while (begin < --end) {
+    char c = *begin;
+    *begin++ = *end;
+    *end = c;
   }
 }
 
-// Cancel the last separator if necessary.
-static void MaybeCancelLastSeparator(State* state) {
-  if (state->nest_level >= 1 && state->append &&
-      state->out_begin <= state->out_cur - 2) {
-    state->out_cur -= 2;
-    *state->out_cur = '\0';
+// Move the output from "middle" on so it comes before the output from
+// "begin" to "middle".  This is used for parts of the name that are
+// printed in a different order than they are mangled.
+static void RotateOutput(State* state, char* begin, char* middle) {
+  if (!state->parse.append || state->parse.overflowed) {
+    return;
   }
+  ReverseOutput(begin, middle);
+  ReverseOutput(middle, state->parse.out_cur);
+  ReverseOutput(begin, state->parse.out_cur);
 }
 
 // Returns true if the identifier of the given length pointed to by
@@ -325,7 +524,129 @@ static void MaybeCancelLastSeparator(State* state) {
 static bool IdentifierIsAnonymousNamespace(State* state, int length) {
   static const char anon_prefix[] = "_GLOBAL__N_";
   return (length > (int) sizeof(anon_prefix) - 1 &&  // Should be longer.
-          StrPrefix(state->mangled_cur, anon_prefix));
+          StrPrefix(state->parse.mangled_cur, anon_prefix));
+}
+
+// Returns the start of the bracketed group ending at "end" (which is after
+// a "close" character), or "end" if there is none.
+static const char* SkipGroupBackward(const char* begin, const char* end,
+                                     char open, char close) {
+  if (begin < end && end[-1] == close) {
+    int level = 0;
+    const char* p = end;
+    while (begin < p) {
+      --p;
+      if (*p == close) {
+        ++level;
+      } else if (*p == open && --level == 0) {
+        return p;
+      }
+    }
+  }
+  return end;
+}
+
+// Remember the name a constructor or destructor that follows would have:
+// the last component of the output since "begin", without template args
+// or ABI tags.
+static void SetCtorDtorName(State* state, const char* begin) {
+  if (!state->parse.append || state->parse.overflowed) {
+    return;
+  }
+  const char* end = SkipGroupBackward(begin, state->parse.out_cur, '<', '>');
+  const char* tag;
+  while ((tag = SkipGroupBackward(begin, end, '[', ']')) != end) {
+    end = tag;
+  }
+  const char* name = end;
+  while (begin < name && name[-1] != ':') { --name; }
+  state->parse.prev_name = name;
+  state->parse.prev_name_length = end - name;
+}
+
+// Record a substitution candidate that started at "begin" and ends here.
+static void AddSubstitution(State* state, const char* begin,
+                            SubstitutionKind kind) {
+  if (state->parse.replaying) {
+    return;  // Already recorded the first time.
+  }
+  if (kind == SUBSTITUTION_TYPE && begin == state->hidden_candidate) {
+    return;
+  }
+  if (state->parse.num_substitutions == DEMANGLE_MAX_SUBSTITUTIONS) {
+    state->parse.overflowed = true;
+    return;
+  }
+  Substitution* sub =
+    &state->substitutions[state->parse.num_substitutions++];
+  sub->begin = begin - state->mangled_begin;
+  sub->end = state->parse.mangled_cur - state->mangled_begin;
+  sub->kind = kind;
+}
+
+// Parse a part of the mangled name that was already parsed, at "offset",
+// again in order to print it.  The result does not matter: the parse
+// succeeded before, and (as with ParseMemoized) it can only fail now if a
+// limit was exceeded, in which case demangling fails anyway.
+static void Replay(State* state, int offset, ParseFunc parse_func) {
+  if (!state->parse.append || state->parse.overflowed ||
+      state->too_complex) {
+    return;  // Nothing more would be printed.
+  }
+  if (--state->steps_left < 0 || state->depth >= DEMANGLE_MAX_DEPTH) {
+    state->too_complex = true;
+    return;
+  }
+  const char* mangled_cur = state->parse.mangled_cur;
+  bool replaying = state->parse.replaying;
+  state->parse.mangled_cur = state->mangled_begin + offset;
+  state->parse.replaying = true;
+  ++state->depth;
+  parse_func(state);
+  --state->depth;
+  state->parse.mangled_cur = mangled_cur;
+  state->parse.replaying = replaying;
+}
+
+// Add a declarator that applies to the type parsed next.
+static void PushDeclarator(State* state, DeclaratorKind kind,
+                           const char* class_type) {
+  // A reference to a reference (through a template param) collapses to
+  // one, which is an rvalue reference only if both are.
+  if ((kind == DECLARATOR_REFERENCE || kind == DECLARATOR_RVALUE_REFERENCE) &&
+      state->parse.num_declarators > state->parse.first_declarator) {
+    Declarator* outer = &state->declarators[state->parse.num_declarators - 1];
+    if (outer->kind == DECLARATOR_RVALUE_REFERENCE) {
+      outer->kind = kind;
+      return;
+    }
+    if (outer->kind == DECLARATOR_REFERENCE) {
+      return;
+    }
+  }
+  // Likewise, a qualifier that is already applied is not repeated.
+  if (kind == DECLARATOR_CONST || kind == DECLARATOR_VOLATILE ||
+      kind == DECLARATOR_RESTRICT) {
+    for (int i = state->parse.num_declarators - 1;
+         i >= state->parse.first_declarator; --i) {
+      DeclaratorKind outer = state->declarators[i].kind;
+      if (outer == kind) {
+        return;
+      }
+      if (outer != DECLARATOR_CONST && outer != DECLARATOR_VOLATILE &&
+          outer != DECLARATOR_RESTRICT) {
+        break;
+      }
+    }
+  }
+  if (state->parse.num_declarators == DEMANGLE_MAX_DECLARATORS) {
+    state->parse.overflowed = true;
+    return;
+  }
+  Declarator* declarator = &state->declarators[state->parse.num_declarators++];
+  declarator->kind = kind;
+  declarator->class_type =
+    class_type != NULL ? class_type - state->mangled_begin : -1;
 }
 
 // Forward declarations of our parsing functions.
@@ -333,15 +654,15 @@ static bool ParseMangledName(State* state);
 static bool ParseEncoding(State* state);
 static bool ParseName(State* state);
 static bool ParseUnscopedName(State* state);
-static bool ParseUnscopedTemplateName(State* state);
 static bool ParseNestedName(State* state);
 static bool ParsePrefix(State* state);
 static bool ParseUnqualifiedName(State* state);
 static bool ParseSourceName(State* state);
 static bool ParseLocalSourceName(State* state);
+static bool ParseUnnamedTypeName(State* state);
 static bool ParseNumber(State* state, int* number_out);
 static bool ParseFloatNumber(State* state);
-static bool ParseSeqId(State* state);
+static bool ParseSeqId(State* state, int* seq_id_out);
 static bool ParseIdentifier(State* state, int length);
 static bool ParseAbiTags(State* state);
 static bool ParseAbiTag(State* state);
@@ -352,18 +673,31 @@ static bool ParseNVOffset(State* state);
 static bool ParseVOffset(State* state);
 static bool ParseCtorDtorName(State* state);
 static bool ParseType(State* state);
-static bool ParseCVQualifiers(State* state);
+static bool ParseCVQualifiers(State* state, unsigned char* qualifiers_out);
+static bool ParseRefQualifier(State* state, unsigned char* qualifiers_out);
+static bool ParseQualifiedType(State* state);
+static bool ParseVendorQualifiedType(State* state);
 static bool ParseBuiltinType(State* state);
 static bool ParseFunctionType(State* state);
 static bool ParseBareFunctionType(State* state);
+static int ParseList(State* state, ParseFunc parse_func);
+static bool ParseParameterTypes(State* state);
 static bool ParseClassEnumType(State* state);
 static bool ParseArrayType(State* state);
 static bool ParsePointerToMemberType(State* state);
+static bool ParseVectorType(State* state);
+static bool ParsePackExpansion(State* state);
+static bool ParseDecltype(State* state);
 static bool ParseTemplateParam(State* state);
-static bool ParseTemplateTemplateParam(State* state);
 static bool ParseTemplateArgs(State* state);
+static bool ParseTemplateArgList(State* state, int* num_args_out);
 static bool ParseTemplateArg(State* state);
 static bool ParseExpression(State* state);
+static bool ParseOperand(State* state);
+static bool ParseExpressionList(State* state);
+static bool ParseFunctionParam(State* state);
+static bool ParseUnresolvedName(State* state);
+static bool ParseScopedName(State* state);
 static bool ParseExprPrimary(State* state);
 static bool ParseLocalName(State* state);
 static bool ParseDiscriminator(State* state);
@@ -384,9 +718,24 @@ static bool ParseSubstitution(State* state);
 // ensure that the state isn't changed in the latter case, we save the
 // original state before we call more than one parsing functions
 // consecutively with &&, and restore the state if unsuccessful.  See
-// ParseEncoding() as an example of this convention.  We follow the
+// ParseSourceName() as an example of this convention.  We follow the
 // convention throughout the code.
 //
+// Alternatives that share a prefix are factored so that the prefix is
+// parsed only once; retrying it for each alternative takes time
+// exponential in the nesting depth of the symbol.  See ParseEncoding() as
+// an example.  Where alternatives still overlap, ParseMemoized() avoids
+// repeating parses that are known to fail.
+//
+// Output is printed as it is parsed, in the format c++filt uses.  Parts
+// of the name that are referred to later (substitutions and template
+// arguments) are recorded as offsets into the mangled name, and parsed
+// again by Replay() to print them where they are referred to.  Parts
+// that are printed in a different order than they are mangled (such as
+// the return types of function templates) are moved with RotateOutput(),
+// and type modifiers that may need to be printed inside a function or
+// array type (such as the * in int (*)()) are deferred as declarators.
+//
 // Originally we tried to do demangling without following the full ABI
 // syntax but it turned out we needed to follow the full syntax to
 // parse complicated cases like nested template arguments.  Note that
@@ -407,41 +756,104 @@ static bool ParseMangledName(State* state) {
 // <encoding> ::= <(function) name> <bare-function-type>
 //            ::= <(data) name>
 //            ::= <special-name>
-static bool ParseEncoding(State* state) {
-  State copy = *state;
-  if (ParseName(state) && ParseBareFunctionType(state)) {
-    return true;
+//
+// The <bare-function-type> of a function template starts with its return
+// type, except for constructors, destructors and conversion operators.
+static bool DoParseEncoding(State* state) {
+  bool hide_return_type = state->parse.hide_return_type;
+  bool hide_type = state->parse.hide_type;
+  bool bind_template_args = state->parse.bind_template_args;
+  int template_args = state->parse.template_args;
+  bool append = state->parse.append;
+  state->parse.hide_return_type = false;
+  state->parse.hide_type = false;
+  state->parse.bind_template_args = true;
+  char* name = state->parse.out_cur;
+  if (!ParseName(state)) {
+    state->parse.bind_template_args = bind_template_args;
+    state->parse.hide_return_type = hide_return_type;
+    state->parse.hide_type = hide_type;
+    return ParseSpecialName(state);
+  }
+  state->parse.bind_template_args = false;
+  state->parse.append = append && !hide_type;
+  bool has_return_type =
+    state->parse.name_is_template && !state->parse.name_is_ctor_dtor_conv;
+  unsigned char qualifiers = state->parse.name_qualifiers;
+
+  ParseState copy = state->parse;
+  char* return_type = state->parse.out_cur;
+  if (has_return_type) {
+    bool append_type = state->parse.append;
+    state->parse.append = append_type && !hide_return_type;
+    bool result = ParseType(state);
+    state->parse.append = append_type;
+    if (result && !hide_return_type) {
+      MaybeAppend(state, " ");
+      RotateOutput(state, name, return_type);
+    }
+    if (!result || !ParseBareFunctionType(state)) {
+      state->parse = copy;
+      TruncateOutput(state, return_type);
+    }
+  } else {
+    Optional(ParseBareFunctionType(state));
   }
-  *state = copy;
-
-  if (ParseName(state) || ParseSpecialName(state)) {
-    return true;
+  if (state->parse.mangled_cur != copy.mangled_cur) {
+    MaybeAppendQualifiers(state, qualifiers);
   }
-  return false;
+  state->parse.append = append;
+  state->parse.bind_template_args = bind_template_args;
+  state->parse.template_args = template_args;
+  return true;
+}
+
+static bool ParseEncoding(State* state) {
+  return ParseMemoized(state, RULE_ENCODING, DoParseEncoding);
 }
 
 // <name> ::= <nested-name>
 //        ::= <unscoped-template-name> <template-args>
 //        ::= <unscoped-name>
 //        ::= <local-name>
-static bool ParseName(State* state) {
+// <unscoped-template-name> ::= <unscoped-name>
+//                          ::= <substitution>
+static bool DoParseName(State* state) {
   if (ParseNestedName(state) || ParseLocalName(state)) {
     return true;
   }
 
-  State copy = *state;
-  if (ParseUnscopedTemplateName(state) && ParseTemplateArgs(state)) {
+  // Take template args if there are any, to be greedier than a plain
+  // <unscoped-name>.
+  const char* begin = state->parse.mangled_cur;
+  if (ParseUnscopedName(state)) {
+    ParseState copy = state->parse;
+    AddSubstitution(state, begin, SUBSTITUTION_UNSCOPED_NAME);
+    bool is_template = ParseTemplateArgs(state);
+    if (!is_template) {
+      state->parse = copy;
+    }
+    state->parse.name_is_template = is_template;
+    state->parse.name_is_ctor_dtor_conv = false;
+    state->parse.name_qualifiers = 0;
     return true;
   }
-  *state = copy;
 
-  // Less greedy than <unscoped-template-name> <template-args>.
-  if (ParseUnscopedName(state)) {
+  ParseState copy = state->parse;
+  if (ParseSubstitution(state) && ParseTemplateArgs(state)) {
+    state->parse.name_is_template = true;
+    state->parse.name_is_ctor_dtor_conv = false;
+    state->parse.name_qualifiers = 0;
     return true;
   }
+  state->parse = copy;
   return false;
 }
 
+static bool ParseName(State* state) {
+  return ParseMemoized(state, RULE_NAME, DoParseName);
+}
+
 // <unscoped-name> ::= <unqualified-name>
 //                 ::= St <unqualified-name>
 static bool ParseUnscopedName(State* state) {
@@ -449,35 +861,41 @@ static bool ParseUnscopedName(State* state) {
     return true;
   }
 
-  State copy = *state;
+  ParseState copy = state->parse;
   if (ParseTwoCharToken(state, "St") && MaybeAppend(state, "std::") &&
       ParseUnqualifiedName(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
-// <unscoped-template-name> ::= <unscoped-name>
-//                          ::= <substitution>
-static bool ParseUnscopedTemplateName(State* state) {
-  return ParseUnscopedName(state) || ParseSubstitution(state);
-}
-
-// <nested-name> ::= N [<CV-qualifiers>] <prefix> <unqualified-name> E
-//               ::= N [<CV-qualifiers>] <template-prefix> <template-args> E
+// <nested-name> ::= N [<CV-qualifiers>] [<ref-qualifier>] <prefix>
+//                   <unqualified-name> E
+//               ::= N [<CV-qualifiers>] [<ref-qualifier>]
+//                   <template-prefix> <template-args> E
 static bool ParseNestedName(State* state) {
-  State copy = *state;
-  if (ParseOneCharToken(state, 'N') && EnterNestedName(state) &&
-      Optional(ParseCVQualifiers(state)) && ParsePrefix(state) &&
-      LeaveNestedName(state, copy.nest_level) &&
+  ParseState copy = state->parse;
+  unsigned char qualifiers = 0;
+  if (ParseOneCharToken(state, 'N') &&
+      Optional(ParseCVQualifiers(state, &qualifiers)) &&
+      Optional(ParseRefQualifier(state, &qualifiers)) && ParsePrefix(state) &&
       ParseOneCharToken(state, 'E')) {
+    state->parse.name_qualifiers = qualifiers;
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
+// Returns true if an <unqualified-name> starting at "str" is a
+// constructor, destructor or conversion operator.
+static bool IsCtorDtorConv(const char* str) {
+  return (str[0] == 'C' && (IsDigit(str[1]) || str[1] == 'I')) ||
+         (str[0] == 'D' && IsDigit(str[1])) ||
+         (str[0] == 'c' && str[1] == 'v');
+}
+
 // This part is tricky.  If we literally translate them to code, we'll
 // end up infinite loop.  Hence we merge them to avoid the case.
 //
@@ -485,27 +903,75 @@ static bool ParseNestedName(State* state) {
 //          ::= <template-prefix> <template-args>
 //          ::= <template-param>
 //          ::= <substitution>
+//          ::= <data-member-prefix>
 //          ::= # empty
 // <template-prefix> ::= <prefix> <(template) unqualified-name>
 //                   ::= <template-param>
 //                   ::= <substitution>
+// <data-member-prefix> ::= <(member) source-name> M
+//
+// Every prefix except the whole <nested-name> is a substitution candidate.
+// When a candidate is printed again, this stops at the end of it.
 static bool ParsePrefix(State* state) {
+  const char* begin = state->parse.mangled_cur;
+  const char* end = state->prefix_end;
+  state->prefix_end = NULL;
   bool has_something = false;
-  while (true) {
-    MaybeAppendSeparator(state);
-    if (ParseTemplateParam(state) || ParseSubstitution(state) ||
-        ParseUnscopedName(state)) {
-      has_something = true;
-      MaybeIncreaseNestLevel(state);
+  bool is_template = false;
+  bool is_ctor_dtor_conv = false;
+  // The name of constructors and destructors in this prefix.  Names in
+  // template args must not change it.
+  const char* ctor_name = state->parse.prev_name;
+  int ctor_name_length = state->parse.prev_name_length;
+  while (end == NULL || state->parse.mangled_cur < end) {
+    const char* component = state->parse.mangled_cur;
+    if (has_something && component[0] == 'I') {
+      if (!ParseTemplateArgs(state)) {
+        break;
+      }
+      is_template = true;
+    } else if (has_something && component[0] == 'M') {
+      ++state->parse.mangled_cur;  // Not printed.
       continue;
-    }
-    MaybeCancelLastSeparator(state);
-    if (has_something && ParseTemplateArgs(state)) {
-      return ParsePrefix(state);
     } else {
-      break;
+      char* separator = state->parse.out_cur;
+      bool overflowed = state->parse.overflowed;
+      if (has_something) {
+        MaybeAppend(state, "::");
+      }
+      char* name = state->parse.out_cur;
+      state->parse.prev_name = ctor_name;
+      state->parse.prev_name_length = ctor_name_length;
+      bool is_substitution = false;
+      if (!ParseTemplateParam(state)) {
+        is_substitution = ParseSubstitution(state);
+        if (!is_substitution && !ParseUnqualifiedName(state)) {
+          TruncateOutput(state, separator);
+          state->parse.overflowed = overflowed;
+          break;
+        }
+      }
+      has_something = true;
+      is_template = false;
+      is_ctor_dtor_conv = IsCtorDtorConv(component);
+      // Unnamed types are named after the enclosing class.
+      if (component[0] != 'U') {
+        SetCtorDtorName(state, name);
+        ctor_name = state->parse.prev_name;
+        ctor_name_length = state->parse.prev_name_length;
+      }
+      if (is_substitution) {
+        continue;  // Already a substitution.
+      }
+    }
+    if (state->parse.mangled_cur[0] != 'E') {
+      AddSubstitution(state, begin, SUBSTITUTION_PREFIX);
     }
   }
+  state->parse.prev_name = ctor_name;
+  state->parse.prev_name_length = ctor_name_length;
+  state->parse.name_is_template = is_template;
+  state->parse.name_is_ctor_dtor_conv = is_ctor_dtor_conv;
   return true;
 }
 
@@ -513,20 +979,26 @@ static bool ParsePrefix(State* state) {
 //                    ::= <ctor-dtor-name>
 //                    ::= <source-name> [<abi-tags>]
 //                    ::= <local-source-name> [<abi-tags>]
-static bool ParseUnqualifiedName(State* state) {
+//                    ::= <unnamed-type-name>
+static bool DoParseUnqualifiedName(State* state) {
   return (ParseOperatorName(state) || ParseCtorDtorName(state) ||
           (ParseSourceName(state) && Optional(ParseAbiTags(state))) ||
-          (ParseLocalSourceName(state) && Optional(ParseAbiTags(state))));
+          (ParseLocalSourceName(state) && Optional(ParseAbiTags(state))) ||
+          ParseUnnamedTypeName(state));
+}
+
+static bool ParseUnqualifiedName(State* state) {
+  return ParseMemoized(state, RULE_UNQUALIFIED_NAME, DoParseUnqualifiedName);
 }
 
 // <source-name> ::= <positive length number> <identifier>
 static bool ParseSourceName(State* state) {
-  State copy = *state;
+  ParseState copy = state->parse;
   int length = -1;
   if (ParseNumber(state, &length) && ParseIdentifier(state, length)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
@@ -536,12 +1008,41 @@ static bool ParseSourceName(State* state) {
 //   http://gcc.gnu.org/bugzilla/show_bug.cgi?id=31775
 //   http://gcc.gnu.org/viewcvs?view=rev&revision=124467
 static bool ParseLocalSourceName(State* state) {
-  State copy = *state;
+  ParseState copy = state->parse;
   if (ParseOneCharToken(state, 'L') && ParseSourceName(state) &&
       Optional(ParseDiscriminator(state))) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
+  return false;
+}
+
+// <unnamed-type-name> ::= Ut [<(nonnegative) number>] _
+//                     ::= Ul <lambda-sig> E [<(nonnegative) number>] _
+// <lambda-sig> ::= <(parameter) type>+
+static bool ParseUnnamedTypeName(State* state) {
+  ParseState copy = state->parse;
+  int number = -1;
+  if (ParseTwoCharToken(state, "Ut") && MaybeAppend(state, "{unnamed type#") &&
+      Optional(ParseNumber(state, &number)) && ParseOneCharToken(state, '_')) {
+    MaybeAppendNumber(state, number + 2);
+    MaybeAppend(state, "}");
+    return true;
+  }
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "Ul") && MaybeAppend(state, "{lambda(")) {
+    state->parse.in_lambda_signature = true;
+    if (ParseParameterTypes(state) && ParseOneCharToken(state, 'E') &&
+        MaybeAppend(state, ")#") && Optional(ParseNumber(state, &number)) &&
+        ParseOneCharToken(state, '_')) {
+      state->parse.in_lambda_signature = copy.in_lambda_signature;
+      MaybeAppendNumber(state, number + 2);
+      MaybeAppend(state, "}");
+      return true;
+    }
+  }
+  state->parse = copy;
   return false;
 }
 
@@ -553,17 +1054,18 @@ static bool ParseNumber(State* state, int* number_out) {
   if (ParseOneCharToken(state, 'n')) {
     sign = -1;
   }
-  const char* p = state->mangled_cur;
+  const char* p = state->parse.mangled_cur;
   int number = 0;
   for (; *p != '\0'; ++p) {
     if (IsDigit(*p)) {
-      number = number * 10 + (*p - '0');
+      // Saturate rather than overflow; no valid length is this large.
+      number = number < 100000000 ? number * 10 + (*p - '0') : 1000000000;
     } else {
       break;
     }
   }
-  if (p != state->mangled_cur) {  // Conversion succeeded.
-    state->mangled_cur = p;
+  if (p != state->parse.mangled_cur) {  // Conversion succeeded.
+    state->parse.mangled_cur = p;
     if (number_out != NULL) {
       *number_out = number * sign;
     }
@@ -575,14 +1077,14 @@ static bool ParseNumber(State* state, int* number_out) {
 // Floating-point literals are encoded using a fixed-length lowercase
 // hexadecimal string.
 static bool ParseFloatNumber(State* state) {
-  const char* p = state->mangled_cur;
+  const char* p = state->parse.mangled_cur;
   for (; *p != '\0'; ++p) {
     if (!IsDigit(*p) && !(*p >= 'a' && *p <= 'f')) {
       break;
     }
   }
-  if (p != state->mangled_cur) {  // Conversion succeeded.
-    state->mangled_cur = p;
+  if (p != state->parse.mangled_cur) {  // Conversion succeeded.
+    state->parse.mangled_cur = p;
     return true;
   }
   return false;
@@ -590,15 +1092,24 @@ static bool ParseFloatNumber(State* state) {
 
 // The <seq-id> is a sequence number in base 36,
 // using digits and upper case letters
-static bool ParseSeqId(State* state) {
-  const char* p = state->mangled_cur;
+static bool ParseSeqId(State* state, int* seq_id_out) {
+  const char* p = state->parse.mangled_cur;
+  int seq_id = 0;
   for (; *p != '\0'; ++p) {
-    if (!IsDigit(*p) && !(*p >= 'A' && *p <= 'Z')) {
+    if (IsDigit(*p)) {
+      seq_id = seq_id * 36 + (*p - '0');
+    } else if (*p >= 'A' && *p <= 'Z') {
+      seq_id = seq_id * 36 + (*p - 'A' + 10);
+    } else {
       break;
     }
+    if (seq_id > DEMANGLE_MAX_SUBSTITUTIONS) {
+      seq_id = DEMANGLE_MAX_SUBSTITUTIONS;  // Cannot be valid anyway.
+    }
   }
-  if (p != state->mangled_cur) {  // Conversion succeeded.
-    state->mangled_cur = p;
+  if (p != state->parse.mangled_cur) {  // Conversion succeeded.
+    state->parse.mangled_cur = p;
+    *seq_id_out = seq_id;
     return true;
   }
   return false;
@@ -606,78 +1117,99 @@ static bool ParseSeqId(State* state) {
 
 // <identifier> ::= <unqualified source code identifier> (of given length)
 static bool ParseIdentifier(State* state, int length) {
-  if (length == -1 || !AtLeastNumCharsRemaining(state->mangled_cur, length)) {
+  if (length == -1 || !AtLeastNumCharsRemaining(state, length)) {
     return false;
   }
   if (IdentifierIsAnonymousNamespace(state, length)) {
     MaybeAppend(state, "(anonymous namespace)");
   } else {
-    MaybeAppendWithLength(state, state->mangled_cur, length);
+    MaybeAppendWithLength(state, state->parse.mangled_cur, length);
   }
-  state->mangled_cur += length;
+  state->parse.mangled_cur += length;
   return true;
 }
 
 // <abi-tags> ::= <abi-tag> [<abi-tags>]
 static bool ParseAbiTags(State* state) {
-  State copy = *state;
-  DisableAppend(state);
-  if (OneOrMore(ParseAbiTag, state)) {
-    RestoreAppend(state, copy.append);
+  if (ParseAbiTag(state)) {
+    while (ParseAbiTag(state)) {}
     return true;
   }
-  *state = copy;
   return false;
 }
 
 // <abi-tag> ::= B <source-name>
 static bool ParseAbiTag(State* state) {
-  return ParseOneCharToken(state, 'B') && ParseSourceName(state);
+  ParseState copy = state->parse;
+  if (ParseOneCharToken(state, 'B') && MaybeAppend(state, "[abi:") &&
+      ParseSourceName(state)) {
+    MaybeAppend(state, "]");
+    return true;
+  }
+  state->parse = copy;
+  return false;
+}
+
+// Returns the operator_list entry for the operator at "mangled_cur", or
+// NULL if there is none.
+static const AbbrevPair* FindOperator(State* state) {
+  // Operator names should start with a lower alphabet followed by a
+  // lower/upper alphabet.
+  if (!(IsLower(state->parse.mangled_cur[0]) &&
+        IsAlpha(state->parse.mangled_cur[1]))) {
+    return NULL;
+  }
+  // We may want to perform a binary search if we really need speed.
+  const AbbrevPair* p;
+  for (p = operator_list; p->abbrev != NULL; ++p) {
+    if (state->parse.mangled_cur[0] == p->abbrev[0] &&
+        state->parse.mangled_cur[1] == p->abbrev[1]) {
+      return p;
+    }
+  }
+  return NULL;
 }
 
 // <operator-name> ::= nw, and other two letters cases
 //                 ::= cv <type>  # (cast)
+//                 ::= li <source-name>  # operator ""
 //                 ::= v  <digit> <source-name> # vendor extended operator
 static bool ParseOperatorName(State* state) {
-  if (!AtLeastNumCharsRemaining(state->mangled_cur, 2)) {
+  if (!AtLeastNumCharsRemaining(state, 2)) {
     return false;
   }
   // First check with "cv" (cast) case.
-  State copy = *state;
+  ParseState copy = state->parse;
   if (ParseTwoCharToken(state, "cv") && MaybeAppend(state, "operator ") &&
-      EnterNestedName(state) && ParseType(state) &&
-      LeaveNestedName(state, copy.nest_level)) {
+      ParseType(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "li") && MaybeAppend(state, "operator\"\" ") &&
+      ParseSourceName(state)) {
+    return true;
+  }
+  state->parse = copy;
 
   // Then vendor extended operators.
   if (ParseOneCharToken(state, 'v') && ParseCharClass(state, "0123456789") &&
-      ParseSourceName(state)) {
+      MaybeAppend(state, "operator ") && ParseSourceName(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
-  // Other operator names should start with a lower alphabet followed
-  // by a lower/upper alphabet.
-  if (!(IsLower(state->mangled_cur[0]) && IsAlpha(state->mangled_cur[1]))) {
+  const AbbrevPair* p = FindOperator(state);
+  if (p == NULL) {
     return false;
   }
-  // We may want to perform a binary search if we really need speed.
-  const AbbrevPair* p;
-  for (p = operator_list; p->abbrev != NULL; ++p) {
-    if (state->mangled_cur[0] == p->abbrev[0] &&
-        state->mangled_cur[1] == p->abbrev[1]) {
-      MaybeAppend(state, "operator");
-      if (IsLower(*p->real_name)) {  // new, delete, etc.
-        MaybeAppend(state, " ");
-      }
-      MaybeAppend(state, p->real_name);
-      state->mangled_cur += 2;
-      return true;
-    }
+  MaybeAppend(state, "operator");
+  if (IsLower(*p->real_name)) {  // new, delete, etc.
+    MaybeAppend(state, " ");
   }
-  return false;
+  MaybeAppend(state, p->real_name);
+  state->parse.mangled_cur += 2;
+  return true;
 }
 
 // <special-name> ::= TV <type>
@@ -691,86 +1223,147 @@ static bool ParseOperatorName(State* state) {
 //                ::= TC <type> <(offset) number> _ <(base) type>
 //                ::= TF <type>
 //                ::= TJ <type>
+//                ::= TH <(object) name>
+//                ::= TW <(object) name>
 //                ::= GR <name>
 //                ::= GA <encoding>
+//                ::= GTt <encoding>
 //                ::= Th <call-offset> <(base) encoding>
 //                ::= Tv <call-offset> <(base) encoding>
 //
-// Note: we don't care much about them since they don't appear in
-// stack traces.  The are special data.
+// Most of these are data rather than code, so they rarely appear in
+// stack traces, but thunks do.
 static bool ParseSpecialName(State* state) {
-  State copy = *state;
-  if (ParseOneCharToken(state, 'T') && ParseCharClass(state, "VTIS") &&
+  ParseState copy = state->parse;
+  if (ParseTwoCharToken(state, "TV") && MaybeAppend(state, "vtable for ") &&
       ParseType(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
-  if (ParseTwoCharToken(state, "Tc") && ParseCallOffset(state) &&
-      ParseCallOffset(state) && ParseEncoding(state)) {
+  if (ParseTwoCharToken(state, "TT") && MaybeAppend(state, "VTT for ") &&
+      ParseType(state)) {
+    return true;
+  }
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "TI") && MaybeAppend(state, "typeinfo for ") &&
+      ParseType(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
-  if (ParseTwoCharToken(state, "GV") && ParseName(state)) {
+  if (ParseTwoCharToken(state, "TS") &&
+      MaybeAppend(state, "typeinfo name for ") && ParseType(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
-  if (ParseOneCharToken(state, 'T') && ParseCallOffset(state) &&
+  if (ParseTwoCharToken(state, "Tc") &&
+      MaybeAppend(state, "covariant return thunk to ") &&
+      ParseCallOffset(state) && ParseCallOffset(state) &&
       ParseEncoding(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "GV") &&
+      MaybeAppend(state, "guard variable for ") && ParseName(state)) {
+    return true;
+  }
+  state->parse = copy;
+
+  if (ParseOneCharToken(state, 'T') &&
+      MaybeAppend(state, state->parse.mangled_cur[0] == 'h'
+                           ? "non-virtual thunk to "
+                           : "virtual thunk to ") &&
+      ParseCallOffset(state) && ParseEncoding(state)) {
+    return true;
+  }
+  state->parse = copy;
 
   // G++ extensions
-  if (ParseTwoCharToken(state, "TC") && ParseType(state) &&
-      ParseNumber(state, NULL) && ParseOneCharToken(state, '_') &&
-      DisableAppend(state) && ParseType(state)) {
-    RestoreAppend(state, copy.append);
+  if (ParseTwoCharToken(state, "TC") &&
+      MaybeAppend(state, "construction vtable for ")) {
+    // Printed as <(base) type>-in-<type>.
+    char* type = state->parse.out_cur;
+    if (ParseType(state) && ParseNumber(state, NULL) &&
+        ParseOneCharToken(state, '_')) {
+      char* base_type = state->parse.out_cur;
+      if (ParseType(state)) {
+        MaybeAppend(state, "-in-");
+        RotateOutput(state, type, base_type);
+        return true;
+      }
+    }
+  }
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "TF") &&
+      MaybeAppend(state, "typeinfo fn for ") && ParseType(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
-  if (ParseOneCharToken(state, 'T') && ParseCharClass(state, "FJ") &&
-      ParseType(state)) {
+  if (ParseTwoCharToken(state, "TJ") &&
+      MaybeAppend(state, "java Class for ") && ParseType(state)) {
+    return true;
+  }
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "TH") &&
+      MaybeAppend(state, "TLS init function for ") && ParseName(state)) {
+    return true;
+  }
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "TW") &&
+      MaybeAppend(state, "TLS wrapper function for ") && ParseName(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
-  if (ParseTwoCharToken(state, "GR") && ParseName(state)) {
+  if (ParseTwoCharToken(state, "GR") &&
+      MaybeAppend(state, "reference temporary for ") && ParseName(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
-  if (ParseTwoCharToken(state, "GA") && ParseEncoding(state)) {
+  if (ParseTwoCharToken(state, "GA") &&
+      MaybeAppend(state, "hidden alias for ") && ParseEncoding(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "GT") && ParseOneCharToken(state, 't') &&
+      MaybeAppend(state, "transaction clone for ") && ParseEncoding(state)) {
+    return true;
+  }
+  state->parse = copy;
 
   if (ParseOneCharToken(state, 'T') && ParseCharClass(state, "hv") &&
       ParseCallOffset(state) && ParseEncoding(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
 // <call-offset> ::= h <nv-offset> _
 //               ::= v <v-offset> _
 static bool ParseCallOffset(State* state) {
-  State copy = *state;
+  ParseState copy = state->parse;
   if (ParseOneCharToken(state, 'h') && ParseNVOffset(state) &&
       ParseOneCharToken(state, '_')) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
   if (ParseOneCharToken(state, 'v') && ParseVOffset(state) &&
       ParseOneCharToken(state, '_')) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
   return false;
 }
@@ -780,35 +1373,46 @@ static bool ParseNVOffset(State* state) { return ParseNumber(state, NULL); }
 
 // <v-offset>  ::= <(offset) number> _ <(virtual offset) number>
 static bool ParseVOffset(State* state) {
-  State copy = *state;
+  ParseState copy = state->parse;
   if (ParseNumber(state, NULL) && ParseOneCharToken(state, '_') &&
       ParseNumber(state, NULL)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
-// <ctor-dtor-name> ::= C1 | C2 | C3
-//                  ::= D0 | D1 | D2
+// <ctor-dtor-name> ::= C1 | C2 | C3 | C4 | C5
+//                  ::= CI1 <(base) type> | CI2 <(base) type>
+//                  ::= D0 | D1 | D2 | D4 | D5
 static bool ParseCtorDtorName(State* state) {
-  State copy = *state;
-  if (ParseOneCharToken(state, 'C') && ParseCharClass(state, "123")) {
-    const char* const prev_name = state->prev_name;
-    const int prev_name_length = state->prev_name_length;
-    MaybeAppendWithLength(state, prev_name, prev_name_length);
+  ParseState copy = state->parse;
+  if (ParseOneCharToken(state, 'C') && ParseCharClass(state, "12345")) {
+    MaybeAppendWithLength(state, state->parse.prev_name,
+                          state->parse.prev_name_length);
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
-  if (ParseOneCharToken(state, 'D') && ParseCharClass(state, "012")) {
-    const char* const prev_name = state->prev_name;
-    const int prev_name_length = state->prev_name_length;
+  // Inheriting constructors are printed like the constructor they inherit.
+  if (ParseTwoCharToken(state, "CI") && ParseCharClass(state, "12")) {
+    MaybeAppendWithLength(state, state->parse.prev_name,
+                          state->parse.prev_name_length);
+    state->parse.append = false;
+    if (ParseType(state)) {
+      state->parse.append = copy.append;
+      return true;
+    }
+  }
+  state->parse = copy;
+
+  if (ParseOneCharToken(state, 'D') && ParseCharClass(state, "01245")) {
     MaybeAppend(state, "~");
-    MaybeAppendWithLength(state, prev_name, prev_name_length);
+    MaybeAppendWithLength(state, state->parse.prev_name,
+                          state->parse.prev_name_length);
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
@@ -831,371 +1435,1223 @@ static bool ParseCtorDtorName(State* state) {
 //        ::= Dt <expression> E  # decltype of an id-expression or class
 //                               # member access (C++0x)
 //        ::= DT <expression> E  # decltype of an expression (C++0x)
+//        ::= Dv <number> _ <type>  # vector type (GNU)
 //
-static bool ParseType(State* state) {
+// Types are substitution candidates, except for builtin types and
+// substitutions themselves.
+//
+// Modifiers that come before a function or array type are printed inside
+// it, so they are pushed as declarators and printed once the type they
+// modify is known: by that type, if it is a function or array type, or
+// otherwise after it.  Other types (e.g. in template args) start with no
+// declarators.
+static bool DoParseType(State* state) {
+  const char* begin = state->parse.mangled_cur;
+  ParseState copy = state->parse;
+  if (!state->parse.continue_declarators) {
+    state->parse.first_declarator = state->parse.num_declarators;
+  }
+  state->parse.continue_declarators = false;
+  state->parse.bind_template_args = false;
+
   // We should check CV-qualifers, and PRGC things first.
-  State copy = *state;
-  if (ParseCVQualifiers(state) && ParseType(state)) {
-    return true;
+  bool is_candidate = true;
+  if (ParseQualifiedType(state)) {
+    // Done.
+  } else if (ParsePackExpansion(state) || ParseDecltype(state)) {
+    // Done.
+  } else if (ParseVendorQualifiedType(state)) {
+    // Done.
+  } else if (ParseBuiltinType(state)) {
+    if (begin[0] != 'u') {
+      is_candidate = false;
+    }
+  } else if (ParseVectorType(state) || ParseFunctionType(state) ||
+             ParseClassEnumType(state) || ParseArrayType(state) ||
+             ParsePointerToMemberType(state)) {
+    // Done.
+  } else {
+    // These may be function types, which use the declarators.
+    state->parse.continue_declarators = true;
+    if (ParseSubstitution(state)) {
+      is_candidate = false;
+    } else if (ParseTemplateParam(state)) {
+      // A <template-template-param> that is a <substitution> was handled
+      // above, so this only has to check for a <template-param> with
+      // <template-args>.
+      if (state->parse.mangled_cur[0] == 'I') {
+        AddSubstitution(state, begin, SUBSTITUTION_TEMPLATE_PARAM);
+        state->parse.continue_declarators = false;
+        Optional(ParseTemplateArgs(state));
+      }
+    } else {
+      state->parse = copy;
+      return false;
+    }
+    state->parse.continue_declarators = false;
   }
-  *state = copy;
 
-  if (ParseCharClass(state, "OPRCG") && ParseType(state)) {
-    return true;
+  state->parse.first_declarator = copy.first_declarator;
+  state->parse.bind_template_args = copy.bind_template_args;
+  if (is_candidate) {
+    AddSubstitution(state, begin, SUBSTITUTION_TYPE);
   }
-  *state = copy;
+  return true;
+}
 
-  if (ParseTwoCharToken(state, "Dp") && ParseType(state)) {
-    return true;
+static bool ParseType(State* state) {
+  return ParseMemoized(state, RULE_TYPE, DoParseType);
+}
+
+// Print declarators from "first" up to "last", innermost first.
+static void PrintDeclarators(State* state, int first, int last,
+                             bool grouped) {
+  for (int i = last - 1; i >= first; --i) {
+    const Declarator* declarator = &state->declarators[i];
+    switch (declarator->kind) {
+      case DECLARATOR_POINTER:
+        MaybeAppend(state, "*");
+        break;
+      case DECLARATOR_REFERENCE:
+        MaybeAppend(state, "&");
+        break;
+      case DECLARATOR_RVALUE_REFERENCE:
+        MaybeAppend(state, "&&");
+        break;
+      case DECLARATOR_CONST:
+        MaybeAppend(state, " const");
+        break;
+      case DECLARATOR_VOLATILE:
+        MaybeAppend(state, " volatile");
+        break;
+      case DECLARATOR_RESTRICT:
+        MaybeAppend(state, " restrict");
+        break;
+      case DECLARATOR_COMPLEX:
+        MaybeAppend(state, " _Complex");
+        break;
+      case DECLARATOR_IMAGINARY:
+        MaybeAppend(state, " _Imaginary");
+        break;
+      case DECLARATOR_MEMBER_POINTER:
+        if (!grouped || i != last - 1) {
+          MaybeAppend(state, " ");
+        }
+        Replay(state, declarator->class_type, ParseType);
+        MaybeAppend(state, "::*");
+        break;
+    }
   }
-  *state = copy;
+}
 
-  if (ParseOneCharToken(state, 'D') && ParseCharClass(state, "tT") &&
-      ParseExpression(state) && ParseOneCharToken(state, 'E')) {
-    return true;
+// Print the declarators from "first" on that the type they modify did not
+// print itself.
+static void FinishDeclarators(State* state, int first) {
+  if (state->parse.num_declarators > first) {
+    PrintDeclarators(state, first, state->parse.num_declarators, false);
+    state->parse.num_declarators = first;
   }
-  *state = copy;
+}
 
-  if (ParseOneCharToken(state, 'U') && ParseSourceName(state) &&
-      ParseType(state)) {
-    return true;
+// Remove the innermost CV-qualifiers of the current type from the
+// declarators and return them.  These qualify a function type itself, or
+// the elements of an array type, so they are printed differently.
+static unsigned char PopQualifiers(State* state) {
+  unsigned char qualifiers = 0;
+  while (state->parse.num_declarators > state->parse.first_declarator) {
+    DeclaratorKind kind =
+      state->declarators[state->parse.num_declarators - 1].kind;
+    if (kind == DECLARATOR_CONST) {
+      qualifiers |= QUALIFIER_CONST;
+    } else if (kind == DECLARATOR_VOLATILE) {
+      qualifiers |= QUALIFIER_VOLATILE;
+    } else if (kind == DECLARATOR_RESTRICT) {
+      qualifiers |= QUALIFIER_RESTRICT;
+    } else {
+      break;
+    }
+    --state->parse.num_declarators;
   }
-  *state = copy;
+  return qualifiers;
+}
 
-  if (ParseBuiltinType(state) || ParseFunctionType(state) ||
-      ParseClassEnumType(state) || ParseArrayType(state) ||
-      ParsePointerToMemberType(state) || ParseSubstitution(state)) {
-    return true;
+// Print the declarators of the current type inside a function or array
+// type, e.g. the (*) in int (*)().
+static void PrintGroupedDeclarators(State* state) {
+  int first = state->parse.first_declarator;
+  if (state->parse.num_declarators > first) {
+    MaybeAppend(state, "(");
+    PrintDeclarators(state, first, state->parse.num_declarators, true);
+    MaybeAppend(state, ")");
+    state->parse.num_declarators = first;
   }
+}
 
-  if (ParseTemplateTemplateParam(state) && ParseTemplateArgs(state)) {
-    return true;
+// <CV-qualifiers> ::= [r] [V] [K]
+// We don't allow empty <CV-qualifiers> to avoid infinite loop in
+// ParseType().
+static bool ParseCVQualifiers(State* state, unsigned char* qualifiers_out) {
+  unsigned char qualifiers = 0;
+  if (ParseOneCharToken(state, 'r')) {
+    qualifiers |= QUALIFIER_RESTRICT;
+  }
+  if (ParseOneCharToken(state, 'V')) {
+    qualifiers |= QUALIFIER_VOLATILE;
+  }
+  if (ParseOneCharToken(state, 'K')) {
+    qualifiers |= QUALIFIER_CONST;
   }
-  *state = copy;
+  *qualifiers_out |= qualifiers;
+  return qualifiers != 0;
+}
 
-  // Less greedy than <template-template-param> <template-args>.
-  if (ParseTemplateParam(state)) {
+// <ref-qualifier> ::= R  # & ref-qualifier
+//                 ::= O  # && ref-qualifier
+static bool ParseRefQualifier(State* state, unsigned char* qualifiers_out) {
+  if (ParseOneCharToken(state, 'R')) {
+    *qualifiers_out |= QUALIFIER_REFERENCE;
+    return true;
+  }
+  if (ParseOneCharToken(state, 'O')) {
+    *qualifiers_out |= QUALIFIER_RVALUE_REFERENCE;
     return true;
   }
+  return false;
+}
+
+// Return the offset of the template param that the type at "offset"
+// consists of, either directly or as a substitution, or -1 if it is not one.
+static int FindTypeTemplateParam(State* state, int offset) {
+  const Substitution* sub = NULL;
+  const char* p = state->mangled_begin + offset;
+  if (p[0] == 'S') {
+    int index = 0;
+    if (p[1] != '_') {
+      ParseState copy = state->parse;
+      state->parse.mangled_cur = p + 1;
+      int seq_id = -1;
+      bool ok = ParseSeqId(state, &seq_id) &&
+                state->parse.mangled_cur[0] == '_';
+      state->parse = copy;
+      if (!ok) {
+        return -1;
+      }
+      index = seq_id + 1;
+    }
+    if (index >= state->parse.num_substitutions ||
+        state->substitutions[index].kind != SUBSTITUTION_TYPE) {
+      return -1;
+    }
+    sub = &state->substitutions[index];
+    offset = sub->begin;
+    p = state->mangled_begin + offset;
+  }
+  if (p[0] != 'T') {
+    return -1;
+  }
+  const char* end = p + 1;
+  while (IsDigit(*end)) {
+    ++end;
+  }
+  if (*end++ != '_') {
+    return -1;
+  }
+  // Not a template template param with template args.
+  bool is_param = sub != NULL ? state->mangled_begin + sub->end == end
+                              : *end != 'I';
+  return is_param ? offset : -1;
+}
+
+// c++filt prints a template param that a reference refers to with the
+// template args it was first printed with this way, even when it is printed
+// again as (part of) a substitution where other template args apply.  This
+// matters for substitutions recorded in the function of a <local-name>,
+// e.g. in a lambda's template args.  Make the template param of the
+// reference type that follows refer to the same template args.
+static void BindReferencedParam(State* state) {
+  int param = FindTypeTemplateParam(
+    state, state->parse.mangled_cur - state->mangled_begin);
+  if (param < 0) {
+    return;
+  }
+  for (int i = 0; i < state->parse.num_referenced_params; ++i) {
+    const ReferencedParam* referenced = &state->referenced_params[i];
+    if (referenced->param == param) {
+      state->parse.template_args = referenced->template_args;
+      return;
+    }
+  }
+  if (!state->parse.append) {
+    return;  // Not printed yet.
+  }
+  if (state->parse.num_referenced_params == DEMANGLE_MAX_REFERENCED_PARAMS) {
+    state->parse.overflowed = true;
+    return;
+  }
+  ReferencedParam* referenced =
+    &state->referenced_params[state->parse.num_referenced_params++];
+  referenced->param = param;
+  referenced->template_args = state->parse.template_args;
+}
 
+// <CV-qualifiers> <type>, or one of P, R, O, C or G followed by <type>.
+static bool ParseQualifiedType(State* state) {
+  ParseState copy = state->parse;
+  int first = state->parse.num_declarators;
+  unsigned char qualifiers = 0;
+  if (ParseCVQualifiers(state, &qualifiers)) {
+    // Pushed in reverse, since they are printed innermost first.
+    if (qualifiers & QUALIFIER_RESTRICT) {
+      PushDeclarator(state, DECLARATOR_RESTRICT, NULL);
+    }
+    if (qualifiers & QUALIFIER_VOLATILE) {
+      PushDeclarator(state, DECLARATOR_VOLATILE, NULL);
+    }
+    if (qualifiers & QUALIFIER_CONST) {
+      PushDeclarator(state, DECLARATOR_CONST, NULL);
+    }
+  } else if (ParseOneCharToken(state, 'P')) {
+    PushDeclarator(state, DECLARATOR_POINTER, NULL);
+  } else if (ParseOneCharToken(state, 'R')) {
+    PushDeclarator(state, DECLARATOR_REFERENCE, NULL);
+  } else if (ParseOneCharToken(state, 'O')) {
+    PushDeclarator(state, DECLARATOR_RVALUE_REFERENCE, NULL);
+  } else if (ParseOneCharToken(state, 'C')) {
+    PushDeclarator(state, DECLARATOR_COMPLEX, NULL);
+  } else if (ParseOneCharToken(state, 'G')) {
+    PushDeclarator(state, DECLARATOR_IMAGINARY, NULL);
+  } else {
+    return false;
+  }
+  state->parse.continue_declarators = true;
+  int template_args = state->parse.template_args;
+  if (copy.mangled_cur[0] == 'R' || copy.mangled_cur[0] == 'O') {
+    BindReferencedParam(state);
+  }
+  if (ParseType(state)) {
+    state->parse.template_args = template_args;
+    FinishDeclarators(state, first);
+    return true;
+  }
+  state->parse = copy;
   return false;
 }
 
-// <CV-qualifiers> ::= [r] [V] [K]
-// We don't allow empty <CV-qualifiers> to avoid infinite loop in
-// ParseType().
-static bool ParseCVQualifiers(State* state) {
-  int num_cv_qualifiers = 0;
-  num_cv_qualifiers += ParseOneCharToken(state, 'r');
-  num_cv_qualifiers += ParseOneCharToken(state, 'V');
-  num_cv_qualifiers += ParseOneCharToken(state, 'K');
-  return num_cv_qualifiers > 0;
+// U <source-name> <type>
+static bool ParseVendorQualifiedType(State* state) {
+  ParseState copy = state->parse;
+  if (ParseOneCharToken(state, 'U') && ParseSourceName(state) &&
+      MaybeAppend(state, " ") && ParseType(state)) {
+    return true;
+  }
+  state->parse = copy;
+  return false;
 }
 
 // <builtin-type> ::= v, etc.
+//                ::= Dn, etc.
 //                ::= u <source-name>
 static bool ParseBuiltinType(State* state) {
   const AbbrevPair* p;
   for (p = builtin_type_list; p->abbrev != NULL; ++p) {
-    if (state->mangled_cur[0] == p->abbrev[0]) {
+    if (state->parse.mangled_cur[0] == p->abbrev[0]) {
       MaybeAppend(state, p->real_name);
-      ++state->mangled_cur;
+      ++state->parse.mangled_cur;
+      return true;
+    }
+  }
+  for (p = builtin_d_type_list; p->abbrev != NULL; ++p) {
+    if (state->parse.mangled_cur[0] == p->abbrev[0] &&
+        state->parse.mangled_cur[1] == p->abbrev[1]) {
+      MaybeAppend(state, p->real_name);
+      state->parse.mangled_cur += 2;
       return true;
     }
   }
 
-  State copy = *state;
+  ParseState copy = state->parse;
   if (ParseOneCharToken(state, 'u') && ParseSourceName(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
-// <function-type> ::= F [Y] <bare-function-type> E
+// <function-type> ::= [Do] F [Y] <bare-function-type> [<ref-qualifier>] E
+//
+// The first type is the return type.  Qualifiers of the function type
+// itself are printed after the parameters.
 static bool ParseFunctionType(State* state) {
-  State copy = *state;
-  if (ParseOneCharToken(state, 'F') &&
-      Optional(ParseOneCharToken(state, 'Y')) && ParseBareFunctionType(state) &&
-      ParseOneCharToken(state, 'E')) {
-    return true;
+  ParseState copy = state->parse;
+  bool is_noexcept = ParseTwoCharToken(state, "Do");
+  if (!ParseOneCharToken(state, 'F')) {
+    state->parse = copy;
+    return false;
+  }
+  unsigned char qualifiers = PopQualifiers(state);
+  int first = state->parse.first_declarator;
+  if (Optional(ParseOneCharToken(state, 'Y')) && ParseType(state) &&
+      MaybeAppend(state, " ")) {
+    state->parse.first_declarator = first;
+    PrintGroupedDeclarators(state);
+    if (ParseBareFunctionType(state) &&
+        Optional(ParseRefQualifier(state, &qualifiers)) &&
+        ParseOneCharToken(state, 'E')) {
+      MaybeAppendQualifiers(state, qualifiers);
+      if (is_noexcept) {
+        MaybeAppend(state, " noexcept");
+      }
+      return true;
+    }
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
 // <bare-function-type> ::= <(signature) type>+
 static bool ParseBareFunctionType(State* state) {
-  State copy = *state;
-  DisableAppend(state);
-  if (OneOrMore(ParseType, state)) {
-    RestoreAppend(state, copy.append);
-    MaybeAppend(state, "()");
+  ParseState copy = state->parse;
+  if (MaybeAppend(state, "(") && ParseParameterTypes(state)) {
+    MaybeAppend(state, ")");
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
+// Parse any number of "parse_func" and print them separated by commas.
+// Items may print nothing (e.g. empty packs); like c++filt, the commas
+// around them are kept unless no item after them prints anything.
+static int ParseList(State* state, ParseFunc parse_func) {
+  int num_items = 0;
+  char* empty_tail = NULL;  // Commas followed only by empty items.
+  bool empty_tail_overflowed = false;
+  for (;;) {
+    char* separator = state->parse.out_cur;
+    bool overflowed = state->parse.overflowed;
+    if (num_items > 0) {
+      MaybeAppend(state, ", ");
+    }
+    char* item = state->parse.out_cur;
+    if (!parse_func(state)) {
+      // The separator may not have fit, but it is not output after all.
+      TruncateOutput(state, separator);
+      state->parse.overflowed = overflowed;
+      break;
+    }
+    ++num_items;
+    if (state->parse.out_cur != item) {
+      empty_tail = NULL;
+    } else if (empty_tail == NULL && num_items > 1) {
+      empty_tail = separator;
+      empty_tail_overflowed = overflowed;
+    }
+  }
+  if (empty_tail != NULL) {
+    TruncateOutput(state, empty_tail);
+    state->parse.overflowed = empty_tail_overflowed;
+  }
+  return num_items;
+}
+
+// Parse <type>+ and print them separated by commas.  A lone v (no
+// parameters) is not printed.
+static bool ParseParameterTypes(State* state) {
+  const char* begin = state->parse.mangled_cur;
+  char* out = state->parse.out_cur;
+  bool overflowed = state->parse.overflowed;
+  int num_types = ParseList(state, ParseType);
+  if (num_types == 1 && begin[0] == 'v' &&
+      state->parse.mangled_cur == begin + 1) {
+    TruncateOutput(state, out);
+    state->parse.overflowed = overflowed;
+  }
+  return num_types > 0;
+}
+
 // <class-enum-type> ::= <name>
 static bool ParseClassEnumType(State* state) { return ParseName(state); }
 
 // <array-type> ::= A <(positive dimension) number> _ <(element) type>
 //              ::= A [<(dimension) expression>] _ <(element) type>
+//
+// The dimension is printed after the element type.
 static bool ParseArrayType(State* state) {
-  State copy = *state;
-  if (ParseOneCharToken(state, 'A') && ParseNumber(state, NULL) &&
-      ParseOneCharToken(state, '_') && ParseType(state)) {
-    return true;
+  ParseState copy = state->parse;
+  if (!ParseOneCharToken(state, 'A')) {
+    return false;
   }
-  *state = copy;
-
-  if (ParseOneCharToken(state, 'A') && Optional(ParseExpression(state)) &&
-      ParseOneCharToken(state, '_') && ParseType(state)) {
-    return true;
+  const char* dimension = state->parse.mangled_cur;
+  bool is_number = ParseNumber(state, NULL);
+  state->parse.append = false;
+  if (!is_number) {
+    Optional(ParseExpression(state));
   }
-  *state = copy;
-  return false;
+  state->parse.append = copy.append;
+  const char* dimension_end = state->parse.mangled_cur;
+  if (!ParseOneCharToken(state, '_')) {
+    state->parse = copy;
+    return false;
+  }
+  // The dimensions of arrays of arrays are printed together, outermost
+  // first, so the element prints the declarators.
+  bool is_nested = state->parse.mangled_cur[0] == 'A';
+  state->parse.continue_declarators = is_nested;
+  if (!ParseType(state)) {
+    state->parse = copy;
+    return false;
+  }
+  char* dimensions = state->parse.out_cur;
+  if (is_nested) {
+    dimensions = state->array_dimensions;
+  } else {
+    MaybeAppendQualifiers(state, PopQualifiers(state));
+    MaybeAppend(state, " ");
+    if (state->parse.num_declarators > state->parse.first_declarator) {
+      PrintGroupedDeclarators(state);
+      MaybeAppend(state, " ");
+    }
+  }
+  char* dimension_out = state->parse.out_cur;
+  MaybeAppend(state, "[");
+  if (is_number) {
+    MaybeAppendWithLength(state, dimension, dimension_end - dimension);
+  } else if (dimension_end != dimension) {
+    Replay(state, dimension - state->mangled_begin, ParseExpression);
+  }
+  MaybeAppend(state, "]");
+  if (is_nested) {
+    RotateOutput(state, dimensions, dimension_out);
+  } else {
+    dimensions = dimension_out;
+  }
+  state->array_dimensions = dimensions;
+  return true;
 }
 
 // <pointer-to-member-type> ::= M <(class) type> <(member) type>
+//
+// The class is printed as part of the declarator.
 static bool ParsePointerToMemberType(State* state) {
-  State copy = *state;
-  if (ParseOneCharToken(state, 'M') && ParseType(state) && ParseType(state)) {
+  ParseState copy = state->parse;
+  if (!ParseOneCharToken(state, 'M')) {
+    return false;
+  }
+  const char* class_type = state->parse.mangled_cur;
+  int first = state->parse.num_declarators;
+  state->parse.append = false;
+  bool result = ParseType(state);
+  state->parse.append = copy.append;
+  if (result) {
+    // The function type of a const member function is one substitution
+    // candidate, not two.
+    const char* function_type = state->parse.mangled_cur;
+    while (*function_type == 'r' || *function_type == 'V' ||
+           *function_type == 'K') {
+      ++function_type;
+    }
+    const char* hidden_candidate = state->hidden_candidate;
+    if (function_type != state->parse.mangled_cur) {
+      state->hidden_candidate = function_type;
+    }
+    PushDeclarator(state, DECLARATOR_MEMBER_POINTER, class_type);
+    state->parse.continue_declarators = true;
+    result = ParseType(state);
+    state->hidden_candidate = hidden_candidate;
+    if (result) {
+      FinishDeclarators(state, first);
+      return true;
+    }
+  }
+  state->parse = copy;
+  return false;
+}
+
+// Dv <(dimension) number> _ <(element) type>
+static bool ParseVectorType(State* state) {
+  ParseState copy = state->parse;
+  const char* dimension = state->parse.mangled_cur + 2;
+  if (ParseTwoCharToken(state, "Dv") && ParseNumber(state, NULL)) {
+    const char* dimension_end = state->parse.mangled_cur;
+    if (ParseOneCharToken(state, '_') && ParseType(state)) {
+      MaybeAppend(state, " __vector(");
+      MaybeAppendWithLength(state, dimension, dimension_end - dimension);
+      MaybeAppend(state, ")");
+      return true;
+    }
+  }
+  state->parse = copy;
+  return false;
+}
+
+// Dp <type>
+//
+// The type is printed once for each element of the pack it refers to.
+static bool ParsePackExpansion(State* state) {
+  ParseState copy = state->parse;
+  if (!ParseTwoCharToken(state, "Dp")) {
+    return false;
+  }
+  const char* pattern = state->parse.mangled_cur;
+  char* out = state->parse.out_cur;
+  int pack_size = state->pack_size;
+  state->parse.pack_index = 0;
+  state->pack_size = -1;
+  if (!ParseType(state)) {
+    state->parse = copy;
+    state->pack_size = pack_size;
+    return false;
+  }
+  int size = state->pack_size;
+  if (size == 0) {
+    TruncateOutput(state, out);
+    state->parse.overflowed = copy.overflowed;
+  }
+  for (int i = 1; i < size; ++i) {
+    MaybeAppend(state, ", ");
+    state->parse.pack_index = i;
+    Replay(state, pattern - state->mangled_begin, ParseType);
+  }
+  state->parse.pack_index = copy.pack_index;
+  state->pack_size = pack_size;
+  return true;
+}
+
+// Dt <expression> E  # decltype of an id-expression or class member access
+// DT <expression> E  # decltype of an expression
+static bool ParseDecltype(State* state) {
+  ParseState copy = state->parse;
+  if (ParseOneCharToken(state, 'D') && ParseCharClass(state, "tT") &&
+      MaybeAppend(state, "decltype (") && ParseExpression(state) &&
+      ParseOneCharToken(state, 'E')) {
+    MaybeAppend(state, ")");
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
+// Return the offset of the template arg "index" of the template args that
+// template params refer to, or -1 if it does not exist.
+static int FindTemplateArg(State* state, int index) {
+  int list = state->parse.template_args;
+  if (list < 0) {
+    return -1;
+  }
+  if (state->args_list != list) {
+    // Find where each arg starts by parsing them without printing.
+    ParseState copy = state->parse;
+    state->args_list = list;
+    state->num_args = 0;
+    state->parse.mangled_cur = state->mangled_begin + list + 1;
+    state->parse.append = false;
+    state->parse.replaying = true;
+    state->parse.continue_declarators = false;
+    for (;;) {
+      int arg = state->parse.mangled_cur - state->mangled_begin;
+      if (state->num_args == DEMANGLE_MAX_TEMPLATE_ARGS ||
+          !ParseTemplateArg(state)) {
+        break;
+      }
+      state->args[state->num_args++] = arg;
+    }
+    state->parse = copy;
+  }
+  return index < state->num_args ? state->args[index] : -1;
+}
+
+// Return the offset of element "index" of the argument pack at "pack", or
+// -1 if it does not exist.  The size of the pack is stored in pack_size.
+static int FindPackElement(State* state, int pack, int index) {
+  ParseState copy = state->parse;
+  int element = -1;
+  int size = 0;
+  state->parse.mangled_cur = state->mangled_begin + pack + 1;
+  state->parse.append = false;
+  state->parse.replaying = true;
+  state->parse.continue_declarators = false;
+  for (;;) {
+    int arg = state->parse.mangled_cur - state->mangled_begin;
+    if (!ParseTemplateArg(state)) {
+      break;
+    }
+    if (size++ == index) {
+      element = arg;
+    }
+  }
+  state->parse = copy;
+  state->pack_size = size;
+  return element;
+}
+
+// Print the template arg that template param "index" refers to.
+static void PrintTemplateParam(State* state, int index) {
+  if (state->parse.in_lambda_signature) {
+    // A generic lambda.
+    MaybeAppend(state, "auto:");
+    MaybeAppendNumber(state, index + 1);
+    return;
+  }
+  if (!state->parse.append) {
+    return;  // Nothing to print.
+  }
+  int arg = FindTemplateArg(state, index);
+  if (arg < 0) {
+    state->parse.unresolved = true;
+    return;
+  }
+  char first = state->mangled_begin[arg];
+  if (state->parse.pack_index >= 0 && (first == 'J' || first == 'I')) {
+    arg = FindPackElement(state, arg, state->parse.pack_index);
+    if (arg < 0) {
+      return;
+    }
+  }
+  int pack_index = state->parse.pack_index;
+  state->parse.pack_index = -1;
+  Replay(state, arg, ParseTemplateArg);
+  state->parse.pack_index = pack_index;
+}
+
 // <template-param> ::= T_
 //                  ::= T <parameter-2 non-negative number> _
 static bool ParseTemplateParam(State* state) {
   if (ParseTwoCharToken(state, "T_")) {
-    MaybeAppend(state, "?");  // We don't support template substitutions.
+    PrintTemplateParam(state, 0);
     return true;
   }
 
-  State copy = *state;
-  if (ParseOneCharToken(state, 'T') && ParseNumber(state, NULL) &&
-      ParseOneCharToken(state, '_')) {
-    MaybeAppend(state, "?");  // We don't support template substitutions.
+  ParseState copy = state->parse;
+  int number = -1;
+  if (ParseOneCharToken(state, 'T') && ParseNumber(state, &number) &&
+      number >= 0 && ParseOneCharToken(state, '_')) {
+    PrintTemplateParam(state, number + 1);
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
-// <template-template-param> ::= <template-param>
-//                           ::= <substitution>
-static bool ParseTemplateTemplateParam(State* state) {
-  return (ParseTemplateParam(state) || ParseSubstitution(state));
-}
-
 // <template-args> ::= I <template-arg>+ E
-static bool ParseTemplateArgs(State* state) {
-  State copy = *state;
-  DisableAppend(state);
-  if (ParseOneCharToken(state, 'I') && OneOrMore(ParseTemplateArg, state) &&
+static bool DoParseTemplateArgs(State* state) {
+  ParseState copy = state->parse;
+  const char* begin = state->parse.mangled_cur;
+  int num_args = 0;
+  if (ParseOneCharToken(state, 'I') && MaybeAppend(state, "<") &&
+      ParseTemplateArgList(state, &num_args) && num_args > 0 &&
       ParseOneCharToken(state, 'E')) {
-    RestoreAppend(state, copy.append);
-    MaybeAppend(state, "<>");
+    if (OutputEndsWith(state, '>')) {
+      MaybeAppend(state, " ");
+    }
+    MaybeAppend(state, ">");
+    if (copy.bind_template_args) {
+      state->parse.template_args = begin - state->mangled_begin;
+    }
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
+static bool ParseTemplateArgs(State* state) {
+  return ParseMemoized(state, RULE_TEMPLATE_ARGS, DoParseTemplateArgs);
+}
+
+// <template-arg>* printed separated by commas.
+static bool ParseTemplateArgList(State* state, int* num_args_out) {
+  bool bind_template_args = state->parse.bind_template_args;
+  state->parse.bind_template_args = false;
+  state->parse.continue_declarators = false;
+  *num_args_out = ParseList(state, ParseTemplateArg);
+  state->parse.bind_template_args = bind_template_args;
+  return true;
+}
+
 // <template-arg>  ::= <type>
 //                 ::= <expr-primary>
 //                 ::= I <template-arg>* E        # argument pack
 //                 ::= J <template-arg>* E        # argument pack
 //                 ::= X <expression> E
-static bool ParseTemplateArg(State* state) {
-  State copy = *state;
+static bool DoParseTemplateArg(State* state) {
+  ParseState copy = state->parse;
+  int num_args = 0;
   if ((ParseOneCharToken(state, 'I') || ParseOneCharToken(state, 'J')) &&
-      ZeroOrMore(ParseTemplateArg, state) && ParseOneCharToken(state, 'E')) {
+      ParseTemplateArgList(state, &num_args) &&
+      ParseOneCharToken(state, 'E')) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
   if (ParseType(state) || ParseExprPrimary(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
   if (ParseOneCharToken(state, 'X') && ParseExpression(state) &&
       ParseOneCharToken(state, 'E')) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
+  return false;
+}
+
+static bool ParseTemplateArg(State* state) {
+  return ParseMemoized(state, RULE_TEMPLATE_ARG, DoParseTemplateArg);
+}
+
+// Returns true if "abbrev" is an operator that takes one operand.
+static bool IsUnaryOperator(const char* abbrev) {
+  for (const char* const* p = unary_operator_list; *p != NULL; ++p) {
+    if (abbrev[0] == (*p)[0] && abbrev[1] == (*p)[1]) {
+      return true;
+    }
+  }
   return false;
 }
 
 // <expression> ::= <template-param>
 //              ::= <expr-primary>
+//              ::= <function-param>
 //              ::= <unary operator-name> <expression>
 //              ::= <binary operator-name> <expression> <expression>
 //              ::= <trinary operator-name> <expression> <expression>
 //                  <expression>
+//              ::= cl <expression>+ E
+//              ::= cv <type> <expression>
+//              ::= cv <type> _ <expression>* E
+//              ::= dt <expression> <unresolved-name>
+//              ::= pt <expression> <unresolved-name>
 //              ::= st <type>
-//              ::= sr <type> <unqualified-name> <template-args>
-//              ::= sr <type> <unqualified-name>
-static bool ParseExpression(State* state) {
-  if (ParseTemplateParam(state) || ParseExprPrimary(state)) {
+//              ::= sz <expression>
+//              ::= sr <type> <unqualified-name> [<template-args>]
+//              ::= srN <type> <unresolved-name>+ E <unqualified-name>
+//                  [<template-args>]
+//              ::= sr <unresolved-name>+ E <unqualified-name>
+//                  [<template-args>]
+//              ::= <unresolved-name>
+static bool DoParseExpression(State* state) {
+  if (ParseTemplateParam(state) || ParseExprPrimary(state) ||
+      ParseFunctionParam(state)) {
+    return true;
+  }
+
+  ParseState copy = state->parse;
+  if (ParseTwoCharToken(state, "cl") && ParseOperand(state) &&
+      ParseExpressionList(state)) {
+    return true;
+  }
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "cv") && MaybeAppend(state, "(") &&
+      ParseType(state) && MaybeAppend(state, ")") &&
+      ((ParseOneCharToken(state, '_') && ParseExpressionList(state)) ||
+       ParseOperand(state))) {
+    return true;
+  }
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "dt") && ParseOperand(state) &&
+      MaybeAppend(state, ".") && ParseUnresolvedName(state)) {
     return true;
   }
+  state->parse = copy;
 
-  State copy = *state;
-  if (ParseOperatorName(state) && ParseExpression(state) &&
-      ParseExpression(state) && ParseExpression(state)) {
+  if (ParseTwoCharToken(state, "pt") && ParseOperand(state) &&
+      MaybeAppend(state, "->") && ParseUnresolvedName(state)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
-  if (ParseOperatorName(state) && ParseExpression(state) &&
+  if (ParseTwoCharToken(state, "st") && MaybeAppend(state, "sizeof (") &&
+      ParseType(state)) {
+    MaybeAppend(state, ")");
+    return true;
+  }
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "sz") && MaybeAppend(state, "sizeof (") &&
       ParseExpression(state)) {
+    MaybeAppend(state, ")");
+    return true;
+  }
+  state->parse = copy;
+
+  if (ParseTwoCharToken(state, "sr") && ParseScopedName(state)) {
+    return true;
+  }
+  state->parse = copy;
+
+  // Operators with one to three operands.
+  const AbbrevPair* op = FindOperator(state);
+  if (op != NULL) {
+    state->parse.mangled_cur += 2;
+    if (op->abbrev[0] == 'a' && op->abbrev[1] == 'd' &&
+        state->parse.mangled_cur[0] == 'L' &&
+        (state->parse.mangled_cur[1] == '_' ||
+         state->parse.mangled_cur[1] == 'Z')) {
+      // The address of a function or variable, printed as &name.
+      state->parse.hide_type = true;
+      if (MaybeAppend(state, "&") && ParseExprPrimary(state)) {
+        state->parse.hide_type = false;
+        return true;
+      }
+    } else if (IsUnaryOperator(op->abbrev)) {
+      if (MaybeAppend(state, op->real_name) && ParseOperand(state)) {
+        return true;
+      }
+    } else if (op->abbrev[0] == 'q' && op->abbrev[1] == 'u') {
+      if (ParseOperand(state) && MaybeAppend(state, "?") &&
+          ParseOperand(state) && MaybeAppend(state, ":") &&
+          ParseOperand(state)) {
+        return true;
+      }
+    } else if (ParseOperand(state) && MaybeAppend(state, op->real_name) &&
+               ParseOperand(state)) {
+      return true;
+    }
+  }
+  state->parse = copy;
+
+  if (ParseUnresolvedName(state)) {
     return true;
   }
-  *state = copy;
+  return false;
+}
+
+static bool ParseExpression(State* state) {
+  return ParseMemoized(state, RULE_EXPRESSION, DoParseExpression);
+}
 
-  if (ParseOperatorName(state) && ParseExpression(state)) {
+// <expression>* E, printed as a parenthesized list.
+static bool ParseExpressionList(State* state) {
+  ParseState copy = state->parse;
+  MaybeAppend(state, "(");
+  ParseList(state, ParseExpression);
+  if (ParseOneCharToken(state, 'E')) {
+    MaybeAppend(state, ")");
     return true;
   }
-  *state = copy;
+  state->parse = copy;
+  return false;
+}
+
+// Parse an <expression> that is an operand, printed in parentheses unless
+// it is a name or a function parameter.
+static bool ParseOperand(State* state) {
+  const char* p = state->parse.mangled_cur;
+  bool is_name = IsDigit(p[0]) || (p[0] == 's' && p[1] == 'r') ||
+                 (p[0] == 'f' && (p[1] == 'p' || p[1] == 'L'));
+  char* out = state->parse.out_cur;
+  if (!is_name) {
+    MaybeAppend(state, "(");
+  }
+  if (!ParseExpression(state)) {
+    TruncateOutput(state, out);
+    return false;
+  }
+  if (!is_name) {
+    MaybeAppend(state, ")");
+  }
+  return true;
+}
 
-  if (ParseTwoCharToken(state, "st") && ParseType(state)) {
+// <function-param> ::= fp <CV-qualifiers> _
+//                  ::= fp <CV-qualifiers> <number> _
+//                  ::= fL <number> p <CV-qualifiers> _
+//                  ::= fL <number> p <CV-qualifiers> <number> _
+static bool ParseFunctionParam(State* state) {
+  ParseState copy = state->parse;
+  unsigned char qualifiers = 0;
+  int number = -1;
+  if ((ParseTwoCharToken(state, "fp") ||
+       (ParseTwoCharToken(state, "fL") && ParseNumber(state, NULL) &&
+        ParseOneCharToken(state, 'p'))) &&
+      Optional(ParseCVQualifiers(state, &qualifiers)) &&
+      Optional(ParseNumber(state, &number)) && number >= -1 &&
+      ParseOneCharToken(state, '_')) {
+    MaybeAppend(state, "{parm#");
+    MaybeAppendNumber(state, number + 2);
+    MaybeAppend(state, "}");
     return true;
   }
-  *state = copy;
+  state->parse = copy;
+  return false;
+}
 
-  if (ParseTwoCharToken(state, "sr") && ParseType(state) &&
-      ParseUnqualifiedName(state) && ParseTemplateArgs(state)) {
+// <unresolved-name> ::= <source-name> [<template-args>]
+static bool ParseUnresolvedName(State* state) {
+  if (ParseSourceName(state)) {
+    Optional(ParseTemplateArgs(state));
     return true;
   }
-  *state = copy;
+  return false;
+}
 
-  if (ParseTwoCharToken(state, "sr") && ParseType(state) &&
-      ParseUnqualifiedName(state)) {
+// The scope and name of an sr expression, printed as scope::name.
+static bool ParseScopedName(State* state) {
+  ParseState copy = state->parse;
+  bool has_qualifiers = IsDigit(state->parse.mangled_cur[0]);
+  if (!has_qualifiers) {
+    has_qualifiers = ParseOneCharToken(state, 'N');
+    if (!ParseType(state)) {
+      state->parse = copy;
+      return false;
+    }
+  }
+  if (has_qualifiers) {
+    for (;;) {
+      char* separator = state->parse.out_cur;
+      bool overflowed = state->parse.overflowed;
+      if (state->parse.out_cur != copy.out_cur) {
+        MaybeAppend(state, "::");
+      }
+      if (!ParseUnresolvedName(state)) {
+        TruncateOutput(state, separator);
+        state->parse.overflowed = overflowed;
+        break;
+      }
+    }
+    if (!ParseOneCharToken(state, 'E')) {
+      state->parse = copy;
+      return false;
+    }
+  }
+  if (MaybeAppend(state, "::") && ParseUnqualifiedName(state)) {
+    Optional(ParseTemplateArgs(state));
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
+// Returns the suffix an integer literal of the type at "type" is printed
+// with, or NULL if it is printed with a cast.
+static const char* LiteralSuffix(const char* type) {
+  if (!IsDigit(type[1]) && type[1] != 'n') {
+    return NULL;
+  }
+  for (const AbbrevPair* p = literal_suffix_list; p->abbrev != NULL; ++p) {
+    if (type[0] == p->abbrev[0]) {
+      return p->real_name;
+    }
+  }
+  return NULL;
+}
+
 // <expr-primary> ::= L <type> <(value) number> E
 //                ::= L <type> <(value) float> E
 //                ::= L <mangled-name> E
 //                // A bug in g++'s C++ ABI version 2 (-fabi-version=2).
 //                ::= LZ <encoding> E
-static bool ParseExprPrimary(State* state) {
-  State copy = *state;
-  if (ParseOneCharToken(state, 'L') && ParseType(state) &&
-      ParseNumber(state, NULL) && ParseOneCharToken(state, 'E')) {
-    return true;
-  }
-  *state = copy;
+//
+// Integers of the basic types are printed with a suffix (e.g. 5ul) and
+// bools as true or false; other literals are printed with a cast.
+static bool DoParseExprPrimary(State* state) {
+  ParseState copy = state->parse;
+  if (ParseOneCharToken(state, 'L')) {
+    const char* type = state->parse.mangled_cur;
+    bool is_bool = type[0] == 'b' && (type[1] == '0' || type[1] == '1') &&
+                   type[2] == 'E';
+    const char* suffix = LiteralSuffix(type);
+    bool cast = !is_bool && suffix == NULL;
+    state->parse.append = cast && copy.append;
+    if (cast) {
+      MaybeAppend(state, "(");
+    }
+    if (ParseType(state)) {
+      state->parse.append = copy.append;
+      if (cast) {
+        MaybeAppend(state, ")");
+      }
+      ParseState value = state->parse;
+      const char* number = state->parse.mangled_cur;
+      if (ParseNumber(state, NULL) && ParseOneCharToken(state, 'E')) {
+        if (is_bool) {
+          MaybeAppend(state, number[0] == '0' ? "false" : "true");
+          return true;
+        }
+        if (number[0] == 'n') {
+          MaybeAppend(state, "-");
+          ++number;
+        }
+        MaybeAppendWithLength(state, number, state->parse.mangled_cur - 1 -
+                                               number);
+        if (suffix != NULL) {
+          MaybeAppend(state, suffix);
+        }
+        return true;
+      }
+      state->parse = value;
 
-  if (ParseOneCharToken(state, 'L') && ParseType(state) &&
-      ParseFloatNumber(state) && ParseOneCharToken(state, 'E')) {
-    return true;
+      if (ParseFloatNumber(state) && ParseOneCharToken(state, 'E')) {
+        MaybeAppend(state, "[");
+        MaybeAppendWithLength(state, number, state->parse.mangled_cur - 1 -
+                                               number);
+        MaybeAppend(state, "]");
+        return true;
+      }
+    }
   }
-  *state = copy;
+  state->parse = copy;
 
   if (ParseOneCharToken(state, 'L') && ParseMangledName(state) &&
       ParseOneCharToken(state, 'E')) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
   if (ParseTwoCharToken(state, "LZ") && ParseEncoding(state) &&
       ParseOneCharToken(state, 'E')) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
   return false;
 }
 
+static bool ParseExprPrimary(State* state) {
+  return ParseMemoized(state, RULE_EXPR_PRIMARY, DoParseExprPrimary);
+}
+
 // <local-name> := Z <(function) encoding> E <(entity) name>
 //                 [<discriminator>]
 //              := Z <(function) encoding> E s [<discriminator>]
+//              := Z <(function) encoding> E d [<(parameter) number>] _
+//                 <(entity) name>
+//
+// The function is printed without its return type.
 static bool ParseLocalName(State* state) {
-  State copy = *state;
-  if (ParseOneCharToken(state, 'Z') && ParseEncoding(state) &&
-      ParseOneCharToken(state, 'E') && MaybeAppend(state, "::") &&
-      ParseName(state) && Optional(ParseDiscriminator(state))) {
-    return true;
-  }
-  *state = copy;
-
+  ParseState copy = state->parse;
+  state->parse.hide_return_type = true;
   if (ParseOneCharToken(state, 'Z') && ParseEncoding(state) &&
-      ParseTwoCharToken(state, "Es") && Optional(ParseDiscriminator(state))) {
-    return true;
+      ParseOneCharToken(state, 'E')) {
+    state->parse.hide_return_type = false;
+    ParseState entity = state->parse;
+    if (MaybeAppend(state, "::") && ParseName(state) &&
+        Optional(ParseDiscriminator(state))) {
+      return true;
+    }
+    state->parse = entity;
+
+    int number = -1;
+    if (ParseOneCharToken(state, 'd') &&
+        Optional(ParseNumber(state, &number)) &&
+        ParseOneCharToken(state, '_') &&
+        MaybeAppend(state, "::{default arg#")) {
+      MaybeAppendNumber(state, number + 2);
+      if (MaybeAppend(state, "}::") && ParseName(state)) {
+        return true;
+      }
+    }
+    state->parse = entity;
+
+    if (ParseOneCharToken(state, 's') &&
+        MaybeAppend(state, "::string literal") &&
+        Optional(ParseDiscriminator(state))) {
+      state->parse.name_is_template = false;
+      state->parse.name_is_ctor_dtor_conv = false;
+      state->parse.name_qualifiers = 0;
+      return true;
+    }
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
 // <discriminator> := _ <(non-negative) number>
 static bool ParseDiscriminator(State* state) {
-  State copy = *state;
+  ParseState copy = state->parse;
   if (ParseOneCharToken(state, '_') && ParseNumber(state, NULL)) {
     return true;
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
+// Print substitution "index" again.
+static void PrintSubstitution(State* state, int index) {
+  if (index >= state->parse.num_substitutions) {
+    state->parse.unresolved = true;
+    return;
+  }
+  const Substitution* sub = &state->substitutions[index];
+  if (sub->kind != SUBSTITUTION_TYPE) {
+    // Only types use the declarators of a type that refers to them.
+    state->parse.continue_declarators = false;
+  }
+  switch (sub->kind) {
+    case SUBSTITUTION_TYPE:
+      Replay(state, sub->begin, ParseType);
+      break;
+    case SUBSTITUTION_PREFIX:
+      state->prefix_end = state->mangled_begin + sub->end;
+      Replay(state, sub->begin, ParsePrefix);
+      state->prefix_end = NULL;
+      break;
+    case SUBSTITUTION_UNSCOPED_NAME:
+      Replay(state, sub->begin, ParseUnscopedName);
+      break;
+    case SUBSTITUTION_TEMPLATE_PARAM:
+      Replay(state, sub->begin, ParseTemplateParam);
+      break;
+  }
+}
+
 // <substitution> ::= S_
 //                ::= S <seq-id> _
 //                ::= St, etc.
 static bool ParseSubstitution(State* state) {
   if (ParseTwoCharToken(state, "S_")) {
-    MaybeAppend(state, "?");  // We don't support substitutions.
+    PrintSubstitution(state, 0);
     return true;
   }
 
-  State copy = *state;
-  if (ParseOneCharToken(state, 'S') && ParseSeqId(state) &&
+  ParseState copy = state->parse;
+  int seq_id = -1;
+  if (ParseOneCharToken(state, 'S') && ParseSeqId(state, &seq_id) &&
       ParseOneCharToken(state, '_')) {
-    MaybeAppend(state, "?");  // We don't support substitutions.
+    PrintSubstitution(state, seq_id + 1);
     return true;
   }
-  *state = copy;
+  state->parse = copy;
 
   // Expand abbreviations like "St" => "std".
   if (ParseOneCharToken(state, 'S')) {
     const AbbrevPair* p;
     for (p = substitution_list; p->abbrev != NULL; ++p) {
-      if (state->mangled_cur[0] == p->abbrev[1]) {
+      if (state->parse.mangled_cur[0] == p->abbrev[1]) {
         MaybeAppend(state, "std");
         if (p->real_name[0] != '\0') {
           MaybeAppend(state, "::");
           MaybeAppend(state, p->real_name);
         }
-        ++state->mangled_cur;
+        ++state->parse.mangled_cur;
         return true;
       }
     }
   }
-  *state = copy;
+  state->parse = copy;
   return false;
 }
 
-// Parse <mangled-name>, optionally followed by either a function-clone suffix
-// or version suffix.  Returns true only if all of "mangled_cur" was consumed.
+// Parse <mangled-name>, optionally followed by function clone suffixes
+// and/or a version suffix.  Returns true only if all of "mangled_cur" was
+// consumed.
 static bool ParseTopLevelMangledName(State* state) {
   if (ParseMangledName(state)) {
-    if (state->mangled_cur[0] != '\0') {
-      // Drop trailing function clone suffix, if any.
-      if (IsFunctionCloneSuffix(state->mangled_cur)) {
-        return true;
-      }
+    // Print clone suffixes like c++filt, e.g. foo() [clone .cold].
+    size_t length;
+    while ((length = CloneSuffixLength(state->parse.mangled_cur)) > 0) {
+      MaybeAppend(state, " [clone ");
+      MaybeAppendWithLength(state, state->parse.mangled_cur, length);
+      MaybeAppend(state, "]");
+      state->parse.mangled_cur += length;
+    }
+    if (state->parse.mangled_cur[0] != '\0') {
       // Append trailing version suffix if any.
       // ex. _Z3foo@@GLIBCXX_3.4
-      if (state->mangled_cur[0] == '@') {
-        MaybeAppend(state, state->mangled_cur);
+      if (state->parse.mangled_cur[0] == '@') {
+        MaybeAppend(state, state->parse.mangled_cur);
         return true;
       }
       return false;  // Unconsumed suffix.
@@ -1208,7 +2664,13 @@ static bool ParseTopLevelMangledName(State* state) {
 bool shbt_demangle(const char* mangled, char* out, size_t out_size) {
   State state;
   InitState(&state, mangled, out, out_size);
-  return ParseTopLevelMangledName(&state) && !state.overflowed;
+  if (!ParseTopLevelMangledName(&state) || state.parse.overflowed ||
+      state.parse.unresolved) {
+    return false;
+  }
+  // Backtracking may have left output past the cursor.
+  *state.parse.out_cur = '\0';
+  return true;
 }
 
 #endif  // SHBT_USE_BUILTIN_IA64_DEMANGLER
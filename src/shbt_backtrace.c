@@ -24,81 +24,571 @@
 #include "shbt/shbt.h"
 #include "shbt/shbt_internal.h"
 
+// Where libunwind's context is a ucontext_t, it can start from a signal's
+// (with unw_init_local2, from libunwind 1.3).
+#if defined(SHBT_HAVE_UNW_INIT_LOCAL2) && defined(__linux__) && \
+  (defined(__x86_64__) || defined(__powerpc64__))
+#define UNWIND_FROM_SIGNAL_CONTEXT
+#include <ucontext.h>
+#endif
+
+// Copy name to buf. Returns false if it does not fit.
+static bool copy_symbol(const char* name, char* buf, size_t size) {
+  size_t len = 0;
+  for (; name[len] != '\0' && len + 1 < size; ++len) {
+    buf[len] = name[len];
+  }
+  if (name[len] != '\0') {
+    return false;
+  }
+  buf[len] = '\0';
+  return true;
+}
+
+// Look up the name of the function containing pc.
+//
+// This uses the symbol cache, then the symbol index if one has been built,
+// and otherwise libunwind (with cursor, which is repositioned at pc). Unless
+// exact (the frame was interrupted by a signal), pc is a return address, so
+// we look up the call instruction before it (as libunwind does). Only
+// return addresses are cached.
+// Returns false if there is no name or it does not fit in buf.
+static bool get_symbol(unw_cursor_t* cursor, unw_word_t pc, bool exact,
+                       char* buf, size_t size, unw_word_t* offp) {
+  if (size == 0 || pc == 0) {
+    return false;
+  }
+  uintptr_t offset;
+  const char* name = NULL;
+  if (!exact) {
+    name = shbt_symbol_cache_lookup(pc, &offset);
+    if (name != NULL) {
+      *offp = offset;
+      return copy_symbol(name, buf, size);
+    }
+  }
+  // Names looked up while modules are being unloaded are not cached.
+  uint32_t generation = shbt_symbol_cache_generation();
+  uintptr_t start;
+  size_t len = shbt_symbol_index_lookup(exact ? pc : pc - 1, buf, size,
+                                        &start);
+  if (len > 0) {
+    if (len >= size) {
+      return false;
+    }
+    *offp = pc - start;
+  } else if (cursor == NULL ||
+             unw_get_proc_name(cursor, buf, size, offp) != 0) {
+    return false;
+  }
+  if (!exact) {
+    shbt_symbol_cache_insert(pc, buf, *offp, generation);
+  }
+  return true;
+}
+
+/**
+ * Walks the calling thread's stack, with frame pointers or the unwind table
+ * when SHBT is built to use them and they can be used, and otherwise with
+ * libunwind.
+ */
+struct stack_walker {
+  /** Whether frames is used instead of cursor. */
+  bool use_frame_pointers;
+  struct shbt_frame_pointer_cursor frames;
+  /** Whether table is used instead of cursor (until it falls back). */
+  bool use_unwind_table;
+  struct shbt_unwind_table_cursor table;
+  /**
+   * Whether cursor is set up. With frame pointers or the unwind table, it
+   * is only set up when a name must be looked up with libunwind.
+   */
+  bool have_cursor;
+  unw_context_t context;
+  unw_cursor_t cursor;
+  /**
+   * Whether the next step stays at the current frame, because the walk
+   * started at the frame a signal interrupted rather than at its callee.
+   */
+  bool stay;
+  /**
+   * Whether the current frame is the one a signal interrupted, when
+   * cursor or table started there (which they do not otherwise know).
+   */
+  bool at_signal_context;
+};
+
+// Start walking the stack at the calling function, which the first step
+// leaves for its caller. This is inlined so the walk starts from the
+// caller's frame, which is still live while it walks.
+__attribute__((always_inline))
+static inline void stack_walker_init(struct stack_walker* walker) {
+  walker->use_frame_pointers = false;
+  walker->use_unwind_table = false;
+  walker->have_cursor = false;
+  walker->stay = false;
+  walker->at_signal_context = false;
+#ifdef SHBT_USE_FRAME_POINTER_UNWINDER
+  walker->use_frame_pointers =
+    shbt_frame_pointer_init(&walker->frames, __builtin_frame_address(0));
+  if (walker->use_frame_pointers) {
+    return;
+  }
+#endif
+  unw_getcontext(&walker->context);
+#ifdef SHBT_USE_UNWIND_TABLE_UNWINDER
+  walker->use_unwind_table =
+    shbt_unwind_table_init(&walker->table, &walker->context, false);
+  if (walker->use_unwind_table) {
+    return;
+  }
+#endif
+  unw_init_local(&walker->cursor, &walker->context);
+  walker->have_cursor = true;
+}
+
+// Set up cursor from context, whose PC is the instruction a signal
+// interrupted if exact, and otherwise a return address.
+static void stack_walker_init_cursor(struct stack_walker* walker,
+                                     bool exact) {
+#ifdef UNWIND_FROM_SIGNAL_CONTEXT
+  if (exact) {
+    unw_init_local2(&walker->cursor, &walker->context, UNW_INIT_SIGNAL_FRAME);
+  } else {
+    unw_init_local(&walker->cursor, &walker->context);
+  }
+#else
+  (void) exact;
+  unw_init_local(&walker->cursor, &walker->context);
+#endif
+  walker->have_cursor = true;
+}
+
+// Start walking the stack at the frame a signal interrupted, given the
+// context its handler received. Returns false if that cannot be done here.
+static bool stack_walker_init_signal_context(struct stack_walker* walker,
+                                             const void* ucontext) {
+  walker->use_frame_pointers = false;
+  walker->use_unwind_table = false;
+  walker->have_cursor = false;
+  walker->stay = false;
+  walker->at_signal_context = false;
+#ifdef UNWIND_FROM_SIGNAL_CONTEXT
+  if (ucontext == NULL) {
+    return false;
+  }
+#ifdef SHBT_USE_FRAME_POINTER_UNWINDER
+  // This steps to the interrupted frame first by itself.
+  walker->use_frame_pointers =
+    shbt_frame_pointer_init_context(&walker->frames, ucontext);
+  if (walker->use_frame_pointers) {
+    return true;
+  }
+#endif
+  walker->context = *(const ucontext_t*) ucontext;
+  walker->stay = true;
+  walker->at_signal_context = true;
+#ifdef SHBT_USE_UNWIND_TABLE_UNWINDER
+  walker->use_unwind_table =
+    shbt_unwind_table_init(&walker->table, &walker->context, true);
+  if (walker->use_unwind_table) {
+    return true;
+  }
+#endif
+  stack_walker_init_cursor(walker, true);
+  return true;
+#else
+  (void) ucontext;
+  return false;
+#endif
+}
+
+// Step to the caller of the current frame. Returns false at the end.
+static bool stack_walker_step(struct stack_walker* walker) {
+  if (walker->stay) {
+    walker->stay = false;
+    return true;
+  }
+  walker->at_signal_context = false;
+  if (walker->use_frame_pointers) {
+    return shbt_frame_pointer_step(&walker->frames);
+  }
+  if (walker->use_unwind_table) {
+    if (shbt_unwind_table_step(&walker->table)) {
+      return true;
+    }
+    if (!walker->table.fallback) {
+      return false;
+    }
+    // Continue with libunwind from the frame the table cannot step.
+    shbt_unwind_table_get_context(&walker->table, &walker->context);
+    stack_walker_init_cursor(walker, walker->table.exact);
+    walker->use_unwind_table = false;
+  }
+  return unw_step(&walker->cursor) > 0;
+}
+
+// Get the PC of the current frame, or 0 if it is not known.
+static unw_word_t stack_walker_pc(struct stack_walker* walker) {
+  if (walker->use_frame_pointers) {
+    return walker->frames.pc;
+  }
+  if (walker->use_unwind_table) {
+    return walker->table.pc;
+  }
+  unw_word_t pc;
+  if (unw_get_reg(&walker->cursor, UNW_REG_IP, &pc)) {
+    return 0;
+  }
+  return pc;
+}
+
+// Whether the current frame was interrupted by a signal.
+static bool stack_walker_is_signal_frame(struct stack_walker* walker) {
+  if (walker->use_frame_pointers) {
+    return walker->frames.is_signal_frame;
+  }
+  if (walker->at_signal_context) {
+    return true;
+  }
+  if (walker->use_unwind_table) {
+    return false;  // The table leaves signal frames to libunwind.
+  }
+  return unw_is_signal_frame(&walker->cursor) > 0;
+}
+
+// Look up the name of the function containing the current frame's PC (see
+// get_symbol).
+static bool stack_walker_get_symbol(struct stack_walker* walker, char* buf,
+                                    size_t size, unw_word_t* offp) {
+  unw_word_t pc = stack_walker_pc(walker);
+  unw_cursor_t* cursor = &walker->cursor;
+  if (walker->use_frame_pointers || walker->use_unwind_table) {
+    // libunwind only needs a valid cursor to look up names, so one is set
+    // up the first time it is needed and repositioned at each PC.
+    if (!walker->have_cursor) {
+      unw_getcontext(&walker->context);
+      unw_init_local(&walker->cursor, &walker->context);
+      walker->have_cursor = true;
+    }
+    if (unw_set_reg(cursor, UNW_REG_IP, pc)) {
+      cursor = NULL;
+    }
+  }
+  return get_symbol(cursor, pc, stack_walker_is_signal_frame(walker), buf,
+                    size, offp);
+}
+
+// Start walking the stack at the frame a signal interrupted, so the first
+// step goes there. If the handler's context cannot be used, this walks
+// from the calling function (in the handler) past the handler's frames
+// instead, or from the calling function if no frame was interrupted. This
+// is inlined for the same reason as stack_walker_init.
+__attribute__((always_inline))
+static inline void stack_walker_init_signal(struct stack_walker* walker,
+                                            const void* ucontext) {
+  if (stack_walker_init_signal_context(walker, ucontext)) {
+    return;
+  }
+  stack_walker_init(walker);
+  while (stack_walker_step(walker)) {
+    if (stack_walker_is_signal_frame(walker)) {
+      walker->stay = true;
+      return;
+    }
+  }
+  stack_walker_init(walker);
+}
+
+// Collect the frames walker steps to into trace.
+static void collect_frames(struct stack_walker* walker, shbt_frame_t trace[],
+                           size_t num_frames, size_t* num_valid_frames) {
+  size_t cur_frame = 0;
+  while (cur_frame < num_frames && stack_walker_step(walker)) {
+    trace[cur_frame].addr = (void*) stack_walker_pc(walker);
+    unw_word_t offp;
+    if (!stack_walker_get_symbol(walker, trace[cur_frame].symbol,
+                                 sizeof(trace[cur_frame].symbol), &offp)) {
+      // Failed to get symbol name.
+      strncpy(trace[cur_frame].symbol, SHBT_UNKNOWN_SYMBOL,
+              sizeof(trace[cur_frame].symbol));
+    }
+    ++cur_frame;
+  }
+  *num_valid_frames = cur_frame;
+}
+
 bool shbt_collect_backtrace(shbt_frame_t trace[], size_t num_frames,
                             size_t* num_valid_frames) {
+  struct stack_walker walker;
+  stack_walker_init(&walker);
+  collect_frames(&walker, trace, num_frames, num_valid_frames);
+  return true;
+}
+
+bool shbt_collect_backtrace_from_context(const void* ucontext,
+                                         shbt_frame_t trace[],
+                                         size_t num_frames,
+                                         size_t* num_valid_frames) {
+  struct stack_walker walker;
+  stack_walker_init_signal(&walker, ucontext);
+  collect_frames(&walker, trace, num_frames, num_valid_frames);
+  return true;
+}
+
+bool shbt_collect_addresses(void* pcs[], size_t max_pcs, size_t* num_pcs) {
+  struct stack_walker walker;
+  stack_walker_init(&walker);
+  size_t cur_pc = 0;
+  while (cur_pc < max_pcs && stack_walker_step(&walker)) {
+    unw_word_t pc = stack_walker_pc(&walker);
+    if (pc == 0) {
+      break;
+    }
+    pcs[cur_pc] = (void*) pc;
+    ++cur_pc;
+  }
+  *num_pcs = cur_pc;
+  return true;
+}
+
+size_t shbt_collect_signal_addresses(const void* ucontext, void* pcs[],
+                                     size_t max_pcs) {
+  struct stack_walker walker;
+  stack_walker_init_signal(&walker, ucontext);
+  size_t cur_pc = 0;
+  while (cur_pc < max_pcs && stack_walker_step(&walker)) {
+    unw_word_t pc = stack_walker_pc(&walker);
+    if (pc == 0) {
+      break;
+    }
+    pcs[cur_pc] = (void*) pc;
+    ++cur_pc;
+  }
+  return cur_pc;
+}
+
+bool shbt_symbolize(void* const pcs[], size_t num_pcs, shbt_frame_t trace[]) {
+  return shbt_symbolize_ex(pcs, num_pcs, trace, false);
+}
+
+bool shbt_symbolize_ex(void* const pcs[], size_t num_pcs,
+                       shbt_frame_t trace[], bool first_frame_exact) {
+  // We only need a valid cursor for libunwind to look up procedure names, so
+  // initialize one here and then reposition it at each address.
   unw_context_t context;
   unw_getcontext(&context);
   unw_cursor_t cursor;
   unw_init_local(&cursor, &context);
-  size_t cur_frame = 0;
-  const char* unknown_symbol_str = "(unknown symbol)";
-  while (cur_frame < num_frames && unw_step(&cursor) > 0) {
+  for (size_t cur_frame = 0; cur_frame < num_pcs; ++cur_frame) {
+    trace[cur_frame].addr = pcs[cur_frame];
     unw_word_t offp;
-    if (unw_get_proc_name(&cursor, trace[cur_frame].symbol,
-                          sizeof(trace[cur_frame].symbol), &offp)) {
+    if (unw_set_reg(&cursor, UNW_REG_IP, (unw_word_t) pcs[cur_frame]) ||
+        !get_symbol(&cursor, (unw_word_t) pcs[cur_frame],
+                    (cur_frame == 0 && first_frame_exact) ||
+                    unw_is_signal_frame(&cursor) > 0,
+                    trace[cur_frame].symbol,
+                    sizeof(trace[cur_frame].symbol), &offp)) {
       // Failed to get symbol name.
-      strncpy(trace[cur_frame].symbol, unknown_symbol_str,
+      strncpy(trace[cur_frame].symbol, SHBT_UNKNOWN_SYMBOL,
               sizeof(trace[cur_frame].symbol));
     }
-    ++cur_frame;
   }
-  *num_valid_frames = cur_frame;
   return true;
 }
 
+// Print a single frame of a backtrace, followed by the module containing
+// it and its offset there (which, unlike the address, is the same in every
+// run), or just the address if the module is not known.
+static void print_frame(struct shbt_writer* writer,
+                        const struct shbt_module_map* map, size_t frame_num,
+                        void* addr, const char* symbol) {
+  // Fully demangled template names can be long.
+  char demangled_buf[4096] = {0};
+  // Print frame number, with manual padding.
+  if (frame_num < 10) {
+    shbt_writer_puts(writer, "   ");
+  } else if (frame_num < 100) {
+    shbt_writer_puts(writer, "  ");
+  } else if (frame_num < 1000) {
+    shbt_writer_puts(writer, " ");
+  }
+  shbt_writer_put_int(writer, frame_num, 10, 0);
+  shbt_writer_puts(writer, ": ");
+  int64_t start = writer->timing != NULL ? shbt_now_ns() : 0;
+  const char* demangled_symbol = shbt_symbol_cache_demangle(
+    (uintptr_t) addr, symbol, demangled_buf, sizeof(demangled_buf));
+  if (writer->timing != NULL) {
+    writer->timing->demangle_ns += shbt_now_ns() - start;
+  }
+  if (demangled_symbol != NULL) {
+    shbt_writer_puts(writer, demangled_symbol);
+  } else {
+    shbt_writer_puts(writer, symbol);
+  }
+  const struct shbt_module* module =
+    shbt_module_map_find(map, (uintptr_t) addr);
+  if (module != NULL) {
+    shbt_writer_puts(writer, " [");
+    shbt_writer_puts(writer, module->name);
+    shbt_writer_puts(writer, "+0x");
+    shbt_writer_put_int(writer, (intptr_t) ((uintptr_t) addr -
+                                            module->load_base), 16, 0);
+  } else {
+    shbt_writer_puts(writer, " [0x");
+    shbt_writer_put_int(writer, (intptr_t) addr, 16, 0);
+  }
+  shbt_writer_puts(writer, "]\n");
+}
+
 bool shbt_print_collected_backtrace_fd(shbt_frame_t trace[], size_t num_frames,
                                        int fd) {
-  char str_buf[128] = {0};  // Should be sufficiently large.
-  char demangled_symbol[1024] = {0};
+  struct shbt_writer writer;
+  shbt_writer_init(&writer, fd);
+  const struct shbt_module_map* map = shbt_module_map_acquire();
   for (size_t cur_frame = 0; cur_frame < num_frames; ++cur_frame) {
-    // Print frame number, with manual padding.
-    if (cur_frame < 10) {
-      shbt_safe_print("   ", fd);
-    } else if (cur_frame < 100) {
-      shbt_safe_print("  ", fd);
-    } else if (cur_frame < 1000) {
-      shbt_safe_print(" ", fd);
-    }
-    shbt_itoa(cur_frame, str_buf, sizeof(str_buf), 10, 0);
-    shbt_safe_print(str_buf, fd);
-    shbt_safe_print(": ", fd);
-    if (shbt_demangle(trace[cur_frame].symbol, demangled_symbol,
-                      sizeof(demangled_symbol))) {
-      shbt_safe_print(demangled_symbol, fd);
-#ifdef SHBT_USE_BUILTIN_IA64_DEMANGLER
-      // Print the mangled symbol too, since this demangler doesn't fully
-      // demangle some C++ stuff (function/template arguments, etc.).
-      shbt_safe_print(" (", fd);
-      shbt_safe_print(trace[cur_frame].symbol, fd);
-      shbt_safe_print(")", fd);
-#endif
-    } else {
-      shbt_safe_print(trace[cur_frame].symbol, fd);
+    print_frame(&writer, map, cur_frame, trace[cur_frame].addr,
+                trace[cur_frame].symbol);
+  }
+  shbt_module_map_release(map);
+  return shbt_writer_finish(&writer);
+}
+
+void shbt_string_arena_init(shbt_string_arena_t* arena, char* buf,
+                            size_t size) {
+  arena->buf = buf;
+  arena->size = size;
+  arena->used = 0;
+}
+
+const char* shbt_string_arena_get(const shbt_string_arena_t* arena,
+                                  uint32_t ref) {
+  if (ref == SHBT_NO_SYMBOL || ref >= arena->used) {
+    return NULL;
+  }
+  return arena->buf + ref;
+}
+
+bool shbt_collect_compact_backtrace(shbt_compact_frame_t trace[],
+                                    size_t num_frames,
+                                    size_t* num_valid_frames,
+                                    shbt_string_arena_t* arena) {
+  struct stack_walker walker;
+  stack_walker_init(&walker);
+  size_t cur_frame = 0;
+  while (cur_frame < num_frames && stack_walker_step(&walker)) {
+    trace[cur_frame].addr = (void*) stack_walker_pc(&walker);
+    trace[cur_frame].offset = 0;
+    trace[cur_frame].symbol = SHBT_NO_SYMBOL;
+    // Look up the name directly into the free space in the arena. This
+    // fails if the name does not fit, in which case the space is not used.
+    char* name = arena->buf + arena->used;
+    size_t space = arena->size - arena->used;
+    unw_word_t offp;
+    if (space > 0 && arena->used < SHBT_NO_SYMBOL &&
+        stack_walker_get_symbol(&walker, name, space, &offp)) {
+      trace[cur_frame].offset = offp < UINT32_MAX ? offp : UINT32_MAX;
+      // Share the name with the previous frame if it is the same (e.g. for
+      // recursion), otherwise keep it.
+      const char* prev_name = NULL;
+      if (cur_frame > 0) {
+        prev_name =
+          shbt_string_arena_get(arena, trace[cur_frame - 1].symbol);
+      }
+      if (prev_name != NULL && strcmp(prev_name, name) == 0) {
+        trace[cur_frame].symbol = trace[cur_frame - 1].symbol;
+      } else {
+        trace[cur_frame].symbol = arena->used;
+        arena->used += strlen(name) + 1;
+      }
     }
-    shbt_safe_print("\n", fd);
+    ++cur_frame;
   }
+  *num_valid_frames = cur_frame;
   return true;
 }
 
-bool shbt_print_backtrace_fd(int fd) {
-  size_t depth = shbt_get_stack_depth();
-  shbt_frame_t trace[depth];
-  size_t valid_depth = 0;
-  if (!shbt_collect_backtrace(trace, depth, &valid_depth)) {
-    return false;
+bool shbt_print_compact_backtrace_fd(const shbt_compact_frame_t trace[],
+                                     size_t num_frames,
+                                     const shbt_string_arena_t* arena,
+                                     int fd) {
+  struct shbt_writer writer;
+  shbt_writer_init(&writer, fd);
+  const struct shbt_module_map* map = shbt_module_map_acquire();
+  for (size_t cur_frame = 0; cur_frame < num_frames; ++cur_frame) {
+    const char* symbol =
+      shbt_string_arena_get(arena, trace[cur_frame].symbol);
+    print_frame(&writer, map, cur_frame, trace[cur_frame].addr,
+                symbol != NULL ? symbol : SHBT_UNKNOWN_SYMBOL);
   }
-  if (!shbt_print_collected_backtrace_fd(trace, valid_depth, fd)) {
-    return false;
+  shbt_module_map_release(map);
+  return shbt_writer_finish(&writer);
+}
+
+// Write the frames walker steps to, where walking started at start (if the
+// writer is timed).
+static void write_frames(struct shbt_writer* writer,
+                         struct stack_walker* walker, int64_t start) {
+  // Print each frame as soon as we unwind to it. This unwinds the stack only
+  // once and uses a fixed amount of stack space regardless of the depth,
+  // which matters when running on a small signal handler stack.
+  struct shbt_handler_timing* timing = writer->timing;
+  char symbol[1024];
+  const struct shbt_module_map* map = shbt_module_map_acquire();
+  for (size_t cur_frame = 0; stack_walker_step(walker); ++cur_frame) {
+    unw_word_t pc = stack_walker_pc(walker);
+    unw_word_t offp;
+    if (!stack_walker_get_symbol(walker, symbol, sizeof(symbol), &offp)) {
+      // Failed to get symbol name.
+      strncpy(symbol, SHBT_UNKNOWN_SYMBOL, sizeof(symbol));
+    }
+    if (timing != NULL) {
+      timing->unwind_ns += shbt_now_ns() - start;
+    }
+    print_frame(writer, map, cur_frame, (void*) pc, symbol);
+    if (timing != NULL) {
+      start = shbt_now_ns();
+    }
   }
+  if (timing != NULL) {
+    timing->unwind_ns += shbt_now_ns() - start;
+  }
+  shbt_module_map_release(map);
+}
+
+bool shbt_write_backtrace(struct shbt_writer* writer, size_t skip_frames) {
+  int64_t start = writer->timing != NULL ? shbt_now_ns() : 0;
+  struct stack_walker walker;
+  stack_walker_init(&walker);
+  for (size_t i = 0; i < skip_frames; ++i) {
+    if (!stack_walker_step(&walker)) {
+      return true;
+    }
+  }
+  write_frames(writer, &walker, start);
+  return true;
+}
+
+bool shbt_write_signal_backtrace(struct shbt_writer* writer,
+                                 const void* ucontext) {
+  int64_t start = writer->timing != NULL ? shbt_now_ns() : 0;
+  struct stack_walker walker;
+  stack_walker_init_signal(&walker, ucontext);
+  write_frames(writer, &walker, start);
   return true;
 }
 
+bool shbt_print_backtrace_fd(int fd) {
+  struct shbt_writer writer;
+  shbt_writer_init(&writer, fd);
+  shbt_write_backtrace(&writer, 1);  // Skip this frame.
+  return shbt_writer_finish(&writer);
+}
+
 size_t shbt_get_stack_depth() {
-  unw_context_t context;
-  unw_getcontext(&context);
-  unw_cursor_t cursor;
-  unw_init_local(&cursor, &context);
+  struct stack_walker walker;
+  stack_walker_init(&walker);
   size_t cur_frame = 0;
-  for (; unw_step(&cursor) > 0; ++cur_frame) {}
+  for (; stack_walker_step(&walker); ++cur_frame) {}
   return cur_frame;
 }
@@ -0,0 +1,187 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Binary crash records.
+ *
+ * A record is assembled in a static buffer and written with one write, so
+ * a crash costs a stack walk and a single system call, with no symbol
+ * lookups or formatting. If several threads crash at once, only the first
+ * gets the buffer; the others assemble their record on their own stack,
+ * which has room for the addresses but few modules.
+ *
+ * Modules come from the module map snapshot, so the dynamic loader is not
+ * involved and records can be written even if it was interrupted.
+ */
+
+#define _GNU_SOURCE  // For SYS_gettid.
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+// Size of the static record buffer. This fits the addresses and a few
+// hundred modules with typical path lengths.
+#define SHBT_CRASH_RECORD_BUFFER_SIZE (64 * 1024)
+
+static atomic_int crash_record_fd = -1;
+static _Alignas(8) char crash_record_buffer[SHBT_CRASH_RECORD_BUFFER_SIZE];
+static atomic_flag crash_record_buffer_busy = ATOMIC_FLAG_INIT;
+
+void shbt_set_crash_record_fd(int fd) {
+  atomic_store_explicit(&crash_record_fd, fd, memory_order_relaxed);
+}
+
+int shbt_get_crash_record_fd() {
+  return atomic_load_explicit(&crash_record_fd, memory_order_relaxed);
+}
+
+// Append entries for the modules in a snapshot, as far as they fit.
+// Returns false if some did not fit.
+static bool crash_record_add_modules(const struct shbt_module_map* map,
+                                     char* buf, size_t size, size_t* len,
+                                     uint32_t* num_modules) {
+  bool complete = !map->truncated;
+  for (size_t i = 0; i < map->num_modules; ++i) {
+    const struct shbt_module* mod = &map->modules[i];
+    size_t path_size = strlen(mod->path) + 1;
+    if (path_size > UINT16_MAX) {
+      path_size = UINT16_MAX;
+    }
+    size_t entry_size = (sizeof(shbt_crash_record_module_t) + path_size + 7) &
+      ~(size_t) 7;
+    if (*len + entry_size > size) {
+      complete = false;
+      continue;
+    }
+    shbt_crash_record_module_t module;
+    memset(&module, 0, sizeof(module));
+    module.load_base = mod->load_base;
+    module.start = mod->start;
+    module.end = mod->end;
+    module.entry_size = (uint32_t) entry_size;
+    module.path_size = (uint16_t) path_size;
+    module.build_id_size = (uint16_t) mod->build_id_size;
+    memcpy(module.build_id, mod->build_id, mod->build_id_size);
+    char* entry = buf + *len;
+    memcpy(entry, &module, sizeof(module));
+    memcpy(entry + sizeof(module), mod->path, path_size - 1);
+    memset(entry + sizeof(module) + path_size - 1, 0,
+           entry_size - sizeof(module) - path_size + 1);
+    *len += entry_size;
+    ++*num_modules;
+  }
+  return complete;
+}
+
+// Whether si_addr is set for a signal raised by the kernel.
+static bool crash_record_has_fault_addr(int sig_num) {
+  switch (sig_num) {
+#ifdef SIGILL
+  case SIGILL:
+#endif
+#ifdef SIGFPE
+  case SIGFPE:
+#endif
+#ifdef SIGSEGV
+  case SIGSEGV:
+#endif
+#ifdef SIGBUS
+  case SIGBUS:
+#endif
+#ifdef SIGTRAP
+  case SIGTRAP:
+#endif
+    return true;
+  default:
+    return false;
+  }
+}
+
+bool shbt_write_crash_record(int fd, int sig_num, siginfo_t* info,
+                             const void* ucontext, int mpi_rank) {
+  void* pcs[SHBT_CRASH_RECORD_MAX_PCS];
+  size_t num_pcs = shbt_collect_signal_addresses(ucontext, pcs,
+                                                 SHBT_CRASH_RECORD_MAX_PCS);
+  // Fallback buffer, sized for the header and addresses.
+  uint64_t local_buffer[(sizeof(shbt_crash_record_header_t) +
+                         SHBT_CRASH_RECORD_MAX_PCS * sizeof(uint64_t)) /
+                        sizeof(uint64_t)];
+  bool have_static = !atomic_flag_test_and_set_explicit(
+    &crash_record_buffer_busy, memory_order_acquire);
+  char* buf = have_static ? crash_record_buffer : (char*) local_buffer;
+  size_t size = have_static ? sizeof(crash_record_buffer) :
+    sizeof(local_buffer);
+
+  shbt_crash_record_header_t header;
+  memset(&header, 0, sizeof(header));
+  header.magic = SHBT_CRASH_RECORD_MAGIC;
+  header.version = SHBT_CRASH_RECORD_VERSION;
+  header.header_size = sizeof(header);
+  header.sig_num = sig_num;
+  header.pid = (int32_t) getpid();
+#ifdef __linux__
+  header.tid = (int32_t) syscall(SYS_gettid);
+#endif
+  header.mpi_rank = mpi_rank;
+  if (info != NULL) {
+    header.sig_code = info->si_code;
+    header.sig_errno = info->si_errno;
+    // The sender and the faulting address share storage in siginfo_t, so
+    // only record whichever the signal actually has.
+    if (info->si_code <= 0) {
+      header.sender_pid = (int32_t) info->si_pid;
+      header.sender_uid = (int32_t) info->si_uid;
+    } else if (crash_record_has_fault_addr(sig_num)) {
+      header.fault_addr = (uint64_t) (uintptr_t) info->si_addr;
+    }
+  }
+  struct timespec now;
+  if (clock_gettime(CLOCK_REALTIME, &now) == 0) {
+    header.time_ns = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  }
+  header.num_pcs = (uint32_t) num_pcs;
+  size_t len = sizeof(header);
+  for (size_t i = 0; i < num_pcs; ++i) {
+    uint64_t pc = (uint64_t) (uintptr_t) pcs[i];
+    memcpy(buf + len, &pc, sizeof(pc));
+    len += sizeof(pc);
+  }
+  const struct shbt_module_map* map = shbt_module_map_acquire();
+  if (map == NULL ||
+      !crash_record_add_modules(map, buf, size, &len, &header.num_modules)) {
+    header.flags |= SHBT_CRASH_RECORD_TRUNCATED;
+  }
+  shbt_module_map_release(map);
+  header.record_size = (uint32_t) len;
+  memcpy(buf, &header, sizeof(header));
+  struct iovec iov;
+  iov.iov_base = buf;
+  iov.iov_len = len;
+  bool ok = shbt_safe_writev(fd, &iov, 1);
+  if (have_static) {
+    atomic_flag_clear_explicit(&crash_record_buffer_busy,
+                               memory_order_release);
+  }
+  return ok;
+}
@@ -0,0 +1,271 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Unwinding with frame pointers.
+ *
+ * When code keeps frame pointers (-fno-omit-frame-pointer), each frame
+ * records where its caller's frame is, so the stack can be walked by
+ * following those links instead of interpreting DWARF unwind information.
+ * On x86-64, %rbp points at the saved %rbp of the caller, followed by the
+ * return address. On POWER, the stack pointer points at a back chain to the
+ * caller's frame, which holds the saved link register 16 bytes in.
+ *
+ * A corrupted stack could make those links point anywhere, so every word
+ * is only read if it lies within the stack the frame is on, and frames must
+ * move strictly toward the base of the stack. The bounds of each thread's
+ * stack are recorded ahead of time (when SHBT is loaded, when threads start
+ * or install a signal stack, and when they are profiled), since finding them
+ * is not safe in a signal handler; threads without recorded bounds are left
+ * to libunwind.
+ *
+ * A signal handler's frames may be on an alternate signal stack. On x86-64,
+ * the handler returns into a trampoline that the kernel placed just below
+ * the interrupted context, so the walk continues from the registers saved
+ * there.
+ */
+
+#define _GNU_SOURCE  // For pthread_getattr_np and REG_RIP.
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <ucontext.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+// The unwind table unwinder also uses the stack bounds.
+#if (defined(SHBT_USE_FRAME_POINTER_UNWINDER) || \
+     defined(SHBT_USE_UNWIND_TABLE_UNWINDER)) && defined(__linux__) && \
+  (defined(__x86_64__) || defined(__powerpc64__))
+
+// Bounds of the calling thread's stack, or 0 if not known.
+static _Thread_local uintptr_t thread_stack_low = 0;
+static _Thread_local uintptr_t thread_stack_high = 0;
+
+#ifdef __x86_64__
+// Where signal handlers return to, or 0 if not known.
+static atomic_uintptr_t signal_restorer = 0;
+#endif
+
+// Whether size bytes at addr are aligned and within the cursor's stack.
+static bool frame_in_bounds(const struct shbt_frame_pointer_cursor* cursor,
+                            uintptr_t addr, size_t size) {
+  return addr % sizeof(uintptr_t) == 0 && addr >= cursor->stack_low &&
+         addr < cursor->stack_high && cursor->stack_high - addr >= size;
+}
+
+// Switch to whichever known stack sp is on. Returns false if none.
+static bool frame_switch_stack(struct shbt_frame_pointer_cursor* cursor,
+                               uintptr_t sp) {
+  if (sp >= cursor->thread_low && sp < cursor->thread_high) {
+    cursor->stack_high = cursor->thread_high;
+  } else if (sp >= cursor->alt_low && sp < cursor->alt_high) {
+    cursor->stack_high = cursor->alt_high;
+  } else {
+    return false;
+  }
+  // Nothing below the stack pointer is part of a frame.
+  cursor->stack_low = sp;
+  return true;
+}
+
+bool shbt_frame_pointer_init(struct shbt_frame_pointer_cursor* cursor,
+                             void* frame) {
+  if (thread_stack_high == 0) {
+    return false;
+  }
+  cursor->pc = 0;
+  cursor->is_signal_frame = false;
+  cursor->frame = (uintptr_t) frame;
+  cursor->thread_low = thread_stack_low;
+  cursor->thread_high = thread_stack_high;
+  cursor->alt_low = 0;
+  cursor->alt_high = 0;
+  cursor->signal_context = NULL;
+  // Handlers may be running on an alternate signal stack.
+  stack_t alt_stack;
+  if (sigaltstack(NULL, &alt_stack) == 0 &&
+      (alt_stack.ss_flags & SS_ONSTACK)) {
+    cursor->alt_low = (uintptr_t) alt_stack.ss_sp;
+    cursor->alt_high = cursor->alt_low + alt_stack.ss_size;
+  }
+  return frame_switch_stack(cursor, cursor->frame);
+}
+
+#ifdef __x86_64__
+
+// Step out of a signal trampoline to the interrupted instruction.
+static bool frame_step_signal(struct shbt_frame_pointer_cursor* cursor) {
+  const ucontext_t* context = (const ucontext_t*) cursor->signal_context;
+  cursor->signal_context = NULL;
+  uintptr_t pc = (uintptr_t) context->uc_mcontext.gregs[REG_RIP];
+  uintptr_t sp = (uintptr_t) context->uc_mcontext.gregs[REG_RSP];
+  uintptr_t frame = (uintptr_t) context->uc_mcontext.gregs[REG_RBP];
+  // After a stack overflow, the stack pointer is past the end of the stack,
+  // but the frame may still be on it.
+  if (pc == 0 || (!frame_switch_stack(cursor, sp) &&
+                  !frame_switch_stack(cursor, frame))) {
+    return false;
+  }
+  cursor->pc = pc;
+  cursor->is_signal_frame = true;
+  // The interrupted function may not have set up its frame yet, in which
+  // case this is its caller's frame, and the next step skips a frame.
+  cursor->frame = frame_in_bounds(cursor, frame, 2 * sizeof(uintptr_t)) ?
+    frame : 0;
+  return true;
+}
+
+bool shbt_frame_pointer_init_context(struct shbt_frame_pointer_cursor* cursor,
+                                     const void* context) {
+  // Start from the handler's stack, and step straight to the interrupted
+  // context as if leaving its trampoline.
+  if (!shbt_frame_pointer_init(cursor, __builtin_frame_address(0))) {
+    return false;
+  }
+  cursor->signal_context = context;
+  return true;
+}
+
+bool shbt_frame_pointer_step(struct shbt_frame_pointer_cursor* cursor) {
+  if (cursor->signal_context != NULL) {
+    return frame_step_signal(cursor);
+  }
+  uintptr_t frame = cursor->frame;
+  if (frame == 0 || !frame_in_bounds(cursor, frame, 2 * sizeof(uintptr_t))) {
+    return false;
+  }
+  uintptr_t next_frame = ((const uintptr_t*) frame)[0];
+  uintptr_t pc = ((const uintptr_t*) frame)[1];
+  if (pc == 0) {
+    return false;
+  }
+  cursor->pc = pc;
+  cursor->is_signal_frame = false;
+  uintptr_t restorer = atomic_load_explicit(&signal_restorer,
+                                            memory_order_relaxed);
+  if (restorer != 0 && pc == restorer) {
+    // The kernel put the return address, then the interrupted context, at
+    // the top of the handler's stack.
+    uintptr_t context = frame + 2 * sizeof(uintptr_t);
+    if (frame_in_bounds(cursor, context, sizeof(ucontext_t))) {
+      cursor->signal_context = (const void*) context;
+      cursor->frame = 0;
+      return true;
+    }
+  }
+  // Frames must move toward the base of the stack.
+  cursor->frame = next_frame > frame ? next_frame : 0;
+  return true;
+}
+
+#else  // __powerpc64__
+
+bool shbt_frame_pointer_init_context(struct shbt_frame_pointer_cursor* cursor,
+                                     const void* context) {
+  // The interrupted registers are not read on POWER, so libunwind is used.
+  (void) cursor;
+  (void) context;
+  return false;
+}
+
+bool shbt_frame_pointer_step(struct shbt_frame_pointer_cursor* cursor) {
+  uintptr_t frame = cursor->frame;
+  if (frame == 0 || !frame_in_bounds(cursor, frame, sizeof(uintptr_t))) {
+    return false;
+  }
+  // The caller's frame holds the link register saved by the callee.
+  uintptr_t next_frame = ((const uintptr_t*) frame)[0];
+  if (next_frame <= frame ||
+      !frame_in_bounds(cursor, next_frame, 3 * sizeof(uintptr_t))) {
+    return false;
+  }
+  uintptr_t pc = ((const uintptr_t*) next_frame)[2];
+  if (pc == 0) {
+    return false;
+  }
+  cursor->pc = pc;
+  cursor->is_signal_frame = false;
+  cursor->frame = next_frame;
+  return true;
+}
+
+#endif  // __x86_64__
+
+void shbt_frame_pointer_register_thread() {
+  pthread_attr_t attr;
+  if (pthread_getattr_np(pthread_self(), &attr) != 0) {
+    return;
+  }
+  void* stack_addr;
+  size_t stack_size;
+  if (pthread_attr_getstack(&attr, &stack_addr, &stack_size) == 0) {
+    thread_stack_low = (uintptr_t) stack_addr;
+    thread_stack_high = (uintptr_t) stack_addr + stack_size;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+// The thread that loads SHBT (usually the main thread) may never register
+// itself otherwise.
+__attribute__((constructor)) static void frame_pointer_register_loader() {
+  shbt_frame_pointer_register_thread();
+}
+
+void shbt_frame_pointer_note_handler(int sig_num) {
+#ifdef __x86_64__
+  // Handlers installed through the C library all return to its restorer.
+  struct sigaction sa;
+  if (sigaction(sig_num, NULL, &sa) == 0 && sa.sa_restorer != NULL) {
+    atomic_store_explicit(&signal_restorer, (uintptr_t) sa.sa_restorer,
+                          memory_order_relaxed);
+  }
+#else
+  (void) sig_num;
+#endif
+}
+
+#else  // SHBT_USE_FRAME_POINTER_UNWINDER, etc.
+
+// Frame pointers and stack bounds are not used, so libunwind always is.
+
+bool shbt_frame_pointer_init(struct shbt_frame_pointer_cursor* cursor,
+                             void* frame) {
+  (void) cursor;
+  (void) frame;
+  return false;
+}
+
+bool shbt_frame_pointer_init_context(struct shbt_frame_pointer_cursor* cursor,
+                                     const void* context) {
+  (void) cursor;
+  (void) context;
+  return false;
+}
+
+bool shbt_frame_pointer_step(struct shbt_frame_pointer_cursor* cursor) {
+  (void) cursor;
+  return false;
+}
+
+void shbt_frame_pointer_register_thread() {}
+
+void shbt_frame_pointer_note_handler(int sig_num) {
+  (void) sig_num;
+}
+
+#endif  // SHBT_USE_FRAME_POINTER_UNWINDER, etc.
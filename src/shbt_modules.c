@@ -0,0 +1,359 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Snapshots of the loaded modules.
+ *
+ * Finding modules with dl_iterate_phdr takes the dynamic loader's lock,
+ * so it cannot be done in a signal handler. Instead, the module list is
+ * copied into a static snapshot ahead of time (when a handler is
+ * registered, and again whenever the loaded modules change), which
+ * handlers read without locking or allocating.
+ *
+ * Changes are noticed by the C library's counts of modules ever loaded
+ * and unloaded (dlpi_adds and dlpi_subs), which SHBT checks from its own
+ * threads and entry points that are not used in signal handlers, or
+ * immediately by wrapping dlopen and dlclose (with SHBT_HOOK_DLOPEN).
+ * Everything else derived from the loaded modules (the symbol index,
+ * symbol cache and unwind tables) is refreshed along with the snapshot.
+ *
+ * There are two snapshots: a new one is built in whichever is not current
+ * and then published. Readers count themselves in and out of a snapshot, so
+ * it is not rebuilt while a handler is still reading it.
+ */
+
+#define _GNU_SOURCE  // For dl_iterate_phdr and RTLD_NEXT.
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+#ifdef __linux__
+
+#include <link.h>
+
+#ifdef SHBT_HOOK_DLOPEN
+#include <dlfcn.h>
+#endif
+
+static struct shbt_module_map module_maps[2];
+// Index of the current snapshot, or -1 if none has been taken.
+static atomic_int module_map_current = -1;
+static atomic_int module_map_readers[2];
+static pthread_mutex_t module_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+// The C library's counts of modules loaded and unloaded as of the last
+// update, or 0 if there has been none.
+static _Atomic unsigned long long modules_seen_adds = 0;
+static _Atomic unsigned long long modules_seen_subs = 0;
+
+/** Counts of modules ever loaded and unloaded. */
+struct module_counts {
+  unsigned long long adds;
+  unsigned long long subs;
+  /** Whether the C library provides the counts. */
+  bool known;
+};
+
+// Read the counts, which every module reports the same.
+static int module_counts_get(struct dl_phdr_info* info, size_t size,
+                             void* arg) {
+  struct module_counts* counts = (struct module_counts*) arg;
+  if (size >= offsetof(struct dl_phdr_info, dlpi_subs) +
+              sizeof(info->dlpi_subs)) {
+    counts->adds = info->dlpi_adds;
+    counts->subs = info->dlpi_subs;
+    counts->known = true;
+  }
+  return 1;  // Stop after the first module.
+}
+
+static struct module_counts module_counts_read() {
+  struct module_counts counts = {0, 0, false};
+  dl_iterate_phdr(module_counts_get, &counts);
+  return counts;
+}
+
+// Copy the GNU build ID of a loaded object, returning its length (or 0).
+static size_t module_build_id(struct dl_phdr_info* info, uint8_t* out) {
+  for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_NOTE) {
+      continue;
+    }
+    const char* note = (const char*) (info->dlpi_addr + phdr->p_vaddr);
+    const char* end = note + phdr->p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr)* nhdr = (const ElfW(Nhdr)*) note;
+      const char* name = note + sizeof(ElfW(Nhdr));
+      const uint8_t* desc =
+        (const uint8_t*) name + ((nhdr->n_namesz + 3) & ~3u);
+      note = (const char*) desc + ((nhdr->n_descsz + 3) & ~3u);
+      if (note > end) {
+        break;
+      }
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0 &&
+          nhdr->n_descsz <= SHBT_CRASH_RECORD_MAX_BUILD_ID) {
+        memcpy(out, desc, nhdr->n_descsz);
+        return nhdr->n_descsz;
+      }
+    }
+  }
+  return 0;
+}
+
+// Add one loaded object to the snapshot being built.
+static int module_map_add(struct dl_phdr_info* info, size_t size, void* arg) {
+  (void) size;
+  struct shbt_module_map* map = (struct shbt_module_map*) arg;
+  uintptr_t start = UINTPTR_MAX, end = 0;
+  for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_LOAD) {
+      continue;
+    }
+    uintptr_t seg_start = info->dlpi_addr + phdr->p_vaddr;
+    if (seg_start < start) {
+      start = seg_start;
+    }
+    if (seg_start + phdr->p_memsz > end) {
+      end = seg_start + phdr->p_memsz;
+    }
+  }
+  if (start == UINTPTR_MAX) {
+    return 0;  // Nothing loaded.
+  }
+  // The executable is listed without a name.
+  char exe_path[1024];
+  const char* path = info->dlpi_name;
+  if (path == NULL || path[0] == '\0') {
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[len > 0 ? len : 0] = '\0';
+    path = exe_path;
+  }
+  size_t path_size = strlen(path) + 1;
+  if (map->num_modules == SHBT_MAX_MODULES ||
+      path_size > sizeof(map->paths) - map->paths_used) {
+    map->truncated = true;
+    return 0;
+  }
+  struct shbt_module* module = &map->modules[map->num_modules++];
+  char* module_path = map->paths + map->paths_used;
+  memcpy(module_path, path, path_size);
+  map->paths_used += path_size;
+  module->start = start;
+  module->end = end;
+  module->load_base = info->dlpi_addr;
+  module->path = module_path;
+  const char* slash = strrchr(module_path, '/');
+  module->name = slash != NULL ? slash + 1 : module_path;
+  module->build_id_size = module_build_id(info, module->build_id);
+  return 0;
+}
+
+static int compare_modules(const void* a, const void* b) {
+  const struct shbt_module* x = (const struct shbt_module*) a;
+  const struct shbt_module* y = (const struct shbt_module*) b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Take a new snapshot of the loaded modules.
+static bool module_map_rebuild() {
+  pthread_mutex_lock(&module_map_mutex);
+  int current = atomic_load(&module_map_current);
+  int next = current == 0 ? 1 : 0;
+  // Wait out any handler still reading the snapshot from two updates ago.
+  while (atomic_load(&module_map_readers[next]) != 0) {
+    struct timespec delay = {0, 1000000};
+    nanosleep(&delay, NULL);
+  }
+  struct shbt_module_map* map = &module_maps[next];
+  map->num_modules = 0;
+  map->paths_used = 0;
+  map->truncated = false;
+  dl_iterate_phdr(module_map_add, map);
+  qsort(map->modules, map->num_modules, sizeof(struct shbt_module),
+        &compare_modules);
+  atomic_store(&module_map_current, next);
+  pthread_mutex_unlock(&module_map_mutex);
+  return !map->truncated;
+}
+
+// Note the counts the current modules were seen with. This is done before
+// updating, so a change during the update is noticed by the next check.
+// Returns whether any module may have been unloaded since the last note.
+static bool module_counts_note(const struct module_counts* counts) {
+  atomic_store(&modules_seen_adds, counts->adds);
+  unsigned long long seen_subs = atomic_exchange(&modules_seen_subs,
+                                                 counts->subs);
+  return !counts->known || counts->subs != seen_subs;
+}
+
+// Refresh what else is derived from the loaded modules, where it is used.
+static void modules_refresh_derived(bool unloaded) {
+  shbt_update_symbol_index();
+  // Newly loaded modules only cover addresses that had no names, so cached
+  // names only go stale when a module is unloaded. They may be cached from
+  // the old index, so flush after rebuilding it.
+  if (unloaded) {
+    shbt_symbol_cache_flush();
+  }
+  shbt_update_unwind_table();
+}
+
+bool shbt_update_module_map() {
+  struct module_counts counts = module_counts_read();
+  bool unloaded = module_counts_note(&counts);
+  bool ok = module_map_rebuild();
+  modules_refresh_derived(unloaded);
+  return ok;
+}
+
+void shbt_enable_module_map() {
+  if (atomic_load(&module_map_current) < 0) {
+    shbt_update_module_map();
+  }
+}
+
+void shbt_check_modules() {
+  struct module_counts counts = module_counts_read();
+  if (!counts.known) {
+    return;
+  }
+  if (counts.adds == atomic_load(&modules_seen_adds) &&
+      counts.subs == atomic_load(&modules_seen_subs)) {
+    return;
+  }
+  bool unloaded = module_counts_note(&counts);
+  // Only update the snapshot once one has been taken.
+  if (atomic_load(&module_map_current) >= 0) {
+    module_map_rebuild();
+  }
+  modules_refresh_derived(unloaded);
+}
+
+const struct shbt_module_map* shbt_module_map_acquire() {
+  for (;;) {
+    int current = atomic_load(&module_map_current);
+    if (current < 0) {
+      return NULL;
+    }
+    atomic_fetch_add(&module_map_readers[current], 1);
+    // If an update published the other snapshot in the meantime, this one
+    // may be about to be rebuilt, so switch.
+    if (atomic_load(&module_map_current) == current) {
+      return &module_maps[current];
+    }
+    atomic_fetch_sub(&module_map_readers[current], 1);
+  }
+}
+
+void shbt_module_map_release(const struct shbt_module_map* map) {
+  if (map != NULL) {
+    atomic_fetch_sub(&module_map_readers[map - module_maps], 1);
+  }
+}
+
+#ifdef SHBT_HOOK_DLOPEN
+
+// Wrap dlopen and dlclose so the snapshot follows changes to the loaded
+// modules as soon as they happen, once it has been taken.
+
+typedef void* (*dlopen_fn)(const char*, int);
+typedef int (*dlclose_fn)(void*);
+
+static pthread_once_t module_hook_once = PTHREAD_ONCE_INIT;
+static dlopen_fn real_dlopen = NULL;
+static dlclose_fn real_dlclose = NULL;
+
+static void module_hook_init() {
+  real_dlopen = (dlopen_fn) dlsym(RTLD_NEXT, "dlopen");
+  real_dlclose = (dlclose_fn) dlsym(RTLD_NEXT, "dlclose");
+}
+
+void* dlopen(const char* filename, int flags) {
+  pthread_once(&module_hook_once, &module_hook_init);
+  if (real_dlopen == NULL) {
+    return NULL;
+  }
+  void* handle = real_dlopen(filename, flags);
+  if (handle != NULL) {
+    shbt_check_modules();
+  }
+  return handle;
+}
+
+int dlclose(void* handle) {
+  pthread_once(&module_hook_once, &module_hook_init);
+  if (real_dlclose == NULL) {
+    return -1;
+  }
+  int err = real_dlclose(handle);
+  if (err == 0) {
+    shbt_check_modules();
+  }
+  return err;
+}
+
+#endif  // SHBT_HOOK_DLOPEN
+
+#else  // __linux__
+
+// Snapshots need dl_iterate_phdr and ELF, so there are never any modules
+// elsewhere, and addresses are reported as-is.
+
+bool shbt_update_module_map() {
+  return false;
+}
+
+void shbt_enable_module_map() {}
+
+void shbt_check_modules() {}
+
+const struct shbt_module_map* shbt_module_map_acquire() {
+  return NULL;
+}
+
+void shbt_module_map_release(const struct shbt_module_map* map) {
+  (void) map;
+}
+
+#endif  // __linux__
+
+const struct shbt_module* shbt_module_map_find(
+  const struct shbt_module_map* map, uintptr_t addr) {
+  if (map == NULL) {
+    return NULL;
+  }
+  size_t lo = 0, hi = map->num_modules;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (map->modules[mid].start <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || addr >= map->modules[lo - 1].end) {
+    return NULL;
+  }
+  return &map->modules[lo - 1];
+}
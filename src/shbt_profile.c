@@ -0,0 +1,676 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Export of profiler data in various formats.
+ */
+
+#define _GNU_SOURCE  // For dl_iterate_phdr.
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <link.h>
+#endif
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+/** State for symbolizing stacks during an export. */
+struct profile_symbolizer {
+  /**
+   * Addresses that were symbolized: the interrupted instruction, then
+   * return addresses.
+   */
+  void* const* pcs;
+  /** Symbolized frames. */
+  shbt_frame_t frames[SHBT_PROFILER_MAX_FRAMES];
+  /** Buffer for demangling. */
+  char demangled[1024];
+};
+
+// Symbolize a sampled stack into symbolizer->frames.
+// Returns the number of frames.
+static size_t profile_symbolize(struct profile_symbolizer* symbolizer,
+                                void* const pcs[], size_t num_pcs) {
+  if (num_pcs > SHBT_PROFILER_MAX_FRAMES) {
+    num_pcs = SHBT_PROFILER_MAX_FRAMES;
+  }
+  symbolizer->pcs = pcs;
+  shbt_symbolize_ex(pcs, num_pcs, symbolizer->frames, true);
+  return num_pcs;
+}
+
+// Return the name to report for a symbolized frame.
+static const char* profile_frame_name(struct profile_symbolizer* symbolizer,
+                                      size_t frame) {
+  const char* symbol = symbolizer->frames[frame].symbol;
+  const char* demangled = shbt_symbol_cache_demangle(
+    (uintptr_t) symbolizer->pcs[frame], symbol, symbolizer->demangled,
+    sizeof(symbolizer->demangled));
+  return demangled != NULL ? demangled : symbol;
+}
+
+/** State for writing a folded profile. */
+struct folded_state {
+  struct shbt_writer writer;
+  struct profile_symbolizer symbolizer;
+};
+
+static void write_folded_stack(uint32_t id, void* const pcs[], size_t num_pcs,
+                               uint64_t count, void* arg) {
+  (void) id;
+  struct folded_state* state = (struct folded_state*) arg;
+  num_pcs = profile_symbolize(&state->symbolizer, pcs, num_pcs);
+  if (num_pcs == 0 || count == 0) {
+    return;
+  }
+  // Folded stacks list the outermost frame first.
+  for (size_t i = num_pcs; i-- > 0;) {
+    if (strcmp(state->symbolizer.frames[i].symbol, SHBT_UNKNOWN_SYMBOL) == 0) {
+      // Identify unknown frames by address so they are not all merged.
+      shbt_writer_puts(&state->writer, "0x");
+      shbt_writer_put_int(&state->writer, (intptr_t) pcs[i], 16, 0);
+    } else {
+      shbt_writer_puts(&state->writer,
+                       profile_frame_name(&state->symbolizer, i));
+    }
+    shbt_writer_puts(&state->writer, i > 0 ? ";" : " ");
+  }
+  shbt_writer_put_int(&state->writer, (intptr_t) count, 10, 0);
+  shbt_writer_puts(&state->writer, "\n");
+}
+
+bool shbt_profile_write_folded(int fd) {
+  const shbt_stack_table_t* stacks = shbt_profiler_stacks();
+  if (stacks == NULL) {
+    return true;  // Nothing sampled.
+  }
+  // This is too large for the stack.
+  struct folded_state* state = malloc(sizeof(struct folded_state));
+  if (state == NULL) {
+    return false;
+  }
+  shbt_writer_init(&state->writer, fd);
+  shbt_stack_table_foreach(stacks, write_folded_stack, state);
+  bool ok = shbt_writer_finish(&state->writer);
+  free(state);
+  return ok;
+}
+
+// Protobuf wire types.
+#define PB_WIRE_VARINT 0
+#define PB_WIRE_LENGTH 2
+
+// Field numbers from pprof's profile.proto.
+#define PPROF_PROFILE_SAMPLE_TYPE 1
+#define PPROF_PROFILE_SAMPLE 2
+#define PPROF_PROFILE_MAPPING 3
+#define PPROF_PROFILE_LOCATION 4
+#define PPROF_PROFILE_FUNCTION 5
+#define PPROF_PROFILE_STRING_TABLE 6
+#define PPROF_PROFILE_TIME_NANOS 9
+#define PPROF_PROFILE_DURATION_NANOS 10
+#define PPROF_PROFILE_PERIOD_TYPE 11
+#define PPROF_PROFILE_PERIOD 12
+#define PPROF_PROFILE_DEFAULT_SAMPLE_TYPE 14
+#define PPROF_VALUE_TYPE_TYPE 1
+#define PPROF_VALUE_TYPE_UNIT 2
+#define PPROF_SAMPLE_LOCATION_ID 1
+#define PPROF_SAMPLE_VALUE 2
+#define PPROF_MAPPING_ID 1
+#define PPROF_MAPPING_MEMORY_START 2
+#define PPROF_MAPPING_MEMORY_LIMIT 3
+#define PPROF_MAPPING_FILE_OFFSET 4
+#define PPROF_MAPPING_FILENAME 5
+#define PPROF_MAPPING_BUILD_ID 6
+#define PPROF_MAPPING_HAS_FUNCTIONS 7
+#define PPROF_LOCATION_ID 1
+#define PPROF_LOCATION_MAPPING_ID 2
+#define PPROF_LOCATION_ADDRESS 3
+#define PPROF_LOCATION_LINE 4
+#define PPROF_LINE_FUNCTION_ID 1
+#define PPROF_FUNCTION_ID 1
+#define PPROF_FUNCTION_NAME 2
+#define PPROF_FUNCTION_SYSTEM_NAME 3
+
+/** A growable buffer of encoded protobuf data. */
+struct pb_buffer {
+  uint8_t* data;
+  size_t size;
+  size_t capacity;
+  /** Whether an allocation has failed; later writes are dropped. */
+  bool failed;
+};
+
+static void pb_write(struct pb_buffer* buf, const void* data, size_t len) {
+  if (buf->failed) {
+    return;
+  }
+  if (buf->capacity - buf->size < len) {
+    size_t capacity = buf->capacity > 0 ? buf->capacity : 4096;
+    while (capacity - buf->size < len) {
+      capacity *= 2;
+    }
+    uint8_t* new_data = realloc(buf->data, capacity);
+    if (new_data == NULL) {
+      buf->failed = true;
+      return;
+    }
+    buf->data = new_data;
+    buf->capacity = capacity;
+  }
+  memcpy(buf->data + buf->size, data, len);
+  buf->size += len;
+}
+
+static size_t pb_varint_size(uint64_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    ++size;
+  }
+  return size;
+}
+
+static void pb_put_varint(struct pb_buffer* buf, uint64_t value) {
+  uint8_t bytes[10];
+  size_t len = 0;
+  while (value >= 0x80) {
+    bytes[len++] = (uint8_t) (value | 0x80);
+    value >>= 7;
+  }
+  bytes[len++] = (uint8_t) value;
+  pb_write(buf, bytes, len);
+}
+
+// Write an integer field. Zero is the default value, so it is omitted.
+static void pb_put_uint(struct pb_buffer* buf, int field, uint64_t value) {
+  if (value != 0) {
+    pb_put_varint(buf, (uint64_t) field << 3 | PB_WIRE_VARINT);
+    pb_put_varint(buf, value);
+  }
+}
+
+// Write a string, bytes or embedded message field.
+static void pb_put_bytes(struct pb_buffer* buf, int field, const void* data,
+                         size_t len) {
+  pb_put_varint(buf, (uint64_t) field << 3 | PB_WIRE_LENGTH);
+  pb_put_varint(buf, len);
+  pb_write(buf, data, len);
+}
+
+// Write a packed repeated integer field.
+static void pb_put_packed(struct pb_buffer* buf, int field,
+                          const uint64_t values[], size_t num_values) {
+  size_t len = 0;
+  for (size_t i = 0; i < num_values; ++i) {
+    len += pb_varint_size(values[i]);
+  }
+  pb_put_varint(buf, (uint64_t) field << 3 | PB_WIRE_LENGTH);
+  pb_put_varint(buf, len);
+  for (size_t i = 0; i < num_values; ++i) {
+    pb_put_varint(buf, values[i]);
+  }
+}
+
+/** A hash map from nonzero integer keys to nonzero IDs. */
+struct pprof_map {
+  uint64_t* keys;
+  /** IDs, or 0 if the slot is empty. */
+  uint64_t* ids;
+  size_t num_entries;
+  /** Number of slots; 0 or a power of 2. */
+  size_t num_slots;
+};
+
+static size_t pprof_map_slot(const struct pprof_map* map, uint64_t key) {
+  size_t i = (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) &
+             (map->num_slots - 1);
+  while (map->ids[i] != 0 && map->keys[i] != key) {
+    i = (i + 1) & (map->num_slots - 1);
+  }
+  return i;
+}
+
+// Return the ID for key, or 0 if there is none.
+static uint64_t pprof_map_get(const struct pprof_map* map, uint64_t key) {
+  if (map->num_slots == 0) {
+    return 0;
+  }
+  return map->ids[pprof_map_slot(map, key)];
+}
+
+// Add an ID for a key not already in the map. Returns false if out of memory.
+static bool pprof_map_put(struct pprof_map* map, uint64_t key, uint64_t id) {
+  if (2 * (map->num_entries + 1) > map->num_slots) {
+    struct pprof_map grown;
+    grown.num_slots = map->num_slots > 0 ? 2 * map->num_slots : 1024;
+    grown.num_entries = map->num_entries;
+    grown.keys = malloc(grown.num_slots * sizeof(uint64_t));
+    grown.ids = calloc(grown.num_slots, sizeof(uint64_t));
+    if (grown.keys == NULL || grown.ids == NULL) {
+      free(grown.keys);
+      free(grown.ids);
+      return false;
+    }
+    for (size_t i = 0; i < map->num_slots; ++i) {
+      if (map->ids[i] != 0) {
+        size_t slot = pprof_map_slot(&grown, map->keys[i]);
+        grown.keys[slot] = map->keys[i];
+        grown.ids[slot] = map->ids[i];
+      }
+    }
+    free(map->keys);
+    free(map->ids);
+    *map = grown;
+  }
+  size_t slot = pprof_map_slot(map, key);
+  map->keys[slot] = key;
+  map->ids[slot] = id;
+  ++map->num_entries;
+  return true;
+}
+
+/** An executable mapping of the process. */
+struct pprof_mapping {
+  uint64_t start;
+  uint64_t limit;
+  uint64_t offset;
+  /** String table indices. */
+  uint64_t filename;
+  uint64_t build_id;
+  /** Whether any location in the mapping was symbolized. */
+  bool has_functions;
+};
+
+/** State for writing a pprof profile. */
+struct pprof_state {
+  struct profile_symbolizer symbolizer;
+  /** The encoded Profile message. */
+  struct pb_buffer out;
+  /** Space for encoding embedded messages. */
+  struct pb_buffer scratch;
+  /** The string table, and a map from string hashes to chains of indices. */
+  char** strings;
+  size_t num_strings;
+  size_t max_strings;
+  struct pprof_map string_ids;
+  uint64_t* string_next;
+  /** Map from addresses to location IDs. */
+  struct pprof_map location_ids;
+  size_t num_locations;
+  /** Map from string indices of symbols to function IDs. */
+  struct pprof_map function_ids;
+  size_t num_functions;
+  /** Executable mappings, sorted by address. */
+  struct pprof_mapping* mappings;
+  size_t num_mappings;
+  size_t max_mappings;
+  /** Location IDs of the sample being written. */
+  uint64_t sample_locations[SHBT_PROFILER_MAX_FRAMES];
+  int64_t period_ns;
+  /** Whether an allocation has failed. */
+  bool failed;
+};
+
+static uint64_t pprof_hash_string(const char* str) {
+  // FNV-1a, forced to be nonzero since it is used as a map key.
+  uint64_t hash = 0xcbf29ce484222325ull;
+  for (; *str != '\0'; ++str) {
+    hash = (hash ^ (unsigned char) *str) * 0x100000001b3ull;
+  }
+  return hash | 1;
+}
+
+// Return the string table index of str, adding it if needed.
+static uint64_t pprof_string(struct pprof_state* state, const char* str) {
+  // string_ids maps a hash to the last string added with that hash, which is
+  // chained to any earlier ones with string_next. Indices are stored + 1.
+  uint64_t hash = pprof_hash_string(str);
+  uint64_t first = pprof_map_get(&state->string_ids, hash);
+  for (uint64_t id = first; id != 0; id = state->string_next[id - 1]) {
+    if (strcmp(state->strings[id - 1], str) == 0) {
+      return id - 1;
+    }
+  }
+  if (state->num_strings == state->max_strings) {
+    size_t max_strings = state->max_strings > 0 ? 2 * state->max_strings : 256;
+    char** strings = realloc(state->strings, max_strings * sizeof(char*));
+    if (strings != NULL) {
+      state->strings = strings;
+    }
+    uint64_t* next = realloc(state->string_next,
+                             max_strings * sizeof(uint64_t));
+    if (next != NULL) {
+      state->string_next = next;
+    }
+    if (strings == NULL || next == NULL) {
+      state->failed = true;
+      return 0;
+    }
+    state->max_strings = max_strings;
+  }
+  char* copy = strdup(str);
+  if (copy == NULL) {
+    state->failed = true;
+    return 0;
+  }
+  uint64_t index = state->num_strings++;
+  state->strings[index] = copy;
+  state->string_next[index] = first;
+  if (first == 0) {
+    if (!pprof_map_put(&state->string_ids, hash, index + 1)) {
+      state->failed = true;
+    }
+  } else {
+    // Make the new string the head of the chain.
+    state->string_ids.ids[pprof_map_slot(&state->string_ids, hash)] =
+      index + 1;
+  }
+  return index;
+}
+
+// Return the mapping containing addr, or NULL.
+static struct pprof_mapping* pprof_find_mapping(struct pprof_state* state,
+                                                uint64_t addr) {
+  size_t lo = 0;
+  size_t hi = state->num_mappings;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (addr < state->mappings[mid].start) {
+      hi = mid;
+    } else if (addr >= state->mappings[mid].limit) {
+      lo = mid + 1;
+    } else {
+      return &state->mappings[mid];
+    }
+  }
+  return NULL;
+}
+
+// Read the executable mappings of the process from /proc/self/maps.
+static void pprof_read_mappings(struct pprof_state* state) {
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL) {
+    return;  // Not available on this system; addresses stay unmapped.
+  }
+  char line[4096 + 128];
+  while (fgets(line, sizeof(line), maps) != NULL) {
+    size_t len = strlen(line);
+    if (len > 0 && line[len - 1] == '\n') {
+      line[--len] = '\0';
+    } else {
+      // Skip the rest of an overlong line.
+      int c;
+      while ((c = fgetc(maps)) != EOF && c != '\n') {}
+    }
+    unsigned long long start, limit, offset;
+    char perms[5];
+    int path_pos = 0;
+    if (sscanf(line, "%llx-%llx %4s %llx %*s %*s %n", &start, &limit, perms,
+               &offset, &path_pos) < 4 ||
+        strlen(perms) < 3 || perms[2] != 'x') {
+      continue;
+    }
+    if (state->num_mappings == state->max_mappings) {
+      size_t max_mappings =
+        state->max_mappings > 0 ? 2 * state->max_mappings : 64;
+      struct pprof_mapping* mappings = realloc(
+        state->mappings, max_mappings * sizeof(struct pprof_mapping));
+      if (mappings == NULL) {
+        state->failed = true;
+        break;
+      }
+      state->mappings = mappings;
+      state->max_mappings = max_mappings;
+    }
+    struct pprof_mapping* mapping = &state->mappings[state->num_mappings++];
+    mapping->start = start;
+    mapping->limit = limit;
+    mapping->offset = offset;
+    mapping->filename = pprof_string(state, path_pos > 0 ? line + path_pos
+                                                         : "");
+    mapping->build_id = 0;
+    mapping->has_functions = false;
+  }
+  fclose(maps);
+}
+
+#ifdef __linux__
+
+// Set the build ID of the mappings belonging to one loaded object.
+static int pprof_add_build_id(struct dl_phdr_info* info, size_t size,
+                              void* arg) {
+  (void) size;
+  struct pprof_state* state = (struct pprof_state*) arg;
+  char build_id[2 * 64 + 1];
+  build_id[0] = '\0';
+  for (size_t i = 0; i < info->dlpi_phnum && build_id[0] == '\0'; ++i) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_NOTE) {
+      continue;
+    }
+    const char* note = (const char*) (info->dlpi_addr + phdr->p_vaddr);
+    const char* end = note + phdr->p_memsz;
+    while (note + sizeof(ElfW(Nhdr)) <= end) {
+      const ElfW(Nhdr)* nhdr = (const ElfW(Nhdr)*) note;
+      const char* name = note + sizeof(ElfW(Nhdr));
+      const unsigned char* desc =
+        (const unsigned char*) name + ((nhdr->n_namesz + 3) & ~3u);
+      note = (const char*) desc + ((nhdr->n_descsz + 3) & ~3u);
+      if (note > end) {
+        break;
+      }
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0 && nhdr->n_descsz <= 64) {
+        static const char hex[] = "0123456789abcdef";
+        for (size_t j = 0; j < nhdr->n_descsz; ++j) {
+          build_id[2 * j] = hex[desc[j] >> 4];
+          build_id[2 * j + 1] = hex[desc[j] & 0xf];
+        }
+        build_id[2 * nhdr->n_descsz] = '\0';
+        break;
+      }
+    }
+  }
+  if (build_id[0] == '\0') {
+    return 0;
+  }
+  uint64_t build_id_ref = pprof_string(state, build_id);
+  for (size_t i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_LOAD || !(phdr->p_flags & PF_X)) {
+      continue;
+    }
+    uint64_t start = info->dlpi_addr + phdr->p_vaddr;
+    uint64_t limit = start + phdr->p_memsz;
+    for (size_t j = 0; j < state->num_mappings; ++j) {
+      if (state->mappings[j].start < limit &&
+          state->mappings[j].limit > start) {
+        state->mappings[j].build_id = build_id_ref;
+      }
+    }
+  }
+  return 0;
+}
+
+#endif  // __linux__
+
+// Add a location for frame i of the stack being written. Returns its ID.
+static uint64_t pprof_add_location(struct pprof_state* state, size_t i,
+                                   uint64_t addr) {
+  uint64_t id = ++state->num_locations;
+  if (!pprof_map_put(&state->location_ids, addr, id)) {
+    state->failed = true;
+  }
+  struct pprof_mapping* mapping = pprof_find_mapping(state, addr);
+  uint64_t function_id = 0;
+  const char* symbol = state->symbolizer.frames[i].symbol;
+  if (strcmp(symbol, SHBT_UNKNOWN_SYMBOL) != 0) {
+    uint64_t system_name = pprof_string(state, symbol);
+    function_id = pprof_map_get(&state->function_ids, system_name + 1);
+    if (function_id == 0) {
+      function_id = ++state->num_functions;
+      if (!pprof_map_put(&state->function_ids, system_name + 1,
+                         function_id)) {
+        state->failed = true;
+      }
+      uint64_t name =
+        pprof_string(state, profile_frame_name(&state->symbolizer, i));
+      state->scratch.size = 0;
+      pb_put_uint(&state->scratch, PPROF_FUNCTION_ID, function_id);
+      pb_put_uint(&state->scratch, PPROF_FUNCTION_NAME, name);
+      pb_put_uint(&state->scratch, PPROF_FUNCTION_SYSTEM_NAME, system_name);
+      pb_put_bytes(&state->out, PPROF_PROFILE_FUNCTION, state->scratch.data,
+                   state->scratch.size);
+    }
+    if (mapping != NULL) {
+      mapping->has_functions = true;
+    }
+  }
+  state->scratch.size = 0;
+  pb_put_uint(&state->scratch, PPROF_LOCATION_ID, id);
+  if (mapping != NULL) {
+    pb_put_uint(&state->scratch, PPROF_LOCATION_MAPPING_ID,
+                (uint64_t) (mapping - state->mappings) + 1);
+  }
+  pb_put_uint(&state->scratch, PPROF_LOCATION_ADDRESS, addr);
+  if (function_id != 0) {
+    // A Line message holding only the function ID.
+    pb_put_varint(&state->scratch,
+                  (uint64_t) PPROF_LOCATION_LINE << 3 | PB_WIRE_LENGTH);
+    pb_put_varint(&state->scratch, 1 + pb_varint_size(function_id));
+    pb_put_uint(&state->scratch, PPROF_LINE_FUNCTION_ID, function_id);
+  }
+  pb_put_bytes(&state->out, PPROF_PROFILE_LOCATION, state->scratch.data,
+               state->scratch.size);
+  return id;
+}
+
+static void write_pprof_stack(uint32_t id, void* const pcs[], size_t num_pcs,
+                              uint64_t count, void* arg) {
+  (void) id;
+  struct pprof_state* state = (struct pprof_state*) arg;
+  num_pcs = profile_symbolize(&state->symbolizer, pcs, num_pcs);
+  if (num_pcs == 0 || count == 0) {
+    return;
+  }
+  for (size_t i = 0; i < num_pcs; ++i) {
+    // Use the address that was looked up: the interrupted instruction for
+    // the first frame, and inside the call instruction for the rest.
+    uint64_t addr = (uintptr_t) pcs[i] - (i > 0 ? 1 : 0);
+    uint64_t location_id = pprof_map_get(&state->location_ids, addr);
+    if (location_id == 0) {
+      location_id = pprof_add_location(state, i, addr);
+    }
+    state->sample_locations[i] = location_id;
+  }
+  uint64_t values[2] = {count, count * (uint64_t) state->period_ns};
+  state->scratch.size = 0;
+  pb_put_packed(&state->scratch, PPROF_SAMPLE_LOCATION_ID,
+                state->sample_locations, num_pcs);
+  pb_put_packed(&state->scratch, PPROF_SAMPLE_VALUE, values, 2);
+  pb_put_bytes(&state->out, PPROF_PROFILE_SAMPLE, state->scratch.data,
+               state->scratch.size);
+}
+
+// Write a ValueType message for the given type and unit.
+static void pprof_put_value_type(struct pprof_state* state, int field,
+                                 uint64_t type, uint64_t unit) {
+  state->scratch.size = 0;
+  pb_put_uint(&state->scratch, PPROF_VALUE_TYPE_TYPE, type);
+  pb_put_uint(&state->scratch, PPROF_VALUE_TYPE_UNIT, unit);
+  pb_put_bytes(&state->out, field, state->scratch.data, state->scratch.size);
+}
+
+bool shbt_profile_write_pprof(int fd) {
+  struct pprof_state* state = calloc(1, sizeof(struct pprof_state));
+  if (state == NULL) {
+    return false;
+  }
+  struct shbt_profiler_run run;
+  if (!shbt_profiler_get_run(&run)) {
+    memset(&run, 0, sizeof(run));
+  }
+  state->period_ns = run.period_ns;
+  pprof_string(state, "");  // The first string must be empty.
+  uint64_t samples = pprof_string(state, "samples");
+  uint64_t count = pprof_string(state, "count");
+  uint64_t time_type = pprof_string(state, run.wall ? "wall" : "cpu");
+  uint64_t nanoseconds = pprof_string(state, "nanoseconds");
+  pprof_put_value_type(state, PPROF_PROFILE_SAMPLE_TYPE, samples, count);
+  pprof_put_value_type(state, PPROF_PROFILE_SAMPLE_TYPE, time_type,
+                       nanoseconds);
+  pprof_read_mappings(state);
+#ifdef __linux__
+  dl_iterate_phdr(pprof_add_build_id, state);
+#endif
+  const shbt_stack_table_t* stacks = shbt_profiler_stacks();
+  if (stacks != NULL) {
+    shbt_stack_table_foreach(stacks, write_pprof_stack, state);
+  }
+  for (size_t i = 0; i < state->num_mappings; ++i) {
+    const struct pprof_mapping* mapping = &state->mappings[i];
+    state->scratch.size = 0;
+    pb_put_uint(&state->scratch, PPROF_MAPPING_ID, i + 1);
+    pb_put_uint(&state->scratch, PPROF_MAPPING_MEMORY_START, mapping->start);
+    pb_put_uint(&state->scratch, PPROF_MAPPING_MEMORY_LIMIT, mapping->limit);
+    pb_put_uint(&state->scratch, PPROF_MAPPING_FILE_OFFSET, mapping->offset);
+    pb_put_uint(&state->scratch, PPROF_MAPPING_FILENAME, mapping->filename);
+    pb_put_uint(&state->scratch, PPROF_MAPPING_BUILD_ID, mapping->build_id);
+    pb_put_uint(&state->scratch, PPROF_MAPPING_HAS_FUNCTIONS,
+                mapping->has_functions);
+    pb_put_bytes(&state->out, PPROF_PROFILE_MAPPING, state->scratch.data,
+                 state->scratch.size);
+  }
+  for (size_t i = 0; i < state->num_strings; ++i) {
+    pb_put_bytes(&state->out, PPROF_PROFILE_STRING_TABLE, state->strings[i],
+                 strlen(state->strings[i]));
+  }
+  pb_put_uint(&state->out, PPROF_PROFILE_TIME_NANOS, (uint64_t) run.start_ns);
+  pb_put_uint(&state->out, PPROF_PROFILE_DURATION_NANOS,
+              (uint64_t) run.duration_ns);
+  pprof_put_value_type(state, PPROF_PROFILE_PERIOD_TYPE, time_type,
+                       nanoseconds);
+  pb_put_uint(&state->out, PPROF_PROFILE_PERIOD, (uint64_t) run.period_ns);
+  pb_put_uint(&state->out, PPROF_PROFILE_DEFAULT_SAMPLE_TYPE, time_type);
+  bool ok = !state->failed && !state->out.failed && !state->scratch.failed;
+  if (ok) {
+    struct iovec iov;
+    iov.iov_base = state->out.data;
+    iov.iov_len = state->out.size;
+    ok = shbt_safe_writev(fd, &iov, 1);
+  }
+  for (size_t i = 0; i < state->num_strings; ++i) {
+    free(state->strings[i]);
+  }
+  free(state->strings);
+  free(state->string_next);
+  free(state->string_ids.keys);
+  free(state->string_ids.ids);
+  free(state->location_ids.keys);
+  free(state->location_ids.ids);
+  free(state->function_ids.keys);
+  free(state->function_ids.ids);
+  free(state->mappings);
+  free(state->out.data);
+  free(state->scratch.data);
+  free(state);
+  return ok;
+}
@@ -0,0 +1,648 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Sampling profiler.
+ *
+ * Each sampled thread gets a slot with a ring buffer of words. A signal
+ * handler running on the thread unwinds its stack, interns it in the
+ * profiler's stack table, and appends a record of
+ * (number of frames, tid, state, stack ID) to the ring. Only if the stack
+ * table is full are the addresses themselves appended. Readers consume
+ * records from the other end. Ring buffers are allocated when slots are
+ * first used and are never freed, so a late signal can never see a freed
+ * buffer.
+ *
+ * In CPU mode, each slot has a CPU-time timer that delivers SIGPROF to its
+ * thread, passing the slot in si_value. A timer whose thread has exited reads
+ * as disarmed, which is how those slots are found and reclaimed, even if the
+ * thread's ID has since been reused.
+ *
+ * In wall-clock mode, a sampler thread periodically lists the process's
+ * threads in /proc, reads each thread's state, and queues a real-time
+ * signal to it. The signal's value carries the slot index and the state.
+ * Slots of threads that have exited are reclaimed by the sampler.
+ */
+
+#define _GNU_SOURCE  // For SIGEV_THREAD_ID.
+#include <stdint.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+#ifdef __linux__
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Maximum number of threads that can be sampled.
+#define SHBT_PROFILER_MAX_THREADS 256
+// Size of each thread's ring buffer, in words. Must be a power of 2.
+#define SHBT_PROFILER_RING_WORDS (16 * 1024)
+// Number of words in a record before the addresses.
+#define SHBT_PROFILER_RECORD_HEADER 4
+// Capacity of the profiler's stack table.
+#define SHBT_PROFILER_MAX_STACKS (64 * 1024)
+#define SHBT_PROFILER_MAX_STACK_PCS (1024 * 1024)
+// Signal used to request samples in wall-clock mode.
+#define SHBT_PROFILER_WALL_SIGNAL (SIGRTMAX - 4)
+
+// Older C libraries do not name the thread ID field.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/** Profiler state for one thread. */
+struct profiler_thread {
+  /** Thread ID, or 0 if the slot is free. */
+  pid_t tid;
+  /** Timer sampling the thread (CPU mode only). */
+  timer_t timer;
+  /** Whether the thread was found in the last scan (wall-clock mode only). */
+  bool seen;
+  /** Ring buffer of sample records. */
+  uintptr_t* ring;
+  /** Total number of words written to the ring. */
+  atomic_size_t head;
+  /** Total number of words read from the ring. */
+  atomic_size_t tail;
+  /** Set while a sample is being written. */
+  atomic_flag writing;
+};
+
+enum profiler_mode {
+  PROFILER_STOPPED,
+  PROFILER_CPU,
+  PROFILER_WALL
+};
+
+static struct profiler_thread profiler_threads[SHBT_PROFILER_MAX_THREADS];
+static pthread_mutex_t profiler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static enum profiler_mode profiler_mode = PROFILER_STOPPED;
+static struct timespec profiler_interval;
+static int profiler_signal;
+static struct sigaction profiler_old_action;
+static atomic_uint_fast64_t profiler_dropped = 0;
+static shbt_stack_table_t* profiler_stacks = NULL;
+static pthread_t profiler_sampler;
+static atomic_bool profiler_sampler_stop = false;
+// The most recent run, kept after the profiler stops.
+static bool profiler_run_wall = false;
+static int64_t profiler_run_period_ns = 0;
+static struct timespec profiler_run_start;
+static struct timespec profiler_run_stop;
+
+static pid_t profiler_gettid() {
+  return (pid_t) syscall(SYS_gettid);
+}
+
+// Append a sample to a thread's ring buffer, or drop it if there is no room.
+static void profiler_record(struct profiler_thread* thread, pid_t tid,
+                            char state, void* pcs[], size_t num_pcs) {
+  // Only one writer at a time; this is only contended if a signal arrives
+  // in the middle of writing another sample.
+  if (atomic_flag_test_and_set_explicit(&thread->writing,
+                                        memory_order_acquire)) {
+    atomic_fetch_add_explicit(&profiler_dropped, 1, memory_order_relaxed);
+    return;
+  }
+  uint32_t stack_id = shbt_stack_table_intern(profiler_stacks, pcs, num_pcs,
+                                              1);
+  size_t record_pcs = stack_id == SHBT_NO_STACK_ID ? num_pcs : 0;
+  size_t head = atomic_load_explicit(&thread->head, memory_order_relaxed);
+  size_t tail = atomic_load_explicit(&thread->tail, memory_order_acquire);
+  if (SHBT_PROFILER_RING_WORDS - (head - tail) <
+      record_pcs + SHBT_PROFILER_RECORD_HEADER) {
+    atomic_fetch_add_explicit(&profiler_dropped, 1, memory_order_relaxed);
+  } else {
+    const size_t mask = SHBT_PROFILER_RING_WORDS - 1;
+    thread->ring[head++ & mask] = num_pcs;
+    thread->ring[head++ & mask] = (uintptr_t) tid;
+    thread->ring[head++ & mask] = (uintptr_t) (unsigned char) state;
+    thread->ring[head++ & mask] = stack_id;
+    for (size_t i = 0; i < record_pcs; ++i) {
+      thread->ring[head++ & mask] = (uintptr_t) pcs[i];
+    }
+    atomic_store_explicit(&thread->head, head, memory_order_release);
+  }
+  atomic_flag_clear_explicit(&thread->writing, memory_order_release);
+}
+
+// Sample the current thread into a slot, from the context the signal
+// interrupted.
+static void profiler_sample(struct profiler_thread* thread, char state,
+                            const void* ucontext) {
+  int saved_errno = errno;
+  void* pcs[SHBT_PROFILER_MAX_FRAMES];
+  size_t num_pcs = shbt_collect_signal_addresses(ucontext, pcs,
+                                                 SHBT_PROFILER_MAX_FRAMES);
+  profiler_record(thread, profiler_gettid(), state, pcs, num_pcs);
+  errno = saved_errno;
+}
+
+static void profiler_cpu_handler(int sig_num, siginfo_t* info,
+                                 void* void_ucontext) {
+  (void) sig_num;
+  // Ignore SIGPROFs that did not come from one of our timers.
+  if (info->si_code != SI_TIMER) {
+    return;
+  }
+  struct profiler_thread* thread = info->si_value.sival_ptr;
+  if (thread < profiler_threads ||
+      thread >= profiler_threads + SHBT_PROFILER_MAX_THREADS ||
+      thread->ring == NULL) {
+    return;
+  }
+  profiler_sample(thread, 0, void_ucontext);
+}
+
+static void profiler_wall_handler(int sig_num, siginfo_t* info,
+                                  void* void_ucontext) {
+  (void) sig_num;
+  // Ignore signals that did not come from our sampler.
+  if (info->si_code != SI_QUEUE || info->si_pid != getpid()) {
+    return;
+  }
+  uintptr_t value = (uintptr_t) info->si_value.sival_ptr;
+  size_t index = value >> 8;
+  if (index >= SHBT_PROFILER_MAX_THREADS ||
+      profiler_threads[index].ring == NULL) {
+    return;
+  }
+  profiler_sample(&profiler_threads[index], (char) (value & 0xff),
+                  void_ucontext);
+}
+
+// Return the slot for a thread, assigning a free one if needed.
+// Must be called with profiler_mutex held. Returns NULL if there is none.
+static struct profiler_thread* profiler_get_thread(pid_t tid) {
+  struct profiler_thread* thread = NULL;
+  for (size_t i = 0; i < SHBT_PROFILER_MAX_THREADS; ++i) {
+    if (profiler_threads[i].tid == tid) {
+      return &profiler_threads[i];
+    }
+    if (thread == NULL && profiler_threads[i].tid == 0) {
+      thread = &profiler_threads[i];
+    }
+  }
+  if (thread == NULL) {
+    return NULL;
+  }
+  if (thread->ring == NULL) {
+    void* ring = mmap(NULL, SHBT_PROFILER_RING_WORDS * sizeof(uintptr_t),
+                      PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                      -1, 0);
+    if (ring == MAP_FAILED) {
+      return NULL;
+    }
+    thread->ring = ring;
+  }
+  thread->tid = tid;
+  return thread;
+}
+
+// Return whether a slot's CPU-time timer still samples a live thread.
+// The timer stays bound to the thread it was created for, and once that
+// thread exits the kernel reports it as disarmed. (A live timer reads as
+// at least 1 ns from expiring.)
+static bool profiler_cpu_thread_alive(const struct profiler_thread* thread) {
+  struct itimerspec its;
+  if (timer_gettime(thread->timer, &its) < 0) {
+    return false;
+  }
+  return its.it_value.tv_sec != 0 || its.it_value.tv_nsec != 0;
+}
+
+// Delete the timer of a slot and free it. Must be called with
+// profiler_mutex held.
+static void profiler_free_cpu_thread(struct profiler_thread* thread) {
+  // Deleting a timer also discards any signal it has pending.
+  timer_delete(thread->timer);
+  thread->tid = 0;
+}
+
+// Free the slots of threads that have exited. Must be called with
+// profiler_mutex held.
+static void profiler_reclaim_cpu_threads() {
+  for (size_t i = 0; i < SHBT_PROFILER_MAX_THREADS; ++i) {
+    if (profiler_threads[i].tid != 0 &&
+        !profiler_cpu_thread_alive(&profiler_threads[i])) {
+      profiler_free_cpu_thread(&profiler_threads[i]);
+    }
+  }
+}
+
+// Start a CPU-time timer for a thread. Must be called with profiler_mutex
+// held.
+static bool profiler_add_cpu_thread(pid_t tid) {
+  for (size_t i = 0; i < SHBT_PROFILER_MAX_THREADS; ++i) {
+    if (profiler_threads[i].tid == tid) {
+      if (profiler_cpu_thread_alive(&profiler_threads[i])) {
+        return true;  // Already sampled.
+      }
+      // The slot belonged to an earlier thread with the same ID.
+      profiler_free_cpu_thread(&profiler_threads[i]);
+      break;
+    }
+  }
+  struct profiler_thread* thread = profiler_get_thread(tid);
+  if (thread == NULL) {
+    profiler_reclaim_cpu_threads();
+    thread = profiler_get_thread(tid);
+    if (thread == NULL) {
+      return false;
+    }
+  }
+  struct sigevent sev;
+  memset(&sev, 0, sizeof(sev));
+  sev.sigev_notify = SIGEV_THREAD_ID;
+  sev.sigev_signo = SIGPROF;
+  sev.sigev_value.sival_ptr = thread;
+  sev.sigev_notify_thread_id = tid;
+  // The CPU-time clock of an arbitrary thread (see MAKE_THREAD_CPUCLOCK in
+  // the kernel); pthread_getcpuclockid only works for our own threads.
+  clockid_t clock = (clockid_t) ((~(unsigned) tid) << 3) | 6;
+  if (timer_create(clock, &sev, &thread->timer) < 0) {
+    thread->tid = 0;
+    return false;
+  }
+  struct itimerspec its;
+  its.it_interval = profiler_interval;
+  its.it_value = profiler_interval;
+  if (timer_settime(thread->timer, 0, &its, NULL) < 0) {
+    timer_delete(thread->timer);
+    thread->tid = 0;
+    return false;
+  }
+  return true;
+}
+
+// Read the scheduler state of a thread from /proc. Returns 0 on failure.
+static char profiler_thread_state(pid_t tid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/stat", (int) tid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return 0;
+  }
+  char buf[512];
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0) {
+    return 0;
+  }
+  buf[len] = '\0';
+  // The format is "tid (comm) state ...", and comm may contain parentheses
+  // and spaces, so the state follows the last ')'.
+  char* comm_end = strrchr(buf, ')');
+  if (comm_end == NULL || comm_end[1] != ' ') {
+    return 0;
+  }
+  return comm_end[2];
+}
+
+// Request a sample from every thread except the sampler.
+static void profiler_sample_all(pid_t pid, pid_t self) {
+  DIR* dir = opendir("/proc/self/task");
+  if (dir == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&profiler_mutex);
+  for (size_t i = 0; i < SHBT_PROFILER_MAX_THREADS; ++i) {
+    profiler_threads[i].seen = false;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    pid_t tid = (pid_t) atoi(entry->d_name);
+    if (tid <= 0 || tid == self) {
+      continue;
+    }
+    struct profiler_thread* thread = profiler_get_thread(tid);
+    if (thread == NULL) {
+      atomic_fetch_add_explicit(&profiler_dropped, 1, memory_order_relaxed);
+      continue;
+    }
+    thread->seen = true;
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    info.si_signo = profiler_signal;
+    info.si_code = SI_QUEUE;
+    info.si_pid = pid;
+    info.si_uid = getuid();
+    info.si_value.sival_ptr =
+      (void*) (((uintptr_t) (thread - profiler_threads) << 8) |
+               (unsigned char) profiler_thread_state(tid));
+    syscall(SYS_rt_tgsigqueueinfo, pid, tid, profiler_signal, &info);
+  }
+  closedir(dir);
+  // Threads that were not found have exited, so free their slots.
+  for (size_t i = 0; i < SHBT_PROFILER_MAX_THREADS; ++i) {
+    if (!profiler_threads[i].seen) {
+      profiler_threads[i].tid = 0;
+    }
+  }
+  pthread_mutex_unlock(&profiler_mutex);
+}
+
+static void* profiler_sampler_main(void* arg) {
+  (void) arg;
+  pid_t pid = getpid();
+  pid_t self = profiler_gettid();
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!atomic_load(&profiler_sampler_stop)) {
+    next.tv_sec += profiler_interval.tv_sec;
+    next.tv_nsec += profiler_interval.tv_nsec;
+    if (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      ++next.tv_sec;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) ==
+           EINTR) {}
+    if (atomic_load(&profiler_sampler_stop)) {
+      break;
+    }
+    shbt_check_modules();
+    profiler_sample_all(pid, self);
+  }
+  return NULL;
+}
+
+// Install the profiler's signal handler and set the sampling interval.
+// Must be called with profiler_mutex held.
+static bool profiler_setup(int sig_num,
+                           void (*handler)(int, siginfo_t*, void*), int hz) {
+  if (hz <= 0 || hz > 1000000000 || profiler_mode != PROFILER_STOPPED) {
+    return false;
+  }
+  if (profiler_stacks == NULL) {
+    profiler_stacks = shbt_stack_table_create(SHBT_PROFILER_MAX_STACKS,
+                                              SHBT_PROFILER_MAX_STACK_PCS);
+    if (profiler_stacks == NULL) {
+      return false;
+    }
+  }
+  struct sigaction sa;
+  sa.sa_sigaction = handler;
+  // Block the other profiler signal so samples never nest.
+  sigemptyset(&sa.sa_mask);
+  sigaddset(&sa.sa_mask, SIGPROF);
+  sigaddset(&sa.sa_mask, SHBT_PROFILER_WALL_SIGNAL);
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  if (sigaction(sig_num, &sa, &profiler_old_action) < 0) {
+    return false;
+  }
+  shbt_frame_pointer_note_handler(sig_num);
+  shbt_frame_pointer_register_thread();
+  shbt_enable_unwind_table();
+  shbt_check_modules();
+  profiler_signal = sig_num;
+  long interval_ns = 1000000000L / hz;
+  profiler_interval.tv_sec = interval_ns / 1000000000L;
+  profiler_interval.tv_nsec = interval_ns % 1000000000L;
+  profiler_run_wall = sig_num == SHBT_PROFILER_WALL_SIGNAL;
+  profiler_run_period_ns = interval_ns;
+  clock_gettime(CLOCK_REALTIME, &profiler_run_start);
+  return true;
+}
+
+bool shbt_profiler_start(int hz) {
+  pthread_mutex_lock(&profiler_mutex);
+  if (!profiler_setup(SIGPROF, &profiler_cpu_handler, hz)) {
+    pthread_mutex_unlock(&profiler_mutex);
+    return false;
+  }
+  profiler_mode = PROFILER_CPU;
+  // Sample every existing thread. Threads may exit while we do this, so
+  // failing to add one is not an error.
+  DIR* dir = opendir("/proc/self/task");
+  if (dir != NULL) {
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+      pid_t tid = (pid_t) atoi(entry->d_name);
+      if (tid > 0) {
+        profiler_add_cpu_thread(tid);
+      }
+    }
+    closedir(dir);
+  } else {
+    profiler_add_cpu_thread(profiler_gettid());
+  }
+  pthread_mutex_unlock(&profiler_mutex);
+  return true;
+}
+
+bool shbt_profiler_start_wall(int hz) {
+  pthread_mutex_lock(&profiler_mutex);
+  if (!profiler_setup(SHBT_PROFILER_WALL_SIGNAL, &profiler_wall_handler,
+                      hz)) {
+    pthread_mutex_unlock(&profiler_mutex);
+    return false;
+  }
+  // The sampler thread must not handle profiler signals itself.
+  sigset_t sampler_mask, old_mask;
+  sigfillset(&sampler_mask);
+  pthread_sigmask(SIG_SETMASK, &sampler_mask, &old_mask);
+  atomic_store(&profiler_sampler_stop, false);
+  int err = pthread_create(&profiler_sampler, NULL, &profiler_sampler_main,
+                           NULL);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  if (err != 0) {
+    sigaction(profiler_signal, &profiler_old_action, NULL);
+    pthread_mutex_unlock(&profiler_mutex);
+    return false;
+  }
+  profiler_mode = PROFILER_WALL;
+  pthread_mutex_unlock(&profiler_mutex);
+  return true;
+}
+
+bool shbt_profiler_register_thread() {
+  shbt_frame_pointer_register_thread();
+  shbt_check_modules();
+  pthread_mutex_lock(&profiler_mutex);
+  bool added = false;
+  if (profiler_mode == PROFILER_CPU) {
+    added = profiler_add_cpu_thread(profiler_gettid());
+  } else if (profiler_mode == PROFILER_WALL) {
+    added = true;  // The sampler finds new threads itself.
+  }
+  pthread_mutex_unlock(&profiler_mutex);
+  return added;
+}
+
+bool shbt_profiler_stop() {
+  pthread_mutex_lock(&profiler_mutex);
+  enum profiler_mode mode = profiler_mode;
+  pthread_mutex_unlock(&profiler_mutex);
+  if (mode == PROFILER_STOPPED) {
+    return false;
+  }
+  if (mode == PROFILER_WALL) {
+    // Join without the lock, since the sampler takes it.
+    atomic_store(&profiler_sampler_stop, true);
+    pthread_join(profiler_sampler, NULL);
+  }
+  pthread_mutex_lock(&profiler_mutex);
+  for (size_t i = 0; i < SHBT_PROFILER_MAX_THREADS; ++i) {
+    if (profiler_threads[i].tid != 0) {
+      if (mode == PROFILER_CPU) {
+        profiler_free_cpu_thread(&profiler_threads[i]);
+      } else {
+        profiler_threads[i].tid = 0;
+      }
+    }
+  }
+  if (mode == PROFILER_WALL) {
+    // Ignoring the signal discards any that are still pending, which would
+    // otherwise kill the process under the default action.
+    struct sigaction sa;
+    sa.sa_handler = SIG_IGN;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(profiler_signal, &sa, NULL);
+  }
+  sigaction(profiler_signal, &profiler_old_action, NULL);
+  clock_gettime(CLOCK_REALTIME, &profiler_run_stop);
+  profiler_mode = PROFILER_STOPPED;
+  pthread_mutex_unlock(&profiler_mutex);
+  return true;
+}
+
+size_t shbt_profiler_read_samples(
+  void (*fn)(const shbt_profiler_sample_t* sample, void* arg), void* arg) {
+  const size_t mask = SHBT_PROFILER_RING_WORDS - 1;
+  void* pcs[SHBT_PROFILER_MAX_FRAMES];
+  size_t num_samples = 0;
+  pthread_mutex_lock(&profiler_mutex);
+  for (size_t i = 0; i < SHBT_PROFILER_MAX_THREADS; ++i) {
+    struct profiler_thread* thread = &profiler_threads[i];
+    if (thread->ring == NULL) {
+      continue;
+    }
+    size_t head = atomic_load_explicit(&thread->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&thread->tail, memory_order_relaxed);
+    while (tail != head) {
+      shbt_profiler_sample_t sample;
+      sample.num_pcs = thread->ring[tail++ & mask];
+      sample.tid = (int) thread->ring[tail++ & mask];
+      sample.state = (char) thread->ring[tail++ & mask];
+      sample.stack_id = (uint32_t) thread->ring[tail++ & mask];
+      size_t num_pcs;
+      if (sample.stack_id == SHBT_NO_STACK_ID ||
+          !shbt_stack_table_get(profiler_stacks, sample.stack_id,
+                                &sample.pcs, &num_pcs, NULL)) {
+        // Stored in the ring (or the table was reset, and it is lost).
+        num_pcs = sample.stack_id == SHBT_NO_STACK_ID ? sample.num_pcs : 0;
+        for (size_t j = 0; j < num_pcs; ++j) {
+          pcs[j] = (void*) thread->ring[tail++ & mask];
+        }
+        sample.stack_id = SHBT_NO_STACK_ID;
+        sample.pcs = pcs;
+        sample.num_pcs = num_pcs;
+      }
+      // Free the space before calling fn, in case it is slow.
+      atomic_store_explicit(&thread->tail, tail, memory_order_release);
+      fn(&sample, arg);
+      ++num_samples;
+    }
+  }
+  pthread_mutex_unlock(&profiler_mutex);
+  return num_samples;
+}
+
+uint64_t shbt_profiler_dropped_samples() {
+  return atomic_load_explicit(&profiler_dropped, memory_order_relaxed);
+}
+
+shbt_stack_table_t* shbt_profiler_stacks() {
+  return profiler_stacks;
+}
+
+bool shbt_profiler_get_run(struct shbt_profiler_run* run) {
+  pthread_mutex_lock(&profiler_mutex);
+  if (profiler_run_period_ns == 0) {
+    pthread_mutex_unlock(&profiler_mutex);
+    return false;
+  }
+  struct timespec stop = profiler_run_stop;
+  if (profiler_mode != PROFILER_STOPPED) {
+    clock_gettime(CLOCK_REALTIME, &stop);
+  }
+  run->wall = profiler_run_wall;
+  run->period_ns = profiler_run_period_ns;
+  run->start_ns = (int64_t) profiler_run_start.tv_sec * 1000000000 +
+                  profiler_run_start.tv_nsec;
+  run->duration_ns =
+    ((int64_t) stop.tv_sec * 1000000000 + stop.tv_nsec) - run->start_ns;
+  pthread_mutex_unlock(&profiler_mutex);
+  return true;
+}
+
+#else  // __linux__
+
+// Per-thread CPU timers, thread-directed signals and /proc are
+// Linux-specific, so the profiler is not available elsewhere.
+
+bool shbt_profiler_start(int hz) {
+  (void) hz;
+  return false;
+}
+
+bool shbt_profiler_start_wall(int hz) {
+  (void) hz;
+  return false;
+}
+
+bool shbt_profiler_register_thread() {
+  return false;
+}
+
+bool shbt_profiler_stop() {
+  return false;
+}
+
+size_t shbt_profiler_read_samples(
+  void (*fn)(const shbt_profiler_sample_t* sample, void* arg), void* arg) {
+  (void) fn;
+  (void) arg;
+  return 0;
+}
+
+uint64_t shbt_profiler_dropped_samples() {
+  return 0;
+}
+
+shbt_stack_table_t* shbt_profiler_stacks() {
+  return NULL;
+}
+
+bool shbt_profiler_get_run(struct shbt_profiler_run* run) {
+  (void) run;
+  return false;
+}
+
+#endif  // __linux__
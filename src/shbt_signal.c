@@ -316,7 +316,8 @@ static const struct shbt_signal_code_info sigsys_codes[] = {
 static int mpi_rank = -1;
 #endif
 
-static void* signal_handler_stack = NULL;
+static void (*handler_timing_hook)(int, const struct shbt_handler_timing*) =
+  NULL;
 
 struct shbt_signal_info* shbt_get_signal_info(int sig_num) {
   for (size_t i = 0; sig_info[i].sig_name != NULL; ++i) {
@@ -337,35 +338,32 @@ const struct shbt_signal_code_info* shbt_get_signal_code_info(
   return NULL;
 }
 
-void shbt_print_signal(int sig_num, siginfo_t* info) {
-  char str_buf[128] = {0};  // Should be large enough for everything.
-  shbt_itoa(sig_num, str_buf, sizeof(str_buf), 10, 0);
+void shbt_print_signal(struct shbt_writer* writer, int sig_num,
+                       siginfo_t* info) {
   struct shbt_signal_info* shbt_info = shbt_get_signal_info(sig_num);
   if (shbt_info == NULL) {
     // No info on what this signal is, so just do our best.
-    shbt_print_to_stderr("Received unknown signal ");
-    shbt_print_to_stderr(str_buf);
+    shbt_writer_puts(writer, "Received unknown signal ");
+    shbt_writer_put_int(writer, sig_num, 10, 0);
 #ifdef SHBT_HAVE_MPI
     if (mpi_rank >= 0) {
-      shbt_print_to_stderr(" on rank ");
-      shbt_itoa(mpi_rank, str_buf, sizeof(str_buf), 10, 0);
-      shbt_print_to_stderr(str_buf);
+      shbt_writer_puts(writer, " on rank ");
+      shbt_writer_put_int(writer, mpi_rank, 10, 0);
     }
 #endif
-    shbt_print_to_stderr("\n");
+    shbt_writer_puts(writer, "\n");
     return;
   }
-  shbt_print_to_stderr("Received signal ");
-  shbt_print_to_stderr(str_buf);
-  shbt_print_to_stderr(" ");
-  shbt_print_to_stderr(shbt_info->sig_name);
-  shbt_print_to_stderr(" - ");
-  shbt_print_to_stderr(shbt_info->sig_desc);
+  shbt_writer_puts(writer, "Received signal ");
+  shbt_writer_put_int(writer, sig_num, 10, 0);
+  shbt_writer_puts(writer, " ");
+  shbt_writer_puts(writer, shbt_info->sig_name);
+  shbt_writer_puts(writer, " - ");
+  shbt_writer_puts(writer, shbt_info->sig_desc);
 #ifdef SHBT_HAVE_MPI
   if (mpi_rank >= 0) {
-    shbt_print_to_stderr(" on rank ");
-    shbt_itoa(mpi_rank, str_buf, sizeof(str_buf), 10, 0);
-    shbt_print_to_stderr(str_buf);
+    shbt_writer_puts(writer, " on rank ");
+    shbt_writer_put_int(writer, mpi_rank, 10, 0);
   }
 #endif
   // Attempt to provide additional information when available.
@@ -380,13 +378,13 @@ void shbt_print_signal(int sig_num, siginfo_t* info) {
         shbt_get_signal_code_info(generic_codes, info->si_code);
       if (code_info != NULL) {
         was_code_generic = true;
-        shbt_print_to_stderr("\n  ");
-        shbt_print_to_stderr(code_info->code_name);
-        shbt_print_to_stderr(" - ");
-        shbt_print_to_stderr(code_info->code_desc);
+        shbt_writer_puts(writer, "\n  ");
+        shbt_writer_puts(writer, code_info->code_name);
+        shbt_writer_puts(writer, " - ");
+        shbt_writer_puts(writer, code_info->code_desc);
       } else {
         // Only print a newline if we don't have a generic code here.
-        shbt_print_to_stderr("\n");
+        shbt_writer_puts(writer, "\n");
       }
       // Print PID/UID info for kill/sigqueue.
       // TODO: It would make sense for tgkill to also fill this in, but there
@@ -401,112 +399,100 @@ void shbt_print_signal(int sig_num, siginfo_t* info) {
         0
 #endif
       ) {
-        shbt_print_to_stderr(" - Source PID: ");
-        shbt_itoa(info->si_pid, str_buf, sizeof(str_buf), 10, 0);
-        shbt_print_to_stderr(str_buf);
-        shbt_print_to_stderr(" - UID: ");
-        shbt_itoa(info->si_uid, str_buf, sizeof(str_buf), 10, 0);
-        shbt_print_to_stderr(str_buf);
+        shbt_writer_puts(writer, " - Source PID: ");
+        shbt_writer_put_int(writer, info->si_pid, 10, 0);
+        shbt_writer_puts(writer, " - UID: ");
+        shbt_writer_put_int(writer, info->si_uid, 10, 0);
       }
     }
 #ifdef SIGILL
     if (sig_num == SIGILL) {
-      shbt_print_to_stderr("  ");
+      shbt_writer_puts(writer, "  ");
       const struct shbt_signal_code_info* code_info =
         shbt_get_signal_code_info(sigill_codes, info->si_code);
       if (code_info != NULL) {
-        shbt_print_to_stderr(code_info->code_name);
-        shbt_print_to_stderr(" - ");
-        shbt_print_to_stderr(code_info->code_desc);
+        shbt_writer_puts(writer, code_info->code_name);
+        shbt_writer_puts(writer, " - ");
+        shbt_writer_puts(writer, code_info->code_desc);
       } else if (!was_code_generic) {
-        shbt_print_to_stderr("Unknown signal code ");
-        shbt_itoa(info->si_code, str_buf, sizeof(str_buf), 10, 0);
-        shbt_print_to_stderr(str_buf);
+        shbt_writer_puts(writer, "Unknown signal code ");
+        shbt_writer_put_int(writer, info->si_code, 10, 0);
       }
-      shbt_print_to_stderr(" - Fault occurred at address 0x");
-      shbt_itoa((intptr_t) info->si_addr, str_buf, sizeof(str_buf), 16, 12);
-      shbt_print_to_stderr(str_buf);
-      shbt_print_to_stderr("\n");
+      shbt_writer_puts(writer, " - Fault occurred at address 0x");
+      shbt_writer_put_int(writer, (intptr_t) info->si_addr, 16, 12);
+      shbt_writer_puts(writer, "\n");
     } else
 #endif  // SIGILL
 #ifdef SIGFPE
     if (sig_num == SIGFPE) {
-      shbt_print_to_stderr("  ");
+      shbt_writer_puts(writer, "  ");
       const struct shbt_signal_code_info* code_info =
         shbt_get_signal_code_info(sigfpe_codes, info->si_code);
       if (code_info != NULL) {
-        shbt_print_to_stderr(code_info->code_name);
-        shbt_print_to_stderr(" - ");
-        shbt_print_to_stderr(code_info->code_desc);
+        shbt_writer_puts(writer, code_info->code_name);
+        shbt_writer_puts(writer, " - ");
+        shbt_writer_puts(writer, code_info->code_desc);
       } else if (!was_code_generic) {
-        shbt_print_to_stderr("Unknown signal code ");
-        shbt_itoa(info->si_code, str_buf, sizeof(str_buf), 10, 0);
-        shbt_print_to_stderr(str_buf);
+        shbt_writer_puts(writer, "Unknown signal code ");
+        shbt_writer_put_int(writer, info->si_code, 10, 0);
       }
-      shbt_print_to_stderr(" - Fault occurred at address 0x");
-      shbt_itoa((intptr_t) info->si_addr, str_buf, sizeof(str_buf), 16, 12);
-      shbt_print_to_stderr(str_buf);
-      shbt_print_to_stderr("\n");
+      shbt_writer_puts(writer, " - Fault occurred at address 0x");
+      shbt_writer_put_int(writer, (intptr_t) info->si_addr, 16, 12);
+      shbt_writer_puts(writer, "\n");
     } else
 #endif  // SIGFPE
 #ifdef SIGSEGV
     if (sig_num == SIGSEGV) {
-      shbt_print_to_stderr("  ");
+      shbt_writer_puts(writer, "  ");
       const struct shbt_signal_code_info* code_info =
         shbt_get_signal_code_info(sigsegv_codes, info->si_code);
       if (code_info != NULL) {
-        shbt_print_to_stderr(code_info->code_name);
-        shbt_print_to_stderr(" - ");
-        shbt_print_to_stderr(code_info->code_desc);
+        shbt_writer_puts(writer, code_info->code_name);
+        shbt_writer_puts(writer, " - ");
+        shbt_writer_puts(writer, code_info->code_desc);
       } else if (!was_code_generic) {
-        shbt_print_to_stderr("Unknown signal code ");
-        shbt_itoa(info->si_code, str_buf, sizeof(str_buf), 10, 0);
-        shbt_print_to_stderr(str_buf);
+        shbt_writer_puts(writer, "Unknown signal code ");
+        shbt_writer_put_int(writer, info->si_code, 10, 0);
       }
-      shbt_print_to_stderr(" - Fault occurred at address 0x");
-      shbt_itoa((intptr_t) info->si_addr, str_buf, sizeof(str_buf), 16, 12);
-      shbt_print_to_stderr(str_buf);
-      shbt_print_to_stderr("\n");
+      shbt_writer_puts(writer, " - Fault occurred at address 0x");
+      shbt_writer_put_int(writer, (intptr_t) info->si_addr, 16, 12);
+      shbt_writer_puts(writer, "\n");
     } else
 #endif  // SIGSEGV
 #ifdef SIGBUS
     if (sig_num == SIGBUS) {
-      shbt_print_to_stderr("  ");
+      shbt_writer_puts(writer, "  ");
       const struct shbt_signal_code_info* code_info =
         shbt_get_signal_code_info(sigbus_codes, info->si_code);
       if (code_info != NULL) {
-        shbt_print_to_stderr(code_info->code_name);
-        shbt_print_to_stderr(" - ");
-        shbt_print_to_stderr(code_info->code_desc);
+        shbt_writer_puts(writer, code_info->code_name);
+        shbt_writer_puts(writer, " - ");
+        shbt_writer_puts(writer, code_info->code_desc);
       } else if (!was_code_generic) {
-        shbt_print_to_stderr("Unknown signal code ");
-        shbt_itoa(info->si_code, str_buf, sizeof(str_buf), 10, 0);
-        shbt_print_to_stderr(str_buf);
+        shbt_writer_puts(writer, "Unknown signal code ");
+        shbt_writer_put_int(writer, info->si_code, 10, 0);
       }
-      shbt_print_to_stderr(" - Fault occurred at address 0x");
-      shbt_itoa((intptr_t) info->si_addr, str_buf, sizeof(str_buf), 16, 12);
-      shbt_print_to_stderr(str_buf);
-      shbt_print_to_stderr("\n");
+      shbt_writer_puts(writer, " - Fault occurred at address 0x");
+      shbt_writer_put_int(writer, (intptr_t) info->si_addr, 16, 12);
+      shbt_writer_puts(writer, "\n");
     } else
 #endif  // SIGBUS
 #ifdef SIGTRAP
     if (sig_num == SIGTRAP) {
-      shbt_print_to_stderr("  ");
+      shbt_writer_puts(writer, "  ");
       const struct shbt_signal_code_info* code_info =
         shbt_get_signal_code_info(sigtrap_codes, info->si_code);
       if (code_info != NULL) {
-        shbt_print_to_stderr(code_info->code_name);
-        shbt_print_to_stderr(" - ");
-        shbt_print_to_stderr(code_info->code_desc);
+        shbt_writer_puts(writer, code_info->code_name);
+        shbt_writer_puts(writer, " - ");
+        shbt_writer_puts(writer, code_info->code_desc);
       } else if (!was_code_generic) {
-        shbt_print_to_stderr("Unknown signal code ");
-        shbt_itoa(info->si_code, str_buf, sizeof(str_buf), 10, 0);
-        shbt_print_to_stderr(str_buf);
+        shbt_writer_puts(writer, "Unknown signal code ");
+        shbt_writer_put_int(writer, info->si_code, 10, 0);
       }
-      shbt_print_to_stderr(" - Fault occurred at address 0x");
-      shbt_itoa((intptr_t) info->si_addr, str_buf, sizeof(str_buf), 16, 12);
-      shbt_print_to_stderr(str_buf);
-      shbt_print_to_stderr("\n");
+      shbt_writer_puts(writer, " - Fault occurred at address 0x");
+      shbt_writer_put_int(writer, (intptr_t) info->si_addr, 16, 12);
+      shbt_writer_puts(writer, "\n");
     } else
 #endif  // SIGTRAP
 #if defined(SIGIO) || defined(SIGPOLL)
@@ -520,50 +506,47 @@ void shbt_print_signal(int sig_num, siginfo_t* info) {
         0
 #endif
       ) {
-      shbt_print_to_stderr("  ");
+      shbt_writer_puts(writer, "  ");
       const struct shbt_signal_code_info* code_info =
         shbt_get_signal_code_info(sigpoll_codes, info->si_code);
       if (code_info != NULL) {
-        shbt_print_to_stderr(code_info->code_name);
-        shbt_print_to_stderr(" - ");
-        shbt_print_to_stderr(code_info->code_desc);
+        shbt_writer_puts(writer, code_info->code_name);
+        shbt_writer_puts(writer, " - ");
+        shbt_writer_puts(writer, code_info->code_desc);
       } else if (!was_code_generic) {
-        shbt_print_to_stderr("Unknown signal code ");
-        shbt_itoa(info->si_code, str_buf, sizeof(str_buf), 10, 0);
-        shbt_print_to_stderr(str_buf);
+        shbt_writer_puts(writer, "Unknown signal code ");
+        shbt_writer_put_int(writer, info->si_code, 10, 0);
       }
-      shbt_print_to_stderr("\n");
+      shbt_writer_puts(writer, "\n");
     } else
 #endif  // defined(SIGIO) || defined(SIGPOLL)
 #ifdef SIGSYS
     if (sig_num == SIGSYS) {
-      shbt_print_to_stderr("  ");
+      shbt_writer_puts(writer, "  ");
       const struct shbt_signal_code_info* code_info =
         shbt_get_signal_code_info(sigsys_codes, info->si_code);
       if (code_info != NULL) {
-        shbt_print_to_stderr(code_info->code_name);
-        shbt_print_to_stderr(" - ");
-        shbt_print_to_stderr(code_info->code_desc);
+        shbt_writer_puts(writer, code_info->code_name);
+        shbt_writer_puts(writer, " - ");
+        shbt_writer_puts(writer, code_info->code_desc);
       } else if (!was_code_generic) {
-        shbt_print_to_stderr("Unknown signal code ");
-        shbt_itoa(info->si_code, str_buf, sizeof(str_buf), 10, 0);
-        shbt_print_to_stderr(str_buf);
+        shbt_writer_puts(writer, "Unknown signal code ");
+        shbt_writer_put_int(writer, info->si_code, 10, 0);
       }
-      shbt_print_to_stderr("\n");
+      shbt_writer_puts(writer, "\n");
     } else
 #endif  // SIGSYS
     {
       // No special info available.
       if (was_code_generic) {
         // Add newline for generic code.
-        shbt_print_to_stderr("\n");
+        shbt_writer_puts(writer, "\n");
       }
     }
   }
 }
 
 void shbt_sigaction_handler(int sig_num, siginfo_t* info, void* void_ucontext) {
-  (void) void_ucontext;
   struct shbt_signal_info* sig_info = shbt_get_signal_info(sig_num);
   if (sig_info == NULL) {
     // This should never happen, since this signal handler shouldn't be
@@ -571,9 +554,39 @@ void shbt_sigaction_handler(int sig_num, siginfo_t* info, void* void_ucontext) {
     shbt_print_to_stderr("SHBT: Could not get signal info in signal handler\n");
     _exit(EXIT_FAILURE);
   }
-  shbt_print_signal(sig_num, info);
-  shbt_print_to_stderr("Backtrace:\n");
-  shbt_print_backtrace_fd(STDERR_FILENO);
+  void (*timing_hook)(int, const struct shbt_handler_timing*) =
+    handler_timing_hook;
+  struct shbt_handler_timing timing;
+  if (timing_hook != NULL) {
+    memset(&timing, 0, sizeof(timing));
+    timing.start_ns = shbt_now_ns();
+  }
+  int record_fd = shbt_get_crash_record_fd();
+  if (record_fd >= 0) {
+#ifdef SHBT_HAVE_MPI
+    shbt_write_crash_record(record_fd, sig_num, info, void_ucontext,
+                            mpi_rank);
+#else
+    shbt_write_crash_record(record_fd, sig_num, info, void_ucontext, -1);
+#endif
+  } else {
+    // Buffer the report so it is written with as few writes as possible.
+    struct shbt_writer writer;
+    shbt_writer_init(&writer, STDERR_FILENO);
+    writer.timing = timing_hook != NULL ? &timing : NULL;
+    shbt_print_signal(&writer, sig_num, info);
+    shbt_writer_puts(&writer, "Backtrace:\n");
+    shbt_write_signal_backtrace(&writer, void_ucontext);
+    shbt_writer_finish(&writer);
+  }
+  if (timing_hook != NULL) {
+    timing.total_ns = shbt_now_ns() - timing.start_ns;
+    if (record_fd < 0) {
+      timing.print_ns = timing.total_ns - timing.unwind_ns -
+                        timing.demangle_ns - timing.write_ns;
+    }
+    timing_hook(sig_num, &timing);
+  }
   if (sig_info->callback != NULL) {
     sig_info->callback(sig_num);
   }
@@ -631,20 +644,16 @@ bool shbt_register_signal_handler(int sig_num, shbt_exit_action_t exit_action,
   }
 #endif
   sig_info->callback = callback;
-  // Set up the signal handler stack if needed.
-  if (signal_handler_stack == NULL) {
-    signal_handler_stack = malloc(SIGSTKSZ);
-    if (signal_handler_stack == NULL) {
-      return false;
-    }
-    stack_t ss;
-    ss.ss_sp = signal_handler_stack;
-    ss.ss_size = SIGSTKSZ;
-    ss.ss_flags = 0;
-    if (sigaltstack(&ss, NULL) < 0) {
-      return false;
-    }
+  // Set up the signal handler stack for this thread, and for threads
+  // created from now on.
+  if (!shbt_install_signal_stack()) {
+    return false;
   }
+  shbt_enable_thread_signal_stacks();
+  // Record where modules are loaded, so reports can give offsets in them.
+  shbt_enable_module_map();
+  shbt_check_modules();
+  shbt_enable_unwind_table();
   struct sigaction sa;
   sa.sa_sigaction = &shbt_sigaction_handler;
   sigfillset(&sa.sa_mask);
@@ -652,6 +661,7 @@ bool shbt_register_signal_handler(int sig_num, shbt_exit_action_t exit_action,
   if (sigaction(sig_num, &sa, NULL) < 0) {
     return false;
   }
+  shbt_frame_pointer_note_handler(sig_num);
   return true;
 }
 
@@ -741,11 +751,22 @@ bool shbt_register_fatal_handlers() {
     SIGXFSZ,
 #endif
     0};
+  // Optionally build the symbol index now, so it is available to handlers.
+  // Handlers fall back to libunwind if this fails.
+  char* env_symbol_index = getenv("SHBT_SYMBOL_INDEX");
+  if (env_symbol_index != NULL && strcmp(env_symbol_index, "0") != 0) {
+    shbt_build_symbol_index();
+  }
   return shbt_register_signal_handlers(
     sig_nums, (sizeof(sig_nums) / sizeof(int)) - 1,  // Ignore last 0.
     SHBT_EXIT_ACTION_EXIT, NULL);
 }
 
+void shbt_set_handler_timing_hook(
+  void (*hook)(int sig_num, const struct shbt_handler_timing* timing)) {
+  handler_timing_hook = hook;
+}
+
 bool shbt_register_signal_callback(int sig_num, void (*callback)(int)) {
   struct shbt_signal_info* sig_info = shbt_get_signal_info(sig_num);
   if (sig_info == NULL) {
@@ -764,10 +785,3 @@ bool shbt_register_signal_exit_action(int sig_num,
   sig_info->exit_action = exit_action;
   return true;
 }
-
-void __attribute__((destructor)) shbt_cleanup() {
-  if (signal_handler_stack != NULL) {
-    free(signal_handler_stack);
-    signal_handler_stack = NULL;
-  }
-}
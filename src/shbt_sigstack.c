@@ -0,0 +1,233 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Pooled alternate signal stacks.
+ *
+ * Stacks are carved out of chunks mapped with mmap, each with a
+ * PROT_NONE guard page below it, so a handler that overflows its stack
+ * faults instead of silently corrupting a neighbor. A thread takes a stack
+ * from the free list when it first needs one and returns it when it exits
+ * (through a thread-specific data destructor), so thread churn reuses
+ * stacks rather than mapping new ones. Chunks are never unmapped, since a
+ * stack may be in use until the very end of a thread.
+ *
+ * While a stack is free, its first word links it into the free list.
+ */
+
+#define _GNU_SOURCE  // For MAP_ANONYMOUS and RTLD_NEXT.
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+#ifdef SHBT_HOOK_THREAD_CREATE
+#include <dlfcn.h>
+#include <errno.h>
+#endif
+
+// Default size of a signal stack. The handler uses a bounded amount of
+// stack, but considerably more than SIGSTKSZ. Printing a frame demangles
+// its name, which takes up to about 29 KiB (see DEMANGLE_MAX_DEPTH), on
+// top of the signal frame (up to about 11 KiB with AMX state), the
+// handler's buffers (about 5 KiB) and the libunwind cursor. Names are
+// looked up (which also takes a lot of stack in libunwind) before any are
+// demangled, so the two do not add up.
+#define SHBT_SIGNAL_STACK_DEFAULT_SIZE (64 * 1024)
+// Number of stacks mapped at once when the pool is empty.
+#define SHBT_SIGNAL_STACK_CHUNK 32
+
+static pthread_once_t sigstack_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sigstack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t sigstack_key;
+static bool sigstack_key_created = false;
+// Usable size of each stack and of the guard below it, in bytes.
+static size_t sigstack_size = 0;
+static size_t sigstack_guard_size = 0;
+static void* sigstack_free_list = NULL;
+// Whether new threads should get a stack when they start.
+static atomic_bool sigstack_new_threads = false;
+
+// Return a stack to the pool. Must be called with sigstack_mutex held.
+static void sigstack_push(void* stack) {
+  *(void**) stack = sigstack_free_list;
+  sigstack_free_list = stack;
+}
+
+// Release the calling thread's stack when it exits.
+static void sigstack_release(void* stack) {
+  // Stop using the stack before anyone else can get it, unless the
+  // application has replaced it.
+  stack_t current;
+  if (sigaltstack(NULL, &current) == 0 && current.ss_sp == stack) {
+    stack_t ss;
+    ss.ss_sp = NULL;
+    ss.ss_size = 0;
+    ss.ss_flags = SS_DISABLE;
+    if (sigaltstack(&ss, NULL) < 0) {
+      return;  // Still in use somehow; leak it rather than share it.
+    }
+  }
+  pthread_mutex_lock(&sigstack_mutex);
+  sigstack_push(stack);
+  pthread_mutex_unlock(&sigstack_mutex);
+}
+
+static void sigstack_init() {
+  size_t page_size = (size_t) sysconf(_SC_PAGESIZE);
+  size_t size = SHBT_SIGNAL_STACK_DEFAULT_SIZE;
+  if ((size_t) SIGSTKSZ > size) {
+    size = SIGSTKSZ;
+  }
+  char* env_size = getenv("SHBT_SIGNAL_STACK_SIZE");
+  if (env_size != NULL) {
+    char* end;
+    unsigned long long requested = strtoull(env_size, &end, 0);
+    if (*end == '\0' && requested >= (unsigned long long) MINSIGSTKSZ) {
+      size = (size_t) requested;
+    }
+  }
+  sigstack_size = (size + page_size - 1) & ~(page_size - 1);
+  sigstack_guard_size = page_size;
+  sigstack_key_created =
+    pthread_key_create(&sigstack_key, &sigstack_release) == 0;
+}
+
+// Map another chunk of stacks into the pool.
+// Must be called with sigstack_mutex held.
+static bool sigstack_grow() {
+  size_t slot_size = sigstack_guard_size + sigstack_size;
+  char* chunk = mmap(NULL, slot_size * SHBT_SIGNAL_STACK_CHUNK,
+                     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                     -1, 0);
+  if (chunk == MAP_FAILED) {
+    return false;
+  }
+  // Without its guard, a stack overflow would silently run into the next
+  // stack, so give up on the whole chunk if any guard cannot be set up.
+  for (size_t i = 0; i < SHBT_SIGNAL_STACK_CHUNK; ++i) {
+    if (mprotect(chunk + i * slot_size, sigstack_guard_size, PROT_NONE) < 0) {
+      munmap(chunk, slot_size * SHBT_SIGNAL_STACK_CHUNK);
+      return false;
+    }
+  }
+  // Push in reverse so stacks are handed out in address order.
+  for (size_t i = SHBT_SIGNAL_STACK_CHUNK; i-- > 0;) {
+    sigstack_push(chunk + i * slot_size + sigstack_guard_size);
+  }
+  return true;
+}
+
+bool shbt_install_signal_stack() {
+  pthread_once(&sigstack_once, &sigstack_init);
+  // Handlers can walk this thread's stack with frame pointers once its
+  // bounds are known.
+  shbt_frame_pointer_register_thread();
+  stack_t current;
+  if (sigaltstack(NULL, &current) < 0) {
+    return false;
+  }
+  if (!(current.ss_flags & SS_DISABLE)) {
+    return true;  // Already has one, ours or the application's.
+  }
+  pthread_mutex_lock(&sigstack_mutex);
+  if (sigstack_free_list == NULL && !sigstack_grow()) {
+    pthread_mutex_unlock(&sigstack_mutex);
+    return false;
+  }
+  void* stack = sigstack_free_list;
+  sigstack_free_list = *(void**) stack;
+  pthread_mutex_unlock(&sigstack_mutex);
+  stack_t ss;
+  ss.ss_sp = stack;
+  ss.ss_size = sigstack_size;
+  ss.ss_flags = 0;
+  if (sigaltstack(&ss, NULL) < 0) {
+    pthread_mutex_lock(&sigstack_mutex);
+    sigstack_push(stack);
+    pthread_mutex_unlock(&sigstack_mutex);
+    return false;
+  }
+  if (sigstack_key_created) {
+    pthread_setspecific(sigstack_key, stack);
+  }
+  return true;
+}
+
+void shbt_enable_thread_signal_stacks() {
+  atomic_store_explicit(&sigstack_new_threads, true, memory_order_relaxed);
+}
+
+#ifdef SHBT_HOOK_THREAD_CREATE
+
+// Wrap pthread_create so every new thread installs a signal stack before
+// running its start routine.
+
+/** Start routine and argument of a thread being created. */
+struct sigstack_thread_start {
+  void* (*start_routine)(void*);
+  void* arg;
+};
+
+typedef int (*pthread_create_fn)(pthread_t*, const pthread_attr_t*,
+                                 void* (*)(void*), void*);
+
+static pthread_once_t sigstack_hook_once = PTHREAD_ONCE_INIT;
+static pthread_create_fn real_pthread_create = NULL;
+
+static void sigstack_hook_init() {
+  real_pthread_create = (pthread_create_fn) dlsym(RTLD_NEXT,
+                                                  "pthread_create");
+}
+
+static void* sigstack_thread_main(void* arg) {
+  struct sigstack_thread_start start = *(struct sigstack_thread_start*) arg;
+  free(arg);
+  if (atomic_load_explicit(&sigstack_new_threads, memory_order_relaxed)) {
+    shbt_install_signal_stack();
+  } else {
+    shbt_frame_pointer_register_thread();
+  }
+  return start.start_routine(start.arg);
+}
+
+int pthread_create(pthread_t* thread, const pthread_attr_t* attr,
+                   void* (*start_routine)(void*), void* arg) {
+  pthread_once(&sigstack_hook_once, &sigstack_hook_init);
+  if (real_pthread_create == NULL) {
+    return EAGAIN;
+  }
+  struct sigstack_thread_start* start =
+    malloc(sizeof(struct sigstack_thread_start));
+  if (start == NULL) {
+    // Still create the thread, just without a signal stack.
+    return real_pthread_create(thread, attr, start_routine, arg);
+  }
+  start->start_routine = start_routine;
+  start->arg = arg;
+  int err = real_pthread_create(thread, attr, &sigstack_thread_main, start);
+  if (err != 0) {
+    free(start);
+  }
+  return err;
+}
+
+#endif  // SHBT_HOOK_THREAD_CREATE
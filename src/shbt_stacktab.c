@@ -0,0 +1,259 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Stack interning table.
+ *
+ * Stacks are stored in an array of entries, with their addresses in a pool
+ * of words; a stack's ID is its index in the entry array. An open-addressing
+ * hash table of IDs finds existing stacks. Everything lives in one mapping
+ * allocated up front.
+ *
+ * To add a stack, a thread allocates an entry and space in the pool with
+ * atomic increments, fills them in, and then publishes the entry by storing
+ * its ID into an empty hash slot with a CAS. If another thread published the
+ * same stack first, the new entry is left unpublished and is never visible.
+ */
+
+#define _GNU_SOURCE  // For MAP_ANONYMOUS.
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+/** An interned stack. */
+struct stack_entry {
+  /** Hash of the stack's addresses. */
+  uint64_t hash;
+  /** Offset of the stack's addresses in the pool. */
+  uint32_t pcs;
+  /** Number of addresses. */
+  uint32_t num_pcs;
+  /** Count accumulated for the stack. */
+  atomic_uint_fast64_t count;
+  /** Whether the entry is in the hash table. */
+  atomic_bool published;
+};
+
+struct shbt_stack_table {
+  /** Size of the mapping containing the table. */
+  size_t mapping_size;
+  /** Number of hash slots; a power of 2. */
+  size_t num_slots;
+  /** Maximum number of stacks. */
+  size_t max_stacks;
+  /** Size of the address pool, in addresses. */
+  size_t max_pcs;
+  /** Hash slots, holding ID + 1, or 0 if empty. */
+  _Atomic uint32_t* slots;
+  /** Stack entries, indexed by ID. */
+  struct stack_entry* entries;
+  /** Address pool. */
+  void** pcs;
+  /** Number of entries allocated. */
+  atomic_size_t num_entries;
+  /** Number of addresses allocated from the pool. */
+  atomic_size_t num_pcs;
+};
+
+static uint64_t hash_stack(void* const pcs[], size_t num_pcs) {
+  uint64_t hash = num_pcs;
+  for (size_t i = 0; i < num_pcs; ++i) {
+    hash = (hash ^ (uintptr_t) pcs[i]) * 0x9e3779b97f4a7c15ull;
+    hash ^= hash >> 32;
+  }
+  return hash;
+}
+
+// Return true if entry is the given stack.
+static bool entry_matches(const shbt_stack_table_t* table,
+                          const struct stack_entry* entry, uint64_t hash,
+                          void* const pcs[], size_t num_pcs) {
+  return entry->hash == hash && entry->num_pcs == num_pcs &&
+         memcmp(table->pcs + entry->pcs, pcs, num_pcs * sizeof(void*)) == 0;
+}
+
+// Allocate an entry for a stack. Returns its ID, or SHBT_NO_STACK_ID if the
+// table is full.
+static uint32_t alloc_entry(shbt_stack_table_t* table, uint64_t hash,
+                            void* const pcs[], size_t num_pcs) {
+  if (atomic_load_explicit(&table->num_entries, memory_order_relaxed) >=
+        table->max_stacks ||
+      atomic_load_explicit(&table->num_pcs, memory_order_relaxed) + num_pcs >
+        table->max_pcs) {
+    return SHBT_NO_STACK_ID;  // Avoid allocating when it will fail.
+  }
+  size_t id = atomic_fetch_add_explicit(&table->num_entries, 1,
+                                        memory_order_relaxed);
+  if (id >= table->max_stacks) {
+    return SHBT_NO_STACK_ID;
+  }
+  size_t offset = atomic_fetch_add_explicit(&table->num_pcs, num_pcs,
+                                            memory_order_relaxed);
+  struct stack_entry* entry = &table->entries[id];
+  if (offset + num_pcs > table->max_pcs) {
+    // The entry is wasted, but stays unpublished.
+    return SHBT_NO_STACK_ID;
+  }
+  memcpy(table->pcs + offset, pcs, num_pcs * sizeof(void*));
+  entry->hash = hash;
+  entry->pcs = (uint32_t) offset;
+  entry->num_pcs = (uint32_t) num_pcs;
+  return (uint32_t) id;
+}
+
+shbt_stack_table_t* shbt_stack_table_create(size_t max_stacks,
+                                            size_t max_pcs) {
+  if (max_stacks == 0 || max_stacks >= UINT32_MAX / 2 ||
+      max_pcs >= UINT32_MAX) {
+    return NULL;
+  }
+  // Keep the load factor at most 1/2 so probe sequences stay short.
+  size_t num_slots = 1;
+  while (num_slots < 2 * max_stacks) {
+    num_slots *= 2;
+  }
+  size_t entries_offset = sizeof(shbt_stack_table_t);
+  entries_offset = (entries_offset + 63) & ~(size_t) 63;
+  size_t slots_offset =
+    entries_offset + max_stacks * sizeof(struct stack_entry);
+  size_t pcs_offset = slots_offset + num_slots * sizeof(uint32_t);
+  pcs_offset = (pcs_offset + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  size_t mapping_size = pcs_offset + max_pcs * sizeof(void*);
+  void* mapping = mmap(NULL, mapping_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return NULL;
+  }
+  // The mapping is zeroed, so all slots start empty.
+  shbt_stack_table_t* table = (shbt_stack_table_t*) mapping;
+  table->mapping_size = mapping_size;
+  table->num_slots = num_slots;
+  table->max_stacks = max_stacks;
+  table->max_pcs = max_pcs;
+  table->entries = (struct stack_entry*) ((char*) mapping + entries_offset);
+  table->slots = (_Atomic uint32_t*) ((char*) mapping + slots_offset);
+  table->pcs = (void**) ((char*) mapping + pcs_offset);
+  atomic_init(&table->num_entries, 0);
+  atomic_init(&table->num_pcs, 0);
+  return table;
+}
+
+void shbt_stack_table_destroy(shbt_stack_table_t* table) {
+  if (table != NULL) {
+    munmap(table, table->mapping_size);
+  }
+}
+
+uint32_t shbt_stack_table_intern(shbt_stack_table_t* table,
+                                 void* const pcs[], size_t num_pcs,
+                                 uint64_t count) {
+  uint64_t hash = hash_stack(pcs, num_pcs);
+  uint32_t new_id = SHBT_NO_STACK_ID;
+  size_t mask = table->num_slots - 1;
+  size_t i = (size_t) hash & mask;
+  for (size_t probe = 0; probe < table->num_slots; ++probe) {
+    uint32_t slot = atomic_load_explicit(&table->slots[i],
+                                         memory_order_acquire);
+    if (slot == 0) {
+      if (new_id == SHBT_NO_STACK_ID) {
+        new_id = alloc_entry(table, hash, pcs, num_pcs);
+        if (new_id == SHBT_NO_STACK_ID) {
+          return SHBT_NO_STACK_ID;
+        }
+        // Count before publishing, so the count is never missed.
+        atomic_store_explicit(&table->entries[new_id].count, count,
+                              memory_order_relaxed);
+      }
+      if (atomic_compare_exchange_strong_explicit(
+            &table->slots[i], &slot, new_id + 1,
+            memory_order_release, memory_order_acquire)) {
+        atomic_store_explicit(&table->entries[new_id].published, true,
+                              memory_order_release);
+        return new_id;
+      }
+      // Someone else filled the slot; slot now holds what they stored.
+    }
+    struct stack_entry* entry = &table->entries[slot - 1];
+    if (entry_matches(table, entry, hash, pcs, num_pcs)) {
+      atomic_fetch_add_explicit(&entry->count, count, memory_order_relaxed);
+      return slot - 1;
+    }
+    i = (i + 1) & mask;
+  }
+  return SHBT_NO_STACK_ID;
+}
+
+bool shbt_stack_table_get(const shbt_stack_table_t* table, uint32_t id,
+                          void* const** pcs, size_t* num_pcs,
+                          uint64_t* count) {
+  if (id >= table->max_stacks ||
+      id >= atomic_load_explicit(&table->num_entries, memory_order_relaxed)) {
+    return false;
+  }
+  struct stack_entry* entry = &table->entries[id];
+  if (!atomic_load_explicit(&entry->published, memory_order_acquire)) {
+    return false;
+  }
+  *pcs = table->pcs + entry->pcs;
+  *num_pcs = entry->num_pcs;
+  if (count != NULL) {
+    *count = atomic_load_explicit(&entry->count, memory_order_relaxed);
+  }
+  return true;
+}
+
+size_t shbt_stack_table_foreach(
+  const shbt_stack_table_t* table,
+  void (*fn)(uint32_t id, void* const pcs[], size_t num_pcs, uint64_t count,
+             void* arg),
+  void* arg) {
+  size_t num_entries = atomic_load_explicit(&table->num_entries,
+                                            memory_order_relaxed);
+  if (num_entries > table->max_stacks) {
+    num_entries = table->max_stacks;
+  }
+  size_t num_stacks = 0;
+  for (size_t id = 0; id < num_entries; ++id) {
+    void* const* pcs;
+    size_t num_pcs;
+    uint64_t count;
+    if (shbt_stack_table_get(table, (uint32_t) id, &pcs, &num_pcs, &count)) {
+      fn((uint32_t) id, pcs, num_pcs, count, arg);
+      ++num_stacks;
+    }
+  }
+  return num_stacks;
+}
+
+void shbt_stack_table_reset(shbt_stack_table_t* table) {
+  size_t num_entries = atomic_load_explicit(&table->num_entries,
+                                            memory_order_relaxed);
+  if (num_entries > table->max_stacks) {
+    num_entries = table->max_stacks;
+  }
+  for (size_t id = 0; id < num_entries; ++id) {
+    atomic_store_explicit(&table->entries[id].published, false,
+                          memory_order_relaxed);
+  }
+  for (size_t i = 0; i < table->num_slots; ++i) {
+    atomic_store_explicit(&table->slots[i], 0, memory_order_relaxed);
+  }
+  atomic_store_explicit(&table->num_pcs, 0, memory_order_relaxed);
+  atomic_store_explicit(&table->num_entries, 0, memory_order_release);
+}
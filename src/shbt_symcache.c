@@ -0,0 +1,306 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * A cache of symbol names for return addresses.
+ *
+ * This is a fixed-size open-addressing hash table keyed by PC, with names
+ * stored in a fixed-size string pool. Everything is statically allocated and
+ * updated with atomic operations, so it can be used from signal handlers and
+ * by any number of threads without locks.
+ *
+ * Names are never removed from the pool, so pointers to cached names remain
+ * valid forever. When the table or pool fills up, new PCs are simply not
+ * cached.
+ *
+ * When modules are unloaded, their addresses may be reused by others, so
+ * the cache is flushed by moving to a new generation. Entries from older
+ * generations are then skipped as if they were for other PCs, and their
+ * slots are reused by later inserts. Each slot has a sequence number that
+ * is odd while the slot is being rewritten, so readers can tell when what
+ * they read was changed underneath them (a seqlock).
+ */
+
+#define _XOPEN_SOURCE 500
+#include <stdatomic.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+// Number of slots in the table. Must be a power of 2.
+#define SHBT_SYMBOL_CACHE_SLOTS 4096
+// Maximum number of slots to probe before giving up.
+#define SHBT_SYMBOL_CACHE_MAX_PROBES 32
+// Size of the pool for symbol names.
+#define SHBT_SYMBOL_CACHE_POOL_SIZE (512 * 1024)
+
+// Values for the demangled name of a slot that are not pool offsets.
+#define SHBT_SYMBOL_CACHE_NOT_DEMANGLED UINT32_MAX
+#define SHBT_SYMBOL_CACHE_NO_DEMANGLING (UINT32_MAX - 1)
+
+/** A slot in the symbol cache. */
+struct symbol_cache_slot {
+  /** Odd while the slot is being written, and bumped twice per write. */
+  _Atomic uint32_t seq;
+  /** PC this slot is for, or 0 if the slot is free. */
+  _Atomic uintptr_t pc;
+  /** Cache generation the entry was added in. */
+  _Atomic uint32_t generation;
+  /** Offset of the symbol name in the pool. */
+  _Atomic uint32_t symbol;
+  /** Offset of the PC from the start of the function. */
+  _Atomic uint32_t offset;
+  /**
+   * The seq of the entry in the high 32 bits, and in the low 32 bits the
+   * offset of the demangled name in the pool or one of
+   * SHBT_SYMBOL_CACHE_NOT_DEMANGLED (not yet demangled) and
+   * SHBT_SYMBOL_CACHE_NO_DEMANGLING (the symbol cannot be demangled). This
+   * is set after the entry is published, and only for the same seq.
+   */
+  _Atomic uint64_t demangled;
+};
+
+/** A consistent copy of a slot's entry. */
+struct symbol_cache_entry {
+  uint32_t seq;
+  uintptr_t pc;
+  uint32_t generation;
+  uint32_t symbol;
+  uint32_t offset;
+};
+
+static struct symbol_cache_slot symbol_cache[SHBT_SYMBOL_CACHE_SLOTS];
+static char symbol_cache_pool[SHBT_SYMBOL_CACHE_POOL_SIZE];
+static atomic_size_t symbol_cache_pool_used = 0;
+// Entries from other generations are stale.
+static _Atomic uint32_t symbol_cache_generation = 0;
+
+// Return the first slot to probe for pc.
+static size_t symbol_cache_hash(uintptr_t pc) {
+  // Fibonacci hashing; the low bits of PCs are not well distributed.
+  return (size_t) (((uint64_t) pc * 0x9e3779b97f4a7c15ull) >> 32) &
+         (SHBT_SYMBOL_CACHE_SLOTS - 1);
+}
+
+// Copy the entry in slot. Returns false if the slot is being written.
+static bool symbol_cache_read(struct symbol_cache_slot* slot,
+                              struct symbol_cache_entry* entry) {
+  entry->seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+  if (entry->seq & 1) {
+    return false;
+  }
+  entry->pc = atomic_load_explicit(&slot->pc, memory_order_relaxed);
+  entry->generation = atomic_load_explicit(&slot->generation,
+                                           memory_order_relaxed);
+  entry->symbol = atomic_load_explicit(&slot->symbol, memory_order_relaxed);
+  entry->offset = atomic_load_explicit(&slot->offset, memory_order_relaxed);
+  atomic_thread_fence(memory_order_acquire);
+  return atomic_load_explicit(&slot->seq, memory_order_relaxed) == entry->seq;
+}
+
+// Find the entry for pc in the current generation. Returns NULL if it is
+// not cached, and otherwise its slot, with the entry copied to entry.
+static struct symbol_cache_slot* symbol_cache_find(
+  uintptr_t pc, struct symbol_cache_entry* entry) {
+  if (pc == 0) {
+    return NULL;
+  }
+  uint32_t generation = atomic_load_explicit(&symbol_cache_generation,
+                                             memory_order_acquire);
+  size_t i = symbol_cache_hash(pc);
+  for (size_t probe = 0; probe < SHBT_SYMBOL_CACHE_MAX_PROBES; ++probe) {
+    struct symbol_cache_slot* slot = &symbol_cache[i];
+    // Slots being written are skipped; slots are never freed, so the entry
+    // may still be further on.
+    if (symbol_cache_read(slot, entry)) {
+      if (entry->pc == pc && entry->generation == generation) {
+        return slot;
+      }
+      if (entry->pc == 0) {
+        return NULL;
+      }
+    }
+    i = (i + 1) & (SHBT_SYMBOL_CACHE_SLOTS - 1);
+  }
+  return NULL;
+}
+
+// Copy str into the pool. Returns its offset, or UINT32_MAX if it is full.
+static uint32_t symbol_cache_add_string(const char* str) {
+  size_t len = strlen(str) + 1;
+  if (len > SHBT_SYMBOL_CACHE_POOL_SIZE) {
+    return UINT32_MAX;
+  }
+  size_t used = atomic_load_explicit(&symbol_cache_pool_used,
+                                     memory_order_relaxed);
+  do {
+    if (used + len > SHBT_SYMBOL_CACHE_POOL_SIZE) {
+      return UINT32_MAX;
+    }
+  } while (!atomic_compare_exchange_weak_explicit(
+             &symbol_cache_pool_used, &used, used + len,
+             memory_order_relaxed, memory_order_relaxed));
+  memcpy(symbol_cache_pool + used, str, len);
+  return (uint32_t) used;
+}
+
+const char* shbt_symbol_cache_lookup(uintptr_t pc, uintptr_t* offset) {
+  struct symbol_cache_entry entry;
+  if (symbol_cache_find(pc, &entry) == NULL) {
+    return NULL;
+  }
+  *offset = entry.offset;
+  return symbol_cache_pool + entry.symbol;
+}
+
+uint32_t shbt_symbol_cache_generation() {
+  return atomic_load_explicit(&symbol_cache_generation, memory_order_acquire);
+}
+
+void shbt_symbol_cache_insert(uintptr_t pc, const char* symbol,
+                              uintptr_t offset, uint32_t generation) {
+  if (pc == 0 || offset > UINT32_MAX ||
+      generation != shbt_symbol_cache_generation()) {
+    return;
+  }
+  size_t i = symbol_cache_hash(pc);
+  uint32_t symbol_ref = UINT32_MAX;
+  for (size_t probe = 0; probe < SHBT_SYMBOL_CACHE_MAX_PROBES; ++probe) {
+    struct symbol_cache_slot* slot = &symbol_cache[i];
+    struct symbol_cache_entry entry;
+    if (!symbol_cache_read(slot, &entry)) {
+      i = (i + 1) & (SHBT_SYMBOL_CACHE_SLOTS - 1);
+      continue;
+    }
+    if (entry.generation == generation && entry.pc == pc) {
+      return;  // Already cached.
+    }
+    // Free slots and stale entries can be (re)used.
+    if (entry.pc == 0 || entry.generation != generation) {
+      // A stale entry for the same symbol keeps its names, so a hot PC does
+      // not use more of the pool each time the cache is flushed.
+      uint32_t demangled = SHBT_SYMBOL_CACHE_NOT_DEMANGLED;
+      uint32_t slot_symbol_ref = symbol_ref;
+      if (entry.pc == pc &&
+          strcmp(symbol_cache_pool + entry.symbol, symbol) == 0) {
+        slot_symbol_ref = entry.symbol;
+        uint64_t slot_demangled = atomic_load_explicit(&slot->demangled,
+                                                       memory_order_acquire);
+        if ((uint32_t) (slot_demangled >> 32) == entry.seq) {
+          demangled = (uint32_t) slot_demangled;
+        }
+      }
+      // Copy the name before claiming a slot, so a slot is never left
+      // claimed but empty when the pool is full.
+      if (slot_symbol_ref == UINT32_MAX) {
+        symbol_ref = symbol_cache_add_string(symbol);
+        if (symbol_ref == UINT32_MAX) {
+          return;
+        }
+        slot_symbol_ref = symbol_ref;
+      }
+      uint32_t seq = entry.seq;
+      if (atomic_compare_exchange_strong_explicit(
+            &slot->seq, &seq, entry.seq + 1,
+            memory_order_relaxed, memory_order_relaxed)) {
+        // Order the odd seq before the writes, for readers.
+        atomic_thread_fence(memory_order_release);
+        atomic_store_explicit(&slot->pc, pc, memory_order_relaxed);
+        atomic_store_explicit(&slot->generation, generation,
+                              memory_order_relaxed);
+        atomic_store_explicit(&slot->symbol, slot_symbol_ref,
+                              memory_order_relaxed);
+        atomic_store_explicit(&slot->offset, (uint32_t) offset,
+                              memory_order_relaxed);
+        atomic_store_explicit(
+          &slot->demangled, ((uint64_t) (entry.seq + 2) << 32) | demangled,
+          memory_order_relaxed);
+        atomic_store_explicit(&slot->seq, entry.seq + 2,
+                              memory_order_release);
+        return;
+      }
+      // Someone else wrote the slot first; check what they wrote.
+      if (symbol_cache_read(slot, &entry) && entry.pc == pc &&
+          entry.generation == generation) {
+        return;
+      }
+    }
+    i = (i + 1) & (SHBT_SYMBOL_CACHE_SLOTS - 1);
+  }
+}
+
+void shbt_symbol_cache_flush() {
+  atomic_fetch_add_explicit(&symbol_cache_generation, 1,
+                            memory_order_release);
+}
+
+void shbt_symbol_cache_reset() {
+  for (size_t i = 0; i < SHBT_SYMBOL_CACHE_SLOTS; ++i) {
+    atomic_store_explicit(&symbol_cache[i].pc, 0, memory_order_relaxed);
+    atomic_store_explicit(&symbol_cache[i].generation, 0,
+                          memory_order_relaxed);
+  }
+  atomic_store_explicit(&symbol_cache_pool_used, 0, memory_order_relaxed);
+}
+
+const char* shbt_symbol_cache_demangle(uintptr_t pc, const char* symbol,
+                                       char* buf, size_t size) {
+  struct symbol_cache_entry entry;
+  struct symbol_cache_slot* slot = symbol_cache_find(pc, &entry);
+  // Only use the slot if it is for the same symbol, since the caller's PC
+  // may not have been looked up the same way.
+  if (slot != NULL && strcmp(symbol_cache_pool + entry.symbol, symbol) != 0) {
+    slot = NULL;
+  }
+  // The demangled name is only for this entry while its seq matches.
+  uint64_t not_demangled =
+    ((uint64_t) entry.seq << 32) | SHBT_SYMBOL_CACHE_NOT_DEMANGLED;
+  if (slot != NULL) {
+    uint64_t demangled = atomic_load_explicit(&slot->demangled,
+                                              memory_order_acquire);
+    if ((uint32_t) (demangled >> 32) != entry.seq) {
+      slot = NULL;
+    } else if ((uint32_t) demangled == SHBT_SYMBOL_CACHE_NO_DEMANGLING) {
+      return NULL;
+    } else if ((uint32_t) demangled != SHBT_SYMBOL_CACHE_NOT_DEMANGLED) {
+      return symbol_cache_pool + (uint32_t) demangled;
+    }
+  }
+  if (!shbt_demangle(symbol, buf, size)) {
+    if (slot != NULL) {
+      uint64_t expected = not_demangled;
+      atomic_compare_exchange_strong_explicit(
+        &slot->demangled, &expected,
+        ((uint64_t) entry.seq << 32) | SHBT_SYMBOL_CACHE_NO_DEMANGLING,
+        memory_order_release, memory_order_relaxed);
+    }
+    return NULL;
+  }
+  if (slot != NULL) {
+    uint32_t demangled_ref = symbol_cache_add_string(buf);
+    if (demangled_ref != UINT32_MAX) {
+      // If someone else got here first, their copy is identical. If the slot
+      // has been reused since, its seq differs and nothing is changed.
+      uint64_t expected = not_demangled;
+      atomic_compare_exchange_strong_explicit(
+        &slot->demangled, &expected,
+        ((uint64_t) entry.seq << 32) | demangled_ref,
+        memory_order_release, memory_order_relaxed);
+    }
+  }
+  return buf;
+}
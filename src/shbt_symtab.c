@@ -0,0 +1,538 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Precomputed index of ELF function symbols for loaded modules.
+ *
+ * Building the index maps each module's file and collects its function
+ * symbols into a sorted table, so lookups are a binary search with no
+ * allocation or file access.
+ *
+ * Once built, the index is rebuilt whenever modules are loaded or unloaded
+ * (see shbt_check_modules), so unloaded modules are dropped before another
+ * module can be loaded at their addresses and be given their names.
+ *
+ * Symbols are indexed once per file, relative to where it is loaded, so a
+ * module that is reloaded (even at another address) reuses its symbols.
+ * As with the module snapshot, there are two index slots: a new index is
+ * built in whichever is not current and then published. Readers count
+ * themselves in and out of a slot, and an index (and any files only it
+ * used) is freed once no reader can still be using it.
+ */
+
+#define _GNU_SOURCE  // For dl_iterate_phdr.
+#include <stdint.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+#ifdef __linux__
+
+#include <elf.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if UINTPTR_MAX == UINT64_MAX
+#define SHBT_ELFCLASS ELFCLASS64
+#define SHBT_ELF_ST_TYPE ELF64_ST_TYPE
+#else
+#define SHBT_ELFCLASS ELFCLASS32
+#define SHBT_ELF_ST_TYPE ELF32_ST_TYPE
+#endif
+
+/** A function symbol in the index. */
+struct symtab_entry {
+  /** Start of the function, relative to the module's load address. */
+  uintptr_t addr;
+  /** Size of the function (0 if not known). */
+  uint32_t size;
+  /** Offset of the name in the module's string table. */
+  uint32_t name;
+};
+
+/** Indexed symbols for one file. */
+struct symtab_module {
+  /** Device of the module's file. */
+  dev_t dev;
+  /** Inode of the module's file. */
+  ino_t ino;
+  /** Size and modification time, in case the inode was reused. */
+  off_t file_size;
+  struct timespec mtime;
+  /** Number of places in indices that use this module. */
+  size_t refs;
+  /** Mapping of the whole file. */
+  void* map;
+  /** Symbols, sorted by address. */
+  struct symtab_entry* entries;
+  /** Number of entries. */
+  size_t num_entries;
+  /** Size of the mapping of entries. */
+  size_t entries_size;
+  /** String table for symbol names (in the file mapping). */
+  const char* strtab;
+  /** Size of strtab. */
+  size_t strtab_size;
+};
+
+/** Where a module is loaded. */
+struct symtab_placement {
+  /** Address the module was loaded at. */
+  uintptr_t base;
+  /** Start of the module's loaded segments. */
+  uintptr_t start;
+  /** End of the module's loaded segments. */
+  uintptr_t end;
+  struct symtab_module* module;
+};
+
+/** Index of all modules. */
+struct symtab_index {
+  /** Number of modules. */
+  size_t num_modules;
+  /** Modules, sorted by start address. */
+  struct symtab_placement modules[];
+};
+
+/** Information on a loaded module gathered from dl_iterate_phdr. */
+struct loaded_module {
+  uintptr_t base;
+  uintptr_t start;
+  uintptr_t end;
+  char path[PATH_MAX];
+};
+
+struct loaded_module_list {
+  struct loaded_module* modules;
+  size_t num_modules;
+  size_t capacity;
+};
+
+static struct symtab_index* symbol_indices[2];
+// Index of the current slot, or -1 if the index has not been built.
+static atomic_int symbol_index_current = -1;
+static atomic_int symbol_index_readers[2];
+// Serializes building the index.
+static pthread_mutex_t symbol_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int gather_loaded_module(struct dl_phdr_info* info, size_t size,
+                                void* data) {
+  (void) size;
+  struct loaded_module_list* list = (struct loaded_module_list*) data;
+  const char* path = info->dlpi_name;
+  if (path == NULL || path[0] == '\0') {
+    // Only the main executable is unnamed (the vDSO has a name but no
+    // file, and will be skipped when it cannot be opened).
+    if (list->num_modules != 0) {
+      return 0;
+    }
+    path = "/proc/self/exe";
+  }
+  uintptr_t start = UINTPTR_MAX;
+  uintptr_t end = 0;
+  for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type != PT_LOAD) {
+      continue;
+    }
+    uintptr_t seg_start = info->dlpi_addr + phdr->p_vaddr;
+    uintptr_t seg_end = seg_start + phdr->p_memsz;
+    start = seg_start < start ? seg_start : start;
+    end = seg_end > end ? seg_end : end;
+  }
+  if (start >= end) {
+    return 0;
+  }
+  if (list->num_modules == list->capacity) {
+    size_t capacity = list->capacity ? 2 * list->capacity : 32;
+    struct loaded_module* modules =
+      realloc(list->modules, capacity * sizeof(struct loaded_module));
+    if (modules == NULL) {
+      return 1;
+    }
+    list->modules = modules;
+    list->capacity = capacity;
+  }
+  struct loaded_module* module = &list->modules[list->num_modules++];
+  module->base = info->dlpi_addr;
+  module->start = start;
+  module->end = end;
+  strncpy(module->path, path, sizeof(module->path) - 1);
+  module->path[sizeof(module->path) - 1] = '\0';
+  return 0;
+}
+
+static int compare_entries(const void* a, const void* b) {
+  const struct symtab_entry* ea = (const struct symtab_entry*) a;
+  const struct symtab_entry* eb = (const struct symtab_entry*) b;
+  if (ea->addr != eb->addr) {
+    return ea->addr < eb->addr ? -1 : 1;
+  }
+  // Larger sizes first, so aliases without a size are dropped.
+  if (ea->size != eb->size) {
+    return ea->size > eb->size ? -1 : 1;
+  }
+  // qsort is not stable, so break ties to pick the same alias every time.
+  if (ea->name != eb->name) {
+    return ea->name < eb->name ? -1 : 1;
+  }
+  return 0;
+}
+
+static int compare_modules(const void* a, const void* b) {
+  const struct symtab_placement* ma = (const struct symtab_placement*) a;
+  const struct symtab_placement* mb = (const struct symtab_placement*) b;
+  if (ma->start != mb->start) {
+    return ma->start < mb->start ? -1 : 1;
+  }
+  return 0;
+}
+
+// Return true if sym is a defined function that should be indexed.
+static bool is_indexed_symbol(const ElfW(Sym)* sym, size_t strtab_size) {
+  unsigned char type = SHBT_ELF_ST_TYPE(sym->st_info);
+  return (type == STT_FUNC || type == STT_GNU_IFUNC) &&
+         sym->st_shndx != SHN_UNDEF && sym->st_value != 0 &&
+         sym->st_name < strtab_size;
+}
+
+// Index the function symbols of the ELF file mapped at map.
+// Returns false if the file is not a usable ELF file.
+static bool index_elf(const char* map, size_t map_size,
+                      struct symtab_module* module) {
+  if (map_size < sizeof(ElfW(Ehdr))) {
+    return false;
+  }
+  const ElfW(Ehdr)* ehdr = (const ElfW(Ehdr)*) map;
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != SHBT_ELFCLASS ||
+      ehdr->e_shentsize != sizeof(ElfW(Shdr)) || ehdr->e_shoff == 0 ||
+      ehdr->e_shoff > map_size ||
+      (map_size - ehdr->e_shoff) / sizeof(ElfW(Shdr)) < ehdr->e_shnum) {
+    return false;
+  }
+  const ElfW(Shdr)* shdrs = (const ElfW(Shdr)*) (map + ehdr->e_shoff);
+  // Prefer the full symbol table, but stripped binaries only have the
+  // dynamic one.
+  const ElfW(Shdr)* symtab = NULL;
+  for (ElfW(Half) i = 0; i < ehdr->e_shnum; ++i) {
+    if (shdrs[i].sh_type == SHT_SYMTAB) {
+      symtab = &shdrs[i];
+      break;
+    } else if (shdrs[i].sh_type == SHT_DYNSYM) {
+      symtab = &shdrs[i];
+    }
+  }
+  if (symtab == NULL || symtab->sh_entsize != sizeof(ElfW(Sym)) ||
+      symtab->sh_link >= ehdr->e_shnum || symtab->sh_offset > map_size ||
+      map_size - symtab->sh_offset < symtab->sh_size) {
+    return false;
+  }
+  const ElfW(Shdr)* strtab = &shdrs[symtab->sh_link];
+  if (strtab->sh_offset > map_size ||
+      map_size - strtab->sh_offset < strtab->sh_size ||
+      strtab->sh_size > UINT32_MAX) {
+    return false;
+  }
+  const ElfW(Sym)* syms = (const ElfW(Sym)*) (map + symtab->sh_offset);
+  size_t num_syms = symtab->sh_size / sizeof(ElfW(Sym));
+  // Count function symbols so we can size the table.
+  size_t num_funcs = 0;
+  for (size_t i = 0; i < num_syms; ++i) {
+    if (is_indexed_symbol(&syms[i], strtab->sh_size)) {
+      ++num_funcs;
+    }
+  }
+  if (num_funcs == 0) {
+    return false;
+  }
+  size_t entries_size = num_funcs * sizeof(struct symtab_entry);
+  struct symtab_entry* entries =
+    mmap(NULL, entries_size, PROT_READ | PROT_WRITE,
+         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (entries == MAP_FAILED) {
+    return false;
+  }
+  size_t num_entries = 0;
+  for (size_t i = 0; i < num_syms; ++i) {
+    if (is_indexed_symbol(&syms[i], strtab->sh_size)) {
+      entries[num_entries].addr = syms[i].st_value;
+      entries[num_entries].size =
+        syms[i].st_size < UINT32_MAX ? syms[i].st_size : UINT32_MAX;
+      entries[num_entries].name = syms[i].st_name;
+      ++num_entries;
+    }
+  }
+  qsort(entries, num_entries, sizeof(struct symtab_entry), compare_entries);
+  // Drop aliases (multiple symbols at the same address).
+  size_t num_unique = 1;
+  for (size_t i = 1; i < num_entries; ++i) {
+    if (entries[i].addr != entries[num_unique - 1].addr) {
+      entries[num_unique++] = entries[i];
+    }
+  }
+  module->entries = entries;
+  module->num_entries = num_unique;
+  module->entries_size = entries_size;
+  module->strtab = map + strtab->sh_offset;
+  module->strtab_size = strtab->sh_size;
+  return true;
+}
+
+// Index the file of a loaded module, or reuse it from the current index.
+// Returns NULL if it could not be indexed. Must be called with
+// symbol_index_mutex held.
+static struct symtab_module* index_module(const struct loaded_module* loaded,
+                                          struct symtab_index* old_index) {
+  int fd = open(loaded->path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size <= 0) {
+    close(fd);
+    return NULL;
+  }
+  // Reuse the module if its file has already been indexed.
+  if (old_index != NULL) {
+    for (size_t i = 0; i < old_index->num_modules; ++i) {
+      struct symtab_module* module = old_index->modules[i].module;
+      if (module->dev == st.st_dev && module->ino == st.st_ino &&
+          module->file_size == st.st_size &&
+          module->mtime.tv_sec == st.st_mtim.tv_sec &&
+          module->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+        close(fd);
+        ++module->refs;
+        return module;
+      }
+    }
+  }
+  void* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+  struct symtab_module* module = calloc(1, sizeof(struct symtab_module));
+  if (module == NULL) {
+    munmap(map, st.st_size);
+    return NULL;
+  }
+  module->dev = st.st_dev;
+  module->ino = st.st_ino;
+  module->file_size = st.st_size;
+  module->mtime = st.st_mtim;
+  module->refs = 1;
+  // The file stays mapped, since the names point into it.
+  module->map = map;
+  if (!index_elf((const char*) map, st.st_size, module)) {
+    munmap(map, st.st_size);
+    free(module);
+    return NULL;
+  }
+  return module;
+}
+
+// Free an index, and the modules that no other index uses. Must be called
+// with symbol_index_mutex held, once no reader can be using the index.
+static void free_index(struct symtab_index* index) {
+  for (size_t i = 0; i < index->num_modules; ++i) {
+    struct symtab_module* module = index->modules[i].module;
+    if (--module->refs == 0) {
+      munmap(module->entries, module->entries_size);
+      munmap(module->map, module->file_size);
+      free(module);
+    }
+  }
+  free(index);
+}
+
+bool shbt_build_symbol_index() {
+  struct loaded_module_list list = {NULL, 0, 0};
+  if (dl_iterate_phdr(gather_loaded_module, &list) != 0) {
+    free(list.modules);
+    return false;
+  }
+  pthread_mutex_lock(&symbol_index_mutex);
+  int current = atomic_load(&symbol_index_current);
+  int next = current == 0 ? 1 : 0;
+  struct symtab_index* old_index = current >= 0 ? symbol_indices[current]
+                                                : NULL;
+  struct symtab_index* index =
+    malloc(sizeof(struct symtab_index) +
+           list.num_modules * sizeof(struct symtab_placement));
+  if (index == NULL) {
+    pthread_mutex_unlock(&symbol_index_mutex);
+    free(list.modules);
+    return false;
+  }
+  index->num_modules = 0;
+  for (size_t i = 0; i < list.num_modules; ++i) {
+    struct symtab_module* module = index_module(&list.modules[i], old_index);
+    if (module != NULL) {
+      struct symtab_placement* placement =
+        &index->modules[index->num_modules++];
+      placement->base = list.modules[i].base;
+      placement->start = list.modules[i].start;
+      placement->end = list.modules[i].end;
+      placement->module = module;
+    }
+  }
+  qsort(index->modules, index->num_modules, sizeof(struct symtab_placement),
+        compare_modules);
+  // Wait out any handler still reading the index from two builds ago.
+  while (atomic_load(&symbol_index_readers[next]) != 0) {
+    struct timespec delay = {0, 1000000};
+    nanosleep(&delay, NULL);
+  }
+  if (symbol_indices[next] != NULL) {
+    free_index(symbol_indices[next]);
+  }
+  symbol_indices[next] = index;
+  atomic_store(&symbol_index_current, next);
+  pthread_mutex_unlock(&symbol_index_mutex);
+  free(list.modules);
+  return true;
+}
+
+void shbt_update_symbol_index() {
+  if (atomic_load(&symbol_index_current) >= 0) {
+    shbt_build_symbol_index();
+  }
+}
+
+// Start reading the current index. Returns its slot, or -1 if there is
+// none.
+static int symbol_index_acquire() {
+  for (;;) {
+    int current = atomic_load(&symbol_index_current);
+    if (current < 0) {
+      return -1;
+    }
+    atomic_fetch_add(&symbol_index_readers[current], 1);
+    // If a build published the other slot in the meantime, this one may be
+    // about to be freed, so switch.
+    if (atomic_load(&symbol_index_current) == current) {
+      return current;
+    }
+    atomic_fetch_sub(&symbol_index_readers[current], 1);
+  }
+}
+
+// Find the name of the function containing addr in an index, and how much
+// of the string table follows it.
+static const char* symbol_index_find(const struct symtab_index* index,
+                                     uintptr_t addr, uintptr_t* start,
+                                     size_t* max_len) {
+  if (index->num_modules == 0) {
+    return NULL;
+  }
+  // Find the last module starting at or before addr.
+  size_t lo = 0;
+  size_t hi = index->num_modules;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->modules[mid].start <= addr) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  const struct symtab_placement* placement = &index->modules[lo];
+  if (addr < placement->start || addr >= placement->end) {
+    return NULL;
+  }
+  // Find the last symbol starting at or before addr.
+  const struct symtab_module* module = placement->module;
+  const struct symtab_entry* entries = module->entries;
+  uintptr_t rel_addr = addr - placement->base;
+  lo = 0;
+  hi = module->num_entries;
+  if (entries[0].addr > rel_addr) {
+    return NULL;
+  }
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (entries[mid].addr <= rel_addr) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  const struct symtab_entry* entry = &entries[lo];
+  if (entry->size != 0 && rel_addr - entry->addr >= entry->size) {
+    return NULL;  // Between functions.
+  }
+  *start = placement->base + entry->addr;
+  *max_len = module->strtab_size - entry->name;
+  return module->strtab + entry->name;
+}
+
+size_t shbt_symbol_index_lookup(uintptr_t addr, char* buf, size_t size,
+                                uintptr_t* start) {
+  int slot = symbol_index_acquire();
+  if (slot < 0) {
+    return 0;
+  }
+  size_t max_len = 0;
+  const char* name = symbol_index_find(symbol_indices[slot], addr, start,
+                                       &max_len);
+  size_t len = 0;
+  if (name != NULL) {
+    // Copy the name before releasing the index, which may then be freed.
+    // The string table may not be terminated, so stop at its end.
+    while (len < max_len && name[len] != '\0') {
+      if (len + 1 < size) {
+        buf[len] = name[len];
+      }
+      ++len;
+    }
+    if (size > 0) {
+      buf[len < size ? len : size - 1] = '\0';
+    }
+  }
+  atomic_fetch_sub(&symbol_index_readers[slot], 1);
+  return len;
+}
+
+#else  // __linux__
+
+// The index needs ELF and dl_iterate_phdr. Elsewhere, there is never an
+// index, so lookups always fall back to libunwind.
+
+bool shbt_build_symbol_index() {
+  return false;
+}
+
+void shbt_update_symbol_index() {}
+
+size_t shbt_symbol_index_lookup(uintptr_t addr, char* buf, size_t size,
+                                uintptr_t* start) {
+  (void) addr;
+  (void) buf;
+  (void) size;
+  (void) start;
+  return 0;
+}
+
+#endif  // __linux__
@@ -0,0 +1,421 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Backtraces of other threads.
+ *
+ * A thread is asked for its backtrace by queueing a reserved real-time
+ * signal to it. The signal's value identifies a preallocated slot, which the
+ * handler claims, fills with the addresses of the interrupted stack, and
+ * marks done. The requester polls the slots until they are done or a
+ * timeout expires, so a thread that never handles the signal (e.g. because
+ * it is blocked) cannot hang the caller.
+ *
+ * Each request has a generation number, and a handler only fills a slot
+ * that is still waiting for the same generation. A signal that arrives after
+ * its request timed out is therefore ignored. The handler walks the stack
+ * into its own buffer and only copies it to the slot if the request is still
+ * claimed by it, so a handler that is too slow (e.g. blocked on a lock while
+ * unwinding) is abandoned at the deadline and cannot overwrite a later
+ * capture.
+ *
+ * Everything uses static storage and async-signal-safe calls, so this can be
+ * used from signal handlers. Only one capture runs at a time; concurrent
+ * callers fail rather than wait.
+ */
+
+#define _GNU_SOURCE  // For SYS_rt_tgsigqueueinfo and SYS_getdents64.
+#include <stdint.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Signal used to request backtraces.
+#define SHBT_THREADS_SIGNAL (SIGRTMAX - 5)
+// Number of threads that are asked for backtraces at once.
+#define SHBT_THREADS_SLOTS 64
+// Maximum number of frames captured from a thread.
+#define SHBT_THREADS_MAX_FRAMES 128
+// How long to sleep between checks for responses, in nanoseconds.
+#define SHBT_THREADS_POLL_NS 20000
+
+// Phases of a slot, kept in the low bits of its state with the generation
+// above them.
+#define SLOT_IDLE 0
+#define SLOT_REQUESTED 1
+#define SLOT_CLAIMED 2
+#define SLOT_WRITING 3
+#define SLOT_DONE 4
+#define SLOT_STATE(generation, phase) (((generation) << 3) | (phase))
+// Generations wrap at this, so they fit in a signal value with the slot.
+#define SLOT_GENERATION_MASK 0x3fffff
+
+/** A slot for one thread's backtrace. */
+struct thread_slot {
+  /** Thread the backtrace is requested from. */
+  pid_t tid;
+  /** Generation and phase of the request. */
+  _Atomic uint32_t state;
+  /** Whether pcs[0] is an interrupted instruction, not a return address. */
+  bool interrupted;
+  /** Captured addresses. */
+  void* pcs[SHBT_THREADS_MAX_FRAMES];
+  size_t num_pcs;
+};
+
+static struct thread_slot thread_slots[SHBT_THREADS_SLOTS];
+static atomic_flag threads_busy = ATOMIC_FLAG_INIT;
+static bool threads_handler_installed = false;
+static uint32_t threads_generation = 0;
+// For symbolizing while dumping; too large for a signal stack.
+static shbt_frame_t threads_frames[SHBT_THREADS_MAX_FRAMES];
+
+/** Directory entry returned by getdents64, which has no libc wrapper. */
+struct threads_dirent {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+static pid_t threads_gettid() {
+  return (pid_t) syscall(SYS_gettid);
+}
+
+static void threads_handler(int sig_num, siginfo_t* info, void* ucontext) {
+  (void) sig_num;
+  if (info->si_code != SI_QUEUE || info->si_pid != getpid()) {
+    return;  // Not a request from us.
+  }
+  int saved_errno = errno;
+  uint32_t value = (uint32_t) info->si_value.sival_int;
+  size_t index = value & 0xff;
+  uint32_t generation = value >> 8;
+  if (index < SHBT_THREADS_SLOTS) {
+    struct thread_slot* slot = &thread_slots[index];
+    uint32_t expected = SLOT_STATE(generation, SLOT_REQUESTED);
+    if (atomic_compare_exchange_strong_explicit(
+          &slot->state, &expected, SLOT_STATE(generation, SLOT_CLAIMED),
+          memory_order_acquire, memory_order_relaxed)) {
+      // Unwinding can take arbitrarily long, and the requester may give up
+      // meanwhile, so only touch the slot once it is known to be ours.
+      void* pcs[SHBT_THREADS_MAX_FRAMES];
+      size_t num_pcs = shbt_collect_signal_addresses(ucontext, pcs,
+                                                     SHBT_THREADS_MAX_FRAMES);
+      expected = SLOT_STATE(generation, SLOT_CLAIMED);
+      if (atomic_compare_exchange_strong_explicit(
+            &slot->state, &expected, SLOT_STATE(generation, SLOT_WRITING),
+            memory_order_acquire, memory_order_relaxed)) {
+        memcpy(slot->pcs, pcs, num_pcs * sizeof(void*));
+        slot->num_pcs = num_pcs;
+        atomic_store_explicit(&slot->state,
+                              SLOT_STATE(generation, SLOT_DONE),
+                              memory_order_release);
+      }
+    }
+  }
+  errno = saved_errno;
+}
+
+static bool threads_install_handler() {
+  if (threads_handler_installed) {
+    return true;
+  }
+  // The handler stays installed, so late signals are harmless.
+  struct sigaction sa;
+  sa.sa_sigaction = threads_handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_RESTART | SA_SIGINFO;
+  if (sigaction(SHBT_THREADS_SIGNAL, &sa, NULL) < 0) {
+    return false;
+  }
+  shbt_frame_pointer_note_handler(SHBT_THREADS_SIGNAL);
+  threads_handler_installed = true;
+  return true;
+}
+
+static int64_t threads_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Capture the backtraces of the threads set in the first num_slots slots.
+// Slots whose thread did not respond in time have no addresses.
+// Must be called with threads_busy held.
+static void threads_capture(size_t num_slots, int timeout_ms) {
+  pid_t pid = getpid();
+  pid_t self = threads_gettid();
+  threads_generation = (threads_generation + 1) & SLOT_GENERATION_MASK;
+  uint32_t generation = threads_generation;
+  for (size_t i = 0; i < num_slots; ++i) {
+    struct thread_slot* slot = &thread_slots[i];
+    slot->num_pcs = 0;
+    slot->interrupted = true;
+    if (slot->tid == self) {
+      // No need to interrupt ourselves.
+      shbt_collect_addresses(slot->pcs, SHBT_THREADS_MAX_FRAMES,
+                             &slot->num_pcs);
+      slot->interrupted = false;
+      atomic_store_explicit(&slot->state, SLOT_STATE(generation, SLOT_DONE),
+                            memory_order_relaxed);
+      continue;
+    }
+    atomic_store_explicit(&slot->state,
+                          SLOT_STATE(generation, SLOT_REQUESTED),
+                          memory_order_release);
+    siginfo_t info;
+    memset(&info, 0, sizeof(info));
+    info.si_signo = SHBT_THREADS_SIGNAL;
+    info.si_code = SI_QUEUE;
+    info.si_pid = pid;
+    info.si_uid = getuid();
+    info.si_value.sival_int = (int) ((generation << 8) | i);
+    if (syscall(SYS_rt_tgsigqueueinfo, pid, slot->tid, SHBT_THREADS_SIGNAL,
+                &info) < 0) {
+      // Most likely the thread has exited.
+      atomic_store_explicit(&slot->state, SLOT_IDLE, memory_order_relaxed);
+    }
+  }
+  // Wait for every thread to respond, up to the timeout.
+  int64_t deadline = threads_now_ns() + (int64_t) timeout_ms * 1000000;
+  for (;;) {
+    bool waiting = false;
+    for (size_t i = 0; i < num_slots && !waiting; ++i) {
+      uint32_t state = atomic_load_explicit(&thread_slots[i].state,
+                                            memory_order_acquire);
+      waiting = state == SLOT_STATE(generation, SLOT_REQUESTED) ||
+                state == SLOT_STATE(generation, SLOT_CLAIMED) ||
+                state == SLOT_STATE(generation, SLOT_WRITING);
+    }
+    if (!waiting || threads_now_ns() >= deadline) {
+      break;
+    }
+    struct timespec poll = {0, SHBT_THREADS_POLL_NS};
+    nanosleep(&poll, NULL);
+  }
+  // Abandon requests that were not answered in time, whether or not their
+  // handler has started. A handler that finishes later then fails to move the
+  // slot out of SLOT_CLAIMED and leaves it alone. Only a handler that is
+  // already copying its addresses, which takes no locks, is waited for.
+  for (size_t i = 0; i < num_slots; ++i) {
+    struct thread_slot* slot = &thread_slots[i];
+    uint32_t expected = SLOT_STATE(generation, SLOT_REQUESTED);
+    if (!atomic_compare_exchange_strong_explicit(
+          &slot->state, &expected, SLOT_IDLE,
+          memory_order_acquire, memory_order_relaxed)) {
+      expected = SLOT_STATE(generation, SLOT_CLAIMED);
+      atomic_compare_exchange_strong_explicit(
+          &slot->state, &expected, SLOT_IDLE,
+          memory_order_acquire, memory_order_relaxed);
+      while (atomic_load_explicit(&slot->state, memory_order_acquire) ==
+             SLOT_STATE(generation, SLOT_WRITING)) {
+        struct timespec poll = {0, SHBT_THREADS_POLL_NS};
+        nanosleep(&poll, NULL);
+      }
+    }
+    if (atomic_load_explicit(&slot->state, memory_order_acquire) !=
+        SLOT_STATE(generation, SLOT_DONE)) {
+      slot->num_pcs = 0;
+    }
+  }
+}
+
+// Symbolize the addresses captured in a slot into trace.
+static void threads_symbolize(const struct thread_slot* slot,
+                              shbt_frame_t trace[], size_t num_frames) {
+  shbt_symbolize_ex(slot->pcs, num_frames, trace, slot->interrupted);
+}
+
+static bool threads_begin() {
+  if (atomic_flag_test_and_set_explicit(&threads_busy,
+                                        memory_order_acquire)) {
+    return false;  // Another capture is running.
+  }
+  if (!threads_install_handler()) {
+    atomic_flag_clear_explicit(&threads_busy, memory_order_release);
+    return false;
+  }
+  return true;
+}
+
+static void threads_end() {
+  atomic_flag_clear_explicit(&threads_busy, memory_order_release);
+}
+
+bool shbt_collect_thread_addresses(int tid, void* pcs[], size_t max_pcs,
+                                   size_t* num_pcs, int timeout_ms) {
+  if (!threads_begin()) {
+    return false;
+  }
+  struct thread_slot* slot = &thread_slots[0];
+  slot->tid = (pid_t) tid;
+  threads_capture(1, timeout_ms);
+  bool ok = slot->num_pcs > 0;
+  *num_pcs = slot->num_pcs < max_pcs ? slot->num_pcs : max_pcs;
+  memcpy(pcs, slot->pcs, *num_pcs * sizeof(void*));
+  threads_end();
+  return ok;
+}
+
+bool shbt_collect_thread_backtrace(int tid, shbt_frame_t trace[],
+                                   size_t num_frames,
+                                   size_t* num_valid_frames, int timeout_ms) {
+  if (!threads_begin()) {
+    return false;
+  }
+  struct thread_slot* slot = &thread_slots[0];
+  slot->tid = (pid_t) tid;
+  threads_capture(1, timeout_ms);
+  bool ok = slot->num_pcs > 0;
+  *num_valid_frames = slot->num_pcs < num_frames ? slot->num_pcs : num_frames;
+  threads_symbolize(slot, trace, *num_valid_frames);
+  threads_end();
+  return ok;
+}
+
+void shbt_write_thread_name(struct shbt_writer* writer, int tid) {
+  char path[64] = "/proc/self/task/";
+  size_t len = strlen(path);
+  shbt_itoa(tid, path + len, sizeof(path) - len, 10, 0);
+  strncat(path, "/comm", sizeof(path) - strlen(path) - 1);
+  char name[64];
+  ssize_t name_len = -1;
+  int fd = open(path, O_RDONLY);
+  if (fd >= 0) {
+    name_len = read(fd, name, sizeof(name) - 1);
+    close(fd);
+  }
+  shbt_writer_puts(writer, "Thread ");
+  shbt_writer_put_int(writer, tid, 10, 0);
+  if (name_len > 0) {
+    if (name[name_len - 1] == '\n') {
+      --name_len;
+    }
+    name[name_len] = '\0';
+    shbt_writer_puts(writer, " (");
+    shbt_writer_puts(writer, name);
+    shbt_writer_puts(writer, ")");
+  }
+}
+
+// Capture and print the threads in the first num_slots slots.
+static bool threads_dump_slots(int fd, size_t num_slots) {
+  threads_capture(num_slots, SHBT_THREAD_TIMEOUT_MS);
+  bool ok = true;
+  for (size_t i = 0; i < num_slots; ++i) {
+    struct thread_slot* slot = &thread_slots[i];
+    struct shbt_writer writer;
+    shbt_writer_init(&writer, fd);
+    shbt_write_thread_name(&writer, slot->tid);
+    shbt_writer_puts(&writer, slot->num_pcs > 0 ? ":\n" : ": no response\n");
+    ok = shbt_writer_finish(&writer) && ok;
+    if (slot->num_pcs > 0) {
+      threads_symbolize(slot, threads_frames, slot->num_pcs);
+      ok = shbt_print_collected_backtrace_fd(threads_frames, slot->num_pcs,
+                                             fd) && ok;
+    }
+  }
+  return ok;
+}
+
+bool shbt_dump_all_threads(int fd) {
+  // Read the directory with getdents64, since opendir allocates memory.
+  int dir = open("/proc/self/task", O_RDONLY | O_DIRECTORY);
+  if (dir < 0) {
+    return false;
+  }
+  if (!threads_begin()) {
+    close(dir);
+    return false;
+  }
+  bool ok = true;
+  size_t num_slots = 0;
+  char buf[4096] __attribute__((aligned(8)));
+  long len;
+  while ((len = syscall(SYS_getdents64, dir, buf, sizeof(buf))) > 0) {
+    for (long pos = 0; pos < len;) {
+      struct threads_dirent* entry = (struct threads_dirent*) (buf + pos);
+      pos += entry->d_reclen;
+      pid_t tid = 0;
+      for (const char* c = entry->d_name; *c >= '0' && *c <= '9'; ++c) {
+        tid = tid * 10 + (*c - '0');
+      }
+      if (tid <= 0) {
+        continue;  // "." or "..".
+      }
+      thread_slots[num_slots++].tid = tid;
+      if (num_slots == SHBT_THREADS_SLOTS) {
+        ok = threads_dump_slots(fd, num_slots) && ok;
+        num_slots = 0;
+      }
+    }
+  }
+  if (num_slots > 0) {
+    ok = threads_dump_slots(fd, num_slots) && ok;
+  }
+  threads_end();
+  close(dir);
+  return ok && len == 0;
+}
+
+#else  // __linux__
+
+// Thread-directed signals and /proc are Linux-specific.
+
+bool shbt_collect_thread_addresses(int tid, void* pcs[], size_t max_pcs,
+                                   size_t* num_pcs, int timeout_ms) {
+  (void) tid;
+  (void) pcs;
+  (void) max_pcs;
+  (void) timeout_ms;
+  *num_pcs = 0;
+  return false;
+}
+
+bool shbt_collect_thread_backtrace(int tid, shbt_frame_t trace[],
+                                   size_t num_frames,
+                                   size_t* num_valid_frames, int timeout_ms) {
+  (void) tid;
+  (void) trace;
+  (void) num_frames;
+  (void) timeout_ms;
+  *num_valid_frames = 0;
+  return false;
+}
+
+bool shbt_dump_all_threads(int fd) {
+  (void) fd;
+  return false;
+}
+
+void shbt_write_thread_name(struct shbt_writer* writer, int tid) {
+  shbt_writer_puts(writer, "Thread ");
+  shbt_writer_put_int(writer, tid, 10, 0);
+}
+
+#endif  // __linux__
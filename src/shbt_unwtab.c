@@ -0,0 +1,1236 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Compact unwind tables built from .eh_frame.
+ *
+ * Stepping with DWARF call frame information (CFI) means finding the FDE
+ * for a PC and interpreting its instructions up to that PC, for every
+ * frame. Instead, building the table interprets every FDE of each loaded
+ * module once, and records the rule in effect for each range of PCs in a
+ * sorted table, like the kernel's ORC tables. Nearly all code only needs a
+ * few rules: the CFA (the stack pointer in the caller) is the stack or
+ * frame pointer plus an offset, the return address is just below the CFA,
+ * and the caller's frame pointer is either unchanged or saved at an offset
+ * from the CFA. Stepping is then a binary search and a couple of loads.
+ *
+ * Anything else (CFA expressions, signal trampolines, code without CFI) is
+ * marked in the table, and the walk continues from that frame with
+ * libunwind. As with frame pointers, every load is checked against the
+ * bounds of the thread's stack.
+ *
+ * Tables are built once per file, relative to where it is loaded, and the
+ * index of them is rebuilt like the symbol index: in whichever of two slots
+ * is not current, freeing the index from two builds ago (and any tables
+ * only it used) once no reader is counted in its slot.
+ *
+ * This is only implemented for x86-64.
+ */
+
+#define _GNU_SOURCE  // For dl_iterate_phdr and REG_RIP.
+#include <stdint.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+#if defined(SHBT_USE_UNWIND_TABLE_UNWINDER) && defined(__linux__) && \
+  defined(__x86_64__)
+
+#include <elf.h>
+#include <link.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <ucontext.h>
+
+// DWARF register numbers.
+#define DWARF_REG_FP 6
+#define DWARF_REG_SP 7
+
+// Pointer encodings (DW_EH_PE_*).
+#define EH_PE_OMIT 0xff
+#define EH_PE_FORMAT_MASK 0x0f
+#define EH_PE_ABSPTR 0x00
+#define EH_PE_ULEB128 0x01
+#define EH_PE_UDATA2 0x02
+#define EH_PE_UDATA4 0x03
+#define EH_PE_UDATA8 0x04
+#define EH_PE_SLEB128 0x09
+#define EH_PE_SDATA2 0x0a
+#define EH_PE_SDATA4 0x0b
+#define EH_PE_SDATA8 0x0c
+#define EH_PE_APPLICATION_MASK 0x70
+#define EH_PE_PCREL 0x10
+#define EH_PE_DATAREL 0x30
+
+// Nesting of DW_CFA_remember_state that is supported.
+#define MAX_REMEMBERED_STATES 8
+
+/** How to step from a range of PCs. */
+enum unwtab_type {
+  /** No CFI covers these PCs. */
+  UNWTAB_NONE,
+  /** The CFA is the stack pointer plus cfa_offset. */
+  UNWTAB_CFA_SP,
+  /** The CFA is the frame pointer plus cfa_offset. */
+  UNWTAB_CFA_FP,
+  /** There is no caller (the return address is undefined). */
+  UNWTAB_END,
+  /** The rules are too complex for the table. */
+  UNWTAB_COMPLEX
+};
+
+/** Rule for a range of PCs, which ends where the next entry's starts. */
+struct unwtab_entry {
+  /** Offset of the first PC from the start of the module. */
+  uint32_t pc;
+  /** Offset of the CFA from the stack or frame pointer. */
+  int16_t cfa_offset;
+  /**
+   * Where the caller's frame pointer is saved, in words from the CFA, or 0
+   * if it is unchanged.
+   */
+  int8_t fp_slot;
+  /** An enum unwtab_type. */
+  uint8_t type;
+};
+
+/** Unwind table for one module's file, shared by the indices using it. */
+struct unwtab_module {
+  /** Whether the module's file was found, which identifies it. */
+  bool has_file;
+  dev_t dev;
+  ino_t ino;
+  off_t file_size;
+  struct timespec mtime;
+  /** Size of the module's loaded segments. */
+  uintptr_t size;
+  /** Offset of the module's .eh_frame_hdr from the start of its segments. */
+  uintptr_t eh_frame_hdr;
+  /** Number of indices using the module. */
+  size_t refs;
+  /** Entries, sorted by PC. */
+  struct unwtab_entry* entries;
+  /** Number of entries. */
+  size_t num_entries;
+};
+
+/** Where a module is loaded. */
+struct unwtab_placement {
+  /** Start of the module's loaded segments. */
+  uintptr_t start;
+  /** End of the module's loaded segments. */
+  uintptr_t end;
+  struct unwtab_module* module;
+};
+
+/** Unwind tables of all modules. */
+struct unwtab_index {
+  /** Number of modules. */
+  size_t num_modules;
+  /** Modules, sorted by start address. */
+  struct unwtab_placement modules[];
+};
+
+/** Bounded reader of CFI. */
+struct cfi_reader {
+  const uint8_t* p;
+  const uint8_t* end;
+};
+
+/** What an FDE needs from its CIE. */
+struct cfi_cie {
+  const uint8_t* addr;
+  uint64_t code_align;
+  int64_t data_align;
+  uint64_t ra_reg;
+  uint8_t fde_encoding;
+  bool has_augmentation_data;
+  bool is_signal_frame;
+  const uint8_t* instructions;
+  const uint8_t* instructions_end;
+};
+
+/** Rule for a register we track. */
+enum cfi_rule {
+  CFI_RULE_SAME,
+  CFI_RULE_OFFSET,
+  CFI_RULE_UNDEFINED,
+  CFI_RULE_COMPLEX
+};
+
+/** The CFI rules at one PC. */
+struct cfi_row {
+  /** DWARF_REG_SP or DWARF_REG_FP, or -1 if the CFA is not one of them. */
+  int cfa_reg;
+  int64_t cfa_offset;
+  enum cfi_rule fp_rule;
+  int64_t fp_offset;
+  enum cfi_rule ra_rule;
+  int64_t ra_offset;
+};
+
+/** Entries being built for one module. */
+struct unwtab_builder {
+  uintptr_t start;
+  struct unwtab_entry* entries;
+  size_t num_entries;
+  size_t capacity;
+  bool failed;
+};
+
+/** State for building the index from dl_iterate_phdr. */
+struct unwtab_build {
+  struct unwtab_index* old_index;
+  struct unwtab_placement* modules;
+  size_t num_modules;
+  size_t capacity;
+};
+
+static struct unwtab_index* unwind_indices[2];
+// Index of the current slot, or -1 if the index has not been built.
+static atomic_int unwind_index_current = -1;
+static atomic_int unwind_index_readers[2];
+// Serializes building the index.
+static pthread_mutex_t unwind_index_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Whether the index should be kept up to date as modules are loaded.
+static atomic_bool unwind_index_enabled = false;
+
+static bool cfi_read_u8(struct cfi_reader* r, uint8_t* value) {
+  if (r->p >= r->end) {
+    return false;
+  }
+  *value = *r->p++;
+  return true;
+}
+
+// Read size bytes, which may be unaligned, into value.
+static bool cfi_read_bytes(struct cfi_reader* r, void* value, size_t size) {
+  if ((size_t) (r->end - r->p) < size) {
+    return false;
+  }
+  memcpy(value, r->p, size);
+  r->p += size;
+  return true;
+}
+
+static bool cfi_read_uleb(struct cfi_reader* r, uint64_t* value) {
+  uint64_t result = 0;
+  unsigned shift = 0;
+  uint8_t byte;
+  do {
+    if (!cfi_read_u8(r, &byte)) {
+      return false;
+    }
+    if (shift < 64) {
+      result |= (uint64_t) (byte & 0x7f) << shift;
+    }
+    shift += 7;
+  } while (byte & 0x80);
+  *value = result;
+  return true;
+}
+
+static bool cfi_read_sleb(struct cfi_reader* r, int64_t* value) {
+  uint64_t result = 0;
+  unsigned shift = 0;
+  uint8_t byte;
+  do {
+    if (!cfi_read_u8(r, &byte)) {
+      return false;
+    }
+    if (shift < 64) {
+      result |= (uint64_t) (byte & 0x7f) << shift;
+    }
+    shift += 7;
+  } while (byte & 0x80);
+  if (shift < 64 && (byte & 0x40)) {
+    result |= ~(uint64_t) 0 << shift;  // Sign extend.
+  }
+  *value = (int64_t) result;
+  return true;
+}
+
+// Read a pointer with the given encoding. PC-relative pointers are relative
+// to where they are read from, and data-relative ones to data_base.
+static bool cfi_read_encoded(struct cfi_reader* r, uint8_t encoding,
+                             uintptr_t data_base, uintptr_t* value) {
+  uintptr_t pc = (uintptr_t) r->p;
+  uint64_t result;
+  switch (encoding & EH_PE_FORMAT_MASK) {
+  case EH_PE_ABSPTR:
+  case EH_PE_UDATA8:
+  case EH_PE_SDATA8:
+    if (!cfi_read_bytes(r, &result, 8)) {
+      return false;
+    }
+    break;
+  case EH_PE_ULEB128:
+    if (!cfi_read_uleb(r, &result)) {
+      return false;
+    }
+    break;
+  case EH_PE_SLEB128: {
+    int64_t sresult;
+    if (!cfi_read_sleb(r, &sresult)) {
+      return false;
+    }
+    result = (uint64_t) sresult;
+    break;
+  }
+  case EH_PE_UDATA2: {
+    uint16_t v;
+    if (!cfi_read_bytes(r, &v, sizeof(v))) {
+      return false;
+    }
+    result = v;
+    break;
+  }
+  case EH_PE_SDATA2: {
+    int16_t v;
+    if (!cfi_read_bytes(r, &v, sizeof(v))) {
+      return false;
+    }
+    result = (uint64_t) (int64_t) v;
+    break;
+  }
+  case EH_PE_UDATA4: {
+    uint32_t v;
+    if (!cfi_read_bytes(r, &v, sizeof(v))) {
+      return false;
+    }
+    result = v;
+    break;
+  }
+  case EH_PE_SDATA4: {
+    int32_t v;
+    if (!cfi_read_bytes(r, &v, sizeof(v))) {
+      return false;
+    }
+    result = (uint64_t) (int64_t) v;
+    break;
+  }
+  default:
+    return false;
+  }
+  // Indirect pointers (0x80) are only used for personality routines, whose
+  // values are never needed, so that bit is ignored.
+  switch (encoding & EH_PE_APPLICATION_MASK) {
+  case 0:
+    break;
+  case EH_PE_PCREL:
+    result += pc;
+    break;
+  case EH_PE_DATAREL:
+    result += data_base;
+    break;
+  default:
+    return false;
+  }
+  *value = (uintptr_t) result;
+  return true;
+}
+
+// Parse the CIE at addr, which must be before end.
+static bool cfi_parse_cie(const uint8_t* addr, const uint8_t* end,
+                          struct cfi_cie* cie) {
+  struct cfi_reader r = {addr, end};
+  uint32_t length;
+  uint32_t id;
+  uint8_t version;
+  if (!cfi_read_bytes(&r, &length, sizeof(length)) || length == 0 ||
+      length == UINT32_MAX || (size_t) (end - r.p) < length) {
+    return false;
+  }
+  r.end = r.p + length;
+  if (!cfi_read_bytes(&r, &id, sizeof(id)) || id != 0 ||
+      !cfi_read_u8(&r, &version) || (version != 1 && version != 3)) {
+    return false;
+  }
+  const char* augmentation = (const char*) r.p;
+  while (r.p < r.end && *r.p != '\0') {
+    ++r.p;
+  }
+  if (r.p == r.end) {
+    return false;
+  }
+  ++r.p;
+  cie->addr = addr;
+  cie->fde_encoding = EH_PE_ABSPTR;
+  cie->has_augmentation_data = augmentation[0] == 'z';
+  cie->is_signal_frame = false;
+  if (!cfi_read_uleb(&r, &cie->code_align) ||
+      !cfi_read_sleb(&r, &cie->data_align)) {
+    return false;
+  }
+  if (version == 1) {
+    uint8_t ra_reg;
+    if (!cfi_read_u8(&r, &ra_reg)) {
+      return false;
+    }
+    cie->ra_reg = ra_reg;
+  } else if (!cfi_read_uleb(&r, &cie->ra_reg)) {
+    return false;
+  }
+  if (cie->has_augmentation_data) {
+    uint64_t data_length;
+    if (!cfi_read_uleb(&r, &data_length) ||
+        (uint64_t) (r.end - r.p) < data_length) {
+      return false;
+    }
+    struct cfi_reader data = {r.p, r.p + data_length};
+    for (const char* c = augmentation + 1; *c != '\0'; ++c) {
+      uint8_t encoding;
+      uintptr_t personality;
+      if (*c == 'R') {
+        if (!cfi_read_u8(&data, &cie->fde_encoding)) {
+          return false;
+        }
+      } else if (*c == 'P') {
+        if (!cfi_read_u8(&data, &encoding) ||
+            !cfi_read_encoded(&data, encoding, 0, &personality)) {
+          return false;
+        }
+      } else if (*c == 'L') {
+        if (!cfi_read_u8(&data, &encoding)) {
+          return false;
+        }
+      } else if (*c == 'S') {
+        cie->is_signal_frame = true;
+      } else {
+        break;  // The rest of the data can be skipped.
+      }
+    }
+    r.p += data_length;
+  } else if (augmentation[0] != '\0') {
+    return false;  // Without the length, unknown data cannot be skipped.
+  }
+  cie->instructions = r.p;
+  cie->instructions_end = r.end;
+  return true;
+}
+
+static void unwtab_add_entry(struct unwtab_builder* builder, uintptr_t pc,
+                             const struct unwtab_entry* entry) {
+  if (builder->failed) {
+    return;
+  }
+  if (pc < builder->start || pc - builder->start > UINT32_MAX) {
+    return;  // Not in the module.
+  }
+  if (builder->num_entries == builder->capacity) {
+    size_t capacity = builder->capacity ? 2 * builder->capacity : 1024;
+    struct unwtab_entry* entries =
+      realloc(builder->entries, capacity * sizeof(struct unwtab_entry));
+    if (entries == NULL) {
+      builder->failed = true;
+      return;
+    }
+    builder->entries = entries;
+    builder->capacity = capacity;
+  }
+  struct unwtab_entry* added = &builder->entries[builder->num_entries++];
+  *added = *entry;
+  added->pc = (uint32_t) (pc - builder->start);
+}
+
+// Add an entry for the rules in row, starting at pc.
+static void unwtab_add_row(struct unwtab_builder* builder, uintptr_t pc,
+                           const struct cfi_row* row) {
+  struct unwtab_entry entry = {0, 0, 0, UNWTAB_COMPLEX};
+  if (row->ra_rule == CFI_RULE_UNDEFINED) {
+    entry.type = UNWTAB_END;
+  } else if (row->cfa_reg >= 0 && row->ra_rule == CFI_RULE_OFFSET &&
+             row->ra_offset == -(int64_t) sizeof(uintptr_t) &&
+             row->cfa_offset >= INT16_MIN && row->cfa_offset <= INT16_MAX) {
+    if (row->fp_rule == CFI_RULE_SAME) {
+      entry.type = row->cfa_reg == DWARF_REG_SP ? UNWTAB_CFA_SP :
+                                                  UNWTAB_CFA_FP;
+    } else if (row->fp_rule == CFI_RULE_OFFSET &&
+               row->fp_offset % (int64_t) sizeof(uintptr_t) == 0 &&
+               row->fp_offset / (int64_t) sizeof(uintptr_t) >= INT8_MIN &&
+               row->fp_offset / (int64_t) sizeof(uintptr_t) <= INT8_MAX &&
+               row->fp_offset != 0) {
+      entry.type = row->cfa_reg == DWARF_REG_SP ? UNWTAB_CFA_SP :
+                                                  UNWTAB_CFA_FP;
+      entry.fp_slot = (int8_t) (row->fp_offset / (int64_t) sizeof(uintptr_t));
+    }
+    entry.cfa_offset = (int16_t) row->cfa_offset;
+  }
+  unwtab_add_entry(builder, pc, &entry);
+}
+
+// Set the rule for a register, if it is one we track.
+static void cfi_set_rule(struct cfi_row* row, const struct cfi_cie* cie,
+                         uint64_t reg, enum cfi_rule rule, int64_t offset) {
+  if (reg == DWARF_REG_FP) {
+    row->fp_rule = rule;
+    row->fp_offset = offset;
+  } else if (reg == cie->ra_reg) {
+    row->ra_rule = rule;
+    row->ra_offset = offset;
+  }
+}
+
+// Restore a register's rule to the one the CIE gave it.
+static void cfi_restore_rule(struct cfi_row* row, const struct cfi_row* initial,
+                             const struct cfi_cie* cie, uint64_t reg) {
+  if (reg == DWARF_REG_FP) {
+    row->fp_rule = initial->fp_rule;
+    row->fp_offset = initial->fp_offset;
+  } else if (reg == cie->ra_reg) {
+    row->ra_rule = initial->ra_rule;
+    row->ra_offset = initial->ra_offset;
+  }
+}
+
+static void cfi_set_cfa_reg(struct cfi_row* row, uint64_t reg) {
+  row->cfa_reg = (reg == DWARF_REG_SP || reg == DWARF_REG_FP) ? (int) reg : -1;
+}
+
+// Run CFI instructions, updating row. If builder is given, this adds an
+// entry for each row of the table at the PC where it starts, beginning at
+// *loc. Returns false if the instructions cannot be interpreted.
+static bool cfi_run(const uint8_t* instructions, const uint8_t* end,
+                    const struct cfi_cie* cie, const struct cfi_row* initial,
+                    struct cfi_row* row, uintptr_t* loc,
+                    struct unwtab_builder* builder) {
+  struct cfi_reader r = {instructions, end};
+  struct cfi_row remembered[MAX_REMEMBERED_STATES];
+  size_t num_remembered = 0;
+  uintptr_t row_start = loc != NULL ? *loc : 0;
+  while (r.p < r.end) {
+    uint8_t op;
+    cfi_read_u8(&r, &op);
+    uint64_t reg = op & 0x3f;
+    uint64_t uvalue = 0;
+    int64_t svalue = 0;
+    uint64_t advance = 0;
+    bool advances = false;
+    switch (op & 0xc0) {
+    case 0x40:  // DW_CFA_advance_loc
+      advance = op & 0x3f;
+      advances = true;
+      break;
+    case 0x80:  // DW_CFA_offset
+      if (!cfi_read_uleb(&r, &uvalue)) {
+        return false;
+      }
+      cfi_set_rule(row, cie, reg, CFI_RULE_OFFSET,
+                   (int64_t) uvalue * cie->data_align);
+      break;
+    case 0xc0:  // DW_CFA_restore
+      cfi_restore_rule(row, initial, cie, reg);
+      break;
+    default:
+      switch (op) {
+      case 0x00:  // DW_CFA_nop
+        break;
+      case 0x01: {  // DW_CFA_set_loc
+        uintptr_t new_loc;
+        if (!cfi_read_encoded(&r, cie->fde_encoding, 0, &new_loc) ||
+            loc == NULL || new_loc < *loc) {
+          return false;
+        }
+        advance = (new_loc - *loc) / (cie->code_align ? cie->code_align : 1);
+        advances = true;
+        break;
+      }
+      case 0x02: {  // DW_CFA_advance_loc1
+        uint8_t delta;
+        if (!cfi_read_u8(&r, &delta)) {
+          return false;
+        }
+        advance = delta;
+        advances = true;
+        break;
+      }
+      case 0x03: {  // DW_CFA_advance_loc2
+        uint16_t delta;
+        if (!cfi_read_bytes(&r, &delta, sizeof(delta))) {
+          return false;
+        }
+        advance = delta;
+        advances = true;
+        break;
+      }
+      case 0x04: {  // DW_CFA_advance_loc4
+        uint32_t delta;
+        if (!cfi_read_bytes(&r, &delta, sizeof(delta))) {
+          return false;
+        }
+        advance = delta;
+        advances = true;
+        break;
+      }
+      case 0x05:  // DW_CFA_offset_extended
+        if (!cfi_read_uleb(&r, &reg) || !cfi_read_uleb(&r, &uvalue)) {
+          return false;
+        }
+        cfi_set_rule(row, cie, reg, CFI_RULE_OFFSET,
+                     (int64_t) uvalue * cie->data_align);
+        break;
+      case 0x06:  // DW_CFA_restore_extended
+        if (!cfi_read_uleb(&r, &reg)) {
+          return false;
+        }
+        cfi_restore_rule(row, initial, cie, reg);
+        break;
+      case 0x07:  // DW_CFA_undefined
+        if (!cfi_read_uleb(&r, &reg)) {
+          return false;
+        }
+        cfi_set_rule(row, cie, reg, CFI_RULE_UNDEFINED, 0);
+        break;
+      case 0x08:  // DW_CFA_same_value
+        if (!cfi_read_uleb(&r, &reg)) {
+          return false;
+        }
+        cfi_set_rule(row, cie, reg, CFI_RULE_SAME, 0);
+        break;
+      case 0x09:  // DW_CFA_register
+        if (!cfi_read_uleb(&r, &reg) || !cfi_read_uleb(&r, &uvalue)) {
+          return false;
+        }
+        cfi_set_rule(row, cie, reg, CFI_RULE_COMPLEX, 0);
+        break;
+      case 0x0a:  // DW_CFA_remember_state
+        if (num_remembered == MAX_REMEMBERED_STATES) {
+          return false;
+        }
+        remembered[num_remembered++] = *row;
+        break;
+      case 0x0b:  // DW_CFA_restore_state
+        if (num_remembered == 0) {
+          return false;
+        }
+        *row = remembered[--num_remembered];
+        break;
+      case 0x0c:  // DW_CFA_def_cfa
+        if (!cfi_read_uleb(&r, &reg) || !cfi_read_uleb(&r, &uvalue)) {
+          return false;
+        }
+        cfi_set_cfa_reg(row, reg);
+        row->cfa_offset = (int64_t) uvalue;
+        break;
+      case 0x0d:  // DW_CFA_def_cfa_register
+        if (!cfi_read_uleb(&r, &reg)) {
+          return false;
+        }
+        cfi_set_cfa_reg(row, reg);
+        break;
+      case 0x0e:  // DW_CFA_def_cfa_offset
+        if (!cfi_read_uleb(&r, &uvalue)) {
+          return false;
+        }
+        row->cfa_offset = (int64_t) uvalue;
+        break;
+      case 0x0f:  // DW_CFA_def_cfa_expression
+        if (!cfi_read_uleb(&r, &uvalue) ||
+            (uint64_t) (r.end - r.p) < uvalue) {
+          return false;
+        }
+        r.p += uvalue;
+        row->cfa_reg = -1;
+        break;
+      case 0x10:  // DW_CFA_expression
+      case 0x16:  // DW_CFA_val_expression
+        if (!cfi_read_uleb(&r, &reg) || !cfi_read_uleb(&r, &uvalue) ||
+            (uint64_t) (r.end - r.p) < uvalue) {
+          return false;
+        }
+        r.p += uvalue;
+        cfi_set_rule(row, cie, reg, CFI_RULE_COMPLEX, 0);
+        break;
+      case 0x11:  // DW_CFA_offset_extended_sf
+        if (!cfi_read_uleb(&r, &reg) || !cfi_read_sleb(&r, &svalue)) {
+          return false;
+        }
+        cfi_set_rule(row, cie, reg, CFI_RULE_OFFSET,
+                     svalue * cie->data_align);
+        break;
+      case 0x12:  // DW_CFA_def_cfa_sf
+        if (!cfi_read_uleb(&r, &reg) || !cfi_read_sleb(&r, &svalue)) {
+          return false;
+        }
+        cfi_set_cfa_reg(row, reg);
+        row->cfa_offset = svalue * cie->data_align;
+        break;
+      case 0x13:  // DW_CFA_def_cfa_offset_sf
+        if (!cfi_read_sleb(&r, &svalue)) {
+          return false;
+        }
+        row->cfa_offset = svalue * cie->data_align;
+        break;
+      case 0x14:  // DW_CFA_val_offset
+      case 0x15:  // DW_CFA_val_offset_sf
+        if (!cfi_read_uleb(&r, &reg) || !cfi_read_sleb(&r, &svalue)) {
+          return false;
+        }
+        cfi_set_rule(row, cie, reg, CFI_RULE_COMPLEX, 0);
+        break;
+      case 0x2e:  // DW_CFA_GNU_args_size
+        if (!cfi_read_uleb(&r, &uvalue)) {
+          return false;
+        }
+        break;
+      case 0x2f:  // DW_CFA_GNU_negative_offset_extended
+        if (!cfi_read_uleb(&r, &reg) || !cfi_read_uleb(&r, &uvalue)) {
+          return false;
+        }
+        cfi_set_rule(row, cie, reg, CFI_RULE_OFFSET,
+                     -(int64_t) uvalue * cie->data_align);
+        break;
+      default:
+        return false;
+      }
+    }
+    if (advances) {
+      if (loc == NULL) {
+        return false;  // CIEs cannot advance.
+      }
+      uintptr_t new_loc = *loc + advance * cie->code_align;
+      if (builder != NULL && new_loc > row_start) {
+        unwtab_add_row(builder, row_start, row);
+        row_start = new_loc;
+      }
+      *loc = new_loc;
+    }
+  }
+  if (loc != NULL) {
+    *loc = row_start;
+  }
+  return true;
+}
+
+// Add entries for the FDE whose contents (after the CIE pointer) are in
+// [r->p, r->end).
+static void unwtab_add_fde(struct unwtab_builder* builder,
+                           struct cfi_reader* r, const struct cfi_cie* cie) {
+  uintptr_t pc_begin;
+  uintptr_t pc_range;
+  if (!cfi_read_encoded(r, cie->fde_encoding, 0, &pc_begin) ||
+      !cfi_read_encoded(r, cie->fde_encoding & EH_PE_FORMAT_MASK, 0,
+                        &pc_range) ||
+      pc_begin == 0 || pc_range == 0) {
+    return;
+  }
+  if (cie->has_augmentation_data) {
+    uint64_t data_length;
+    if (!cfi_read_uleb(r, &data_length) ||
+        (uint64_t) (r->end - r->p) < data_length) {
+      return;
+    }
+    r->p += data_length;
+  }
+  struct unwtab_entry none = {0, 0, 0, UNWTAB_NONE};
+  size_t first_entry = builder->num_entries;
+  // Until the CIE says otherwise, the CFA and frame pointer are unknown and
+  // the return address is just below the CFA.
+  struct cfi_row initial = {-1, 0, CFI_RULE_SAME, 0, CFI_RULE_OFFSET,
+                            -(int64_t) sizeof(uintptr_t)};
+  if (!cie->is_signal_frame &&
+      cfi_run(cie->instructions, cie->instructions_end, cie, &initial,
+              &initial, NULL, NULL)) {
+    struct cfi_row row = initial;
+    uintptr_t loc = pc_begin;
+    if (cfi_run(r->p, r->end, cie, &initial, &row, &loc, builder)) {
+      unwtab_add_row(builder, loc, &row);
+      unwtab_add_entry(builder, pc_begin + pc_range, &none);
+      return;
+    }
+  }
+  // Leave the whole FDE to libunwind.
+  builder->num_entries = first_entry;
+  struct unwtab_entry complex = {0, 0, 0, UNWTAB_COMPLEX};
+  unwtab_add_entry(builder, pc_begin, &complex);
+  unwtab_add_entry(builder, pc_begin + pc_range, &none);
+}
+
+// Add entries for every FDE in the .eh_frame in [eh_frame, end).
+static void unwtab_add_eh_frame(struct unwtab_builder* builder,
+                                const uint8_t* eh_frame, const uint8_t* end) {
+  struct cfi_cie cie;
+  bool have_cie = false;
+  struct cfi_reader r = {eh_frame, end};
+  while (!builder->failed && r.end - r.p >= 4) {
+    const uint8_t* entry = r.p;
+    uint32_t length;
+    cfi_read_bytes(&r, &length, sizeof(length));
+    if (length == 0) {
+      break;  // Terminator.
+    }
+    if (length == UINT32_MAX || (size_t) (r.end - r.p) < length) {
+      break;  // 64-bit DWARF is not used for .eh_frame.
+    }
+    struct cfi_reader contents = {r.p, r.p + length};
+    r.p += length;
+    uint32_t cie_offset;
+    if (!cfi_read_bytes(&contents, &cie_offset, sizeof(cie_offset))) {
+      continue;
+    }
+    if (cie_offset == 0) {
+      continue;  // A CIE, which is parsed when an FDE uses it.
+    }
+    // The CIE pointer is relative to where it is stored.
+    const uint8_t* cie_addr = contents.p - sizeof(cie_offset) - cie_offset;
+    if (cie_addr < eh_frame || cie_addr >= entry) {
+      continue;
+    }
+    if (!have_cie || cie.addr != cie_addr) {
+      have_cie = cfi_parse_cie(cie_addr, end, &cie);
+      if (!have_cie) {
+        continue;
+      }
+    }
+    unwtab_add_fde(builder, &contents, &cie);
+  }
+}
+
+static int compare_entries(const void* a, const void* b) {
+  const struct unwtab_entry* ea = (const struct unwtab_entry*) a;
+  const struct unwtab_entry* eb = (const struct unwtab_entry*) b;
+  if (ea->pc != eb->pc) {
+    return ea->pc < eb->pc ? -1 : 1;
+  }
+  // Where one FDE ends and another starts, keep the start.
+  if ((ea->type == UNWTAB_NONE) != (eb->type == UNWTAB_NONE)) {
+    return ea->type == UNWTAB_NONE ? 1 : -1;
+  }
+  // qsort is not stable, so break ties to pick the same entry every time.
+  if (ea->type != eb->type) {
+    return ea->type < eb->type ? -1 : 1;
+  }
+  if (ea->cfa_offset != eb->cfa_offset) {
+    return ea->cfa_offset < eb->cfa_offset ? -1 : 1;
+  }
+  if (ea->fp_slot != eb->fp_slot) {
+    return ea->fp_slot < eb->fp_slot ? -1 : 1;
+  }
+  return 0;
+}
+
+static bool same_rule(const struct unwtab_entry* a,
+                      const struct unwtab_entry* b) {
+  return a->type == b->type && a->cfa_offset == b->cfa_offset &&
+         a->fp_slot == b->fp_slot;
+}
+
+static int compare_modules(const void* a, const void* b) {
+  const struct unwtab_placement* ma = (const struct unwtab_placement*) a;
+  const struct unwtab_placement* mb = (const struct unwtab_placement*) b;
+  if (ma->start != mb->start) {
+    return ma->start < mb->start ? -1 : 1;
+  }
+  return 0;
+}
+
+// Find the end of the loaded segment containing addr, or 0.
+static uintptr_t segment_end(const struct dl_phdr_info* info,
+                             uintptr_t addr) {
+  for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    uintptr_t seg_start = info->dlpi_addr + phdr->p_vaddr;
+    if (phdr->p_type == PT_LOAD && addr >= seg_start &&
+        addr - seg_start < phdr->p_memsz) {
+      return seg_start + phdr->p_memsz;
+    }
+  }
+  return 0;
+}
+
+// Build the table for a loaded module, whose file is described by st (or
+// is unknown if st is NULL). Returns NULL if it has no usable .eh_frame.
+static struct unwtab_module* build_module(const struct dl_phdr_info* info,
+                                          uintptr_t start, uintptr_t end,
+                                          uintptr_t eh_frame_hdr,
+                                          const struct stat* st) {
+  // Find .eh_frame from the header the linker adds for it.
+  uintptr_t hdr_end = segment_end(info, eh_frame_hdr);
+  struct cfi_reader r = {(const uint8_t*) eh_frame_hdr,
+                         (const uint8_t*) hdr_end};
+  uint8_t version, eh_frame_encoding, count_encoding, table_encoding;
+  uintptr_t eh_frame;
+  if (hdr_end == 0 || !cfi_read_u8(&r, &version) || version != 1 ||
+      !cfi_read_u8(&r, &eh_frame_encoding) ||
+      !cfi_read_u8(&r, &count_encoding) ||
+      !cfi_read_u8(&r, &table_encoding) ||
+      !cfi_read_encoded(&r, eh_frame_encoding, eh_frame_hdr, &eh_frame)) {
+    return NULL;
+  }
+  uintptr_t eh_frame_end = segment_end(info, eh_frame);
+  if (eh_frame_end == 0) {
+    return NULL;
+  }
+  struct unwtab_builder builder = {start, NULL, 0, 0, false};
+  unwtab_add_eh_frame(&builder, (const uint8_t*) eh_frame,
+                      (const uint8_t*) eh_frame_end);
+  if (builder.failed || builder.num_entries == 0) {
+    free(builder.entries);
+    return NULL;
+  }
+  qsort(builder.entries, builder.num_entries, sizeof(struct unwtab_entry),
+        compare_entries);
+  // Keep one entry per PC, and drop entries that do not change the rule.
+  size_t num_kept = 1;
+  for (size_t i = 1; i < builder.num_entries; ++i) {
+    const struct unwtab_entry* prev = &builder.entries[num_kept - 1];
+    if (builder.entries[i].pc != prev->pc &&
+        !same_rule(&builder.entries[i], prev)) {
+      builder.entries[num_kept++] = builder.entries[i];
+    }
+  }
+  struct unwtab_module* module = calloc(1, sizeof(struct unwtab_module));
+  if (module == NULL) {
+    free(builder.entries);
+    return NULL;
+  }
+  if (st != NULL) {
+    module->has_file = true;
+    module->dev = st->st_dev;
+    module->ino = st->st_ino;
+    module->file_size = st->st_size;
+    module->mtime = st->st_mtim;
+  }
+  module->size = end - start;
+  module->eh_frame_hdr = eh_frame_hdr - start;
+  module->refs = 1;
+  module->entries = builder.entries;
+  module->num_entries = num_kept;
+  return module;
+}
+
+// Whether the module placed at old is the one loaded at [start, end), with
+// its file described by st (or unknown if st is NULL). Modules without a
+// known file (such as the vDSO) are only reused at the same address.
+static bool same_module(const struct unwtab_placement* old, uintptr_t start,
+                        uintptr_t end, uintptr_t eh_frame_hdr,
+                        const struct stat* st) {
+  const struct unwtab_module* module = old->module;
+  if (module->size != end - start ||
+      module->eh_frame_hdr != eh_frame_hdr - start) {
+    return false;
+  }
+  if (st == NULL) {
+    return !module->has_file && old->start == start;
+  }
+  return module->has_file && module->dev == st->st_dev &&
+         module->ino == st->st_ino && module->file_size == st->st_size &&
+         module->mtime.tv_sec == st->st_mtim.tv_sec &&
+         module->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+// Drop the references of placed modules, freeing those no index uses.
+// Must be called with unwind_index_mutex held.
+static void release_modules(struct unwtab_placement* modules,
+                            size_t num_modules) {
+  for (size_t i = 0; i < num_modules; ++i) {
+    struct unwtab_module* module = modules[i].module;
+    if (--module->refs == 0) {
+      free(module->entries);
+      free(module);
+    }
+  }
+}
+
+// Add a module to the index being built. This parses .eh_frame from within
+// dl_iterate_phdr, which keeps the module from being unloaded meanwhile.
+static int build_loaded_module(struct dl_phdr_info* info, size_t size,
+                               void* data) {
+  (void) size;
+  struct unwtab_build* build = (struct unwtab_build*) data;
+  uintptr_t start = UINTPTR_MAX;
+  uintptr_t end = 0;
+  uintptr_t eh_frame_hdr = 0;
+  for (ElfW(Half) i = 0; i < info->dlpi_phnum; ++i) {
+    const ElfW(Phdr)* phdr = &info->dlpi_phdr[i];
+    if (phdr->p_type == PT_GNU_EH_FRAME) {
+      eh_frame_hdr = info->dlpi_addr + phdr->p_vaddr;
+    } else if (phdr->p_type == PT_LOAD) {
+      uintptr_t seg_start = info->dlpi_addr + phdr->p_vaddr;
+      uintptr_t seg_end = seg_start + phdr->p_memsz;
+      start = seg_start < start ? seg_start : start;
+      end = seg_end > end ? seg_end : end;
+    }
+  }
+  if (eh_frame_hdr == 0 || start >= end) {
+    return 0;
+  }
+  if (build->num_modules == build->capacity) {
+    size_t capacity = build->capacity ? 2 * build->capacity : 32;
+    struct unwtab_placement* modules =
+      realloc(build->modules, capacity * sizeof(struct unwtab_placement));
+    if (modules == NULL) {
+      return 1;
+    }
+    build->modules = modules;
+    build->capacity = capacity;
+  }
+  // The executable is listed without a name.
+  const char* path = info->dlpi_name;
+  if (path == NULL || path[0] == '\0') {
+    path = "/proc/self/exe";
+  }
+  struct stat file_st;
+  const struct stat* st = stat(path, &file_st) == 0 ? &file_st : NULL;
+  // Reuse the module if its file has already been built.
+  struct unwtab_module* module = NULL;
+  if (build->old_index != NULL) {
+    for (size_t i = 0; i < build->old_index->num_modules; ++i) {
+      const struct unwtab_placement* old = &build->old_index->modules[i];
+      if (same_module(old, start, end, eh_frame_hdr, st)) {
+        module = old->module;
+        ++module->refs;
+        break;
+      }
+    }
+  }
+  if (module == NULL) {
+    module = build_module(info, start, end, eh_frame_hdr, st);
+  }
+  if (module != NULL) {
+    struct unwtab_placement* placement =
+      &build->modules[build->num_modules++];
+    placement->start = start;
+    placement->end = end;
+    placement->module = module;
+  }
+  return 0;
+}
+
+bool shbt_build_unwind_table() {
+  pthread_mutex_lock(&unwind_index_mutex);
+  int current = atomic_load(&unwind_index_current);
+  int next = current == 0 ? 1 : 0;
+  struct unwtab_build build = {
+    current >= 0 ? unwind_indices[current] : NULL, NULL, 0, 0};
+  struct unwtab_index* index = NULL;
+  if (dl_iterate_phdr(build_loaded_module, &build) == 0) {
+    index = malloc(sizeof(struct unwtab_index) +
+                   build.num_modules * sizeof(struct unwtab_placement));
+  }
+  if (index == NULL) {
+    release_modules(build.modules, build.num_modules);
+    pthread_mutex_unlock(&unwind_index_mutex);
+    free(build.modules);
+    return false;
+  }
+  index->num_modules = build.num_modules;
+  if (build.num_modules > 0) {
+    memcpy(index->modules, build.modules,
+           build.num_modules * sizeof(struct unwtab_placement));
+  }
+  qsort(index->modules, index->num_modules, sizeof(struct unwtab_placement),
+        compare_modules);
+  // Wait out any handler still reading the index from two builds ago.
+  while (atomic_load(&unwind_index_readers[next]) != 0) {
+    struct timespec delay = {0, 1000000};
+    nanosleep(&delay, NULL);
+  }
+  if (unwind_indices[next] != NULL) {
+    release_modules(unwind_indices[next]->modules,
+                    unwind_indices[next]->num_modules);
+    free(unwind_indices[next]);
+  }
+  unwind_indices[next] = index;
+  atomic_store(&unwind_index_current, next);
+  pthread_mutex_unlock(&unwind_index_mutex);
+  free(build.modules);
+  return true;
+}
+
+void shbt_enable_unwind_table() {
+  if (!atomic_exchange(&unwind_index_enabled, true)) {
+    shbt_build_unwind_table();
+  }
+}
+
+void shbt_update_unwind_table() {
+  if (atomic_load(&unwind_index_enabled)) {
+    shbt_build_unwind_table();
+  }
+}
+
+// Start reading the current index. Returns its slot, or -1 if there is
+// none.
+static int unwind_index_acquire() {
+  for (;;) {
+    int current = atomic_load(&unwind_index_current);
+    if (current < 0) {
+      return -1;
+    }
+    atomic_fetch_add(&unwind_index_readers[current], 1);
+    // If a build published the other slot in the meantime, this one may be
+    // about to be freed, so switch.
+    if (atomic_load(&unwind_index_current) == current) {
+      return current;
+    }
+    atomic_fetch_sub(&unwind_index_readers[current], 1);
+  }
+}
+
+// Find the entry for pc in an index, or NULL if no module has one.
+static const struct unwtab_entry* unwtab_find(const struct unwtab_index* index,
+                                              uintptr_t pc) {
+  if (index->num_modules == 0) {
+    return NULL;
+  }
+  // Find the last module starting at or before pc.
+  size_t lo = 0;
+  size_t hi = index->num_modules;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (index->modules[mid].start <= pc) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  const struct unwtab_placement* placement = &index->modules[lo];
+  if (pc < placement->start || pc >= placement->end) {
+    return NULL;
+  }
+  // Find the last entry starting at or before pc.
+  const struct unwtab_module* module = placement->module;
+  uint32_t offset = (uint32_t) (pc - placement->start);
+  const struct unwtab_entry* entries = module->entries;
+  if (entries[0].pc > offset) {
+    return NULL;
+  }
+  lo = 0;
+  hi = module->num_entries;
+  while (hi - lo > 1) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (entries[mid].pc <= offset) {
+      lo = mid;
+    } else {
+      hi = mid;
+    }
+  }
+  return &entries[lo];
+}
+
+// Whether size bytes at addr are aligned and within the cursor's stack.
+static bool unwtab_in_bounds(const struct shbt_unwind_table_cursor* cursor,
+                             uintptr_t addr, size_t size) {
+  const struct shbt_frame_pointer_cursor* stack = &cursor->stack;
+  return addr % sizeof(uintptr_t) == 0 && addr >= stack->stack_low &&
+         addr < stack->stack_high && stack->stack_high - addr >= size;
+}
+
+bool shbt_unwind_table_init(struct shbt_unwind_table_cursor* cursor,
+                            const void* context, bool exact) {
+  if (atomic_load(&unwind_index_current) < 0) {
+    return false;
+  }
+  const ucontext_t* uc = (const ucontext_t*) context;
+  cursor->pc = (uintptr_t) uc->uc_mcontext.gregs[REG_RIP];
+  cursor->sp = (uintptr_t) uc->uc_mcontext.gregs[REG_RSP];
+  cursor->fp = (uintptr_t) uc->uc_mcontext.gregs[REG_RBP];
+  cursor->exact = exact;
+  cursor->fallback = false;
+  return shbt_frame_pointer_init(&cursor->stack, (void*) cursor->sp);
+}
+
+bool shbt_unwind_table_step(struct shbt_unwind_table_cursor* cursor) {
+  cursor->fallback = false;
+  // Unless it was interrupted, the PC is a return address, so look up the
+  // call before it. The entry is copied so the index can be released.
+  int slot = unwind_index_acquire();
+  if (slot < 0) {
+    cursor->fallback = true;
+    return false;
+  }
+  const struct unwtab_entry* found = unwtab_find(
+    unwind_indices[slot], cursor->exact ? cursor->pc : cursor->pc - 1);
+  struct unwtab_entry entry = {0, 0, 0, UNWTAB_NONE};
+  if (found != NULL) {
+    entry = *found;
+  }
+  atomic_fetch_sub(&unwind_index_readers[slot], 1);
+  if (entry.type == UNWTAB_NONE || entry.type == UNWTAB_COMPLEX) {
+    cursor->fallback = true;
+    return false;
+  }
+  if (entry.type == UNWTAB_END) {
+    return false;
+  }
+  uintptr_t base = entry.type == UNWTAB_CFA_SP ? cursor->sp : cursor->fp;
+  uintptr_t cfa = base + (intptr_t) entry.cfa_offset;
+  // The caller's frame must be further up the stack.
+  if (cfa <= cursor->sp ||
+      !unwtab_in_bounds(cursor, cfa - sizeof(uintptr_t), sizeof(uintptr_t))) {
+    return false;
+  }
+  uintptr_t pc = ((const uintptr_t*) cfa)[-1];
+  if (pc == 0) {
+    return false;
+  }
+  if (entry.fp_slot != 0) {
+    uintptr_t saved_fp = cfa + (intptr_t) entry.fp_slot * sizeof(uintptr_t);
+    if (!unwtab_in_bounds(cursor, saved_fp, sizeof(uintptr_t))) {
+      return false;
+    }
+    cursor->fp = *(const uintptr_t*) saved_fp;
+  }
+  cursor->sp = cfa;
+  cursor->pc = pc;
+  cursor->exact = false;
+  return true;
+}
+
+void shbt_unwind_table_get_context(
+  const struct shbt_unwind_table_cursor* cursor, void* context) {
+  ucontext_t* uc = (ucontext_t*) context;
+  uc->uc_mcontext.gregs[REG_RIP] = (greg_t) cursor->pc;
+  uc->uc_mcontext.gregs[REG_RSP] = (greg_t) cursor->sp;
+  uc->uc_mcontext.gregs[REG_RBP] = (greg_t) cursor->fp;
+}
+
+#else  // SHBT_USE_UNWIND_TABLE_UNWINDER, etc.
+
+// There is never a table, so libunwind is always used.
+
+bool shbt_build_unwind_table() {
+  return false;
+}
+
+void shbt_enable_unwind_table() {}
+
+void shbt_update_unwind_table() {}
+
+bool shbt_unwind_table_init(struct shbt_unwind_table_cursor* cursor,
+                            const void* context, bool exact) {
+  (void) cursor;
+  (void) context;
+  (void) exact;
+  return false;
+}
+
+bool shbt_unwind_table_step(struct shbt_unwind_table_cursor* cursor) {
+  cursor->fallback = true;
+  return false;
+}
+
+void shbt_unwind_table_get_context(
+  const struct shbt_unwind_table_cursor* cursor, void* context) {
+  (void) cursor;
+  (void) context;
+}
+
+#endif  // SHBT_USE_UNWIND_TABLE_UNWINDER, etc.
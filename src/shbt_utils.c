@@ -18,26 +18,153 @@
 
 #define _XOPEN_SOURCE 500
 #include <errno.h>
+#include <stdatomic.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "shbt/shbt.h"
 #include "shbt/shbt_internal.h"
 
+// Size of the static writer buffer. This should fit an entire signal report
+// in most cases, so it can be written at once.
+#define SHBT_WRITER_STATIC_BUFFER_SIZE (16 * 1024)
+
+static char static_writer_buf[SHBT_WRITER_STATIC_BUFFER_SIZE];
+static atomic_flag static_writer_busy = ATOMIC_FLAG_INIT;
+
+bool shbt_safe_writev(int fd, struct iovec* iov, int iovcnt) {
+  while (iovcnt > 0) {
+    ssize_t r = writev(fd, iov, iovcnt);
+    if (r < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    // Skip buffers that were completely written, then advance into any that
+    // was only partially written.
+    size_t written = (size_t) r;
+    while (iovcnt > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt > 0) {
+      if (r == 0) {
+        return false;  // No progress is possible.
+      }
+      iov->iov_base = (char*) iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return true;
+}
+
 void shbt_safe_print(const char* output, int fd) {
-  ssize_t r;
-  do {
-    r = write(fd, output, strlen(output));
-  } while (r == -1 && errno == EINTR);
+  struct iovec iov;
+  iov.iov_base = (void*) output;
+  iov.iov_len = strlen(output);
+  shbt_safe_writev(fd, &iov, 1);
 }
 
 void shbt_print_to_stderr(const char* output) {
   shbt_safe_print(output, STDERR_FILENO);
 }
 
+int64_t shbt_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+void shbt_writer_init(struct shbt_writer* writer, int fd) {
+  writer->fd = fd;
+  writer->len = 0;
+  writer->failed = false;
+  writer->timing = NULL;
+  if (!atomic_flag_test_and_set_explicit(&static_writer_busy,
+                                         memory_order_acquire)) {
+    writer->buf = static_writer_buf;
+    writer->size = sizeof(static_writer_buf);
+    writer->is_static = true;
+  } else {
+    writer->buf = writer->local_buf;
+    writer->size = sizeof(writer->local_buf);
+    writer->is_static = false;
+  }
+}
+
+// Write out the first len bytes of the writer's buffer, followed by data.
+static void writer_write_out(struct shbt_writer* writer, size_t len,
+                             const char* data, size_t data_len) {
+  struct iovec iov[2];
+  iov[0].iov_base = writer->buf;
+  iov[0].iov_len = len;
+  iov[1].iov_base = (void*) data;
+  iov[1].iov_len = data_len;
+  int64_t start = writer->timing != NULL ? shbt_now_ns() : 0;
+  if (!shbt_safe_writev(writer->fd, iov, 2)) {
+    writer->failed = true;
+  }
+  if (writer->timing != NULL) {
+    writer->timing->write_ns += shbt_now_ns() - start;
+  }
+  // Keep any unwritten partial line at the start of the buffer.
+  memmove(writer->buf, writer->buf + len, writer->len - len);
+  writer->len -= len;
+}
+
+bool shbt_writer_finish(struct shbt_writer* writer) {
+  if (writer->len > 0) {
+    writer_write_out(writer, writer->len, NULL, 0);
+  }
+  if (writer->is_static) {
+    writer->buf = NULL;
+    writer->size = 0;
+    writer->is_static = false;
+    atomic_flag_clear_explicit(&static_writer_busy, memory_order_release);
+  }
+  return !writer->failed;
+}
+
+void shbt_writer_write(struct shbt_writer* writer, const char* data,
+                       size_t len) {
+  if (writer->size - writer->len < len) {
+    // Make room by writing out all complete lines.
+    size_t line_end = writer->len;
+    while (line_end > 0 && writer->buf[line_end - 1] != '\n') {
+      --line_end;
+    }
+    if (line_end > 0) {
+      writer_write_out(writer, line_end, NULL, 0);
+    }
+    if (writer->size - writer->len < len) {
+      // A single line does not fit, so write it out directly.
+      writer_write_out(writer, writer->len, data, len);
+      return;
+    }
+  }
+  memcpy(writer->buf + writer->len, data, len);
+  writer->len += len;
+}
+
+void shbt_writer_puts(struct shbt_writer* writer, const char* str) {
+  shbt_writer_write(writer, str, strlen(str));
+}
+
+void shbt_writer_put_int(struct shbt_writer* writer, intptr_t i, int base,
+                         size_t pad) {
+  char str_buf[128];  // Sufficient for any base.
+  if (shbt_itoa(i, str_buf, sizeof(str_buf), base, pad) != NULL) {
+    shbt_writer_puts(writer, str_buf);
+  }
+}
+
 // Implementation adapted from Chromium base/debug/stack_trace_posix.cc.
 // See LICENSE for more information.
 char* shbt_itoa(intptr_t i, char* buf, size_t size, int base, size_t pad) {
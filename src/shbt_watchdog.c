@@ -0,0 +1,305 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Hang detection with heartbeats.
+ *
+ * Each thread that calls shbt_heartbeat gets a slot holding a counter that
+ * it alone increments, so a heartbeat is a thread-local load and a relaxed
+ * store (behind a call into the library). A monitor
+ * thread polls the counters a few times per timeout, and reports a thread
+ * whose counter has not changed for the whole timeout, with its backtrace
+ * collected through the thread capture signal.
+ *
+ * Slots are padded to a cache line, so threads heartbeating in tight loops
+ * do not slow each other down.
+ */
+
+#define _GNU_SOURCE  // For SYS_gettid and SYS_tgkill.
+#include <stdint.h>
+
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+#ifdef __linux__
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+// Maximum number of threads that can be monitored.
+#define SHBT_WATCHDOG_MAX_THREADS 256
+// Maximum number of frames reported for a hung thread.
+#define SHBT_WATCHDOG_MAX_FRAMES 64
+// Number of polls a hung thread's backtrace is tried for (e.g. while
+// another thread's is being collected) before it is reported without one.
+#define SHBT_WATCHDOG_CAPTURE_ATTEMPTS 8
+
+/** A thread monitored by the watchdog. */
+struct watchdog_thread {
+  /** Thread ID, or 0 if the slot is free. */
+  _Alignas(64) atomic_int tid;
+  /** Number of heartbeats, written only by the thread. */
+  _Atomic uint64_t beats;
+  /** The thread's own copy of beats, so it never needs to load it. */
+  uint64_t local_beats;
+  // The rest is only used by the monitor thread.
+  /** Thread the monitor last saw in the slot. */
+  int seen_tid;
+  /** Value of beats when the monitor last saw it change. */
+  uint64_t seen_beats;
+  /** Time the monitor last saw beats change. */
+  int64_t seen_ns;
+  /** Whether the current stall has been reported. */
+  bool reported;
+  /** Number of times the current stall's backtrace has been tried. */
+  int capture_attempts;
+};
+
+static struct watchdog_thread watchdog_threads[SHBT_WATCHDOG_MAX_THREADS];
+// Heartbeats of threads that did not get a slot go here and are ignored.
+static struct watchdog_thread watchdog_unmonitored;
+// Initial-exec, so heartbeats load it directly instead of calling
+// __tls_get_addr, as they would in a shared library by default.
+static _Thread_local struct watchdog_thread* watchdog_self
+  __attribute__((tls_model("initial-exec"))) = NULL;
+static pthread_once_t watchdog_once = PTHREAD_ONCE_INIT;
+static pthread_key_t watchdog_key;
+static bool watchdog_key_created = false;
+
+static pthread_mutex_t watchdog_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool watchdog_running = false;
+static pthread_t watchdog_monitor;
+static atomic_bool watchdog_stop = false;
+static int64_t watchdog_timeout_ns;
+static shbt_exit_action_t watchdog_exit_action;
+static shbt_frame_t watchdog_frames[SHBT_WATCHDOG_MAX_FRAMES];
+
+static int64_t watchdog_now_ns() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+// Free the calling thread's slot when it exits.
+static void watchdog_release(void* arg) {
+  struct watchdog_thread* thread = (struct watchdog_thread*) arg;
+  atomic_store_explicit(&thread->tid, 0, memory_order_release);
+}
+
+static void watchdog_init() {
+  watchdog_key_created =
+    pthread_key_create(&watchdog_key, &watchdog_release) == 0;
+}
+
+// Give the calling thread a slot.
+static struct watchdog_thread* watchdog_register() {
+  pthread_once(&watchdog_once, &watchdog_init);
+  int tid = (int) syscall(SYS_gettid);
+  for (size_t i = 0; i < SHBT_WATCHDOG_MAX_THREADS; ++i) {
+    struct watchdog_thread* thread = &watchdog_threads[i];
+    int expected = 0;
+    if (atomic_compare_exchange_strong_explicit(
+          &thread->tid, &expected, tid,
+          memory_order_acquire, memory_order_relaxed)) {
+      thread->local_beats = atomic_load_explicit(&thread->beats,
+                                                 memory_order_relaxed);
+      if (watchdog_key_created) {
+        pthread_setspecific(watchdog_key, thread);
+      }
+      watchdog_self = thread;
+      return thread;
+    }
+  }
+  watchdog_self = &watchdog_unmonitored;
+  return watchdog_self;
+}
+
+void shbt_heartbeat() {
+  struct watchdog_thread* self = watchdog_self;
+  if (self == NULL) {
+    self = watchdog_register();
+  }
+  atomic_store_explicit(&self->beats, ++self->local_beats,
+                        memory_order_relaxed);
+}
+
+void shbt_watchdog_unregister_thread() {
+  struct watchdog_thread* self = watchdog_self;
+  if (self == NULL) {
+    return;
+  }
+  if (self != &watchdog_unmonitored) {
+    if (watchdog_key_created) {
+      pthread_setspecific(watchdog_key, NULL);
+    }
+    watchdog_release(self);
+  }
+  watchdog_self = NULL;
+}
+
+// Report a thread that missed its deadline, then take the exit action.
+// Unless this is the last attempt, nothing is reported if the thread's
+// backtrace cannot be collected. Returns whether it was reported.
+static bool watchdog_report(int tid, int64_t stalled_ns, bool last_attempt) {
+  size_t num_frames;
+  bool collected = shbt_collect_thread_backtrace(
+    tid, watchdog_frames, SHBT_WATCHDOG_MAX_FRAMES, &num_frames,
+    SHBT_THREAD_TIMEOUT_MS);
+  if (!collected && !last_attempt) {
+    return false;
+  }
+  struct shbt_writer writer;
+  shbt_writer_init(&writer, STDERR_FILENO);
+  shbt_writer_puts(&writer, "SHBT watchdog: ");
+  shbt_write_thread_name(&writer, tid);
+  shbt_writer_puts(&writer, " has not sent a heartbeat for ");
+  shbt_writer_put_int(&writer, (intptr_t) (stalled_ns / 1000000), 10, 0);
+  shbt_writer_puts(&writer, " ms\n");
+  if (collected) {
+    shbt_writer_puts(&writer, "Backtrace:\n");
+    shbt_writer_finish(&writer);
+    shbt_print_collected_backtrace_fd(watchdog_frames, num_frames,
+                                      STDERR_FILENO);
+  } else {
+    shbt_writer_puts(&writer, "(Failed to collect backtrace)\n");
+    shbt_writer_finish(&writer);
+  }
+  if (watchdog_exit_action == SHBT_EXIT_ACTION_EXIT) {
+    _exit(EXIT_FAILURE);
+  } else if (watchdog_exit_action == SHBT_EXIT_ACTION_RERAISE) {
+    // Abort in the hung thread, so a core dump shows it as the culprit.
+    signal(SIGABRT, SIG_DFL);
+    syscall(SYS_tgkill, getpid(), tid, SIGABRT);
+    // If the thread has SIGABRT blocked, abort from here instead.
+    sleep(1);
+    abort();
+  }
+  return true;
+}
+
+static void* watchdog_main(void* arg) {
+  (void) arg;
+  // Check several times per timeout so stalls are noticed promptly.
+  int64_t interval_ns = watchdog_timeout_ns / 8;
+  if (interval_ns < 1000000) {
+    interval_ns = 1000000;
+  } else if (interval_ns > 100000000) {
+    interval_ns = 100000000;
+  }
+  struct timespec next;
+  clock_gettime(CLOCK_MONOTONIC, &next);
+  while (!atomic_load(&watchdog_stop)) {
+    next.tv_nsec += interval_ns;
+    while (next.tv_nsec >= 1000000000L) {
+      next.tv_nsec -= 1000000000L;
+      ++next.tv_sec;
+    }
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next, NULL) ==
+           EINTR) {}
+    // Keep reports' module offsets current without hooking dlopen.
+    shbt_check_modules();
+    int64_t now = watchdog_now_ns();
+    for (size_t i = 0; i < SHBT_WATCHDOG_MAX_THREADS; ++i) {
+      struct watchdog_thread* thread = &watchdog_threads[i];
+      int tid = atomic_load_explicit(&thread->tid, memory_order_acquire);
+      if (tid == 0) {
+        thread->seen_tid = 0;
+        continue;
+      }
+      uint64_t beats = atomic_load_explicit(&thread->beats,
+                                            memory_order_relaxed);
+      if (tid != thread->seen_tid || beats != thread->seen_beats) {
+        thread->seen_tid = tid;
+        thread->seen_beats = beats;
+        thread->seen_ns = now;
+        thread->reported = false;
+        thread->capture_attempts = 0;
+      } else if (!thread->reported &&
+                 now - thread->seen_ns >= watchdog_timeout_ns) {
+        // Report each stall once, retrying on later polls until its
+        // backtrace is collected; a later heartbeat re-arms it.
+        thread->reported = watchdog_report(
+          tid, now - thread->seen_ns,
+          ++thread->capture_attempts >= SHBT_WATCHDOG_CAPTURE_ATTEMPTS);
+      }
+    }
+  }
+  return NULL;
+}
+
+bool shbt_watchdog_start(int timeout_ms, shbt_exit_action_t exit_action) {
+  if (timeout_ms <= 0) {
+    return false;
+  }
+  pthread_mutex_lock(&watchdog_mutex);
+  if (watchdog_running) {
+    pthread_mutex_unlock(&watchdog_mutex);
+    return false;
+  }
+  watchdog_timeout_ns = (int64_t) timeout_ms * 1000000;
+  watchdog_exit_action = exit_action;
+  // Start every stall afresh.
+  for (size_t i = 0; i < SHBT_WATCHDOG_MAX_THREADS; ++i) {
+    watchdog_threads[i].seen_tid = 0;
+  }
+  atomic_store(&watchdog_stop, false);
+  if (pthread_create(&watchdog_monitor, NULL, &watchdog_main, NULL) != 0) {
+    pthread_mutex_unlock(&watchdog_mutex);
+    return false;
+  }
+  watchdog_running = true;
+  pthread_mutex_unlock(&watchdog_mutex);
+  return true;
+}
+
+bool shbt_watchdog_stop() {
+  pthread_mutex_lock(&watchdog_mutex);
+  if (!watchdog_running) {
+    pthread_mutex_unlock(&watchdog_mutex);
+    return false;
+  }
+  atomic_store(&watchdog_stop, true);
+  pthread_join(watchdog_monitor, NULL);
+  watchdog_running = false;
+  pthread_mutex_unlock(&watchdog_mutex);
+  return true;
+}
+
+#else  // __linux__
+
+// The watchdog collects backtraces with thread capture, which is
+// Linux-specific. Heartbeats are still accepted, so callers need no checks.
+
+void shbt_heartbeat() {}
+
+void shbt_watchdog_unregister_thread() {}
+
+bool shbt_watchdog_start(int timeout_ms, shbt_exit_action_t exit_action) {
+  (void) timeout_ms;
+  (void) exit_action;
+  return false;
+}
+
+bool shbt_watchdog_stop() {
+  return false;
+}
+
+#endif  // __linux__
@@ -0,0 +1,43 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdlib.h>
+#include <unistd.h>
+#include "shbt/shbt.h"
+
+// Collect only addresses, then symbolize and print them afterward.
+
+#define MAX_PCS 64
+
+void* pcs[MAX_PCS];
+size_t num_pcs = 0;
+volatile int calls = 0;
+
+__attribute__((noinline)) void collect(int depth) {
+  if (depth > 0) {
+    collect(depth - 1);
+  } else {
+    shbt_collect_addresses(pcs, MAX_PCS, &num_pcs);
+  }
+  ++calls;  // Prevent tail calls so each frame shows up.
+}
+
+int main() {
+  collect(3);
+  shbt_frame_t trace[MAX_PCS];
+  shbt_symbolize(pcs, num_pcs, trace);
+  shbt_print_collected_backtrace_fd(trace, num_pcs, STDOUT_FILENO);
+  return 0;
+}
@@ -0,0 +1,56 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "shbt/shbt.h"
+
+// Collect several backtraces into compact frames sharing one string arena.
+
+#define MAX_FRAMES 64
+#define NUM_TRACES 4
+
+shbt_compact_frame_t traces[NUM_TRACES][MAX_FRAMES];
+size_t num_frames[NUM_TRACES];
+char arena_buf[4096];
+shbt_string_arena_t arena;
+volatile int calls = 0;
+
+__attribute__((noinline)) void collect(int trace, int depth) {
+  if (depth > 0) {
+    collect(trace, depth - 1);
+  } else {
+    shbt_collect_compact_backtrace(traces[trace], MAX_FRAMES,
+                                   &num_frames[trace], &arena);
+  }
+  ++calls;  // Prevent tail calls so each frame shows up.
+}
+
+int main() {
+  shbt_string_arena_init(&arena, arena_buf, sizeof(arena_buf));
+  for (int i = 0; i < NUM_TRACES; ++i) {
+    collect(i, i);
+  }
+  for (int i = 0; i < NUM_TRACES; ++i) {
+    printf("Trace %d:\n", i);
+    fflush(stdout);
+    shbt_print_compact_backtrace_fd(traces[i], num_frames[i], &arena,
+                                    STDOUT_FILENO);
+  }
+  printf("%zu bytes of frames, %zu bytes of names\n",
+         sizeof(traces), arena.used);
+  return 0;
+}
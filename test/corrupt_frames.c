@@ -0,0 +1,46 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "shbt/shbt.h"
+
+// Print backtraces after overwriting the saved frame pointer with bad
+// values. With SHBT_UNWINDER=FRAME_POINTER, each backtrace should end at the
+// corrupted frame instead of crashing.
+
+volatile int calls = 0;
+
+__attribute__((noinline)) void corrupt(uintptr_t bad_frame) {
+  void** frame = (void**) __builtin_frame_address(0);
+  void* saved_frame = frame[0];
+  frame[0] = (void*) bad_frame;
+  printf("Saved frame pointer 0x%llx:\n", (unsigned long long) bad_frame);
+  fflush(stdout);
+  shbt_print_backtrace_fd(STDOUT_FILENO);
+  frame[0] = saved_frame;
+  ++calls;  // Prevent tail calls so each frame shows up.
+}
+
+int main() {
+  uintptr_t frame = (uintptr_t) __builtin_frame_address(0);
+  corrupt(0x10);  // Below the stack.
+  corrupt(frame + 1);  // Misaligned.
+  corrupt(frame - 64);  // Toward the top of the stack.
+  corrupt(frame + ((uintptr_t) 1 << 40));  // Past the base of the stack.
+  corrupt(UINTPTR_MAX & ~(uintptr_t) 7);  // Would wrap around.
+  return 0;
+}
@@ -0,0 +1,106 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "shbt/shbt.h"
+
+// Write a crash record for a signal, then read it back and decode it.
+// If a file is given, the record is kept there (try shbt_symbolize on it).
+
+#define MAX_PCS 64
+
+volatile int calls = 0;
+
+__attribute__((noinline)) void crash(int depth) {
+  if (depth > 0) {
+    crash(depth - 1);
+  } else {
+    raise(SIGUSR1);
+  }
+  ++calls;  // Prevent tail calls so each frame shows up.
+}
+
+int main(int argc, char** argv) {
+  char path[] = "/tmp/shbt_crash_record_XXXXXX";
+  int fd;
+  if (argc > 1) {
+    fd = open(argv[1], O_RDWR | O_CREAT | O_TRUNC, 0644);
+  } else {
+    fd = mkstemp(path);
+    unlink(path);
+  }
+  if (fd < 0) {
+    perror("open");
+    return 1;
+  }
+  shbt_register_signal_handler(SIGUSR1, SHBT_EXIT_ACTION_RETURN, NULL);
+  shbt_set_crash_record_fd(fd);
+  crash(3);
+  shbt_set_crash_record_fd(-1);
+
+  static char record[64 * 1024];
+  ssize_t size = pread(fd, record, sizeof(record), 0);
+  shbt_crash_record_header_t header;
+  if (size < (ssize_t) sizeof(header)) {
+    printf("Record too short: %zd bytes\n", size);
+    return 1;
+  }
+  memcpy(&header, record, sizeof(header));
+  if (header.magic != SHBT_CRASH_RECORD_MAGIC ||
+      header.version != SHBT_CRASH_RECORD_VERSION ||
+      header.record_size != (uint32_t) size) {
+    printf("Bad record header\n");
+    return 1;
+  }
+  printf("Record: %u bytes, signal %d (code %d) in process %d thread %d\n",
+         header.record_size, header.sig_num, header.sig_code, header.pid,
+         header.tid);
+  fflush(stdout);
+
+  // The process is still running, so its addresses can be symbolized here.
+  void* pcs[MAX_PCS];
+  size_t num_pcs = header.num_pcs < MAX_PCS ? header.num_pcs : MAX_PCS;
+  const char* p = record + header.header_size;
+  for (size_t i = 0; i < num_pcs; ++i) {
+    uint64_t pc;
+    memcpy(&pc, p + i * sizeof(pc), sizeof(pc));
+    pcs[i] = (void*) (uintptr_t) pc;
+  }
+  shbt_frame_t trace[MAX_PCS];
+  shbt_symbolize_ex(pcs, num_pcs, trace, true);
+  shbt_print_collected_backtrace_fd(trace, num_pcs, STDOUT_FILENO);
+
+  p += header.num_pcs * sizeof(uint64_t);
+  printf("%u modules%s:\n", header.num_modules,
+         header.flags & SHBT_CRASH_RECORD_TRUNCATED ? " (truncated)" : "");
+  for (uint32_t i = 0; i < header.num_modules; ++i) {
+    shbt_crash_record_module_t module;
+    memcpy(&module, p, sizeof(module));
+    printf("  0x%012llx-0x%012llx %s ",
+           (unsigned long long) module.start, (unsigned long long) module.end,
+           p + sizeof(module));
+    for (size_t j = 0; j < module.build_id_size; ++j) {
+      printf("%02x", module.build_id[j]);
+    }
+    printf("\n");
+    p += module.entry_size;
+  }
+  return 0;
+}
@@ -0,0 +1,145 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <dlfcn.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shbt/shbt.h"
+#include "shbt/shbt_internal.h"
+
+// Load a library, index its symbols, unload it, then load another library
+// (usually at the same address) and check its functions are not given the
+// first library's names. Then load and unload the libraries many times, and
+// check that what SHBT keeps for them does not grow, and that a name looked
+// up after every unload is still cached.
+
+// Number of times each library is loaded and unloaded again.
+#define RELOAD_CYCLES 200
+
+// Load path, call its function named name, and check the name reported for
+// its frame. Returns false on failure.
+static bool check_library(const char* path, const char* name,
+                          void** address) {
+  void* handle = dlopen(path, RTLD_NOW);
+  if (handle == NULL) {
+    printf("Failed to load %s: %s\n", path, dlerror());
+    return false;
+  }
+  shbt_update_module_map();
+  void (*function)(shbt_frame_t*) =
+    (void (*)(shbt_frame_t*)) dlsym(handle, name);
+  if (function == NULL) {
+    printf("Failed to find %s\n", name);
+    return false;
+  }
+  // Build the index (again) only after loading the first library.
+  if (*address == NULL) {
+    shbt_build_symbol_index();
+  }
+  shbt_frame_t frame;
+  function(&frame);
+  printf("%s loaded %s previous address: %s\n", name,
+         *address == NULL ? "with no" :
+         (void*) function == *address ? "at the" : "away from the",
+         frame.symbol);
+  *address = (void*) function;
+  dlclose(handle);
+  shbt_update_module_map();
+  return strcmp(frame.symbol, name) == 0;
+}
+
+// Return the number of memory mappings of the process, or 0 on failure.
+static size_t count_mappings() {
+  FILE* maps = fopen("/proc/self/maps", "r");
+  if (maps == NULL) {
+    return 0;
+  }
+  size_t count = 0;
+  int c;
+  while ((c = fgetc(maps)) != EOF) {
+    count += c == '\n';
+  }
+  fclose(maps);
+  return count;
+}
+
+// Return the number of bytes of heap in use, or 0 if it is not known.
+static size_t heap_in_use() {
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || __GLIBC_MINOR__ >= 33)
+  return mallinfo2().uordblks;
+#else
+  return 0;
+#endif
+}
+
+// Load and unload path, updating SHBT and the unwind tables each time, then
+// look up the name of pc. Returns false on failure.
+static bool cycle_library(const char* path, void* pc) {
+  void* handle = dlopen(path, RTLD_NOW);
+  if (handle == NULL) {
+    printf("Failed to load %s: %s\n", path, dlerror());
+    return false;
+  }
+  shbt_update_module_map();
+  shbt_build_unwind_table();
+  dlclose(handle);
+  shbt_update_module_map();
+  shbt_build_unwind_table();
+  shbt_frame_t frame;
+  return shbt_symbolize(&pc, 1, &frame);
+}
+
+int main() {
+  void* address = NULL;
+  if (!check_library(MODULE_RELOAD_A, "reload_function_a", &address) ||
+      !check_library(MODULE_RELOAD_B, "reload_function_b", &address)) {
+    return EXIT_FAILURE;
+  }
+  void* pc;
+  size_t num_pcs;
+  if (!shbt_collect_addresses(&pc, 1, &num_pcs) || num_pcs != 1) {
+    return EXIT_FAILURE;
+  }
+  // Build the unwind tables first, so they are counted from the start.
+  shbt_build_unwind_table();
+  size_t mappings = count_mappings();
+  size_t heap = heap_in_use();
+  for (int i = 0; i < RELOAD_CYCLES; ++i) {
+    if (!cycle_library(MODULE_RELOAD_A, pc) ||
+        !cycle_library(MODULE_RELOAD_B, pc)) {
+      return EXIT_FAILURE;
+    }
+  }
+  uintptr_t offset;
+  const char* cached = shbt_symbol_cache_lookup((uintptr_t) pc, &offset);
+  printf("Name cached after %d reloads: %s\n", RELOAD_CYCLES,
+         cached != NULL ? cached : "(none)");
+  if (cached == NULL) {
+    return EXIT_FAILURE;
+  }
+  size_t new_mappings = count_mappings();
+  size_t new_heap = heap_in_use();
+  printf("Mappings after %d reloads: %zu, before: %zu\n", RELOAD_CYCLES,
+         new_mappings, mappings);
+  printf("Heap after %d reloads: %zu, before: %zu\n", RELOAD_CYCLES,
+         new_heap, heap);
+  // Allow for the C library's own memory, which may be allocated meanwhile.
+  if (new_mappings > mappings + 8 || new_heap > heap + 64 * 1024) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
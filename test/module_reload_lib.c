@@ -0,0 +1,29 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stddef.h>
+#include "shbt/shbt.h"
+
+// A library for module_reload. It is built twice, with RELOAD_FUNCTION
+// naming its one function differently, so both builds are the same size.
+
+volatile int calls = 0;
+
+// Collect the frame of this function.
+__attribute__((noinline)) void RELOAD_FUNCTION(shbt_frame_t* frame) {
+  size_t num_frames;
+  shbt_collect_backtrace(frame, 1, &num_frames);
+  ++calls;  // Prevent tail calls.
+}
@@ -0,0 +1,54 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include "shbt/shbt.h"
+
+// Overflow the stack of a worker thread. The handler should still print a
+// backtrace, since the thread gets its own alternate signal stack.
+
+volatile int calls = 0;
+volatile int max_depth = 1 << 30;
+
+__attribute__((noinline)) int recurse(int depth) {
+  volatile char frame[1024];
+  frame[0] = (char) depth;
+  int r = depth < max_depth ? recurse(depth + 1) + frame[0] : 0;
+  ++calls;  // Prevent tail-call optimization.
+  return r;
+}
+
+void* worker_main(void* arg) {
+  (void) arg;
+#ifndef SHBT_HOOK_THREAD_CREATE
+  shbt_install_signal_stack();
+#endif
+  recurse(0);
+  return NULL;
+}
+
+int main() {
+  shbt_register_fatal_handlers();
+  // Use a small stack so the backtrace stays short.
+  pthread_attr_t attr;
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+  pthread_t worker;
+  pthread_create(&worker, &attr, worker_main, NULL);
+  pthread_join(worker, NULL);
+  printf("Should not reach here\n");
+  return 0;
+}
@@ -0,0 +1,119 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "shbt/shbt.h"
+
+// Profile two busy threads, then print the innermost frame of each sample.
+// Many short-lived threads are registered first, so the busy thread is only
+// sampled if the slots of exited threads are reused. If files are given, folded stacks are written to the first (try
+// shbt_flamegraph on it) and a pprof profile to the second.
+
+volatile double sink = 0.0;
+
+__attribute__((noinline)) void spin(long iters) {
+  for (long i = 0; i < iters; ++i) {
+    sink += (double) i * 0.5;
+  }
+}
+
+// Number of short-lived threads, more than the profiler can sample at once.
+#define NUM_SHORT_THREADS 300
+
+void* short_thread_main(void* arg) {
+  (void) arg;
+  shbt_profiler_register_thread();
+  return NULL;
+}
+
+void* thread_main(void* arg) {
+  bool* registered = (bool*) arg;
+  *registered = shbt_profiler_register_thread();
+  spin(100000000);
+  return NULL;
+}
+
+void print_sample(const shbt_profiler_sample_t* sample, void* arg) {
+  size_t* num_samples = (size_t*) arg;
+  if (*num_samples < 5 && sample->num_pcs > 0) {
+    shbt_frame_t frame;
+    shbt_symbolize_ex(sample->pcs, 1, &frame, true);
+    printf("Thread %d (%zu frames): %s\n", sample->tid, sample->num_pcs,
+           frame.symbol);
+  }
+  ++*num_samples;
+}
+
+void find_top_stack(uint32_t id, void* const pcs[], size_t num_pcs,
+                    uint64_t count, void* arg) {
+  (void) id;
+  (void) pcs;
+  (void) num_pcs;
+  uint64_t* top_count = (uint64_t*) arg;
+  if (count > *top_count) {
+    *top_count = count;
+  }
+}
+
+int main(int argc, char** argv) {
+  if (!shbt_profiler_start(1000)) {
+    printf("Failed to start profiler\n");
+    return 1;
+  }
+  pthread_t thread;
+  for (int i = 0; i < NUM_SHORT_THREADS; ++i) {
+    pthread_create(&thread, NULL, short_thread_main, NULL);
+    pthread_join(thread, NULL);
+  }
+  bool registered = false;
+  pthread_create(&thread, NULL, thread_main, &registered);
+  spin(100000000);
+  pthread_join(thread, NULL);
+  shbt_profiler_stop();
+  if (!registered) {
+    printf("Failed to register thread after %d exited threads\n",
+           NUM_SHORT_THREADS);
+    return 1;
+  }
+  size_t num_samples = 0;
+  shbt_profiler_read_samples(print_sample, &num_samples);
+  printf("%zu samples, %llu dropped\n", num_samples,
+         (unsigned long long) shbt_profiler_dropped_samples());
+  uint64_t top_count = 0;
+  size_t num_stacks = shbt_stack_table_foreach(shbt_profiler_stacks(),
+                                               find_top_stack, &top_count);
+  printf("%zu distinct stacks, hottest sampled %llu times\n", num_stacks,
+         (unsigned long long) top_count);
+  if (argc > 1) {
+    int fd = open(argv[1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || !shbt_profile_write_folded(fd)) {
+      printf("Failed to write folded stacks to %s\n", argv[1]);
+      return 1;
+    }
+    close(fd);
+  }
+  if (argc > 2) {
+    int fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || !shbt_profile_write_pprof(fd)) {
+      printf("Failed to write pprof profile to %s\n", argv[2]);
+      return 1;
+    }
+    close(fd);
+  }
+  return 0;
+}
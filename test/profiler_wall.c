@@ -0,0 +1,84 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "shbt/shbt.h"
+
+// Profile a busy thread and a blocked thread by wall-clock time, then
+// count the samples of each thread by state.
+
+volatile double sink = 0.0;
+int pipe_fds[2];
+
+__attribute__((noinline)) void spin(long iters) {
+  for (long i = 0; i < iters; ++i) {
+    sink += (double) i * 0.5;
+  }
+}
+
+void* thread_main(void* arg) {
+  (void) arg;
+  char c;
+  // Block until the main thread is done.
+  while (read(pipe_fds[0], &c, 1) < 0) {}
+  return NULL;
+}
+
+struct counts {
+  int tid;
+  size_t running;
+  size_t sleeping;
+  size_t other;
+};
+
+void count_sample(const shbt_profiler_sample_t* sample, void* arg) {
+  struct counts* counts = (struct counts*) arg;
+  for (; counts->tid != 0 && counts->tid != sample->tid; ++counts) {}
+  counts->tid = sample->tid;
+  if (sample->state == 'R') {
+    ++counts->running;
+  } else if (sample->state == 'S') {
+    ++counts->sleeping;
+  } else {
+    ++counts->other;
+  }
+}
+
+int main() {
+  if (pipe(pipe_fds) < 0) {
+    return 1;
+  }
+  pthread_t thread;
+  pthread_create(&thread, NULL, thread_main, NULL);
+  if (!shbt_profiler_start_wall(100)) {
+    printf("Failed to start profiler\n");
+    return 1;
+  }
+  spin(100000000);
+  shbt_profiler_stop();
+  if (write(pipe_fds[1], "x", 1) != 1) {
+    return 1;
+  }
+  pthread_join(thread, NULL);
+  struct counts counts[8] = {{0}};
+  shbt_profiler_read_samples(count_sample, counts);
+  for (size_t i = 0; i < 8 && counts[i].tid != 0; ++i) {
+    printf("Thread %d: %zu running, %zu sleeping, %zu other\n", counts[i].tid,
+           counts[i].running, counts[i].sleeping, counts[i].other);
+  }
+  return 0;
+}
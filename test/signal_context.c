@@ -0,0 +1,58 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE  // For SA_SIGINFO.
+#include <signal.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "shbt/shbt.h"
+
+// Collect a backtrace in a handler of our own, starting from the frame the
+// signal interrupted rather than from the handler.
+
+#define MAX_FRAMES 64
+
+shbt_frame_t trace[MAX_FRAMES];
+volatile int calls = 0;
+
+void handler(int sig_num, siginfo_t* info, void* ucontext) {
+  (void) sig_num;
+  (void) info;
+  size_t num_frames = 0;
+  shbt_collect_backtrace_from_context(ucontext, trace, MAX_FRAMES,
+                                      &num_frames);
+  shbt_print_collected_backtrace_fd(trace, num_frames, STDOUT_FILENO);
+}
+
+__attribute__((noinline)) void interrupt(int depth) {
+  if (depth > 0) {
+    interrupt(depth - 1);
+  } else {
+    raise(SIGUSR1);
+  }
+  ++calls;  // Prevent tail calls so each frame shows up.
+}
+
+int main() {
+  struct sigaction sa;
+  sa.sa_sigaction = &handler;
+  sigemptyset(&sa.sa_mask);
+  sa.sa_flags = SA_SIGINFO;
+  if (sigaction(SIGUSR1, &sa, NULL) < 0) {
+    return EXIT_FAILURE;
+  }
+  interrupt(3);
+  return 0;
+}
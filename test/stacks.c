@@ -0,0 +1,62 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <stdio.h>
+#include "shbt/shbt.h"
+
+// Intern stacks collected from a few call paths and print their counts.
+
+#define MAX_PCS 64
+
+shbt_stack_table_t* table;
+volatile int calls = 0;
+
+__attribute__((noinline)) void collect(int depth) {
+  if (depth > 0) {
+    collect(depth - 1);
+  } else {
+    void* pcs[MAX_PCS];
+    size_t num_pcs;
+    shbt_collect_addresses(pcs, MAX_PCS, &num_pcs);
+    shbt_stack_table_intern(table, pcs, num_pcs, 1);
+  }
+  ++calls;  // Prevent tail calls so each frame shows up.
+}
+
+void print_stack(uint32_t id, void* const pcs[], size_t num_pcs,
+                 uint64_t count, void* arg) {
+  (void) pcs;
+  (void) arg;
+  printf("Stack %u: %zu frames, count %llu\n", id, num_pcs,
+         (unsigned long long) count);
+}
+
+int main() {
+  table = shbt_stack_table_create(128, 4096);
+  if (table == NULL) {
+    printf("Failed to create stack table\n");
+    return 1;
+  }
+  for (int i = 0; i < 10; ++i) {
+    collect(i % 3);
+  }
+  shbt_stack_table_foreach(table, print_stack, NULL);
+  shbt_stack_table_reset(table);
+  collect(0);
+  printf("After reset:\n");
+  shbt_stack_table_foreach(table, print_stack, NULL);
+  shbt_stack_table_destroy(table);
+  return 0;
+}
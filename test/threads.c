@@ -0,0 +1,97 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#define _GNU_SOURCE  // For SYS_gettid.
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include "shbt/shbt.h"
+
+// Capture the backtrace of a busy thread, then dump every thread, including
+// one blocked in a system call.
+
+volatile double sink = 0.0;
+atomic_int spinner_tid = 0;
+atomic_bool done = false;
+int blocker_pipe[2];
+
+__attribute__((noinline)) void spin() {
+  while (!atomic_load(&done)) {
+    sink += 0.5;
+  }
+}
+
+void* spinner_main(void* arg) {
+  (void) arg;
+  atomic_store(&spinner_tid, (int) syscall(SYS_gettid));
+  spin();
+  return NULL;
+}
+
+__attribute__((noinline)) void block() {
+  char c;
+  if (read(blocker_pipe[0], &c, 1) < 0) {
+    perror("read");
+  }
+}
+
+void* blocker_main(void* arg) {
+  (void) arg;
+  block();
+  return NULL;
+}
+
+int main() {
+  if (pipe(blocker_pipe) < 0) {
+    perror("pipe");
+    return 1;
+  }
+  pthread_t spinner, blocker;
+  pthread_create(&spinner, NULL, spinner_main, NULL);
+  pthread_create(&blocker, NULL, blocker_main, NULL);
+  while (atomic_load(&spinner_tid) == 0) {}
+  usleep(10000);  // Let the blocker block.
+
+  shbt_frame_t trace[32];
+  size_t num_frames;
+  if (shbt_collect_thread_backtrace(atomic_load(&spinner_tid), trace, 32,
+                                    &num_frames, 100)) {
+    printf("Spinning thread:\n");
+    fflush(stdout);
+    shbt_print_collected_backtrace_fd(trace, num_frames, 1);
+  } else {
+    printf("Failed to collect the spinning thread's backtrace\n");
+  }
+
+  printf("\nAll threads:\n");
+  fflush(stdout);
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  shbt_dump_all_threads(1);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  printf("\nDumped in %.3f ms\n", (end.tv_sec - start.tv_sec) * 1e3 +
+                                  (end.tv_nsec - start.tv_nsec) / 1e6);
+
+  atomic_store(&done, true);
+  if (write(blocker_pipe[1], "x", 1) < 0) {
+    perror("write");
+  }
+  pthread_join(spinner, NULL);
+  pthread_join(blocker, NULL);
+  return 0;
+}
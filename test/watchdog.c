@@ -0,0 +1,65 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "shbt/shbt.h"
+
+// Run a worker that heartbeats for a while and then hangs. The watchdog
+// should report the hung worker's backtrace, but not the main thread, which
+// never sends heartbeats.
+
+volatile double sink = 0.0;
+int hang_pipe[2];
+
+__attribute__((noinline)) void hang() {
+  char c;
+  if (read(hang_pipe[0], &c, 1) < 0) {
+    perror("read");
+  }
+}
+
+void* worker_main(void* arg) {
+  (void) arg;
+  for (long i = 0; i < 50000000; ++i) {
+    sink += 0.5;
+    shbt_heartbeat();
+  }
+  hang();
+  return NULL;
+}
+
+int main() {
+  if (pipe(hang_pipe) < 0) {
+    perror("pipe");
+    return 1;
+  }
+  if (!shbt_watchdog_start(200, SHBT_EXIT_ACTION_RETURN)) {
+    printf("Failed to start watchdog\n");
+    return 1;
+  }
+  pthread_t worker;
+  pthread_create(&worker, NULL, worker_main, NULL);
+  sleep(1);
+  // Release the worker.
+  if (write(hang_pipe[1], "x", 1) < 0) {
+    perror("write");
+  }
+  pthread_join(worker, NULL);
+  shbt_watchdog_stop();
+  printf("Worker finished\n");
+  return 0;
+}
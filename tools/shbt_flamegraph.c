@@ -0,0 +1,398 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Generate a flame graph SVG from folded stacks.
+ *
+ * Usage: shbt_flamegraph [-t title] [-w width] [file]
+ *
+ * Reads folded stacks ("frame;frame;frame count" lines, as written by
+ * shbt_profile_write_folded) from file, or standard input, and writes an SVG
+ * to standard output. Identical stacks may appear on multiple lines; their
+ * counts are summed.
+ *
+ * This does not depend on SHBT itself, so it can be built and run anywhere.
+ */
+
+#define _POSIX_C_SOURCE 200809L  // For getline.
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Layout parameters, in pixels.
+#define FRAME_HEIGHT 16
+#define FONT_SIZE 12
+#define FONT_WIDTH 0.59  // Average character width relative to FONT_SIZE.
+#define PAD_X 10
+#define PAD_TOP 40
+#define PAD_BOTTOM 10
+#define MIN_FRAME_WIDTH 0.1
+
+/** A node in the call tree. */
+struct node {
+  /** Offset of the name in the name pool. */
+  size_t name;
+  /** Parent node. */
+  uint32_t parent;
+  /** First child, or 0 if none (the root is never a child). */
+  uint32_t first_child;
+  /** Next sibling, or 0 if none. */
+  uint32_t next_sibling;
+  /** Samples in this node and its children. */
+  uint64_t count;
+};
+
+/** The call tree being built. */
+struct tree {
+  /** Nodes; node 0 is the root. */
+  struct node* nodes;
+  size_t num_nodes;
+  size_t max_nodes;
+  /** Pool of NUL-terminated names. */
+  char* names;
+  size_t names_size;
+  size_t max_names_size;
+  /** Hash table of (parent, name) -> node, holding node + 1 or 0. */
+  uint32_t* children;
+  size_t num_children_slots;
+};
+
+static void* xrealloc(void* ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    fprintf(stderr, "shbt_flamegraph: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static uint64_t hash_child(uint32_t parent, const char* name, size_t len) {
+  // FNV-1a.
+  uint64_t hash = 0xcbf29ce484222325ull ^ parent;
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ (unsigned char) name[i]) * 0x100000001b3ull;
+  }
+  return hash;
+}
+
+static void tree_rehash(struct tree* tree, size_t num_slots) {
+  free(tree->children);
+  tree->children = calloc(num_slots, sizeof(uint32_t));
+  if (tree->children == NULL) {
+    fprintf(stderr, "shbt_flamegraph: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  tree->num_children_slots = num_slots;
+  for (uint32_t id = 1; id < tree->num_nodes; ++id) {
+    const char* name = tree->names + tree->nodes[id].name;
+    size_t i = hash_child(tree->nodes[id].parent, name, strlen(name)) &
+               (num_slots - 1);
+    while (tree->children[i] != 0) {
+      i = (i + 1) & (num_slots - 1);
+    }
+    tree->children[i] = id + 1;
+  }
+}
+
+static uint32_t tree_add_node(struct tree* tree, uint32_t parent,
+                              const char* name, size_t len) {
+  if (tree->num_nodes == tree->max_nodes) {
+    tree->max_nodes *= 2;
+    tree->nodes = xrealloc(tree->nodes, tree->max_nodes * sizeof(struct node));
+  }
+  while (tree->names_size + len + 1 > tree->max_names_size) {
+    tree->max_names_size *= 2;
+    tree->names = xrealloc(tree->names, tree->max_names_size);
+  }
+  uint32_t id = (uint32_t) tree->num_nodes++;
+  struct node* node = &tree->nodes[id];
+  node->name = tree->names_size;
+  memcpy(tree->names + tree->names_size, name, len);
+  tree->names[tree->names_size + len] = '\0';
+  tree->names_size += len + 1;
+  node->parent = parent;
+  node->first_child = 0;
+  node->next_sibling = tree->nodes[parent].first_child;
+  tree->nodes[parent].first_child = id;
+  node->count = 0;
+  return id;
+}
+
+// Find the child of parent with the given name, adding it if needed.
+static uint32_t tree_child(struct tree* tree, uint32_t parent,
+                           const char* name, size_t len) {
+  if (2 * tree->num_nodes >= tree->num_children_slots) {
+    tree_rehash(tree, 2 * tree->num_children_slots);
+  }
+  size_t mask = tree->num_children_slots - 1;
+  size_t i = hash_child(parent, name, len) & mask;
+  while (tree->children[i] != 0) {
+    uint32_t id = tree->children[i] - 1;
+    const char* id_name = tree->names + tree->nodes[id].name;
+    if (tree->nodes[id].parent == parent && strncmp(id_name, name, len) == 0 &&
+        id_name[len] == '\0') {
+      return id;
+    }
+    i = (i + 1) & mask;
+  }
+  uint32_t id = tree_add_node(tree, parent, name, len);
+  tree->children[i] = id + 1;
+  return id;
+}
+
+static void tree_init(struct tree* tree) {
+  tree->max_nodes = 1024;
+  tree->nodes = xrealloc(NULL, tree->max_nodes * sizeof(struct node));
+  tree->max_names_size = 64 * 1024;
+  tree->names = xrealloc(NULL, tree->max_names_size);
+  tree->names[0] = '\0';
+  tree->names_size = 1;
+  tree->num_nodes = 1;
+  memset(&tree->nodes[0], 0, sizeof(struct node));
+  tree->children = NULL;
+  tree_rehash(tree, 4096);
+}
+
+// Add one folded line to the tree. Returns false if it is malformed.
+static bool tree_add_line(struct tree* tree, char* line, size_t len) {
+  while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r' ||
+                     line[len - 1] == ' ')) {
+    --len;
+  }
+  if (len == 0) {
+    return true;  // Ignore blank lines.
+  }
+  line[len] = '\0';
+  char* count_str = strrchr(line, ' ');
+  if (count_str == NULL || count_str == line) {
+    return false;
+  }
+  char* end;
+  errno = 0;
+  unsigned long long count = strtoull(count_str + 1, &end, 10);
+  if (errno != 0 || *end != '\0' || end == count_str + 1) {
+    return false;
+  }
+  tree->nodes[0].count += count;
+  uint32_t node = 0;
+  const char* frame = line;
+  while (frame < count_str) {
+    const char* frame_end = memchr(frame, ';', (size_t) (count_str - frame));
+    if (frame_end == NULL) {
+      frame_end = count_str;
+    }
+    if (frame_end > frame) {
+      node = tree_child(tree, node, frame, (size_t) (frame_end - frame));
+      tree->nodes[node].count += count;
+    }
+    frame = frame_end + 1;
+  }
+  return true;
+}
+
+static struct tree* sort_tree;
+
+static int compare_by_name(const void* a, const void* b) {
+  return strcmp(sort_tree->names + sort_tree->nodes[*(const uint32_t*) a].name,
+                sort_tree->names + sort_tree->nodes[*(const uint32_t*) b].name);
+}
+
+// Sort every node's children by name, as is conventional for flame graphs.
+static void tree_sort(struct tree* tree) {
+  uint32_t* ids = xrealloc(NULL, tree->num_nodes * sizeof(uint32_t));
+  sort_tree = tree;
+  for (uint32_t parent = 0; parent < tree->num_nodes; ++parent) {
+    size_t n = 0;
+    for (uint32_t id = tree->nodes[parent].first_child; id != 0;
+         id = tree->nodes[id].next_sibling) {
+      ids[n++] = id;
+    }
+    if (n < 2) {
+      continue;
+    }
+    qsort(ids, n, sizeof(uint32_t), compare_by_name);
+    tree->nodes[parent].first_child = ids[0];
+    for (size_t i = 0; i + 1 < n; ++i) {
+      tree->nodes[ids[i]].next_sibling = ids[i + 1];
+    }
+    tree->nodes[ids[n - 1]].next_sibling = 0;
+  }
+  free(ids);
+}
+
+// Return the depth of the deepest frame that will be drawn.
+static size_t tree_depth(const struct tree* tree, uint32_t id,
+                         double px_per_sample) {
+  size_t depth = 0;
+  for (uint32_t child = tree->nodes[id].first_child; child != 0;
+       child = tree->nodes[child].next_sibling) {
+    if (tree->nodes[child].count * px_per_sample >= MIN_FRAME_WIDTH) {
+      size_t child_depth = tree_depth(tree, child, px_per_sample) + 1;
+      if (child_depth > depth) {
+        depth = child_depth;
+      }
+    }
+  }
+  return depth;
+}
+
+static void write_escaped(FILE* out, const char* str, size_t max_len) {
+  for (size_t i = 0; str[i] != '\0' && i < max_len; ++i) {
+    switch (str[i]) {
+    case '&': fputs("&amp;", out); break;
+    case '<': fputs("&lt;", out); break;
+    case '>': fputs("&gt;", out); break;
+    case '"': fputs("&quot;", out); break;
+    default: fputc(str[i], out); break;
+    }
+  }
+}
+
+/** Parameters for drawing. */
+struct svg_layout {
+  FILE* out;
+  double px_per_sample;
+  uint64_t total;
+  int height;
+};
+
+static void write_frame(const struct tree* tree, const struct svg_layout* svg,
+                        uint32_t id, double x, size_t depth) {
+  const struct node* node = &tree->nodes[id];
+  double width = node->count * svg->px_per_sample;
+  if (width < MIN_FRAME_WIDTH) {
+    return;
+  }
+  const char* name = id == 0 ? "all" : tree->names + node->name;
+  double y = svg->height - PAD_BOTTOM - (double) (depth + 1) * FRAME_HEIGHT;
+  // Pick a stable warm color from the name.
+  uint64_t hash = hash_child(0, name, strlen(name));
+  int red = 205 + (int) (hash % 50);
+  int green = (int) ((hash >> 8) % 230);
+  int blue = (int) ((hash >> 16) % 55);
+  fputs("<g><title>", svg->out);
+  write_escaped(svg->out, name, SIZE_MAX);
+  fprintf(svg->out, " (%llu samples, %.2f%%)</title>",
+          (unsigned long long) node->count,
+          100.0 * (double) node->count / (double) svg->total);
+  fprintf(svg->out,
+          "<rect x=\"%.1f\" y=\"%.1f\" width=\"%.1f\" height=\"%d\" "
+          "fill=\"rgb(%d,%d,%d)\" rx=\"2\"/>",
+          x, y, width, FRAME_HEIGHT - 1, red, green, blue);
+  // Truncate the label to fit, or omit it if there is too little room.
+  size_t fit = (size_t) ((width - 6) / (FONT_SIZE * FONT_WIDTH));
+  if (fit >= 3) {
+    size_t len = strlen(name);
+    fprintf(svg->out, "<text x=\"%.1f\" y=\"%.1f\">", x + 3,
+            y + FRAME_HEIGHT - 4);
+    if (len <= fit) {
+      write_escaped(svg->out, name, len);
+    } else {
+      write_escaped(svg->out, name, fit - 2);
+      fputs("..", svg->out);
+    }
+    fputs("</text>", svg->out);
+  }
+  fputs("</g>\n", svg->out);
+  for (uint32_t child = node->first_child; child != 0;
+       child = tree->nodes[child].next_sibling) {
+    write_frame(tree, svg, child, x, depth + 1);
+    x += tree->nodes[child].count * svg->px_per_sample;
+  }
+}
+
+static void write_svg(FILE* out, const struct tree* tree, const char* title,
+                      int width) {
+  struct svg_layout svg;
+  svg.out = out;
+  svg.total = tree->nodes[0].count;
+  svg.px_per_sample =
+    svg.total > 0 ? (double) (width - 2 * PAD_X) / (double) svg.total : 0.0;
+  size_t depth = svg.total > 0 ? tree_depth(tree, 0, svg.px_per_sample) : 0;
+  svg.height = PAD_TOP + PAD_BOTTOM + (int) (depth + 1) * FRAME_HEIGHT;
+  fprintf(out,
+          "<?xml version=\"1.0\" standalone=\"no\"?>\n"
+          "<svg version=\"1.1\" width=\"%d\" height=\"%d\" "
+          "xmlns=\"http://www.w3.org/2000/svg\">\n"
+          "<style>text { font-family: monospace; font-size: %dpx; }"
+          "</style>\n"
+          "<rect width=\"100%%\" height=\"100%%\" fill=\"#f8f8f8\"/>\n"
+          "<text x=\"%d\" y=\"24\" text-anchor=\"middle\" "
+          "style=\"font-size: 17px\">",
+          width, svg.height, FONT_SIZE, width / 2);
+  write_escaped(out, title, SIZE_MAX);
+  fputs("</text>\n", out);
+  if (svg.total > 0) {
+    write_frame(tree, &svg, 0, PAD_X, 0);
+  }
+  fputs("</svg>\n", out);
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: shbt_flamegraph [-t title] [-w width] [file]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+  const char* title = "Flame Graph";
+  int width = 1200;
+  const char* path = NULL;
+  for (int i = 1; i < argc; ++i) {
+    if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      title = argv[++i];
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      width = atoi(argv[++i]);
+      if (width <= 2 * PAD_X) {
+        usage();
+      }
+    } else if (argv[i][0] == '-' || path != NULL) {
+      usage();
+    } else {
+      path = argv[i];
+    }
+  }
+  FILE* in = stdin;
+  if (path != NULL) {
+    in = fopen(path, "r");
+    if (in == NULL) {
+      fprintf(stderr, "shbt_flamegraph: cannot open %s: %s\n", path,
+              strerror(errno));
+      return EXIT_FAILURE;
+    }
+  }
+  struct tree tree;
+  tree_init(&tree);
+  char* line = NULL;
+  size_t line_size = 0;
+  ssize_t len;
+  size_t line_num = 0;
+  while ((len = getline(&line, &line_size, in)) >= 0) {
+    ++line_num;
+    if (!tree_add_line(&tree, line, (size_t) len)) {
+      fprintf(stderr, "shbt_flamegraph: ignoring malformed line %zu\n",
+              line_num);
+    }
+  }
+  free(line);
+  if (in != stdin) {
+    fclose(in);
+  }
+  tree_sort(&tree);
+  write_svg(stdout, &tree, title, width);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,1616 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/*
+ * Symbolize crash records and address lists offline.
+ *
+ * Usage: shbt_symbolize [-j threads] [-m maps] [-d debug_dir] [file...]
+ *
+ * Each file (or standard input) holds either crash records, as written by
+ * SHBT signal handlers after shbt_set_crash_record_fd (any number of them,
+ * one after another), or a list of hexadecimal addresses, one per line,
+ * with blank lines separating backtraces. Crash records list the modules
+ * they need; address lists are resolved using maps, a copy of the
+ * /proc/<pid>/maps of the process the addresses came from.
+ *
+ * Every backtrace is printed with function names (demangled), source files
+ * and line numbers, read from the modules' ELF symbol tables and DWARF line
+ * tables. Debug information in separate files is found by build ID under
+ * /usr/lib/debug/.build-id, or any debug_dir given.
+ *
+ * Identical addresses are resolved once, however many backtraces they
+ * appear in, and modules are loaded and addresses resolved in parallel.
+ */
+
+#define _POSIX_C_SOURCE 200809L  // For pread, strsignal and gmtime_r.
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "shbt/shbt.h"
+
+// Marks a frame whose address is not in any known module.
+#define NO_LOOKUP UINT32_MAX
+// Marks a line table row with no file.
+#define NO_FILE UINT32_MAX
+// Maximum number of extra debug directories.
+#define MAX_DEBUG_DIRS 16
+// Number of addresses each thread resolves at a time.
+#define LOOKUP_BATCH 64
+
+char* symbolize_demangle(const char* mangled);
+
+/** A memory-mapped ELF file. */
+struct elf_image {
+  const uint8_t* data;
+  size_t size;
+  bool is64;
+  /** Section header string table. */
+  const char* shstrtab;
+  size_t shstrtab_size;
+};
+
+/** The parts of a section header that are needed, for either ELF class. */
+struct elf_section {
+  uint32_t name;
+  uint32_t type;
+  uint64_t flags;
+  uint64_t offset;
+  uint64_t size;
+  uint32_t link;
+};
+
+/** A loadable segment, for mapping file offsets to addresses. */
+struct segment {
+  uint64_t offset;
+  uint64_t vaddr;
+  uint64_t filesz;
+};
+
+/** A function symbol. */
+struct symbol {
+  uint64_t addr;
+  uint64_t size;
+  const char* name;
+  /** Preference among symbols at the same address (higher is better). */
+  int rank;
+};
+
+/** A row of a DWARF line table. */
+struct line_row {
+  uint64_t addr;
+  uint32_t file;
+  uint32_t line;
+  /** Whether this row ends a sequence (and covers no code). */
+  bool end;
+};
+
+/** A module (executable or shared library) referenced by the input. */
+struct module {
+  char* path;
+  uint8_t build_id[SHBT_CRASH_RECORD_MAX_BUILD_ID];
+  size_t build_id_size;
+  // Filled in when the module is loaded.
+  bool loaded;
+  struct elf_image image;
+  struct elf_image debug_image;
+  struct segment* segments;
+  size_t num_segments;
+  struct symbol* symbols;
+  size_t num_symbols;
+  struct line_row* rows;
+  size_t num_rows;
+  size_t max_rows;
+  char** files;
+  size_t num_files;
+  size_t max_files;
+};
+
+/** A unique address to resolve, and the result. */
+struct lookup {
+  uint32_t module;
+  /** Whether value is a file offset (from maps) rather than an address. */
+  bool by_offset;
+  uint64_t value;
+  // Filled in when resolved.
+  bool resolved;
+  uint64_t vaddr;
+  const char* symbol;
+  char* demangled;
+  uint64_t symbol_offset;
+  const char* file;
+  uint32_t line;
+};
+
+/** A frame of an input backtrace. */
+struct frame {
+  uint64_t pc;
+  uint32_t lookup;
+  /** 1 if the lookup is for pc - 1 (a return address), else 0. */
+  uint8_t adjust;
+};
+
+/** A backtrace from the input. */
+struct trace {
+  /** Input file it came from. */
+  const char* source;
+  /** Whether it is a crash record (rather than an address list). */
+  bool is_record;
+  /** Header of the crash record, if it is one. */
+  shbt_crash_record_header_t header;
+  /** Index of the first frame in frames. */
+  size_t first_frame;
+  size_t num_frames;
+};
+
+/** A module mapped at an address range, in a record or maps file. */
+struct mapping {
+  uint64_t start;
+  uint64_t end;
+  /** Load base (records) or file offset of start (maps). */
+  uint64_t base;
+  uint32_t module;
+};
+
+static struct module* modules = NULL;
+static size_t num_modules = 0, max_modules = 0;
+static uint32_t* module_index = NULL;  // Hash of path/build ID -> module + 1.
+static size_t module_index_slots = 0;
+
+static struct lookup* lookups = NULL;
+static size_t num_lookups = 0, max_lookups = 0;
+static uint32_t* lookup_index = NULL;  // Hash of key -> lookup + 1.
+static size_t lookup_index_slots = 0;
+
+static struct frame* frames = NULL;
+static size_t num_frames = 0, max_frames = 0;
+static struct trace* traces = NULL;
+static size_t num_traces = 0, max_traces = 0;
+
+static struct mapping* maps = NULL;  // From -m.
+static size_t num_maps = 0;
+
+static const char* debug_dirs[MAX_DEBUG_DIRS];
+static size_t num_debug_dirs = 0;
+
+static void* xrealloc(void* ptr, size_t size) {
+  ptr = realloc(ptr, size);
+  if (ptr == NULL) {
+    fprintf(stderr, "shbt_symbolize: out of memory\n");
+    exit(EXIT_FAILURE);
+  }
+  return ptr;
+}
+
+static char* xstrdup(const char* str) {
+  size_t len = strlen(str) + 1;
+  return memcpy(xrealloc(NULL, len), str, len);
+}
+
+// Grow an array to hold at least one more element.
+static void* grow(void* array, size_t* max, size_t num, size_t elem_size) {
+  if (num < *max) {
+    return array;
+  }
+  *max = *max ? 2 * *max : 64;
+  return xrealloc(array, *max * elem_size);
+}
+
+static uint64_t hash_bytes(const void* data, size_t len, uint64_t hash) {
+  const uint8_t* bytes = (const uint8_t*) data;
+  for (size_t i = 0; i < len; ++i) {
+    hash = (hash ^ bytes[i]) * 0x100000001b3ull;  // FNV-1a.
+  }
+  return hash;
+}
+
+static uint64_t hash_u64(uint64_t x) {
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdull;
+  x ^= x >> 33;
+  return x;
+}
+
+// Read a whole file (or standard input, if path is NULL).
+static uint8_t* read_file(const char* path, size_t* size) {
+  int fd = path != NULL ? open(path, O_RDONLY) : STDIN_FILENO;
+  if (fd < 0) {
+    return NULL;
+  }
+  size_t len = 0, max = 1 << 16;
+  uint8_t* buf = xrealloc(NULL, max);
+  for (;;) {
+    if (len == max) {
+      max *= 2;
+      buf = xrealloc(buf, max);
+    }
+    ssize_t n = read(fd, buf + len, max - len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      if (n < 0) {
+        free(buf);
+        buf = NULL;
+      }
+      break;
+    }
+    len += (size_t) n;
+  }
+  if (path != NULL) {
+    close(fd);
+  }
+  if (buf != NULL) {
+    // Null-terminate, so text can be parsed in place.
+    buf = xrealloc(buf, len + 1);
+    buf[len] = '\0';
+  }
+  *size = len;
+  return buf;
+}
+
+/*
+ * Modules.
+ */
+
+// Find or add a module by path and build ID.
+static uint32_t module_intern(const char* path, const uint8_t* build_id,
+                              size_t build_id_size) {
+  if (2 * (num_modules + 1) > module_index_slots) {
+    size_t slots = module_index_slots ? 2 * module_index_slots : 64;
+    free(module_index);
+    module_index = xrealloc(NULL, slots * sizeof(uint32_t));
+    memset(module_index, 0, slots * sizeof(uint32_t));
+    module_index_slots = slots;
+    for (size_t i = 0; i < num_modules; ++i) {
+      uint64_t hash = hash_bytes(modules[i].path, strlen(modules[i].path),
+                                 0xcbf29ce484222325ull);
+      hash = hash_bytes(modules[i].build_id, modules[i].build_id_size, hash);
+      size_t slot = hash & (slots - 1);
+      while (module_index[slot] != 0) {
+        slot = (slot + 1) & (slots - 1);
+      }
+      module_index[slot] = (uint32_t) i + 1;
+    }
+  }
+  uint64_t hash = hash_bytes(path, strlen(path), 0xcbf29ce484222325ull);
+  hash = hash_bytes(build_id, build_id_size, hash);
+  size_t slot = hash & (module_index_slots - 1);
+  while (module_index[slot] != 0) {
+    struct module* module = &modules[module_index[slot] - 1];
+    if (module->build_id_size == build_id_size &&
+        memcmp(module->build_id, build_id, build_id_size) == 0 &&
+        strcmp(module->path, path) == 0) {
+      return module_index[slot] - 1;
+    }
+    slot = (slot + 1) & (module_index_slots - 1);
+  }
+  modules = grow(modules, &max_modules, num_modules, sizeof(struct module));
+  struct module* module = &modules[num_modules];
+  memset(module, 0, sizeof(*module));
+  module->path = xstrdup(path);
+  memcpy(module->build_id, build_id, build_id_size);
+  module->build_id_size = build_id_size;
+  module_index[slot] = (uint32_t) num_modules + 1;
+  return (uint32_t) num_modules++;
+}
+
+/*
+ * Unique addresses.
+ */
+
+static uint64_t lookup_hash(uint32_t module, bool by_offset, uint64_t value) {
+  uint64_t key = (uint64_t) module << 1 | by_offset;
+  return hash_u64(value ^ key * 0x9e3779b97f4a7c15ull);
+}
+
+// Find or add the lookup for an address in a module.
+static uint32_t lookup_intern(uint32_t module, bool by_offset,
+                              uint64_t value) {
+  if (2 * (num_lookups + 1) > lookup_index_slots) {
+    size_t slots = lookup_index_slots ? 2 * lookup_index_slots : 1024;
+    free(lookup_index);
+    lookup_index = xrealloc(NULL, slots * sizeof(uint32_t));
+    memset(lookup_index, 0, slots * sizeof(uint32_t));
+    lookup_index_slots = slots;
+    for (size_t i = 0; i < num_lookups; ++i) {
+      size_t slot = lookup_hash(lookups[i].module, lookups[i].by_offset,
+                                lookups[i].value) & (slots - 1);
+      while (lookup_index[slot] != 0) {
+        slot = (slot + 1) & (slots - 1);
+      }
+      lookup_index[slot] = (uint32_t) i + 1;
+    }
+  }
+  size_t slot = lookup_hash(module, by_offset, value) &
+    (lookup_index_slots - 1);
+  while (lookup_index[slot] != 0) {
+    struct lookup* lookup = &lookups[lookup_index[slot] - 1];
+    if (lookup->module == module && lookup->by_offset == by_offset &&
+        lookup->value == value) {
+      return lookup_index[slot] - 1;
+    }
+    slot = (slot + 1) & (lookup_index_slots - 1);
+  }
+  lookups = grow(lookups, &max_lookups, num_lookups, sizeof(struct lookup));
+  struct lookup* lookup = &lookups[num_lookups];
+  memset(lookup, 0, sizeof(*lookup));
+  lookup->module = module;
+  lookup->by_offset = by_offset;
+  lookup->value = value;
+  lookup_index[slot] = (uint32_t) num_lookups + 1;
+  return (uint32_t) num_lookups++;
+}
+
+static int compare_mappings(const void* a, const void* b) {
+  const struct mapping* x = (const struct mapping*) a;
+  const struct mapping* y = (const struct mapping*) b;
+  return x->start < y->start ? -1 : x->start > y->start;
+}
+
+// Find the mapping containing addr in a sorted list.
+static const struct mapping* find_mapping(const struct mapping* list,
+                                          size_t num, uint64_t addr) {
+  size_t lo = 0, hi = num;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (list[mid].start <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || addr >= list[lo - 1].end) {
+    return NULL;
+  }
+  return &list[lo - 1];
+}
+
+// Add a frame, recording which module address it needs resolved.
+// The innermost frame of a crash record is the interrupted instruction;
+// every other address is a return address, so the call is at pc - 1.
+static void add_frame(uint64_t pc, bool is_return, const struct mapping* list,
+                      size_t num, bool by_offset) {
+  frames = grow(frames, &max_frames, num_frames, sizeof(struct frame));
+  struct frame* frame = &frames[num_frames++];
+  frame->pc = pc;
+  frame->adjust = is_return && pc > 0;
+  frame->lookup = NO_LOOKUP;
+  uint64_t addr = pc - frame->adjust;
+  const struct mapping* mapping = find_mapping(list, num, addr);
+  if (mapping != NULL) {
+    uint64_t value = by_offset ? addr - mapping->start + mapping->base :
+      addr - mapping->base;
+    frame->lookup = lookup_intern(mapping->module, by_offset, value);
+  }
+}
+
+/*
+ * Input.
+ */
+
+static uint16_t swap16(uint16_t x) {
+  return (uint16_t) (x >> 8 | x << 8);
+}
+
+static uint32_t swap32(uint32_t x) {
+  return (x >> 24) | ((x >> 8) & 0xff00) | ((x << 8) & 0xff0000) | (x << 24);
+}
+
+static uint64_t swap64(uint64_t x) {
+  return (uint64_t) swap32((uint32_t) x) << 32 | swap32((uint32_t) (x >> 32));
+}
+
+static void swap_header(shbt_crash_record_header_t* header) {
+  header->magic = swap32(header->magic);
+  header->version = swap16(header->version);
+  header->header_size = swap16(header->header_size);
+  header->record_size = swap32(header->record_size);
+  int32_t* fields[] = {&header->sig_num, &header->sig_code,
+                       &header->sig_errno, &header->pid, &header->tid,
+                       &header->sender_pid, &header->sender_uid,
+                       &header->mpi_rank};
+  for (size_t i = 0; i < sizeof(fields) / sizeof(fields[0]); ++i) {
+    *fields[i] = (int32_t) swap32((uint32_t) *fields[i]);
+  }
+  header->num_pcs = swap32(header->num_pcs);
+  header->num_modules = swap32(header->num_modules);
+  header->flags = swap32(header->flags);
+  header->fault_addr = swap64(header->fault_addr);
+  header->time_ns = (int64_t) swap64((uint64_t) header->time_ns);
+}
+
+static bool is_record(const uint8_t* data, size_t size) {
+  uint32_t magic;
+  if (size < sizeof(magic)) {
+    return false;
+  }
+  memcpy(&magic, data, sizeof(magic));
+  return magic == SHBT_CRASH_RECORD_MAGIC ||
+    magic == swap32(SHBT_CRASH_RECORD_MAGIC);
+}
+
+// Add the crash records in a file. Returns false if any are malformed.
+static bool read_records(const char* source, const uint8_t* data,
+                         size_t size) {
+  struct mapping* record_maps = NULL;
+  size_t max_record_maps = 0;
+  size_t pos = 0;
+  while (pos < size) {
+    shbt_crash_record_header_t header;
+    if (size - pos < sizeof(header)) {
+      break;
+    }
+    memcpy(&header, data + pos, sizeof(header));
+    bool swapped = header.magic != SHBT_CRASH_RECORD_MAGIC;
+    if (swapped) {
+      swap_header(&header);
+    }
+    if (header.magic != SHBT_CRASH_RECORD_MAGIC ||
+        header.header_size < sizeof(header) ||
+        header.record_size > size - pos ||
+        header.record_size < header.header_size ||
+        header.num_pcs > (header.record_size - header.header_size) / 8) {
+      break;
+    }
+    const uint8_t* record = data + pos;
+    size_t record_size = header.record_size;
+    // Modules first, so the addresses can be assigned to them.
+    size_t num_record_maps = 0;
+    size_t mod_pos = header.header_size + (size_t) header.num_pcs * 8;
+    bool ok = true;
+    for (uint32_t i = 0; i < header.num_modules; ++i) {
+      shbt_crash_record_module_t module;
+      if (record_size - mod_pos < sizeof(module)) {
+        ok = false;
+        break;
+      }
+      memcpy(&module, record + mod_pos, sizeof(module));
+      if (swapped) {
+        module.load_base = swap64(module.load_base);
+        module.start = swap64(module.start);
+        module.end = swap64(module.end);
+        module.entry_size = swap32(module.entry_size);
+        module.path_size = swap16(module.path_size);
+        module.build_id_size = swap16(module.build_id_size);
+      }
+      if (module.entry_size > record_size - mod_pos ||
+          module.path_size == 0 ||
+          module.entry_size < sizeof(module) + module.path_size ||
+          module.build_id_size > SHBT_CRASH_RECORD_MAX_BUILD_ID) {
+        ok = false;
+        break;
+      }
+      const char* path = (const char*) record + mod_pos + sizeof(module);
+      if (path[module.path_size - 1] == '\0' && path[0] != '\0') {
+        record_maps = grow(record_maps, &max_record_maps, num_record_maps,
+                           sizeof(struct mapping));
+        struct mapping* mapping = &record_maps[num_record_maps++];
+        mapping->start = module.start;
+        mapping->end = module.end;
+        mapping->base = module.load_base;
+        mapping->module = module_intern(path, module.build_id,
+                                        module.build_id_size);
+      }
+      mod_pos += module.entry_size;
+    }
+    if (!ok) {
+      break;
+    }
+    qsort(record_maps, num_record_maps, sizeof(struct mapping),
+          &compare_mappings);
+    traces = grow(traces, &max_traces, num_traces, sizeof(struct trace));
+    struct trace* trace = &traces[num_traces++];
+    trace->source = source;
+    trace->is_record = true;
+    trace->header = header;
+    trace->first_frame = num_frames;
+    trace->num_frames = header.num_pcs;
+    for (uint32_t i = 0; i < header.num_pcs; ++i) {
+      uint64_t pc;
+      memcpy(&pc, record + header.header_size + (size_t) i * 8, sizeof(pc));
+      add_frame(swapped ? swap64(pc) : pc, i > 0, record_maps,
+                num_record_maps, false);
+    }
+    pos += record_size;
+  }
+  free(record_maps);
+  return pos == size;
+}
+
+// Add the backtraces in an address list.
+static void read_addresses(const char* source, char* data, size_t size) {
+  struct trace* trace = NULL;
+  size_t line_num = 0;
+  char* end = data + size;
+  for (char* line = data; line < end;) {
+    char* next = memchr(line, '\n', (size_t) (end - line));
+    next = next != NULL ? next : end;
+    *next = '\0';
+    ++line_num;
+    char* p = line + strspn(line, " \t\r");
+    if (*p == '\0') {
+      trace = NULL;  // Blank line: start a new backtrace.
+    } else if (*p != '#') {
+      char* num_end;
+      errno = 0;
+      uint64_t pc = strtoull(p, &num_end, 16);
+      if (num_end == p || errno != 0) {
+        fprintf(stderr, "shbt_symbolize: %s:%zu: ignoring malformed line\n",
+                source, line_num);
+      } else {
+        if (trace == NULL) {
+          traces = grow(traces, &max_traces, num_traces,
+                        sizeof(struct trace));
+          trace = &traces[num_traces++];
+          memset(trace, 0, sizeof(*trace));
+          trace->source = source;
+          trace->first_frame = num_frames;
+        }
+        // As in a crash record, every address but the first is taken to
+        // be a return address.
+        add_frame(pc, trace->num_frames > 0, maps, num_maps, true);
+        ++trace->num_frames;
+      }
+    }
+    line = next + 1;
+  }
+}
+
+// Read a module map in /proc/<pid>/maps format.
+static bool read_maps(const char* path) {
+  size_t size;
+  char* data = (char*) read_file(path, &size);
+  if (data == NULL) {
+    return false;
+  }
+  size_t max_maps = 0;
+  for (char* line = strtok(data, "\n"); line != NULL;
+       line = strtok(NULL, "\n")) {
+    unsigned long long start, end, offset;
+    char perms[8];
+    int path_pos = 0;
+    if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perms,
+               &offset, &path_pos) < 4 || path_pos == 0 ||
+        strchr(perms, 'x') == NULL || line[path_pos] != '/') {
+      continue;
+    }
+    maps = grow(maps, &max_maps, num_maps, sizeof(struct mapping));
+    struct mapping* mapping = &maps[num_maps++];
+    mapping->start = start;
+    mapping->end = end;
+    mapping->base = offset;
+    mapping->module = module_intern(line + path_pos, NULL, 0);
+  }
+  free(data);
+  qsort(maps, num_maps, sizeof(struct mapping), &compare_mappings);
+  return true;
+}
+
+/*
+ * ELF files.
+ */
+
+static bool elf_open(const char* path, struct elf_image* image) {
+  memset(image, 0, sizeof(*image));
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(Elf32_Ehdr)) {
+    close(fd);
+    return false;
+  }
+  void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return false;
+  }
+  image->data = (const uint8_t*) data;
+  image->size = (size_t) st.st_size;
+  const unsigned char* ident = image->data;
+  uint16_t one = 1;
+  int host_data = *(const uint8_t*) &one ? ELFDATA2LSB : ELFDATA2MSB;
+  if (memcmp(ident, ELFMAG, SELFMAG) != 0 || ident[EI_DATA] != host_data ||
+      (ident[EI_CLASS] != ELFCLASS32 && ident[EI_CLASS] != ELFCLASS64) ||
+      (ident[EI_CLASS] == ELFCLASS64 && image->size < sizeof(Elf64_Ehdr))) {
+    munmap(data, image->size);
+    image->data = NULL;
+    return false;
+  }
+  image->is64 = ident[EI_CLASS] == ELFCLASS64;
+  return true;
+}
+
+static size_t elf_num_sections(const struct elf_image* image) {
+  const Elf64_Ehdr* e64 = (const Elf64_Ehdr*) image->data;
+  const Elf32_Ehdr* e32 = (const Elf32_Ehdr*) image->data;
+  uint64_t offset = image->is64 ? e64->e_shoff : e32->e_shoff;
+  size_t num = image->is64 ? e64->e_shnum : e32->e_shnum;
+  size_t entsize = image->is64 ? sizeof(Elf64_Shdr) : sizeof(Elf32_Shdr);
+  if (offset == 0 || offset > image->size ||
+      num > (image->size - offset) / entsize) {
+    return 0;
+  }
+  return num;
+}
+
+static void elf_section(const struct elf_image* image, size_t i,
+                        struct elf_section* section) {
+  if (image->is64) {
+    const Elf64_Ehdr* ehdr = (const Elf64_Ehdr*) image->data;
+    const Elf64_Shdr* shdr =
+      (const Elf64_Shdr*) (image->data + ehdr->e_shoff) + i;
+    section->name = shdr->sh_name;
+    section->type = shdr->sh_type;
+    section->flags = shdr->sh_flags;
+    section->offset = shdr->sh_offset;
+    section->size = shdr->sh_size;
+    section->link = shdr->sh_link;
+  } else {
+    const Elf32_Ehdr* ehdr = (const Elf32_Ehdr*) image->data;
+    const Elf32_Shdr* shdr =
+      (const Elf32_Shdr*) (image->data + ehdr->e_shoff) + i;
+    section->name = shdr->sh_name;
+    section->type = shdr->sh_type;
+    section->flags = shdr->sh_flags;
+    section->offset = shdr->sh_offset;
+    section->size = shdr->sh_size;
+    section->link = shdr->sh_link;
+  }
+  // Sections without data in the file (or with bogus offsets) are empty.
+  if (section->type == SHT_NOBITS || section->offset > image->size ||
+      section->size > image->size - section->offset) {
+    section->size = 0;
+  }
+}
+
+static void elf_init_shstrtab(struct elf_image* image) {
+  size_t num = elf_num_sections(image);
+  size_t index = image->is64 ?
+    ((const Elf64_Ehdr*) image->data)->e_shstrndx :
+    ((const Elf32_Ehdr*) image->data)->e_shstrndx;
+  if (index < num) {
+    struct elf_section section;
+    elf_section(image, index, &section);
+    image->shstrtab = (const char*) image->data + section.offset;
+    image->shstrtab_size = section.size;
+  }
+}
+
+// Find a section by name. Compressed sections are treated as missing.
+static bool elf_find_section(const struct elf_image* image, const char* name,
+                             struct elf_section* section) {
+  if (image->data == NULL) {
+    return false;
+  }
+  size_t num = elf_num_sections(image);
+  size_t name_len = strlen(name);
+  for (size_t i = 0; i < num; ++i) {
+    elf_section(image, i, section);
+    if (section->name + name_len < image->shstrtab_size &&
+        memcmp(image->shstrtab + section->name, name, name_len + 1) == 0) {
+      return section->size > 0 && !(section->flags & SHF_COMPRESSED);
+    }
+  }
+  return false;
+}
+
+// Read the GNU build ID note, returning its size (or 0).
+static size_t elf_build_id(const struct elf_image* image, uint8_t* out) {
+  size_t num = elf_num_sections(image);
+  for (size_t i = 0; i < num; ++i) {
+    struct elf_section section;
+    elf_section(image, i, &section);
+    if (section.type != SHT_NOTE) {
+      continue;
+    }
+    const uint8_t* note = image->data + section.offset;
+    const uint8_t* end = note + section.size;
+    while (note + sizeof(Elf64_Nhdr) <= end) {
+      // Note headers are the same in both ELF classes.
+      const Elf64_Nhdr* nhdr = (const Elf64_Nhdr*) note;
+      const uint8_t* name = note + sizeof(Elf64_Nhdr);
+      const uint8_t* desc = name + ((nhdr->n_namesz + 3) & ~3u);
+      if (desc > end || (size_t) (end - desc) < nhdr->n_descsz) {
+        break;
+      }
+      note = desc + ((nhdr->n_descsz + 3) & ~3u);
+      if (nhdr->n_type == NT_GNU_BUILD_ID && nhdr->n_namesz == 4 &&
+          memcmp(name, "GNU", 4) == 0 &&
+          nhdr->n_descsz <= SHBT_CRASH_RECORD_MAX_BUILD_ID) {
+        memcpy(out, desc, nhdr->n_descsz);
+        return nhdr->n_descsz;
+      }
+    }
+  }
+  return 0;
+}
+
+static void elf_load_segments(struct module* module) {
+  const struct elf_image* image = &module->image;
+  uint64_t offset = image->is64 ?
+    ((const Elf64_Ehdr*) image->data)->e_phoff :
+    ((const Elf32_Ehdr*) image->data)->e_phoff;
+  size_t num = image->is64 ? ((const Elf64_Ehdr*) image->data)->e_phnum :
+    ((const Elf32_Ehdr*) image->data)->e_phnum;
+  size_t entsize = image->is64 ? sizeof(Elf64_Phdr) : sizeof(Elf32_Phdr);
+  if (offset == 0 || offset > image->size ||
+      num > (image->size - offset) / entsize) {
+    return;
+  }
+  module->segments = xrealloc(NULL, (num + 1) * sizeof(struct segment));
+  for (size_t i = 0; i < num; ++i) {
+    struct segment* segment = &module->segments[module->num_segments];
+    if (image->is64) {
+      const Elf64_Phdr* phdr = (const Elf64_Phdr*) (image->data + offset) + i;
+      if (phdr->p_type != PT_LOAD) {
+        continue;
+      }
+      segment->offset = phdr->p_offset;
+      segment->vaddr = phdr->p_vaddr;
+      segment->filesz = phdr->p_filesz;
+    } else {
+      const Elf32_Phdr* phdr = (const Elf32_Phdr*) (image->data + offset) + i;
+      if (phdr->p_type != PT_LOAD) {
+        continue;
+      }
+      segment->offset = phdr->p_offset;
+      segment->vaddr = phdr->p_vaddr;
+      segment->filesz = phdr->p_filesz;
+    }
+    ++module->num_segments;
+  }
+}
+
+static int compare_symbols(const void* a, const void* b) {
+  const struct symbol* x = (const struct symbol*) a;
+  const struct symbol* y = (const struct symbol*) b;
+  if (x->addr != y->addr) {
+    return x->addr < y->addr ? -1 : 1;
+  }
+  return x->rank - y->rank;
+}
+
+// Add the function symbols from a symbol table section.
+static void elf_load_symbols(struct module* module,
+                             const struct elf_image* image,
+                             const char* table_name) {
+  struct elf_section table, strtab;
+  if (!elf_find_section(image, table_name, &table) ||
+      table.link >= elf_num_sections(image)) {
+    return;
+  }
+  elf_section(image, table.link, &strtab);
+  const char* strings = (const char*) image->data + strtab.offset;
+  size_t entsize = image->is64 ? sizeof(Elf64_Sym) : sizeof(Elf32_Sym);
+  size_t num = table.size / entsize;
+  module->symbols = xrealloc(module->symbols,
+                             (module->num_symbols + num) *
+                             sizeof(struct symbol));
+  for (size_t i = 0; i < num; ++i) {
+    uint64_t addr, size;
+    uint32_t name;
+    unsigned type, bind, shndx;
+    if (image->is64) {
+      const Elf64_Sym* sym = (const Elf64_Sym*) (image->data + table.offset) + i;
+      addr = sym->st_value;
+      size = sym->st_size;
+      name = sym->st_name;
+      type = ELF64_ST_TYPE(sym->st_info);
+      bind = ELF64_ST_BIND(sym->st_info);
+      shndx = sym->st_shndx;
+    } else {
+      const Elf32_Sym* sym = (const Elf32_Sym*) (image->data + table.offset) + i;
+      addr = sym->st_value;
+      size = sym->st_size;
+      name = sym->st_name;
+      type = ELF32_ST_TYPE(sym->st_info);
+      bind = ELF32_ST_BIND(sym->st_info);
+      shndx = sym->st_shndx;
+    }
+    if ((type != STT_FUNC && type != STT_GNU_IFUNC) || shndx == SHN_UNDEF ||
+        addr == 0 || name >= strtab.size) {
+      continue;
+    }
+    struct symbol* symbol = &module->symbols[module->num_symbols++];
+    symbol->addr = addr;
+    symbol->size = size;
+    symbol->name = strings + name;
+    // Prefer sized, then global, symbols when several share an address.
+    symbol->rank = (size > 0) * 2 + (bind == STB_GLOBAL);
+  }
+}
+
+/*
+ * DWARF line tables.
+ */
+
+/** A position in DWARF data. */
+struct cursor {
+  const uint8_t* p;
+  const uint8_t* end;
+  bool error;
+};
+
+static bool cursor_check(struct cursor* c, size_t n) {
+  if (c->error || (size_t) (c->end - c->p) < n) {
+    c->error = true;
+    c->p = c->end;
+    return false;
+  }
+  return true;
+}
+
+static uint64_t read_fixed(struct cursor* c, size_t n) {
+  if (!cursor_check(c, n)) {
+    return 0;
+  }
+  uint64_t value = 0;
+  // Little-endian targets only; elf_open rejects other byte orders.
+  for (size_t i = 0; i < n; ++i) {
+    value |= (uint64_t) c->p[i] << (8 * i);
+  }
+  c->p += n;
+  return value;
+}
+
+static uint64_t read_uleb(struct cursor* c) {
+  uint64_t value = 0;
+  unsigned shift = 0;
+  while (cursor_check(c, 1)) {
+    uint8_t byte = *c->p++;
+    if (shift < 64) {
+      value |= (uint64_t) (byte & 0x7f) << shift;
+    }
+    shift += 7;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  return value;
+}
+
+static int64_t read_sleb(struct cursor* c) {
+  int64_t value = 0;
+  unsigned shift = 0;
+  uint8_t byte = 0;
+  while (cursor_check(c, 1)) {
+    byte = *c->p++;
+    if (shift < 64) {
+      value |= (int64_t) ((uint64_t) (byte & 0x7f) << shift);
+    }
+    shift += 7;
+    if (!(byte & 0x80)) {
+      break;
+    }
+  }
+  if (shift < 64 && (byte & 0x40)) {
+    value |= -((int64_t) 1 << shift);
+  }
+  return value;
+}
+
+static const char* read_cstr(struct cursor* c) {
+  const uint8_t* nul = c->error ? NULL :
+    memchr(c->p, '\0', (size_t) (c->end - c->p));
+  if (nul == NULL) {
+    c->error = true;
+    c->p = c->end;
+    return "";
+  }
+  const char* str = (const char*) c->p;
+  c->p = nul + 1;
+  return str;
+}
+
+/** String sections referenced by DWARF 5 line table headers. */
+struct dwarf_strings {
+  struct cursor str;
+  struct cursor line_str;
+};
+
+static const char* string_at(const struct cursor* section, uint64_t offset) {
+  if (offset >= (uint64_t) (section->end - section->p)) {
+    return "";
+  }
+  const char* str = (const char*) section->p + offset;
+  if (memchr(str, '\0', (size_t) (section->end - section->p) - offset) ==
+      NULL) {
+    return "";
+  }
+  return str;
+}
+
+// Read an attribute of a DWARF 5 directory or file entry. Returns the
+// string value, or NULL if the form is not a string (setting *value).
+static const char* read_form(struct cursor* c, uint64_t form, bool is64,
+                             const struct dwarf_strings* strings,
+                             uint64_t* value) {
+  *value = 0;
+  switch (form) {
+  case 0x08:  // DW_FORM_string
+    return read_cstr(c);
+  case 0x0e:  // DW_FORM_strp
+    return string_at(&strings->str, read_fixed(c, is64 ? 8 : 4));
+  case 0x1f:  // DW_FORM_line_strp
+    return string_at(&strings->line_str, read_fixed(c, is64 ? 8 : 4));
+  case 0x0b:  // DW_FORM_data1
+    *value = read_fixed(c, 1);
+    return NULL;
+  case 0x05:  // DW_FORM_data2
+    *value = read_fixed(c, 2);
+    return NULL;
+  case 0x06:  // DW_FORM_data4
+    *value = read_fixed(c, 4);
+    return NULL;
+  case 0x07:  // DW_FORM_data8
+    *value = read_fixed(c, 8);
+    return NULL;
+  case 0x1e:  // DW_FORM_data16
+    cursor_check(c, 16);
+    c->p += c->error ? 0 : 16;
+    return NULL;
+  case 0x0f:  // DW_FORM_udata
+    *value = read_uleb(c);
+    return NULL;
+  case 0x09: {  // DW_FORM_block
+    uint64_t len = read_uleb(c);
+    if (cursor_check(c, len)) {
+      c->p += len;
+    }
+    return NULL;
+  }
+  default:
+    c->error = true;
+    return NULL;
+  }
+}
+
+// Add a file name to a module, joined with its directory.
+static uint32_t add_file(struct module* module, const char* dir,
+                         const char* name) {
+  module->files = grow(module->files, &module->max_files, module->num_files,
+                       sizeof(char*));
+  char* path;
+  if (name[0] == '/' || dir == NULL || dir[0] == '\0') {
+    path = xstrdup(name);
+  } else {
+    size_t dir_len = strlen(dir), name_len = strlen(name);
+    path = xrealloc(NULL, dir_len + name_len + 2);
+    memcpy(path, dir, dir_len);
+    path[dir_len] = '/';
+    memcpy(path + dir_len + 1, name, name_len + 1);
+  }
+  module->files[module->num_files] = path;
+  return (uint32_t) module->num_files++;
+}
+
+// Read a DWARF 5 directory or file name table into names (and, for files,
+// dir_indices).
+static size_t read_entry_table(struct cursor* c, bool is64,
+                               const struct dwarf_strings* strings,
+                               const char*** names, uint64_t** dir_indices) {
+  uint8_t num_formats = (uint8_t) read_fixed(c, 1);
+  uint64_t formats[2 * 16];
+  if (num_formats > 16) {
+    c->error = true;
+    return 0;
+  }
+  for (size_t i = 0; i < num_formats; ++i) {
+    formats[2 * i] = read_uleb(c);
+    formats[2 * i + 1] = read_uleb(c);
+  }
+  uint64_t count = read_uleb(c);
+  if (c->error || count > (uint64_t) (c->end - c->p)) {
+    c->error = true;
+    return 0;
+  }
+  *names = xrealloc(NULL, (count + 1) * sizeof(char*));
+  if (dir_indices != NULL) {
+    *dir_indices = xrealloc(NULL, (count + 1) * sizeof(uint64_t));
+  }
+  for (uint64_t i = 0; i < count && !c->error; ++i) {
+    (*names)[i] = "";
+    if (dir_indices != NULL) {
+      (*dir_indices)[i] = 0;
+    }
+    for (size_t j = 0; j < num_formats; ++j) {
+      uint64_t value;
+      const char* str = read_form(c, formats[2 * j + 1], is64, strings,
+                                  &value);
+      if (formats[2 * j] == 1 && str != NULL) {  // DW_LNCT_path
+        (*names)[i] = str;
+      } else if (formats[2 * j] == 2 && dir_indices != NULL) {
+        (*dir_indices)[i] = value;  // DW_LNCT_directory_index
+      }
+    }
+  }
+  return (size_t) count;
+}
+
+static void add_row(struct module* module, uint64_t addr, uint32_t file,
+                    uint32_t line, bool end) {
+  module->rows = grow(module->rows, &module->max_rows, module->num_rows,
+                      sizeof(struct line_row));
+  struct line_row* row = &module->rows[module->num_rows++];
+  row->addr = addr;
+  row->file = file;
+  row->line = line;
+  row->end = end;
+}
+
+// Run the line number program of one unit, adding its rows to module.
+static void read_line_unit(struct module* module, struct cursor* c,
+                           const struct dwarf_strings* strings) {
+  uint64_t unit_length = read_fixed(c, 4);
+  bool is64 = unit_length == 0xffffffff;
+  if (is64) {
+    unit_length = read_fixed(c, 8);
+  }
+  if (!cursor_check(c, unit_length)) {
+    return;
+  }
+  struct cursor unit = {c->p, c->p + unit_length, false};
+  c->p += unit_length;
+  uint16_t version = (uint16_t) read_fixed(&unit, 2);
+  if (version < 2 || version > 5) {
+    return;
+  }
+  size_t addr_size = 8;
+  if (version >= 5) {
+    addr_size = read_fixed(&unit, 1);
+    read_fixed(&unit, 1);  // Segment selector size.
+  }
+  uint64_t header_length = read_fixed(&unit, is64 ? 8 : 4);
+  if (!cursor_check(&unit, header_length)) {
+    return;
+  }
+  const uint8_t* program = unit.p + header_length;
+  uint8_t min_inst_length = (uint8_t) read_fixed(&unit, 1);
+  if (version >= 4) {
+    read_fixed(&unit, 1);  // Maximum operations per instruction.
+  }
+  read_fixed(&unit, 1);  // Default is_stmt.
+  int8_t line_base = (int8_t) read_fixed(&unit, 1);
+  uint8_t line_range = (uint8_t) read_fixed(&unit, 1);
+  uint8_t opcode_base = (uint8_t) read_fixed(&unit, 1);
+  uint8_t opcode_lengths[256];
+  for (size_t i = 1; i < opcode_base; ++i) {
+    opcode_lengths[i] = (uint8_t) read_fixed(&unit, 1);
+  }
+  if (unit.error || line_range == 0) {
+    return;
+  }
+
+  // Map the unit's file numbers to module files.
+  uint32_t* files = NULL;
+  size_t num_files = 0;
+  if (version >= 5) {
+    const char** dirs = NULL;
+    const char** names = NULL;
+    uint64_t* dir_indices = NULL;
+    size_t num_dirs = read_entry_table(&unit, is64, strings, &dirs, NULL);
+    if (!unit.error) {
+      num_files = read_entry_table(&unit, is64, strings, &names,
+                                   &dir_indices);
+    }
+    if (!unit.error) {
+      files = xrealloc(NULL, (num_files + 1) * sizeof(uint32_t));
+      for (size_t i = 0; i < num_files; ++i) {
+        files[i] = add_file(module, dir_indices[i] < num_dirs ?
+                            dirs[dir_indices[i]] : NULL, names[i]);
+      }
+    }
+    free(dirs);
+    free(names);
+    free(dir_indices);
+  } else {
+    // File numbers start at 1, and directory 0 is the compilation
+    // directory, which is not in the line table.
+    const char* dirs[256];
+    size_t num_dirs = 1;
+    dirs[0] = NULL;
+    for (;;) {
+      const char* dir = read_cstr(&unit);
+      if (dir[0] == '\0' || unit.error) {
+        break;
+      }
+      if (num_dirs < 256) {
+        dirs[num_dirs++] = dir;
+      }
+    }
+    size_t max_files = 0;
+    files = grow(files, &max_files, num_files, sizeof(uint32_t));
+    files[num_files++] = NO_FILE;
+    for (;;) {
+      const char* name = read_cstr(&unit);
+      if (name[0] == '\0' || unit.error) {
+        break;
+      }
+      uint64_t dir = read_uleb(&unit);
+      read_uleb(&unit);  // Modification time.
+      read_uleb(&unit);  // Length.
+      files = grow(files, &max_files, num_files, sizeof(uint32_t));
+      files[num_files++] = add_file(module, dir < num_dirs ? dirs[dir] : NULL,
+                                    name);
+    }
+  }
+  if (unit.error || files == NULL) {
+    free(files);
+    return;
+  }
+
+  // Run the program.
+  unit.p = program;
+  uint64_t addr = 0;
+  uint64_t file = 1;
+  int64_t line = 1;
+  // Sequences starting at address 0 belong to functions the linker
+  // discarded, and would shadow whatever really is at low addresses.
+  bool skip_sequence = false;
+  size_t sequence_start = module->num_rows;
+  while (unit.p < unit.end && !unit.error) {
+    uint8_t opcode = (uint8_t) read_fixed(&unit, 1);
+    bool emit = false;
+    if (opcode >= opcode_base) {
+      uint8_t adjusted = opcode - opcode_base;
+      addr += (uint64_t) (adjusted / line_range) * min_inst_length;
+      line += line_base + adjusted % line_range;
+      emit = true;
+    } else if (opcode == 0) {  // Extended opcode.
+      uint64_t len = read_uleb(&unit);
+      if (len == 0 || !cursor_check(&unit, len)) {
+        break;
+      }
+      const uint8_t* next = unit.p + len;
+      uint8_t sub_opcode = (uint8_t) read_fixed(&unit, 1);
+      if (sub_opcode == 1) {  // DW_LNE_end_sequence
+        if (skip_sequence) {
+          module->num_rows = sequence_start;
+        } else {
+          add_row(module, addr, NO_FILE, 0, true);
+        }
+        sequence_start = module->num_rows;
+        addr = 0;
+        file = 1;
+        line = 1;
+        skip_sequence = false;
+      } else if (sub_opcode == 2) {  // DW_LNE_set_address
+        addr = read_fixed(&unit, len - 1 <= 8 ? len - 1 : addr_size);
+        if (module->num_rows == sequence_start && addr == 0) {
+          skip_sequence = true;
+        }
+      }
+      unit.p = next;
+    } else if (opcode == 1) {  // DW_LNS_copy
+      emit = true;
+    } else if (opcode == 2) {  // DW_LNS_advance_pc
+      addr += read_uleb(&unit) * min_inst_length;
+    } else if (opcode == 3) {  // DW_LNS_advance_line
+      line += read_sleb(&unit);
+    } else if (opcode == 4) {  // DW_LNS_set_file
+      file = read_uleb(&unit);
+    } else if (opcode == 8) {  // DW_LNS_const_add_pc
+      addr += (uint64_t) ((255 - opcode_base) / line_range) * min_inst_length;
+    } else if (opcode == 9) {  // DW_LNS_fixed_advance_pc
+      addr += read_fixed(&unit, 2);
+    } else {
+      // Other standard opcodes only change registers that are not needed.
+      for (size_t i = 0; i < opcode_lengths[opcode]; ++i) {
+        read_uleb(&unit);
+      }
+    }
+    if (emit && !skip_sequence) {
+      add_row(module, addr, file < num_files ? files[file] : NO_FILE,
+              line > 0 && line <= UINT32_MAX ? (uint32_t) line : 0, false);
+    }
+  }
+  // Drop an unterminated sequence.
+  module->num_rows = sequence_start;
+  free(files);
+}
+
+static int compare_rows(const void* a, const void* b) {
+  const struct line_row* x = (const struct line_row*) a;
+  const struct line_row* y = (const struct line_row*) b;
+  if (x->addr != y->addr) {
+    return x->addr < y->addr ? -1 : 1;
+  }
+  // A sequence ending where another starts must not hide it.
+  return (int) y->end - (int) x->end;
+}
+
+static void load_line_table(struct module* module,
+                            const struct elf_image* image) {
+  struct elf_section line, str, line_str;
+  if (!elf_find_section(image, ".debug_line", &line)) {
+    return;
+  }
+  struct dwarf_strings strings;
+  memset(&strings, 0, sizeof(strings));
+  if (elf_find_section(image, ".debug_str", &str)) {
+    strings.str.p = image->data + str.offset;
+    strings.str.end = strings.str.p + str.size;
+  }
+  if (elf_find_section(image, ".debug_line_str", &line_str)) {
+    strings.line_str.p = image->data + line_str.offset;
+    strings.line_str.end = strings.line_str.p + line_str.size;
+  }
+  struct cursor c = {image->data + line.offset,
+                     image->data + line.offset + line.size, false};
+  while (c.p < c.end && !c.error) {
+    read_line_unit(module, &c, &strings);
+  }
+  // Rows within a sequence are already in order, so this is stable enough.
+  qsort(module->rows, module->num_rows, sizeof(struct line_row),
+        &compare_rows);
+}
+
+/*
+ * Resolution.
+ */
+
+// Find a separate debug file for a module by its build ID.
+static bool open_debug_file(const uint8_t* build_id, size_t build_id_size,
+                            struct elf_image* image) {
+  if (build_id_size < 2) {
+    return false;
+  }
+  char hex[2 * SHBT_CRASH_RECORD_MAX_BUILD_ID + 1];
+  for (size_t i = 0; i < build_id_size; ++i) {
+    snprintf(hex + 2 * i, 3, "%02x", build_id[i]);
+  }
+  for (size_t i = 0; i <= num_debug_dirs; ++i) {
+    const char* dir = i < num_debug_dirs ? debug_dirs[i] : "/usr/lib/debug";
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/.build-id/%.2s/%s.debug", dir, hex,
+             hex + 2);
+    if (elf_open(path, image)) {
+      elf_init_shstrtab(image);
+      return true;
+    }
+  }
+  return false;
+}
+
+static void load_module(struct module* module) {
+  if (module->path[0] != '/') {
+    return;  // Not from a file, e.g. the vDSO.
+  }
+  if (!elf_open(module->path, &module->image)) {
+    fprintf(stderr, "shbt_symbolize: cannot load %s\n", module->path);
+    return;
+  }
+  elf_init_shstrtab(&module->image);
+  uint8_t build_id[SHBT_CRASH_RECORD_MAX_BUILD_ID];
+  size_t build_id_size = elf_build_id(&module->image, build_id);
+  if (module->build_id_size > 0 &&
+      (build_id_size != module->build_id_size ||
+       memcmp(build_id, module->build_id, build_id_size) != 0)) {
+    fprintf(stderr, "shbt_symbolize: warning: %s does not match the build "
+            "ID recorded for it, results may be wrong\n", module->path);
+  }
+  elf_load_segments(module);
+  // Prefer the build ID the module had when it crashed, to find debug info
+  // for the right build.
+  const uint8_t* debug_id = module->build_id_size > 0 ? module->build_id :
+    build_id;
+  size_t debug_id_size = module->build_id_size > 0 ? module->build_id_size :
+    build_id_size;
+  struct elf_section section;
+  if (!elf_find_section(&module->image, ".debug_line", &section) ||
+      !elf_find_section(&module->image, ".symtab", &section)) {
+    open_debug_file(debug_id, debug_id_size, &module->debug_image);
+  }
+  elf_load_symbols(module, &module->debug_image, ".symtab");
+  if (module->num_symbols == 0) {
+    elf_load_symbols(module, &module->image, ".symtab");
+  }
+  if (module->num_symbols == 0) {
+    elf_load_symbols(module, &module->image, ".dynsym");
+  }
+  qsort(module->symbols, module->num_symbols, sizeof(struct symbol),
+        &compare_symbols);
+  load_line_table(module, &module->debug_image);
+  if (module->num_rows == 0) {
+    load_line_table(module, &module->image);
+  }
+  module->loaded = true;
+}
+
+static const struct symbol* find_symbol(const struct module* module,
+                                        uint64_t addr) {
+  size_t lo = 0, hi = module->num_symbols;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (module->symbols[mid].addr <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0) {
+    return NULL;
+  }
+  const struct symbol* symbol = &module->symbols[lo - 1];
+  if (symbol->size > 0 && addr >= symbol->addr + symbol->size) {
+    return NULL;
+  }
+  return symbol;
+}
+
+static const struct line_row* find_row(const struct module* module,
+                                       uint64_t addr) {
+  size_t lo = 0, hi = module->num_rows;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (module->rows[mid].addr <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  if (lo == 0 || module->rows[lo - 1].end) {
+    return NULL;
+  }
+  return &module->rows[lo - 1];
+}
+
+static void resolve(struct lookup* lookup) {
+  const struct module* module = &modules[lookup->module];
+  if (!module->loaded) {
+    return;
+  }
+  if (lookup->by_offset) {
+    // Turn the file offset into an address.
+    bool found = false;
+    for (size_t i = 0; i < module->num_segments; ++i) {
+      const struct segment* segment = &module->segments[i];
+      if (lookup->value >= segment->offset &&
+          lookup->value < segment->offset + segment->filesz) {
+        lookup->vaddr = lookup->value - segment->offset + segment->vaddr;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      return;
+    }
+  } else {
+    lookup->vaddr = lookup->value;
+  }
+  lookup->resolved = true;
+  const struct symbol* symbol = find_symbol(module, lookup->vaddr);
+  if (symbol != NULL) {
+    lookup->symbol = symbol->name;
+    lookup->symbol_offset = lookup->vaddr - symbol->addr;
+    if (strncmp(symbol->name, "_Z", 2) == 0) {
+      lookup->demangled = symbolize_demangle(symbol->name);
+    }
+  }
+  const struct line_row* row = find_row(module, lookup->vaddr);
+  if (row != NULL && row->file != NO_FILE) {
+    lookup->file = module->files[row->file];
+    lookup->line = row->line;
+  }
+}
+
+/** Work shared by a group of threads. */
+struct work {
+  atomic_size_t next;
+  size_t count;
+  size_t batch;
+  void (*fn)(size_t);
+};
+
+static void* work_main(void* arg) {
+  struct work* work = (struct work*) arg;
+  for (;;) {
+    size_t start = atomic_fetch_add(&work->next, work->batch);
+    if (start >= work->count) {
+      break;
+    }
+    size_t end = start + work->batch < work->count ? start + work->batch :
+      work->count;
+    for (size_t i = start; i < end; ++i) {
+      work->fn(i);
+    }
+  }
+  return NULL;
+}
+
+// Call fn for 0 through count - 1, across up to num_threads threads.
+static void run_parallel(size_t count, size_t batch, void (*fn)(size_t),
+                         int num_threads) {
+  struct work work;
+  atomic_init(&work.next, 0);
+  work.count = count;
+  work.batch = batch;
+  work.fn = fn;
+  pthread_t threads[256];
+  int num_started = 0;
+  for (int i = 1; i < num_threads && i < 256; ++i) {
+    if (pthread_create(&threads[num_started], NULL, &work_main, &work) != 0) {
+      break;
+    }
+    ++num_started;
+  }
+  work_main(&work);
+  for (int i = 0; i < num_started; ++i) {
+    pthread_join(threads[i], NULL);
+  }
+}
+
+static void load_module_at(size_t i) {
+  load_module(&modules[i]);
+}
+
+static void resolve_at(size_t i) {
+  resolve(&lookups[i]);
+}
+
+/*
+ * Output.
+ */
+
+static void print_frame(size_t index, const struct frame* frame) {
+  printf("  #%-3zu 0x%016llx", index, (unsigned long long) frame->pc);
+  if (frame->lookup == NO_LOOKUP) {
+    printf(" (no module)\n");
+    return;
+  }
+  const struct lookup* lookup = &lookups[frame->lookup];
+  const char* symbol = lookup->demangled != NULL ? lookup->demangled :
+    lookup->symbol;
+  if (symbol != NULL) {
+    printf(" in %s+0x%llx", symbol,
+           (unsigned long long) (lookup->symbol_offset + frame->adjust));
+  } else {
+    printf(" in ??");
+  }
+  if (lookup->file != NULL) {
+    printf(" at %s:%u", lookup->file, lookup->line);
+  }
+  if (lookup->resolved) {
+    printf(" (%s+0x%llx)\n", modules[lookup->module].path,
+           (unsigned long long) (lookup->vaddr + frame->adjust));
+  } else {
+    printf(" (%s)\n", modules[lookup->module].path);
+  }
+}
+
+static void print_trace(const struct trace* trace, size_t index) {
+  if (trace->is_record) {
+    const shbt_crash_record_header_t* header = &trace->header;
+    printf("Crash in process %d thread %d", header->pid, header->tid);
+    if (header->mpi_rank >= 0) {
+      printf(" on rank %d", header->mpi_rank);
+    }
+    if (header->time_ns > 0) {
+      time_t secs = (time_t) (header->time_ns / 1000000000);
+      struct tm tm;
+      char when[64];
+      if (gmtime_r(&secs, &tm) != NULL &&
+          strftime(when, sizeof(when), "%Y-%m-%dT%H:%M:%S", &tm) > 0) {
+        printf(" at %s.%06dZ", when,
+               (int) (header->time_ns % 1000000000 / 1000));
+      }
+    }
+    printf(" (%s)\n", trace->source);
+    printf("Signal %d (%s), code %d", header->sig_num,
+           strsignal(header->sig_num), header->sig_code);
+    if (header->sender_pid != 0) {
+      printf(", sent by process %d", header->sender_pid);
+    }
+    if (header->fault_addr != 0) {
+      printf(", address 0x%llx", (unsigned long long) header->fault_addr);
+    }
+    if (header->flags & SHBT_CRASH_RECORD_TRUNCATED) {
+      printf(" (some modules missing)");
+    }
+    printf("\n");
+  } else {
+    printf("Backtrace %zu (%s)\n", index, trace->source);
+  }
+  for (size_t i = 0; i < trace->num_frames; ++i) {
+    print_frame(i, &frames[trace->first_frame + i]);
+  }
+  printf("\n");
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: shbt_symbolize [-j threads] [-m maps] "
+          "[-d debug_dir] [file...]\n");
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char** argv) {
+  long num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  int num_threads = num_cpus > 0 ? (int) num_cpus : 1;
+  int opt;
+  while ((opt = getopt(argc, argv, "j:m:d:")) != -1) {
+    if (opt == 'j') {
+      num_threads = atoi(optarg);
+      if (num_threads < 1) {
+        usage();
+      }
+    } else if (opt == 'm') {
+      if (!read_maps(optarg)) {
+        fprintf(stderr, "shbt_symbolize: cannot read %s: %s\n", optarg,
+                strerror(errno));
+        return EXIT_FAILURE;
+      }
+    } else if (opt == 'd') {
+      if (num_debug_dirs == MAX_DEBUG_DIRS) {
+        usage();
+      }
+      debug_dirs[num_debug_dirs++] = optarg;
+    } else {
+      usage();
+    }
+  }
+
+  // Read all inputs first, so every unique address is known before any
+  // are resolved.
+  int status = EXIT_SUCCESS;
+  for (int i = optind; i < argc || i == optind; ++i) {
+    const char* path = i < argc ? argv[i] : NULL;
+    const char* source = path != NULL ? path : "<stdin>";
+    size_t size;
+    uint8_t* data = read_file(path, &size);
+    if (data == NULL) {
+      fprintf(stderr, "shbt_symbolize: cannot read %s: %s\n", source,
+              strerror(errno));
+      status = EXIT_FAILURE;
+      continue;
+    }
+    if (is_record(data, size)) {
+      if (!read_records(source, data, size)) {
+        fprintf(stderr, "shbt_symbolize: %s: ignoring malformed or "
+                "truncated record\n", source);
+      }
+    } else {
+      if (num_maps == 0 && size > 0) {
+        fprintf(stderr, "shbt_symbolize: %s: address lists need a module "
+                "map (-m)\n", source);
+      }
+      read_addresses(source, (char*) data, size);
+    }
+    // Addresses and paths have been copied out.
+    free(data);
+  }
+
+  run_parallel(num_modules, 1, &load_module_at, num_threads);
+  run_parallel(num_lookups, LOOKUP_BATCH, &resolve_at, num_threads);
+
+  size_t num_lists = 0;
+  for (size_t i = 0; i < num_traces; ++i) {
+    print_trace(&traces[i], traces[i].is_record ? 0 : ++num_lists);
+  }
+  return status;
+}
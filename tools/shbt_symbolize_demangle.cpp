@@ -0,0 +1,43 @@
+/* Copyright 2019 Nikoli Dryden
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/**
+ * C++ symbol demangling for shbt_symbolize, via the compiler ABI.
+ *
+ * This runs offline, so unlike in the library there is no reason to avoid
+ * the ABI demangler, which is complete.
+ *
+ * Note: This is a .cpp file since cxxabi.h is typically only in the default
+ * include paths for C++ compilation.
+ */
+
+#include <cxxabi.h>
+#include <stdlib.h>
+
+/**
+ * Demangle a symbol.
+ *
+ * Returns the demangled name, which must be freed, or NULL if the symbol is
+ * not a valid mangled name. This is thread-safe.
+ */
+extern "C" char* symbolize_demangle(const char* mangled) {
+  int status;
+  char* demangled = abi::__cxa_demangle(mangled, NULL, NULL, &status);
+  if (status != 0) {
+    free(demangled);
+    return NULL;
+  }
+  return demangled;
+}